@@ -111,14 +111,21 @@ private:
 	int32_t refId;
 	int32_t mateId;
 	int32_t matePos;
-	vector<CigarOp> cigar;
 	Strandedness strandedness;
 	Orientation orientation;
-	Strand strand;
+
+	// The cigar and strand are only decoded from the underlying record on demand,
+	// as most alignments never need them
+	mutable vector<CigarOp> cigar;
+	mutable bool cigarDecoded;
+	mutable Strand strand;
+	mutable bool strandDecoded;
 
 	void init();
 
-	Strand calcStrand();
+	void decodeCigar() const;
+
+	Strand calcStrand() const;
 
 public:
 
@@ -160,21 +167,21 @@ public:
 
 	void setCigar(vector<CigarOp>& cig) {
 		cigar = cig;
+		cigarDecoded = true;
 	}
 
 	const vector<CigarOp>& getCigar() const {
+		decodeCigar();
 		return cigar;
 	}
 
 	const string getCigarAsString() const {
-		stringstream ss;
-		for (const auto & c : cigar) {
-			ss << c.toString();
-		}
-		return ss.str();
+		decodeCigar();
+		return getCigarAsString(cigar.data(), cigar.size());
 	}
 
 	void setCigarOpAt(uint32_t index, CigarOp cigarOp) {
+		decodeCigar();
 		cigar[index] = cigarOp;
 	}
 
@@ -198,12 +205,16 @@ public:
 		this->matePos = matePos;
 	}
 
-	const CigarOp& getCigarOpAt(uint32_t index) const {
-		return cigar[index];
+	CigarOp getCigarOpAt(uint32_t index) const {
+		if (cigarDecoded) {
+			return cigar[index];
+		}
+		const uint32_t c = bam_get_cigar(b)[index];
+		return CigarOp(bam_cigar_opchr(c), bam_cigar_oplen(c));
 	}
 
 	size_t getNbCigarOps() const {
-		return cigar.size();
+		return cigarDecoded ? cigar.size() : b->core.n_cigar;
 	}
 
 	int32_t getPosition() const {
@@ -222,6 +233,10 @@ public:
 		return position + alignedLength - 1;
 	}
 
+	int32_t getAlignedLength() const {
+		return alignedLength;
+	}
+
 	int32_t getReferenceId() const {
 		return refId;
 	}
@@ -238,7 +253,19 @@ public:
 		return b->core.qual;
 	}
 
+	uint32_t getAlignmentFlag() const {
+		return alFlag;
+	}
+
 	Strand getStrand() const {
+		if (!strandDecoded) {
+			// Try deriving from XS tag first if it's present.  If not then try to
+			// work it all out from the protocol suggested and the reverse strand
+			// flag.
+			Strand s = getXSStrand();
+			strand = s != Strand::UNKNOWN ? s : calcStrand();
+			strandDecoded = true;
+		}
 		return strand;
 	}
 
@@ -300,9 +327,19 @@ public:
 	 */
 	bool calcIfProperPair(Orientation orientation) const;
 
+	static bool calcIfProperPair(uint32_t flag, bool mateOnSameRef, int32_t position, int32_t matePos, Orientation orientation);
+
 
 	string deriveName() const;
 
+	/**
+	 * Hashes the same name that deriveName() would produce, i.e. the read name
+	 * plus which read of the pair this is, directly from the raw record without
+	 * building a string
+	 * @return A hash of the derived name
+	 */
+	size_t hashName() const;
+
 	string getQuerySeq() const;
 	string getQuerySeqAfterClipping() const;
 	string getQuerySeqAfterClipping(const string& query_seq) const;
@@ -321,6 +358,14 @@ public:
 	string getPaddedQuerySeq(const string& querySeq, int32_t start, int32_t end, int32_t& actual_start, int32_t& actual_end, const bool include_soft_clips) const;
 	string getPaddedGenomeSeq(const string& fullGenomeSeq, int32_t start, int32_t end, int32_t q_start, int32_t q_end, const bool include_soft_clips) const;
 
+	// These versions operate on a cigar and position held outside of a BamAlignment, so
+	// they can also be used on compact copies of alignments.  Note that the query provided
+	// to getPaddedQuerySeq must already have soft clips removed if include_soft_clips is false.
+	static string getCigarAsString(const CigarOp* cigar, const size_t nbOps);
+	static string getQuerySeqAfterClipping(const CigarOp* cigar, const size_t nbOps, int32_t position, int32_t alignedLength, const string& query_seq);
+	static string getPaddedQuerySeq(const CigarOp* cigar, const size_t nbOps, int32_t position, int32_t alignedLength, const string& query, int32_t start, int32_t end, int32_t& actual_start, int32_t& actual_end, const bool include_soft_clips);
+	static string getPaddedGenomeSeq(const CigarOp* cigar, const size_t nbOps, int32_t position, int32_t alignedLength, const string& fullGenomeSeq, int32_t start, int32_t end, int32_t q_start, int32_t q_end, const bool include_soft_clips);
+
 	string toString() const;
 	string toString(bool afterClipping) const;
 
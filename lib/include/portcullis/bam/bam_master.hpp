@@ -39,6 +39,7 @@ using boost::filesystem::path;
 using boost::lexical_cast;
 
 #include <htslib/faidx.h>
+#include <htslib/sam.h>
 
 namespace portcullis {
 namespace bam {
@@ -223,49 +224,34 @@ public:
 
 	static bool isCoordSortedBam(const path& bamFile);
 
+	/**
+	 * Whether the BAM has an index that is at least as new as the BAM itself, i.e.
+	 * an index that isn't out of date
+	 */
 	static bool isNewerIndexPresent(const path& bamFile, bool useCsi);
 
 	/**
-	 * Creates a command that can be used to merge multiple BAM files with samtools
-	 * @param bamFiles The paths to each BAM file to merge
-	 * @param mergedBamFile The output file
-	 * @param threads Number of threads to use during merging
-	 * @return Command line
+	 * Whether two BAM headers list the same target sequences, in the same order
 	 */
-	static string createMergeBamCmd(const vector<path>& bamFiles, const path& mergedBamFile, uint16_t threads);
-
+	static bool haveSameTargets(const bam_hdr_t* a, const bam_hdr_t* b);
 
 	/**
-	 * Creates a samtools command that can be used to sort a bam file.  Assumes
-	 * entries will be sorted by position using 1 thread and 1GB or RAM.
-	 * @param unsortedFile The bam file that needs sorting
-	 * @param sortedFile The path to the new sorted bam file which will be created
-	 * @return The command that can be used to sort the bam file
+	 * Lists the target sequences in a BAM header
 	 */
-	static string createSortBamCmd(const path& unsortedFile, const path& sortedFile) {
-		return createSortBamCmd(unsortedFile, sortedFile, false, 1, string("1G"));
-	}
+	static shared_ptr<RefSeqPtrList> createRefList(const bam_hdr_t* header);
 
 	/**
-	 * Creates a samtools command that can be used to sort a bam file
-	 * @param unsortedFile The bam file that needs sorting
-	 * @param sortedFile The path to the new sorted bam file which will be created
-	 * @param sortByName If true, bam entries are sorted by name, otherwise by position
-	 * @param threads Number of threads to use
-	 * @param memory Amount of memory to request
-	 * @return The command that can be used to sort the bam file
+	 * Makes a map based on the same RefSeqs stored in the provided list, keyed off the reference index
 	 */
-	static string createSortBamCmd( const path& unsortedFile,
-									const path& sortedFile,
-									bool sortByName,
-									uint16_t threads,
-									const string& memory);
+	static shared_ptr<RefSeqPtrIndexMap> createRefMap(const RefSeqPtrList& list);
+
 	/**
-	 * Creates a samtools command that can be used to index a sorted bam file
+	 * Indexes a sorted bam file in-process with htslib, creating the same index
+	 * as "samtools index"
 	 * @param sortedBam Path to a sorted bam file to index
-	 * @return The command that can be used to index the sorted bam file
+	 * @param useCsi Whether to create a CSI index rather than a BAI index
 	 */
-	static string createIndexBamCmd(const path& sortedBam, bool useCsi);
+	static void indexBam(const path& sortedBam, bool useCsi);
 
 };
 }
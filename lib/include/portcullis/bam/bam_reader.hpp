@@ -17,11 +17,14 @@
 
 #pragma once
 
+#include <functional>
 #include <memory>
+#include <queue>
 #include <sstream>
 #include <string>
 #include <unordered_map>
 #include <vector>
+using std::priority_queue;
 using std::unique_ptr;
 using std::string;
 using std::unordered_map;
@@ -41,6 +44,7 @@ using boost::lexical_cast;
 #include <htslib/bgzf.h>
 
 #include <portcullis/bam/bam_alignment.hpp>
+#include <portcullis/bam/bgzf_pipeline.hpp>
 using portcullis::bam::BamAlignment;
 using portcullis::bam::BamAlignmentPtr;
 using portcullis::bam::RefSeqPtr;
@@ -51,26 +55,87 @@ using portcullis::bam::RefSeqPtrIndexMap;
 namespace portcullis {
 namespace bam {
 
-
+/**
+ * A loaded BAM index.  Queries only read the index, so one can be shared by any
+ * number of readers on any number of threads.
+ */
+typedef shared_ptr<hts_idx_t> BamIndexPtr;
+
+/**
+ * Reads alignments from a BAM file, either sequentially, from a region, or from a
+ * list of virtual offsets.
+ *
+ * Can also read several coordinate sorted BAM files with the same target sequences
+ * as if they were a single BAM, merging their alignments into coordinate order on
+ * the fly.  Ties go to the earliest file, so the alignments come out exactly as
+ * they would from a merged BAM.  Regions are supported if every file is indexed,
+ * but virtual offsets are not, as they only make sense within a single file.
+ */
 class BamReader {
 
 private:
 
+	typedef std::pair<uint64_t, size_t> MergeEntry;
+
 	path bamFile;
+	vector<path> bamFiles;
 	uint16_t threads;
 
 	BGZF *fp;
 	bam_hdr_t* header;
 	bam1_t* c;
-	hts_idx_t* index;
+	BamIndexPtr index;
+	// Indexes loaded elsewhere, one for each BAM file, so this reader needn't load its own
+	vector<BamIndexPtr> sharedIndexes;
 	hts_itr_t * iter;
 
+	// Whether a region has been set.  htslib returns no iterator for some empty regions.
+	bool regionSet;
+
+	// Run of consecutive target sequences to read, when reading whole targets
+	int32_t firstTarget;
+	int32_t lastTarget;
+	bool targetsSet;
+
+	// Virtual offsets of the alignments to read, when reading by offset
+	vector<int64_t> offsets;
+	size_t nextOffset;
+	bool offsetsSet;
+
+	// Virtual offset of the current alignment, or -1 if not known
+	int64_t currentOffset;
+
+	// Only used for sequential reading with multiple threads
+	unique_ptr<BgzfPipeline> pipeline;
+
+	// Only used when reading several BAMs at once.  Holds the next alignment from each
+	// file, keyed on sort order then file.
+	vector<shared_ptr<BamReader>> parts;
+	priority_queue<MergeEntry, vector<MergeEntry>, std::greater<MergeEntry>> mergeQueue;
+	bool mergeStarted;
+	size_t currentPart;
+
 	BamAlignment b;
 
+	void openParts(const uint16_t threads);
+
+	void loadIndex();
+
+	void queueNext(const size_t part);
+
+	bool nextMerged();
+
 public:
 
 	BamReader(const path& _bamFile);
 
+	/**
+	 * Reads the given BAM files as one.  With a single file this is the same as reading
+	 * that file on its own.
+	 * @param _bamFiles Coordinate sorted BAM files with the same target sequences
+	 */
+	BamReader(const vector<path>& _bamFiles);
+
 	virtual ~BamReader();
 
 	// **** Methods for extracting reference target sequences ********
@@ -87,8 +152,20 @@ public:
 
 	string bamDetails() const;
 
+	const vector<path>& getBamFiles() const {
+		return bamFiles;
+	}
+
 	void open();
 
+	/**
+	 * Opens the BAM file, using the given number of threads to decompress the file
+	 * when reading it sequentially (i.e. when no region is set).  When reading several
+	 * files the threads are shared between them.
+	 * @param threads Number of decompression threads
+	 */
+	void open(const uint16_t threads);
+
 	void close();
 
 	bool next();
@@ -97,7 +174,55 @@ public:
 
 	void setRegion(const int32_t seqIndex, const int32_t start, const int32_t end);
 
+	/**
+	 * Restricts reading to every alignment on a run of consecutive target sequences.
+	 * Rather than querying the index for each target, this seeks once to the first
+	 * alignment and reads on until the last target is passed, so batches of small
+	 * target sequences that share BGZF blocks don't inflate them over and over.
+	 * @param firstSeqIndex Index of the first target sequence
+	 * @param lastSeqIndex Index of the last target sequence (inclusive)
+	 */
+	void setTargets(const int32_t firstSeqIndex, const int32_t lastSeqIndex);
+
+	/**
+	 * Restricts reading to the alignments starting at the given virtual offsets.  The
+	 * offsets must be in file order.  Alignments within a block that has already been
+	 * inflated are reached by skipping forward, so the reader only jumps between blocks.
+	 * Not supported when reading several files.
+	 * @param offsets Virtual offsets of the alignments to read
+	 */
+	void setOffsets(const vector<int64_t>& offsets);
+
+	/**
+	 * Virtual offset of the current alignment.  Only known when reading sequentially
+	 * or by offset, not when reading a region.
+	 * @return The virtual offset, or -1 if not known
+	 */
+	int64_t getCurrentOffset() const {
+		return currentOffset;
+	}
+
 	bool isCoordSortedBam();
+
+	const vector<BamIndexPtr>& getIndexes() const {
+		return sharedIndexes;
+	}
+
+	/**
+	 * Shares indexes that have already been loaded, rather than this reader loading
+	 * its own when a region is first set.  Must be called before opening the reader.
+	 * @param indexes One index for each BAM file, as returned by loadIndexes
+	 */
+	void setIndexes(const vector<BamIndexPtr>& indexes) {
+		this->sharedIndexes = indexes;
+	}
+
+	/**
+	 * Loads the index for each BAM file, ready to share between readers
+	 * @param bamFiles The BAM files
+	 * @return The indexes, in the same order.  Null for a BAM without an index.
+	 */
+	static vector<BamIndexPtr> loadIndexes(const vector<path>& bamFiles);
 };
 
 }
@@ -0,0 +1,203 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#pragma once
+
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+
+#include <boost/filesystem/path.hpp>
+using boost::filesystem::path;
+
+#include <htslib/sam.h>
+
+namespace portcullis {
+namespace bam {
+
+/**
+ * Receives the alignments from the final merge of a BamSorter, in coordinate order,
+ * as they are written to the output.  This lets work that needs sorted alignments
+ * get going while the sorted BAM is still being written, rather than reading it all
+ * back in afterwards.
+ */
+class SortedAlignmentConsumer {
+public:
+
+	virtual ~SortedAlignmentConsumer() {
+	}
+
+	/**
+	 * Called before the first alignment
+	 * @param header Header of the sorted output
+	 */
+	virtual void start(const bam_hdr_t* header) = 0;
+
+	/**
+	 * Called with each alignment in sorted order.  The alignment is only valid for the
+	 * duration of the call, so must be copied if it needs to be kept.
+	 */
+	virtual void consume(const bam1_t* b) = 0;
+
+	/**
+	 * Called once the sorted output, and its index if requested, have been written
+	 */
+	virtual void finish() = 0;
+};
+
+/**
+ * Sorts the alignments from one or more BAM files by coordinate into a single
+ * output BAM, using an external merge sort.  Alignments from unsorted inputs are
+ * buffered in memory until the memory budget is used up, at which point the
+ * buffer is sorted on multiple threads and spilled to a temporary run file.  The
+ * runs, the final buffer and any inputs that are already coordinate sorted are
+ * then merged straight into the output, which is compressed on multiple threads
+ * and can be indexed as it is written.
+ *
+ * Alignments are ordered exactly as samtools sort orders them: by target, then
+ * position, then strand, with ties kept in input order.  All inputs must have
+ * the same target sequences.
+ */
+class BamSorter {
+private:
+
+	struct SortEntry {
+		uint64_t key;
+		bam1_t* b;
+	};
+
+	path outputFile;
+	uint16_t threads;
+	uint64_t memory;
+	bool mergeSortedInputs;
+	bool buildIndex;
+	bool useCsi;
+	SortedAlignmentConsumer* consumer;
+
+	vector<SortEntry> buffer;
+	uint64_t bufferSize;
+
+	// Temporary files holding sorted runs
+	vector<path> runs;
+
+	void sortBuffer();
+
+	path spillBuffer(const bam_hdr_t* header);
+
+	void clearBuffer();
+
+	void merge(const bam_hdr_t* header, const vector<path>& files);
+
+public:
+
+	BamSorter(const path& _outputFile);
+
+	virtual ~BamSorter();
+
+	uint16_t getThreads() const {
+		return threads;
+	}
+
+	void setThreads(uint16_t threads) {
+		this->threads = threads < 1 ? 1 : threads;
+	}
+
+	uint64_t getMemory() const {
+		return memory;
+	}
+
+	/**
+	 * @param memory Approximate number of bytes of alignments to hold in memory
+	 * before spilling them to a temporary file
+	 */
+	void setMemory(uint64_t memory) {
+		this->memory = memory;
+	}
+
+	bool isMergeSortedInputs() const {
+		return mergeSortedInputs;
+	}
+
+	/**
+	 * @param mergeSortedInputs Whether inputs with a header saying they are coordinate
+	 * sorted are merged in as they are, rather than sorted again
+	 */
+	void setMergeSortedInputs(bool mergeSortedInputs) {
+		this->mergeSortedInputs = mergeSortedInputs;
+	}
+
+	bool isBuildIndex() const {
+		return buildIndex;
+	}
+
+	/**
+	 * @param buildIndex Whether to create the BAM index for the output while writing it
+	 */
+	void setBuildIndex(bool buildIndex) {
+		this->buildIndex = buildIndex;
+	}
+
+	bool isUseCsi() const {
+		return useCsi;
+	}
+
+	/**
+	 * @param useCsi Whether the index should be CSI rather than BAI
+	 */
+	void setUseCsi(bool useCsi) {
+		this->useCsi = useCsi;
+	}
+
+	SortedAlignmentConsumer* getConsumer() const {
+		return consumer;
+	}
+
+	/**
+	 * @param consumer Something to hand each alignment to as the sorted output is
+	 * written, or nullptr for nothing.  Not owned by the sorter.
+	 */
+	void setConsumer(SortedAlignmentConsumer* consumer) {
+		this->consumer = consumer;
+	}
+
+	/**
+	 * Sorts all the alignments in the given BAM files into the output file
+	 * @param inputs The BAM files to sort
+	 */
+	void sort(const vector<path>& inputs);
+
+	/**
+	 * The key alignments are sorted on.  Unplaced reads sort last.
+	 */
+	static uint64_t sortKey(const bam1_t* b) {
+		return ((uint64_t) ((uint32_t) b->core.tid & 0x7FFFFFFF) << 33) |
+			   ((uint64_t) (uint32_t) (b->core.pos + 1) << 1) |
+			   (bam_is_rev(b) ? 1 : 0);
+	}
+
+	/**
+	 * Parses a memory size such as "512M" or "2G".  Suffixes are powers of 1024,
+	 * and a number without a suffix is in bytes.
+	 * @param size The memory size
+	 * @return The number of bytes
+	 */
+	static uint64_t parseMemorySize(const string& size);
+};
+
+}
+}
@@ -17,12 +17,15 @@
 
 #pragma once
 
+#include <deque>
 #include <memory>
 #include <sstream>
 #include <string>
 #include <vector>
+using std::deque;
 using std::shared_ptr;
 using std::make_shared;
+using std::unique_ptr;
 using std::string;
 using std::vector;
 using std::stringstream;
@@ -36,29 +39,157 @@ using boost::filesystem::path;
 using boost::lexical_cast;
 
 #include <htslib/faidx.h>
+#include <htslib/hts.h>
+#include <htslib/bgzf.h>
 
 #include <portcullis/bam/bam_alignment.hpp>
+#include <portcullis/bam/bgzf_writer.hpp>
 
 namespace portcullis {
 namespace bam {
 
+/**
+ * Location of a run of complete BGZF blocks within a file
+ */
+struct BamChunk {
+	int64_t start = 0;
+	int64_t end = 0;
+};
+
+/**
+ * Writes alignments to a BAM file, compressing on as many threads as requested.
+ * If the alignments are written in coordinate order, the BAI or CSI index can be
+ * built as they are written, saving a second pass over the file to index it.
+ */
 class BamWriter {
 private:
+
+	// An index entry waiting for its block to be placed in the file
+	struct PendingIndexEntry {
+		int32_t tid;
+		int32_t start;
+		int32_t end;
+		bool mapped;
+		BgzfPosition after;
+	};
+
 	path bamFile;
+	uint16_t threads;
+	bool buildIndex;
+	bool useCsi;
 
-	BGZF *fp;
+	unique_ptr<BgzfWriter> out;
+
+	// htslib writes the alignments instead on big endian hosts, as the records are
+	// only laid out here for little endian ones.  The index is then built on close.
+	BGZF* fp;
+
+	hts_idx_t* index;
+	deque<PendingIndexEntry> pendingIndex;
+
+	void writeIndexEntries(const bool all);
 
 public:
 	BamWriter(const path& _bamFile) {
 		bamFile = _bamFile;
+		threads = 1;
+		buildIndex = false;
+		useCsi = false;
+		fp = nullptr;
+		index = nullptr;
+	}
+
+	virtual ~BamWriter();
+
+	uint16_t getThreads() const {
+		return threads;
+	}
+
+	/**
+	 * @param threads Number of threads to use for compression.  Call before open.
+	 */
+	void setThreads(uint16_t threads) {
+		this->threads = threads < 1 ? 1 : threads;
+	}
+
+	bool isBuildIndex() const {
+		return buildIndex;
+	}
+
+	/**
+	 * @param buildIndex Whether to index the BAM as it is written.  The index is
+	 * saved next to the BAM when it is closed.  Alignments must then be written
+	 * in coordinate order.  Call before open.
+	 */
+	void setBuildIndex(bool buildIndex) {
+		this->buildIndex = buildIndex;
+	}
+
+	bool isUseCsi() const {
+		return useCsi;
+	}
+
+	/**
+	 * @param useCsi Whether to build a CSI index rather than a BAI index
+	 */
+	void setUseCsi(bool useCsi) {
+		this->useCsi = useCsi;
+	}
+
+	void open(const bam_hdr_t* header);
+
+	int write(const BamAlignment& ba);
+
+	int write(const bam1_t* b);
+
+	/**
+	 * Copies a chunk of alignments written by a BamChunkWriter onto the end of this file.
+	 * Can't be used while building an index.
+	 * @param chunkFile The file the chunk was written to
+	 * @param chunk The location of the chunk in that file
+	 */
+	void writeChunk(const path& chunkFile, const BamChunk& chunk);
+
+	void close();
+};
+
+/**
+ * Writes alignments, without a header, in chunks that start and end on BGZF block
+ * boundaries.  Several writers can work in parallel, and their chunks can then be
+ * copied in order into a single BAM file with BamWriter::writeChunk, without having
+ * to recompress anything.
+ */
+class BamChunkWriter {
+private:
+	path chunkFile;
+
+	BGZF *fp;
+
+	int64_t chunkStart;
+
+public:
+	BamChunkWriter(const path& _chunkFile) {
+		chunkFile = _chunkFile;
+		fp = nullptr;
+		chunkStart = 0;
 	}
 
-	virtual ~BamWriter() {}
+	virtual ~BamChunkWriter() {}
 
-	void open(bam_hdr_t* header);
+	const path& getChunkFile() const {
+		return chunkFile;
+	}
+
+	void open();
 
 	int write(const BamAlignment& ba);
 
+	/**
+	 * Ends the current chunk, so that alignments written afterwards start a new one
+	 * @return The location of the alignments written since the last chunk ended
+	 */
+	BamChunk endChunk();
+
 	void close();
 };
 
@@ -0,0 +1,135 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#pragma once
+
+#include <cstdio>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+using std::condition_variable;
+using std::deque;
+using std::mutex;
+using std::queue;
+using std::shared_ptr;
+using std::string;
+using std::thread;
+using std::vector;
+
+#include <boost/filesystem/path.hpp>
+using boost::filesystem::path;
+
+#include <htslib/sam.h>
+
+namespace portcullis {
+namespace bam {
+
+/**
+ * Reads BGZF blocks sequentially from a BAM file and inflates them using a pool
+ * of worker threads.  A dedicated thread reads compressed blocks ahead of the
+ * consumer, while the workers decompress them in parallel.  Blocks are handed back
+ * to the consumer in file order, so records come out exactly as they would from
+ * bam_read1.
+ *
+ * This only handles sequential reading.  Random access via an index is left to
+ * htslib.
+ */
+class BgzfPipeline {
+private:
+
+	struct Block {
+		vector<uint8_t> compressed;
+		vector<uint8_t> uncompressed;
+		int64_t address = 0;
+		bool ready = false;
+		string error;
+	};
+	typedef shared_ptr<Block> BlockPtr;
+
+	path bamFile;
+	FILE* in;
+	int64_t nextAddress;
+	uint16_t threads;
+	size_t maxBlocks;
+
+	// Blocks in file order, waiting to be consumed
+	deque<BlockPtr> output;
+
+	// Blocks waiting to be inflated
+	queue<BlockPtr> work;
+
+	mutex blocksMutex;
+	condition_variable workAvailable;
+	condition_variable blockReady;
+	condition_variable spaceAvailable;
+	bool eof;
+	bool terminate;
+
+	thread reader;
+	vector<thread> inflaters;
+
+	// The block currently being consumed
+	BlockPtr current;
+	size_t offset;
+	size_t startOffset;
+
+	void readBlocks();
+
+	void inflateBlocks();
+
+	bool nextBlock();
+
+public:
+
+	/**
+	 * Starts reading the BAM file from the given virtual offset
+	 * @param _bamFile The BAM file to read
+	 * @param virtualOffset Virtual file offset of the first record to read (e.g. from bgzf_tell after reading the header)
+	 * @param _threads Number of threads to use for decompression
+	 */
+	BgzfPipeline(const path& _bamFile, const int64_t virtualOffset, const uint16_t _threads);
+
+	virtual ~BgzfPipeline();
+
+	/**
+	 * Reads up to length bytes of uncompressed data
+	 * @return The number of bytes read.  Less than length only at the end of the file.
+	 */
+	size_t read(void* data, const size_t length);
+
+	/**
+	 * Virtual file offset of the next byte to be read, as bgzf_tell would report it
+	 * when positioned at the start of a record
+	 * @return The virtual offset, or -1 at the end of the file
+	 */
+	int64_t tell();
+
+	/**
+	 * Reads the next alignment from the stream.  Behaves like bam_read1.
+	 * @param b The alignment to populate
+	 * @return >= 0 on success, -1 at the end of the file, < -1 if the record is truncated
+	 */
+	int readRecord(bam1_t* b);
+};
+
+}
+}
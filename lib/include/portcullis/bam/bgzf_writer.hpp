@@ -0,0 +1,169 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#pragma once
+
+#include <cstdio>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+using std::condition_variable;
+using std::deque;
+using std::mutex;
+using std::queue;
+using std::shared_ptr;
+using std::string;
+using std::thread;
+using std::vector;
+
+#include <boost/filesystem/path.hpp>
+using boost::filesystem::path;
+
+namespace portcullis {
+namespace bam {
+
+/**
+ * Position of a byte written to a BgzfWriter, before we know where its block will
+ * end up in the file
+ */
+struct BgzfPosition {
+	uint64_t block = 0;		// Number of blocks before this one in the file
+	uint32_t offset = 0;	// Offset within the uncompressed block
+};
+
+/**
+ * Writes a BGZF file, deflating blocks using a pool of worker threads.  A dedicated
+ * thread writes the compressed blocks out in order as they become ready.  Unlike
+ * htslib's multi-threaded writer, this keeps track of the address of every block
+ * written, so the virtual offset of anything written can be found once its block
+ * has made it to the file.  That's what lets BamWriter build an index on the fly.
+ */
+class BgzfWriter {
+private:
+
+	struct Block {
+		vector<uint8_t> uncompressed;
+		vector<uint8_t> compressed;
+		bool ready = false;
+		string error;
+	};
+	typedef shared_ptr<Block> BlockPtr;
+
+	path file;
+	FILE* out;
+	int level;
+	uint16_t threads;
+	size_t maxBlocks;
+
+	// Blocks in file order, waiting to be written
+	deque<BlockPtr> output;
+
+	// Blocks waiting to be deflated
+	queue<BlockPtr> work;
+
+	mutex blocksMutex;
+	condition_variable workAvailable;
+	condition_variable blockReady;
+	condition_variable spaceAvailable;
+	condition_variable blockWritten;
+	bool finished;
+	bool terminate;
+	string error;
+
+	thread writer;
+	vector<thread> deflaters;
+
+	// The block currently being filled, and the number of blocks handed on before it
+	BlockPtr current;
+	uint64_t nbBlocks;
+
+	// File address of the start of each block, known once the block before it is written
+	vector<int64_t> addresses;
+
+	void writeBlocks();
+
+	void deflateBlocks();
+
+	void queueBlock(BlockPtr block);
+
+public:
+
+	/**
+	 * Opens the file for writing
+	 * @param _file The file to write
+	 * @param _level zlib compression level, or -1 for the default
+	 * @param _threads Number of threads to use for compression
+	 */
+	BgzfWriter(const path& _file, const int _level, const uint16_t _threads);
+
+	virtual ~BgzfWriter();
+
+	/**
+	 * Writes uncompressed data, splitting it across blocks as necessary
+	 */
+	void write(const void* data, const size_t length);
+
+	/**
+	 * Starts a new block if the given number of bytes won't fit in the current one,
+	 * so that a record doesn't get split across blocks unless it has to be.  Behaves
+	 * like bgzf_flush_try.
+	 */
+	void reserve(const size_t length);
+
+	/**
+	 * Writes data that is already BGZF compressed, such as a run of complete blocks
+	 * from another file.  Anything written before is flushed first.
+	 */
+	void writeRaw(const void* data, const size_t length);
+
+	/**
+	 * Ends the current block, so that whatever is written next starts a new one
+	 */
+	void flush();
+
+	/**
+	 * Position of the next byte to be written
+	 */
+	BgzfPosition tell() const;
+
+	/**
+	 * Whether the block holding the given position has been placed in the file yet,
+	 * i.e. whether getVirtualOffset will return without waiting
+	 */
+	bool isPlaced(const BgzfPosition& position);
+
+	/**
+	 * Converts a position into a virtual file offset, waiting for the blocks before
+	 * it to be written if necessary
+	 * @param position A position returned by tell
+	 * @return The virtual file offset, as bgzf_tell would report it
+	 */
+	int64_t getVirtualOffset(const BgzfPosition& position);
+
+	/**
+	 * Writes out everything remaining, followed by the BGZF end of file marker
+	 */
+	void close();
+};
+
+}
+}
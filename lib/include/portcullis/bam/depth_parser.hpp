@@ -23,6 +23,7 @@
 #include <vector>
 using std::shared_ptr;
 using std::make_shared;
+using std::unique_ptr;
 using std::string;
 using std::vector;
 using std::stringstream;
@@ -39,6 +40,9 @@ using boost::lexical_cast;
 #include <htslib/sam.h>
 #include <htslib/bgzf.h>
 
+#include <portcullis/bam/bam_reader.hpp>
+#include <portcullis/bam/bgzf_pipeline.hpp>
+
 namespace portcullis {
 namespace bam {
 
@@ -46,6 +50,8 @@ namespace bam {
 typedef struct {     // auxiliary data structure
 	BGZF* fp;      // the file handler
 	hts_itr_t* iter; // NULL if a region not specified
+	BgzfPipeline* pipeline; // NULL if reading on a single thread
+	BamReader* reader; // Set when reading several BAM files as one
 	int min_mapQ, min_len; // mapQ filter; length filter
 } aux_t;
 
@@ -66,6 +72,8 @@ private:
 	bam_hdr_t *header;
 	aux_t** data;
 	bam_mplp_t mplp;
+	unique_ptr<BgzfPipeline> pipeline;
+	unique_ptr<BamReader> reader;
 
 	depth last;
 	bool start;
@@ -84,6 +92,19 @@ public:
 
 	DepthParser(path _bamFile, uint8_t _strandSpecific, bool _allowGappedAlignments);
 
+	/**
+	 * Creates a depth parser which uses multiple threads to decompress the BAM file
+	 * @param threads Number of decompression threads
+	 */
+	DepthParser(path _bamFile, uint8_t _strandSpecific, bool _allowGappedAlignments, uint16_t threads);
+
+	/**
+	 * Creates a depth parser over several coordinate sorted BAM files, as if they
+	 * had been merged into one
+	 * @param threads Number of decompression threads, shared between the files
+	 */
+	DepthParser(const vector<path>& _bamFiles, uint8_t _strandSpecific, bool _allowGappedAlignments, uint16_t threads);
+
 	virtual ~DepthParser();
 
 
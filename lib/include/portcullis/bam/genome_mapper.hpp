@@ -20,10 +20,12 @@
 #include <memory>
 #include <sstream>
 #include <string>
+#include <unordered_map>
 #include <vector>
 using std::shared_ptr;
 using std::make_shared;
 using std::string;
+using std::unordered_map;
 using std::vector;
 using std::stringstream;
 
@@ -39,6 +41,7 @@ using boost::lexical_cast;
 #include <htslib/sam.h>
 
 #include <portcullis/bam/bam_master.hpp>
+#include <portcullis/bam/packed_genome.hpp>
 
 namespace portcullis {
 namespace bam {
@@ -52,6 +55,13 @@ private:
 	// Handle to genome map.  Created by constructor.
 	faidx_t* fastaIndex;
 
+	// Index of each sequence name in the fasta index.  Created when the index is loaded.
+	unordered_map<string, int32_t> seqIndices;
+
+	// Packed copy of the genome, used instead of the fasta index when set.  May be
+	// shared with other genome mappers.
+	shared_ptr<PackedGenome> packedGenome;
+
 protected:
 
 
@@ -83,6 +93,11 @@ public:
 	}
 
 
+	path getPackedGenomeFile() const {
+		return path(genomeFile.parent_path()) /= path(genomeFile.leaf().string() + ".packed");
+	}
+
+
 	/**
 	 * Constructs the index for this fasta genome file
 	 */
@@ -94,6 +109,33 @@ public:
 	 */
 	void loadFastaIndex();
 
+	/**
+	 * Packs this genome file into two bits per base.  The fasta index must already
+	 * have been built.
+	 */
+	void buildPackedGenome();
+
+	/**
+	 * Memory maps the packed genome for this genome file, if there is one, it is up
+	 * to date and it was packed for this host, and uses it for fetching bases by name
+	 * and position
+	 * @return Whether the packed genome was loaded
+	 */
+	bool loadPackedGenome();
+
+	shared_ptr<PackedGenome> getPackedGenome() const {
+		return packedGenome;
+	}
+
+	/**
+	 * Fetch bases by name and position from an already loaded packed genome rather
+	 * than the fasta index.  The packed genome is read only, so one can be shared
+	 * between the genome mappers on every thread.
+	 */
+	void setPackedGenome(shared_ptr<PackedGenome> packedGenome) {
+		this->packedGenome = packedGenome;
+	}
+
 
 	/**
 	 * @abstract    Fetch the sequence in a region.
@@ -113,12 +155,41 @@ public:
 	 */
 	string fetchBases(const char* name, int start, int end, int* len) const;
 
+	/**
+	 * @abstract    Fetch the sequence in a region into the caller's buffer.
+	 * @param  name Region name
+	 * @param  start    Start location on region (zero-based, inclusive)
+	 * @param  end  End position (zero-based, inclusive)
+	 * @param  bases    Filled with the sequence; empty if no seq found
+	 * @return      Length of the region returned, or negative if no seq found
+	 */
+	int fetchBases(const char* name, int start, int end, string& bases) const;
+
+	/**
+	 * @abstract    Fetch the sequence in a region into the caller's buffer, without
+	 *              looking up the region name again.
+	 * @param  index    Index of the region, from getSeqIndex
+	 * @param  start    Start location on region (zero-based, inclusive)
+	 * @param  end  End position (zero-based, inclusive)
+	 * @param  bases    Filled with the sequence; empty if no seq found
+	 * @return      Length of the region returned, or negative if no seq found
+	 */
+	int fetchBases(const int32_t index, int start, int end, string& bases) const;
+
+	/**
+	 * Looks up the index of a sequence, so that several regions on it can be
+	 * fetched with a single name lookup
+	 * @param name Name of the sequence
+	 * @return The index of the sequence, or -1 if there is no sequence with that name
+	 */
+	int32_t getSeqIndex(const char* name) const;
+
 	/**
 	 * Get the number of sequences / contigs / scaffolds in the genome
 	 * @return
 	 */
 	int getNbSeqs() {
-		return faidx_nseq(fastaIndex);
+		return packedGenome != nullptr ? packedGenome->getNbSequences() : faidx_nseq(fastaIndex);
 	}
 
 };
@@ -0,0 +1,165 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+#include <boost/filesystem/path.hpp>
+using boost::filesystem::path;
+
+namespace portcullis {
+namespace bam {
+
+/**
+ * A run of bases that can't be held in two bits, such as Ns
+ */
+struct PackedBaseRun {
+	uint64_t start;
+	uint32_t length;
+	char base;
+	char padding[3];
+};
+
+/**
+ * A run of soft masked (lower case) bases
+ */
+struct PackedMaskRun {
+	uint64_t start;
+	uint64_t length;
+};
+
+/**
+ * A genome held as two bits per base, with the odd bases that don't fit, such as
+ * Ns, and the soft masking kept on the side as runs.  The packed file is built once
+ * from the fasta file and memory mapped read only, so one instance can be shared by
+ * any number of threads, and the pages are shared with any other process reading
+ * the same file.  Fetching a region just decodes the bases into the caller's buffer,
+ * without the file seeks, line handling and allocation a fasta index fetch needs.
+ *
+ * Fetches return exactly what faidx_fetch_seq would for the same fasta file.
+ */
+class PackedGenome {
+private:
+
+	struct Sequence {
+		string name;
+		int64_t length;
+		const uint8_t* bases;
+		const PackedBaseRun* exceptions;
+		uint64_t nbExceptions;
+		const PackedMaskRun* masks;
+		uint64_t nbMasks;
+	};
+
+	path packedFile;
+	uint8_t* data;
+	size_t size;
+
+	// Size and modification time of the fasta file, so we can tell if we're out of date
+	uint64_t fastaSize;
+	int64_t fastaTime;
+
+	vector<Sequence> sequences;
+	unordered_map<string, int32_t> names;
+
+	void close();
+
+public:
+
+	PackedGenome() : data(nullptr), size(0), fastaSize(0), fastaTime(0) {}
+
+	PackedGenome(const PackedGenome&) = delete;
+
+	PackedGenome& operator=(const PackedGenome&) = delete;
+
+	virtual ~PackedGenome() {
+		close();
+	}
+
+	/**
+	 * Packs a fasta file.  The fasta file must already have been indexed.
+	 * @param fastaFile The genome to pack
+	 * @param packedFile Where to write the packed genome
+	 */
+	static void build(const path& fastaFile, const path& packedFile);
+
+	/**
+	 * Memory maps a packed genome
+	 * @param packedFile The file created by build
+	 */
+	void open(const path& packedFile);
+
+	/**
+	 * Whether a packed genome can be opened here.  The file holds its runs in the byte
+	 * order of the host that built it, so one from a host with the other byte order,
+	 * or from a version of portcullis with a different layout, has to be rebuilt.
+	 * @param packedFile The file created by build
+	 */
+	static bool isCompatible(const path& packedFile);
+
+	/**
+	 * Whether this was packed from the given fasta file, as it is now
+	 * @param fastaFile The fasta file
+	 */
+	bool isPackingOf(const path& fastaFile) const;
+
+	path getPackedFile() const {
+		return packedFile;
+	}
+
+	size_t getNbSequences() const {
+		return sequences.size();
+	}
+
+	/**
+	 * @param name Name of a sequence
+	 * @return The index of the sequence, or -1 if there is no sequence with that name
+	 */
+	int32_t getIndex(const string& name) const {
+		auto it = names.find(name);
+		return it == names.end() ? -1 : it->second;
+	}
+
+	const string& getName(const int32_t index) const {
+		return sequences[index].name;
+	}
+
+	int64_t getLength(const int32_t index) const {
+		return sequences[index].length;
+	}
+
+	/**
+	 * Decodes the bases in a region.  The region is clamped to the sequence in the
+	 * same way faidx_fetch_seq clamps it, so is never empty for a non-empty sequence.
+	 * @param index Index of the sequence
+	 * @param start Start position (zero-based, inclusive)
+	 * @param end End position (zero-based, inclusive)
+	 * @param bases Filled with the bases, reusing its storage where possible
+	 * @return The number of bases, or -2 if the index is out of range
+	 */
+	int fetch(const int32_t index, int start, int end, string& bases) const;
+};
+
+}
+}
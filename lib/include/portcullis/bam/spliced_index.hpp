@@ -0,0 +1,137 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+using std::string;
+using std::vector;
+
+#include <boost/filesystem/path.hpp>
+using boost::filesystem::path;
+
+namespace portcullis {
+namespace bam {
+
+/**
+ * Location of a spliced alignment in a coordinate sorted BAM file
+ */
+struct SplicedRecord {
+	int32_t start;		// Position of the first aligned base
+	int32_t end;		// Position after the last aligned base, as given by bam_endpos
+	int64_t offset;		// Virtual offset of the record
+	uint64_t nameHash;	// Hash of the read name, as given by BamAlignment::hashName
+};
+
+/**
+ * Summary of the query lengths of a set of alignments, such as the unspliced
+ * alignments on a target sequence
+ */
+struct AlignmentStats {
+	uint64_t count = 0;
+	uint64_t sumQueryLengths = 0;
+	int32_t minQueryLength = INT32_MAX;
+	int32_t maxQueryLength = 0;
+};
+
+/**
+ * A sidecar to a coordinate sorted BAM file, holding the virtual offsets of the
+ * spliced alignments on each target sequence and a summary of the unspliced
+ * alignments.  Junctions only come from spliced alignments, which are usually a
+ * small fraction of an RNAseq BAM, so this lets the junction finder read just
+ * those records instead of parsing the whole file.  The read name hashes and the
+ * query length summaries also give the genome wide stats some junction metrics
+ * depend on, without reading the BAM at all.
+ *
+ * Only alignments that start within their target sequence are recorded, which
+ * matches what a region query over the whole target would return.
+ */
+class SplicedIndex {
+private:
+	// Size and modification time of the BAM, so we can tell if the index is out of date
+	uint64_t bamSize;
+	int64_t bamTime;
+
+	vector<vector<SplicedRecord>> records;
+	vector<int32_t> maxLengths;
+	vector<AlignmentStats> unspliced;
+	vector<AlignmentStats> spliced;
+
+public:
+
+	SplicedIndex() : bamSize(0), bamTime(0) {}
+
+	/**
+	 * Builds the index with a single sequential pass over the BAM file
+	 * @param bamFile Coordinate sorted BAM file to index
+	 * @param threads Number of threads to use for decompressing the BAM
+	 */
+	void build(const path& bamFile, const uint16_t threads);
+
+	void load(const path& indexFile);
+
+	void save(const path& indexFile) const;
+
+	/**
+	 * Whether this index was built from the given BAM file, as it is now
+	 * @param bamFile The BAM file
+	 */
+	bool isIndexOf(const path& bamFile) const;
+
+	/**
+	 * Finds the spliced alignments overlapping a region, i.e. the same spliced
+	 * alignments that a region query on the BAM index would return
+	 * @param refId Index of the target sequence
+	 * @param start Start of the region (inclusive)
+	 * @param end End of the region (exclusive)
+	 * @return Virtual offsets of the alignments, in file order
+	 */
+	vector<int64_t> findOffsets(const int32_t refId, const int32_t start, const int32_t end) const;
+
+	const AlignmentStats& getUnsplicedStats(const int32_t refId) const {
+		return unspliced[refId];
+	}
+
+	const AlignmentStats& getSplicedStats(const int32_t refId) const {
+		return spliced[refId];
+	}
+
+	/**
+	 * The spliced alignments on a target sequence, in file order
+	 */
+	const vector<SplicedRecord>& getRecords(const int32_t refId) const {
+		return records[refId];
+	}
+
+	/**
+	 * Longest stretch of the target sequence covered by a single spliced alignment
+	 */
+	int32_t getMaxLength(const int32_t refId) const {
+		return maxLengths[refId];
+	}
+
+	size_t getNbTargets() const {
+		return records.size();
+	}
+
+	uint64_t getNbSplicedAlignments() const;
+};
+
+}
+}
@@ -41,6 +41,34 @@ typedef boost::error_info<struct IntronError, string> IntronErrorInfo;
 struct IntronException: virtual boost::exception, virtual std::exception { };
 
 
+/**
+ * Compact key identifying an intron by the index of its target sequence and its
+ * position.  Trivially copyable, so it can be built for every gap in an alignment
+ * and used to look up the junction without any allocation.
+ */
+struct IntronKey {
+	int32_t refIndex;
+	int32_t start;
+	int32_t end;
+
+	bool operator==(const IntronKey& other) const {
+		return refIndex == other.refIndex && start == other.start && end == other.end;
+	}
+
+	bool operator!=(const IntronKey& other) const {
+		return !((*this) == other);
+	}
+
+	size_t hash() const {
+		// Mix the fields together, then finish as in splitmix64 so that nearby introns
+		// spread out over the table
+		uint64_t h = ((uint64_t) (uint32_t) refIndex << 32 | (uint32_t) start) * 0x9E3779B97F4A7C15ULL ^ (uint32_t) end;
+		h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+		return (size_t) (h ^ (h >> 31));
+	}
+};
+
 class Intron {
 
 
@@ -76,6 +104,10 @@ public:
 		return !((*this) == other);
 	}
 
+	IntronKey key() const {
+		return IntronKey{ ref.index, start, end };
+	}
+
 
 
 	int32_t size() const {
@@ -17,9 +17,11 @@
 
 #pragma once
 
+#include <array>
 #include <iostream>
 #include <math.h>
 #include <string>
+#include <utility>
 #include <vector>
 #include <memory>
 #include <unordered_map>
@@ -83,6 +85,11 @@ const string SEMI_CANONICAL_SEQ2_RC = SeqUtils::reverseComplement(SEMI_CANONICAL
 // equal and to avoid any issues.
 const uint32_t TRIMMED_COVERAGE_LENGTH = 50;
 
+// Length of each of the regions either side of a splice site used to calculate the
+// coverage metric.  Two regions are used on each side, so depths are required for
+// 2 * COVERAGE_REGION_LENGTH + 1 positions around each splice site.
+const int32_t COVERAGE_REGION_LENGTH = 10;
+
 enum class CanonicalSS {
 	CANONICAL,
 	SEMI_CANONICAL,
@@ -135,9 +142,23 @@ struct SplicingScores {
 	double splicingSignal = 0.0;
 };
 
+/**
+ * A compact record of the spliced alignments supporting a junction that share a
+ * position, cigar and query sequence.  Only the fields required for calculating the
+ * junction metrics that need the reads are kept here, and those are the same for each
+ * alignment sharing the record.  The variable length parts of the alignment (cigar and
+ * packed query bases) are stored contiguously in buffers owned by the junction, and
+ * this record holds offsets into them.  This avoids taking a full deep copy of every
+ * spliced alignment.
+ */
 struct AlignmentInfo {
-	BamAlignmentPtr ba;
-	size_t nameCode;
+	int32_t position;
+	int32_t alignedLength;
+	int32_t queryLength;
+	uint32_t cigarOffset;
+	uint32_t basesOffset;
+	uint32_t nbCigarOps;
+	uint32_t multiplicity; // Number of alignments sharing this record
 	uint32_t totalUpstreamMatches; // Total number of upstream matches in this junction window
 	uint32_t totalDownstreamMatches; // Total number of downstream matches in this junction window
 	uint32_t totalUpstreamMismatches;
@@ -149,11 +170,14 @@ struct AlignmentInfo {
 	uint32_t nbMismatches; // Total number of mismatches in this junction window
 	uint32_t mmes; // Minimal Match on Either Side of exon junction
 
-	AlignmentInfo(BamAlignmentPtr _ba) {
-		// Copy alignment
-		ba = _ba;
-		// Calculate a hash of the alignment name
-		nameCode = std::hash<std::string>()(ba->deriveName());
+	AlignmentInfo(const BamAlignment& al, const uint32_t _cigarOffset, const uint32_t _basesOffset) {
+		position = al.getStart();
+		alignedLength = al.getAlignedLength();
+		queryLength = al.getRaw()->core.l_qseq;
+		cigarOffset = _cigarOffset;
+		basesOffset = _basesOffset;
+		nbCigarOps = al.getNbCigarOps();
+		multiplicity = 1;
 		totalUpstreamMatches = 0;
 		totalDownstreamMatches = 0;
 		totalUpstreamMismatches = 0;
@@ -166,25 +190,51 @@ struct AlignmentInfo {
 		mmes = 0;
 	}
 
-	~AlignmentInfo() {
-		ba.reset();
+	int32_t getEnd() const {
+		return position + alignedLength - 1;
 	}
 
-	void calcMatchStats(const Intron& i, const uint32_t leftStart, const uint32_t rightEnd, const string& ancLeft, const string& ancRight);
+	/**
+	 * Calculates the match statistics for this alignment
+	 * @param i The intron this alignment supports
+	 * @param leftStart Start of the junction's left anchor
+	 * @param rightEnd End of the junction's right anchor
+	 * @param ancLeft Genomic sequence of the left anchor
+	 * @param ancRight Genomic sequence of the right anchor
+	 * @param cigar Pointer to the start of this alignment's cigar
+	 * @param bases Pointer to the start of this alignment's packed query bases
+	 */
+	void calcMatchStats(const Intron& i, const uint32_t leftStart, const uint32_t rightEnd, const string& ancLeft, const string& ancRight,
+						const CigarOp* cigar, const uint8_t* bases);
 
 	uint32_t getNbMatchesFromStart(const string& query, const string& anchor);
 	uint32_t getNbMatchesFromEnd(const string& query, const string& anchor);
 };
 
-typedef shared_ptr<AlignmentInfo> AlignmentInfoPtr;
-
 class Junction {
 private:
 
 	// **** Properties that describe where the junction is ****
 	shared_ptr<Intron> intron;
-	vector<shared_ptr<AlignmentInfo>> alignments;
+	vector<AlignmentInfo> alignments; // Distinct alignments, each with the number of alignments sharing it
+	vector<CigarOp> alignmentCigars; // Cigars of all distinct alignments, concatenated
+	vector<uint8_t> alignmentBases; // Packed query bases of all distinct alignments, concatenated
+	std::unordered_map<size_t, uint32_t> alignmentIndex; // Hash of position, cigar and bases to distinct alignment
 	vector<size_t> alignmentCodes;
+	vector<uint32_t> sampleRecords; // Distinct alignment for each alignment in the sample, if sampling
+	vector<std::pair<int32_t, uint32_t>> alignmentStarts; // Number of alignments starting at each position, in position order
+	uint32_t maxAlignments; // Most alignments to keep for the metrics that need the reads, or 0 to keep them all
+	uint32_t nbReplacedAlignments; // Sampled alignments replaced since the buffers were last compacted
+
+	// Running tallies over every alignment, so the counts stay exact when only a sample
+	// of the alignments is kept
+	int32_t lastAlStart;
+	int32_t lastAlEnd;
+	uint32_t nbAlPosStrand;
+	uint32_t nbAlNegStrand;
+	uint32_t nbAlUnknownStrand;
+	std::array<uint32_t, 5> nbAlProperlyPairedBy; // Portcullis properly paired alignments for each orientation
+	std::array<uint32_t, 5> nbAlReliableBy; // Reliable alignments for each orientation
 
 
 	// **** Junction metrics ****
@@ -193,6 +243,7 @@ private:
 
 	// Alignment counts
 	uint32_t nbAlRaw;
+	uint32_t nbAlSampled; // Alignments the read based metrics were calculated from
 	uint32_t nbAlDistinct;
 	uint32_t nbAlMultiplySpliced; // uniquely spliced = split - multiply spliced
 	uint32_t nbAlUniquelyMapped; // multiply mapped = split - uniquely_mapped
@@ -272,6 +323,20 @@ protected:
 
 	Strand predictedStrandFromSpliceSites(const string& seq1, const string& seq2);
 
+	/**
+	 * Adds the alignment to the record of the identical alignments already in this
+	 * junction, or starts a new record if there are none
+	 * @param al The alignment
+	 * @return Index of the record
+	 */
+	uint32_t addAlignmentRecord(const BamAlignment& al);
+
+	/**
+	 * Drops the records with no alignments left in the sample, along with their cigars
+	 * and bases
+	 */
+	void compactAlignments();
+
 
 public:
 
@@ -298,8 +363,43 @@ public:
 
 	void clearAlignments();
 
-	const BamAlignment& getFirstAlignment() const {
-		return *(alignments[0]->ba);
+	/**
+	 * The most alignments kept for the metrics that need the reads themselves, i.e. the
+	 * mismatch, anchor depth and multiple mapping metrics
+	 * @return The limit, or 0 if all alignments are kept
+	 */
+	uint32_t getMaxAlignments() const {
+		return maxAlignments;
+	}
+
+	/**
+	 * Caps the alignments kept for the metrics that need the reads themselves.  Past
+	 * this a uniform random sample of the alignments is kept, so memory and time spent
+	 * on a very deep junction are bounded.  Alignment counts, strand, entropy and anchor
+	 * lengths are tallied as alignments are added, so stay exact.  Must be set before
+	 * any alignments are added.
+	 * @param maxAlignments The most alignments to keep, or 0 to keep them all
+	 */
+	void setMaxAlignments(uint32_t maxAlignments) {
+		this->maxAlignments = maxAlignments;
+	}
+
+	/**
+	 * The number of records held for the alignments kept, including any no longer in
+	 * the sample that haven't been dropped yet.  Identical alignments share a record.
+	 * @return
+	 */
+	size_t getNbAlignmentRecords() const {
+		return alignments.size();
+	}
+
+	/**
+	 * Whether the metrics that need the reads were estimated from a sample of the
+	 * alignments, rather than all of them
+	 * @return
+	 */
+	bool isSampled() const {
+		return maxAlignments > 0 && nbAlRaw > maxAlignments;
 	}
 
 	const Intron& getLocation() const {
@@ -790,6 +890,17 @@ public:
 		return nbSamples;
 	}
 
+	/**
+	 * The number of spliced alignments the mismatch, anchor depth and multiple mapping
+	 * metrics were calculated from.  This is the same as the number of spliced
+	 * alignments unless the alignments kept for this junction were capped, in which
+	 * case those metrics are estimates from a sample.
+	 * @return
+	 */
+	uint32_t getNbSampledAlignments() const {
+		return nbAlSampled;
+	}
+
 
 	/**
 	 * Whether or not this junction looks suspicious (i.e. it may not be genuine)
@@ -998,6 +1109,10 @@ public:
 		this->nbSamples = nbSamples;
 	}
 
+	void setNbSampledAlignments(uint32_t nbAlSampled) {
+		this->nbAlSampled = nbAlSampled;
+	}
+
 	void setSuspicious(bool suspicious) {
 		this->suspicious = suspicious;
 	}
@@ -1055,8 +1170,7 @@ public:
 	// ****** Methods intended to be executed after all alignments are added to the junction
 
 	/**
-	 * This will iterate over the alignments in this junction and determine if there's consistency between
-	 * the strand from the alignments
+	 * Determines if there's consistency between the strand of the alignments in this junction
 	 */
 	void determineStrandFromReads();
 
@@ -1066,14 +1180,6 @@ public:
 	 */
 	void processJunctionWindow(const GenomeMapper& genomeMapper);
 
-	/**
-	 * Process non-spliced alignments within a certain region upstream and downstream of the junction
-	 * @param reader
-	 * @param refLength
-	 * @param maxQueryLength
-	 */
-	void processJunctionVicinity(BamReader& reader, int32_t refLength, int32_t maxQueryLength);
-
 	/**
 	 * Based on the alignments in this junction calculate junction metrics
 	 */
@@ -1123,6 +1229,15 @@ public:
 	 */
 	double calcEntropy(const vector<int32_t> offsets);
 
+	/**
+	 * Calculates the shannon entropy score from the number of alignments starting at each
+	 * position, which gives the same result as listing each alignment's start position
+	 * @param startCounts The positions and the number of alignments starting there, in
+	 * position order
+	 * @return
+	 */
+	double calcEntropy(const vector<std::pair<int32_t, uint32_t>>& startCounts);
+
 	/**
 	 * Metrics: # Distinct Alignments, # Unique/Reliable Alignments, #mismatches
 	 * @return
@@ -1145,13 +1260,21 @@ public:
 	/**
 	 * Calculates metric 18.  Multiple mapping score
 	 */
-	void calcMultipleMappingScore(SplicedAlignmentMap& map);
+	void calcMultipleMappingScore(const SplicedAlignmentMap& map);
 
 
 	double calcCoverage(int32_t a, int32_t b, const vector<uint32_t>& coverageLevels);
 
 	double calcCoverage(const vector<uint32_t>& coverageLevels);
 
+	/**
+	 * Calculates coverage from depths around the splice sites only.  Each vector holds
+	 * the 2 * COVERAGE_REGION_LENGTH + 1 values that would be found in the full coverage
+	 * levels, starting at intron start - 2 * COVERAGE_REGION_LENGTH for the donor and
+	 * intron end for the acceptor.
+	 */
+	double calcCoverage(const vector<uint32_t>& donorLevels, const vector<uint32_t>& acceptorLevels);
+
 	/**
 	 * Calculates a score for this intron size based on how this intron size fits
 	 * into an expected distribution specified by the length at the threhsold percentile
@@ -1295,7 +1418,8 @@ public:
 			 << j.coverage << "\t"
 			 << j.nbUpstreamFlankingAlignments << "\t"
 			 << j.nbDownstreamFlankingAlignments << "\t"
-			 << j.nbSamples;
+			 << j.nbSamples << "\t"
+			 << j.nbAlSampled;
 		for (size_t i = 0; i < JAD_NAMES.size(); i++) {
 			strm << "\t" << j.junctionAnchorDepth[i];
 		}
@@ -1367,7 +1491,8 @@ const JuncUint32FuncMap JunctionUint32FunctionMap = {
 	{"dist_nearest_junc", &Junction::getDistanceToNearestJunction},
 	{"nb_up_aln", &Junction::getNbUpstreamFlankingAlignments},
 	{"nb_down_aln", &Junction::getNbDownstreamFlankingAlignments},
-	{"nb_samples", &Junction::getNbSamples}
+	{"nb_samples", &Junction::getNbSamples},
+	{"nb_sampled_aln", &Junction::getNbSampledAlignments}
 };
 
 const JuncDoubleFuncMap JunctionDoubleFunctionMap = {
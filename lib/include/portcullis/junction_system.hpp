@@ -17,7 +17,10 @@
 
 #pragma once
 
+#include <algorithm>
 #include <fstream>
+#include <functional>
+#include <queue>
 #include <vector>
 #include <memory>
 #include <unordered_map>
@@ -31,29 +34,176 @@ using boost::timer::auto_cpu_timer;
 #include <portcullis/intron.hpp>
 #include <portcullis/junction.hpp>
 #include <portcullis/seq_utils.hpp>
+#include <portcullis/target_regions.hpp>
 using portcullis::Intron;
 using portcullis::IntronHasher;
+using portcullis::IntronKey;
 using portcullis::Junction;
 using portcullis::JunctionPtr;
 using portcullis::SeqUtils;
 
-typedef std::unordered_map<Intron, JunctionPtr, IntronHasher> DistinctJunctions;
-typedef std::unordered_map<Intron, JunctionPtr, IntronHasher>::iterator JunctionMapIterator;
-typedef std::pair<const Intron, JunctionPtr> JunctionMapType;
 typedef std::vector<JunctionPtr> JunctionList;
 typedef std::shared_ptr<JunctionList> JunctionListPtr;
 
 namespace portcullis {
 
+/**
+ * Maximum number of reads htslib's pileup will buffer before it starts dropping reads
+ * that start at the current position.  Coverage is calculated as though by the pileup,
+ * so the same limit applies.
+ */
+const uint16_t PILEUP_MAX_DEPTH = 8000;
+
+/**
+ * Counts alignments against a set of thresholds on a single target sequence, so that
+ * the number of alignments starting (or ending) before any threshold can be found
+ * after a single pass over the alignments.
+ */
+struct FlankingCounts {
+	JunctionList junctions;
+	vector<int32_t> startThresholds;
+	vector<int32_t> endThresholds;
+	vector<uint32_t> startCounts;
+	vector<uint32_t> endCounts;
+
+	/**
+	 * Creates the sorted thresholds for each of the junctions.  Call after all junctions
+	 * have been added.
+	 */
+	void init();
+
+	/**
+	 * Records an unspliced alignment
+	 * @param start Start of the alignment
+	 * @param end End of the alignment (inclusive)
+	 */
+	void add(const int32_t start, const int32_t end) {
+		startCounts[std::upper_bound(startThresholds.begin(), startThresholds.end(), start) - startThresholds.begin()]++;
+		endCounts[std::upper_bound(endThresholds.begin(), endThresholds.end(), end) - endThresholds.begin()]++;
+	}
+
+	/**
+	 * Sets the number of upstream and downstream flanking alignments on each junction
+	 */
+	void setFlankingAlignments();
+};
+
+/**
+ * Read depths on a single target sequence, kept only within the windows around each
+ * junction's splice sites that are used for the coverage metric.  Depths are built up
+ * in a difference array from the aligned blocks of each read, so memory is bounded by
+ * the number of junctions rather than the length of the target.
+ */
+struct FlankDepths {
+	JunctionList junctions;
+	vector<int32_t> windowStarts;
+	vector<int32_t> windowEnds;
+	vector<size_t> windowOffsets;
+	vector<int32_t> depths;
+
+	// Ends of the reads htslib's pileup would be holding at the last read position
+	std::priority_queue<int32_t, vector<int32_t>, std::greater<int32_t>> buffered;
+	int32_t lastPos = -1;
+
+	/**
+	 * Merges the windows around each of the junctions.  Call after all junctions
+	 * have been added.
+	 */
+	void init();
+
+	/**
+	 * Records a block of aligned bases
+	 * @param start Start of the block
+	 * @param end End of the block (exclusive)
+	 */
+	void add(const int32_t start, const int32_t end);
+
+	/**
+	 * Records the aligned blocks of an unspliced read.  Reads must be given in
+	 * coordinate order.
+	 * @param al The alignment
+	 */
+	void add(const BamAlignment& al);
+
+	/**
+	 * Sets the coverage metric on each junction
+	 */
+	void setCoverage();
+
+	/**
+	 * Depth at a coverage level, i.e. one along from the reference position.  Only
+	 * valid after setCoverage, and zero outside the windows.
+	 * @param level The coverage level
+	 */
+	uint32_t getDepth(const int32_t level) const;
+};
+
+/**
+ * Open addressing hash table from introns to rows of a junction list.  Keys are held
+ * inline and collisions are resolved by linear probing, so looking up the junction
+ * for a gap in an alignment is a few reads from one array, with no allocation.
+ */
+class IntronTable {
+private:
+
+	struct Slot {
+		IntronKey key;
+		uint32_t row;
+	};
+
+	vector<Slot> slots;
+	size_t count;
+
+	void grow();
+
+public:
+
+	static const uint32_t NONE = UINT32_MAX;
+
+	IntronTable() : count(0) {}
+
+	/**
+	 * @return The row of the intron, or NONE if it isn't in the table
+	 */
+	uint32_t find(const IntronKey& key) const;
+
+	/**
+	 * Sets the row of the intron, replacing any row it already had
+	 */
+	void insert(const IntronKey& key, const uint32_t row);
+
+	/**
+	 * Replaces the contents with the row of each of the given junctions
+	 */
+	void assign(const JunctionList& junctions);
+
+	void clear() {
+		slots.clear();
+		count = 0;
+	}
+
+	size_t size() const {
+		return count;
+	}
+
+	bool empty() const {
+		return count == 0;
+	}
+};
+
 class JunctionSystem {
 private:
-	DistinctJunctions distinctJunctions;
+	// Row of each distinct junction in the junction list
+	IntronTable distinctJunctions;
 	JunctionList junctionList;
 
 	int32_t minQueryLength;
 	double meanQueryLength;
 	int32_t maxQueryLength;
 
+	// Most alignments each new junction keeps for the metrics that need the reads
+	uint32_t maxJunctionAlignments;
+
 	shared_ptr<vector<RefSeqPtr>> refs;
 
 	size_t createJunctionGroup(size_t index, vector<JunctionPtr>& group);
@@ -109,6 +259,19 @@ public:
 		this->refs = refs;
 	}
 
+	uint32_t getMaxJunctionAlignments() const {
+		return maxJunctionAlignments;
+	}
+
+	/**
+	 * Caps the alignments each junction found from here on keeps for the metrics that
+	 * need the reads themselves.  See Junction::setMaxAlignments.
+	 * @param maxJunctionAlignments The most alignments to keep, or 0 to keep them all
+	 */
+	void setMaxJunctionAlignments(uint32_t maxJunctionAlignments) {
+		this->maxJunctionAlignments = maxJunctionAlignments;
+	}
+
 
 	void addJunction(JunctionPtr j);
 
@@ -126,19 +289,47 @@ public:
 	 * @return Whether a junction was found in this alignment or not
 	 */
 	bool addJunctions(const BamAlignment& al) {
-		return addJunctions(al, 0, al.getPosition());
+		return addJunctions(al, 0, al.getPosition(), INT32_MIN, INT32_MAX);
 	}
 
-	bool addJunctions(const BamAlignment& al, const size_t startOp, const int32_t offset);
+	/**
+	 * Same as addJunctions, except only junctions whose intron starts within
+	 * [regionStart, regionEnd) are recorded.  This allows a target sequence to
+	 * be split into windows, with each junction owned by exactly one window.
+	 * @param al The alignment to search for junctions
+	 * @param regionStart Start of the owned region (inclusive)
+	 * @param regionEnd End of the owned region (exclusive)
+	 * @return Whether a junction was found in this alignment or not, regardless
+	 * of whether it was recorded
+	 */
+	bool addJunctionsInRegion(const BamAlignment& al, const int32_t regionStart, const int32_t regionEnd) {
+		return addJunctions(al, 0, al.getPosition(), regionStart, regionEnd);
+	}
 
-	void findFlankingAlignments(const path& alignmentsFile);
+	bool addJunctions(const BamAlignment& al, const size_t startOp, const int32_t offset, const int32_t regionStart, const int32_t regionEnd);
 
-	void calcCoverage(const path& alignmentsFile, Strandedness strandSpecific);
+	void calcMultipleMappingStats(const SplicedAlignmentMap& map);
 
-	void calcMultipleMappingStats(SplicedAlignmentMap& map);
+	/**
+	 * Counts flanking alignments and calculates coverage for the junctions on a single
+	 * target sequence, using one pass over the unspliced alignments on that target.
+	 * Only the given junctions are modified, so target sequences can be processed in
+	 * parallel as long as each thread has its own reader.
+	 * @param reader Reader for the coordinate sorted and indexed unspliced alignments
+	 * @param refId Index of the target sequence
+	 * @param junctions All the junctions on the target sequence
+	 */
+	static void calcUnsplicedMetrics(BamReader& reader, const int32_t refId, const JunctionList& junctions);
 
 	void calcJunctionStats();
 
+	/**
+	 * Removes the junctions whose introns don't overlap any of the target regions.
+	 * Junction ids are left alone.
+	 * @param targets The target regions
+	 */
+	void restrictTo(const TargetRegions& targets);
+
 	std::pair<Orientation, Strandedness> determineStrandedness(bool verbose) const;
 
 	void sort();
@@ -0,0 +1,102 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+using std::map;
+using std::string;
+using std::vector;
+
+#include <boost/exception/all.hpp>
+#include <boost/filesystem/path.hpp>
+using boost::filesystem::path;
+
+namespace portcullis {
+
+typedef boost::error_info<struct ManifestError, string> ManifestErrorInfo;
+struct ManifestException: virtual boost::exception, virtual std::exception { };
+
+/**
+ * Records what a set of outputs was made from: fingerprints of the input files and
+ * the settings that affect the outputs, along with fingerprints of the outputs
+ * themselves.  It is saved next to the outputs, so a re-run can tell exactly which
+ * outputs are still valid rather than trusting anything that exists.  Files are
+ * fingerprinted by their size and modification time, which is cheap to check even
+ * for large BAMs.
+ */
+class Manifest {
+private:
+	map<string, string> entries;
+
+public:
+
+	bool empty() const {
+		return entries.empty();
+	}
+
+	void set(const string& key, const string& value) {
+		entries[key] = value;
+	}
+
+	/**
+	 * Records the fingerprint of a file
+	 */
+	void setFile(const string& key, const path& file) {
+		entries[key] = fingerprint(file);
+	}
+
+	/**
+	 * Copies the entries whose keys start with the given prefix from another manifest
+	 */
+	void setAll(const Manifest& other, const string& prefix);
+
+	/**
+	 * Whether both manifests have the same entries for keys starting with the given prefix
+	 */
+	bool matches(const Manifest& other, const string& prefix) const;
+
+	/**
+	 * Whether there are file entries with keys starting with the given prefix, and
+	 * all those files still have the recorded fingerprints
+	 */
+	bool filesUnchanged(const string& prefix) const;
+
+	/**
+	 * Whether the outputs recorded in a previous manifest can be reused for this one.
+	 * The entries the outputs depend on, such as the inputs and settings they were made
+	 * with, must be the same in both, and the output files must not have changed since.
+	 * @param previous The manifest saved with the existing outputs
+	 * @param dependsOn Prefixes of the entries the outputs depend on
+	 * @param outputs Prefix of the output file entries in the previous manifest
+	 */
+	bool canReuse(const Manifest& previous, const vector<string>& dependsOn, const string& outputs) const;
+
+	void load(const path& file);
+
+	void save(const path& file) const;
+
+	/**
+	 * Size, modification time and location of a file, or "missing" if there is no
+	 * such file
+	 */
+	static string fingerprint(const path& file);
+};
+
+}
@@ -17,6 +17,7 @@
 
 #pragma once
 
+#include <algorithm>
 #include <string>
 using std::string;
 
@@ -96,6 +97,17 @@ public:
 		// reverse it
 		return reverseSeq(sequence);
 	}
+
+	/**
+	 * Reverse complements the provided sequence in place, so a buffer can be reused
+	 * @param sequence
+	 */
+	static void reverseComplementInPlace(string& sequence) {
+		for (auto & c : sequence) {
+			c = REVCOMP_LOOKUP[(int)c - 65];
+		}
+		std::reverse(sequence.begin(), sequence.end());
+	}
 };
 
 
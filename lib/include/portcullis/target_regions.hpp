@@ -0,0 +1,153 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#pragma once
+
+#include <functional>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+using std::pair;
+using std::set;
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+#include <boost/exception/all.hpp>
+#include <boost/filesystem/path.hpp>
+using boost::filesystem::path;
+
+#include "bam/bam_master.hpp"
+using portcullis::bam::RefSeqPtrList;
+
+namespace portcullis {
+
+typedef boost::error_info<struct TargetRegionsError, string> TargetRegionsErrorInfo;
+struct TargetRegionsException: virtual boost::exception, virtual std::exception { };
+
+/**
+ * A region of a target sequence
+ */
+struct TargetRegion {
+	int32_t refIndex;
+	int32_t start;		// Zero-based, inclusive
+	int32_t end;		// Zero-based, exclusive
+};
+
+/**
+ * A target region widened to take in the junctions its junctions' metrics depend on
+ */
+struct TargetWindow {
+	TargetRegion region;
+	int32_t maxSpan;	// Longest stretch of the target covered by a spliced alignment in the window
+	int32_t maxEnd;		// Furthest intron end of the junctions overlapping the target
+};
+
+/**
+ * Collects the introns from the spliced alignments overlapping a window of a target
+ * sequence, and the longest stretch of the target covered by any of those alignments
+ */
+typedef std::function<void(const int32_t start, const int32_t end, set<pair<int32_t, int32_t>>& introns, int32_t& maxSpan)> IntronFinder;
+
+/**
+ * The regions of the genome an analysis is restricted to, such as the genes in a
+ * panel, as loaded from a BED file.  Overlapping and touching regions are merged.
+ */
+class TargetRegions {
+private:
+
+	// Sorted, non-overlapping [start, end) intervals for each sequence name
+	unordered_map<string, vector<pair<int32_t, int32_t>>> intervals;
+
+public:
+
+	TargetRegions() {}
+
+	TargetRegions(const path& bedFile) {
+		load(bedFile);
+	}
+
+	/**
+	 * Loads the regions from a BED file.  Only the first three columns are used, and
+	 * track, browser and comment lines are skipped.
+	 * @param bedFile The BED file
+	 */
+	void load(const path& bedFile);
+
+	bool empty() const {
+		return intervals.empty();
+	}
+
+	/**
+	 * @return The number of regions, after merging any that overlap
+	 */
+	size_t size() const;
+
+	/**
+	 * Lists the regions on the given target sequences, in target sequence order then
+	 * position order, and clipped to the ends of the target sequences
+	 * @param refs The target sequences
+	 * @return The regions
+	 */
+	vector<TargetRegion> getRegions(const RefSeqPtrList& refs) const;
+
+	/**
+	 * Lists the sequences with regions that are not among the given target sequences,
+	 * which usually means the BED file is for a different assembly
+	 * @param refs The target sequences
+	 * @return Names of the unknown sequences
+	 */
+	vector<string> getUnknownSequences(const RefSeqPtrList& refs) const;
+
+	/**
+	 * Whether the given region overlaps any of the target regions
+	 * @param refName Name of the target sequence
+	 * @param start Start of the region (inclusive)
+	 * @param end End of the region (exclusive)
+	 */
+	bool overlaps(const string& refName, const int32_t start, const int32_t end) const;
+
+	/**
+	 * Widens a target region into the window of junctions that the junctions overlapping
+	 * the target are compared with.  A junction is grouped with any chain of neighbours
+	 * sharing a splice site with it, and measures the distance to its nearest neighbours,
+	 * so each side is widened until it holds a pair of neighbouring junctions beyond the
+	 * target that don't share a splice site, or reaches the end of the target sequence.
+	 * The window also owns every junction overlapping the target, i.e. starts at or
+	 * before all their introns.  Each time a side is widened, the step doubles.
+	 * @param target The target region
+	 * @param refLength Length of the target sequence
+	 * @param minStep The least to widen a side by the first time, if the target is shorter
+	 * @param findIntrons Collects the introns in a window
+	 * @param window Set to the widened region
+	 * @return False if no junctions overlap the target, so there is nothing to analyse
+	 */
+	static bool widen(const TargetRegion& target, const int32_t refLength, const int32_t minStep,
+					  const IntronFinder& findIntrons, TargetWindow& window);
+
+	/**
+	 * Sorts regions in target sequence then position order, merging any that overlap
+	 * or touch
+	 * @param regions The regions, which may overlap
+	 * @return The merged regions
+	 */
+	static vector<TargetRegion> merge(vector<TargetRegion> regions);
+};
+
+}
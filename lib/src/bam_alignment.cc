@@ -74,32 +74,26 @@ void portcullis::bam::BamAlignment::init() {
 	refId = b->core.tid;
 	mateId = b->core.mtid;
 	matePos = b->core.mpos;
-	uint32_t* c = bam_get_cigar(b);
-	alignedLength = 0;
-	// Record the cigar in an easy to access format and calculate the aligned length
-	// along the way
+	alignedLength = bam_cigar2rlen(b->core.n_cigar, bam_get_cigar(b));
+	// Cigar and strand are decoded lazily
+	cigarDecoded = false;
+	strandDecoded = false;
+}
+
+void portcullis::bam::BamAlignment::decodeCigar() const {
+	if (cigarDecoded) {
+		return;
+	}
+	const uint32_t* c = bam_get_cigar(b);
 	cigar.clear();
+	cigar.reserve(b->core.n_cigar);
 	for (uint32_t i = 0; i < b->core.n_cigar; i++) {
-		CigarOp op(bam_cigar_opchr(c[i]), bam_cigar_oplen(c[i]));
-		cigar.push_back(op);
-		if (CigarOp::opConsumesReference(op.type)) {
-			alignedLength += op.length;
-		}
-	}
-	// Determine actual read strand
-	// Try deriving from XS tag first if it's present.  If not then try to
-	// work it all out from the protocol suggested and the reverse strand
-	// flag.
-	Strand s = getXSStrand();
-	if (s != Strand::UNKNOWN) {
-		strand = s;
-	}
-	else {
-		strand = calcStrand();
+		cigar.push_back(CigarOp(bam_cigar_opchr(c[i]), bam_cigar_oplen(c[i])));
 	}
+	cigarDecoded = true;
 }
 
-portcullis::bam::Strand portcullis::bam::BamAlignment::calcStrand() {
+portcullis::bam::Strand portcullis::bam::BamAlignment::calcStrand() const {
 	Strand strand = Strand::UNKNOWN;
 	if (strandedness == Strandedness::FIRSTSTRAND) {
 		if (orientation == Orientation::FR) {
@@ -162,6 +156,9 @@ portcullis::bam::BamAlignment::BamAlignment() {
 	mateId = -1;
 	strandedness = Strandedness::UNKNOWN;
 	orientation = Orientation::UNKNOWN;
+	cigarDecoded = true;
+	strand = Strand::UNKNOWN;
+	strandDecoded = false;
 }
 
 /**
@@ -241,6 +238,22 @@ string portcullis::bam::BamAlignment::deriveName() const {
 			   qName;
 }
 
+size_t portcullis::bam::BamAlignment::hashName() const {
+	// 64-bit FNV-1a
+	uint64_t hash = 14695981039346656037ULL;
+	auto addChars = [&hash](const char* s) {
+		for (; *s != '\0'; s++) {
+			hash ^= (uint8_t) * s;
+			hash *= 1099511628211ULL;
+		}
+	};
+	addChars(bam_get_qname(b));
+	if (isPaired()) {
+		addChars(this->isFirstMate() ? "_R1" : this->isSecondMate() ? "_R2" : "_R?");
+	}
+	return (size_t)hash;
+}
+
 string portcullis::bam::BamAlignment::getQuerySeq() const {
 	stringstream ss;
 	for (int32_t i = 0; i < b->core.l_qseq; ++i) {
@@ -254,29 +267,47 @@ string portcullis::bam::BamAlignment::getQuerySeqAfterClipping() const {
 }
 
 string portcullis::bam::BamAlignment::getQuerySeqAfterClipping(const string& seq) const {
-	int32_t start = getStart();
-	int32_t end = getEnd();
-	int32_t clippedStart = cigar.front().type == BAM_CIGAR_SOFTCLIP_CHAR ? start + cigar.front().length : start;
-	int32_t clippedEnd = cigar.back().type == BAM_CIGAR_SOFTCLIP_CHAR ? end - cigar.back().length : end;
+	decodeCigar();
+	return getQuerySeqAfterClipping(cigar.data(), cigar.size(), position, alignedLength, seq);
+}
+
+string portcullis::bam::BamAlignment::getQuerySeqAfterClipping(const CigarOp* cigar, const size_t nbOps, int32_t position, int32_t alignedLength, const string& seq) {
+	int32_t start = position;
+	int32_t end = position + alignedLength - 1;
+	int32_t clippedStart = cigar[0].type == BAM_CIGAR_SOFTCLIP_CHAR ? start + cigar[0].length : start;
+	int32_t clippedEnd = cigar[nbOps - 1].type == BAM_CIGAR_SOFTCLIP_CHAR ? end - cigar[nbOps - 1].length : end;
 	int32_t deltaStart = clippedStart - start;
 	int32_t deltaEnd = end - clippedEnd;
 	return seq.substr(deltaStart, seq.size() - deltaStart - deltaEnd + 1);
 }
 
+string portcullis::bam::BamAlignment::getCigarAsString(const CigarOp* cigar, const size_t nbOps) {
+	stringstream ss;
+	for (size_t i = 0; i < nbOps; i++) {
+		ss << cigar[i].toString();
+	}
+	return ss.str();
+}
+
 /**
  * We assume that orientatio
  * @param orientation
  * @return
  */
 bool portcullis::bam::BamAlignment::calcIfProperPair(Orientation orientation) const {
-	if (!this->isPaired() || !this->isMateMapped()) {
+	return calcIfProperPair(alFlag, refId == mateId, position, matePos, orientation);
+}
+
+bool portcullis::bam::BamAlignment::calcIfProperPair(uint32_t flag, bool mateOnSameRef, int32_t position, int32_t matePos, Orientation orientation) {
+	if ((flag & BAM_FPAIRED) == 0 || (flag & BAM_FMUNMAP) != 0) {
 		return false;
 	}
-	if (this->refId != this->mateId) {
+	if (!mateOnSameRef) {
 		return false;
 	}
-	bool diffStrand = this->isReverseStrand() != this->isMateReverseStrand();
-	bool posGap = !this->isReverseStrand() ? this->position < this->matePos : this->position > this->matePos;
+	const bool reverseStrand = (flag & BAM_FREVERSE) != 0;
+	bool diffStrand = reverseStrand != ((flag & BAM_FMREVERSE) != 0);
+	bool posGap = !reverseStrand ? position < matePos : position > matePos;
 	if (orientation == Orientation::FR) {
 		return diffStrand && posGap;
 	}
@@ -292,8 +323,18 @@ bool portcullis::bam::BamAlignment::calcIfProperPair(Orientation orientation) co
 }
 
 bool portcullis::bam::BamAlignment::isSplicedRead() const {
-	for (const auto & op : cigar) {
-		if (op.type == BAM_CIGAR_REFSKIP_CHAR) {
+	if (cigarDecoded) {
+		for (const auto & op : cigar) {
+			if (op.type == BAM_CIGAR_REFSKIP_CHAR) {
+				return true;
+			}
+		}
+		return false;
+	}
+	// Check the raw cigar directly, which avoids decoding it for unspliced reads
+	const uint32_t* c = bam_get_cigar(b);
+	for (uint32_t i = 0; i < b->core.n_cigar; i++) {
+		if (bam_cigar_op(c[i]) == BAM_CREF_SKIP) {
 			return true;
 		}
 	}
@@ -302,8 +343,17 @@ bool portcullis::bam::BamAlignment::isSplicedRead() const {
 
 uint32_t portcullis::bam::BamAlignment::getNbJunctionsInRead() const {
 	int32_t nbJunctions = 0;
-	for (const auto & op : cigar) {
-		if (op.type == BAM_CIGAR_REFSKIP_CHAR) {
+	if (cigarDecoded) {
+		for (const auto & op : cigar) {
+			if (op.type == BAM_CIGAR_REFSKIP_CHAR) {
+				nbJunctions++;
+			}
+		}
+		return nbJunctions;
+	}
+	const uint32_t* c = bam_get_cigar(b);
+	for (uint32_t i = 0; i < b->core.n_cigar; i++) {
+		if (bam_cigar_op(c[i]) == BAM_CREF_SKIP) {
 			nbJunctions++;
 		}
 	}
@@ -319,6 +369,7 @@ uint32_t portcullis::bam::BamAlignment::calcNbAlignedBases(int32_t start, int32_
 	}
 	int32_t count = 0;
 	int32_t pos = position;
+	decodeCigar();
 	for (const auto & op : cigar) {
 		if (pos > end) {
 			break;
@@ -342,11 +393,20 @@ string portcullis::bam::BamAlignment::getPaddedQuerySeq(const string& query_seq,
 	if (start > getEnd() || end < position)
 		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
 								  "Found an alignment that does not have a presence in the requested region")));
+	string query = include_soft_clips ? query_seq : this->getQuerySeqAfterClipping(query_seq);
+	decodeCigar();
+	return getPaddedQuerySeq(cigar.data(), cigar.size(), position, alignedLength, query, start, end, actual_start, actual_end, include_soft_clips);
+}
+
+string portcullis::bam::BamAlignment::getPaddedQuerySeq(const CigarOp* cigar, const size_t nbOps, int32_t position, int32_t alignedLength, const string& query, int32_t start, int32_t end, int32_t& actual_start, int32_t& actual_end, const bool include_soft_clips) {
+	if (start > position + alignedLength - 1 || end < position)
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Found an alignment that does not have a presence in the requested region")));
 	int32_t qPos = 0;
 	int32_t rPos = position;
-	string query = include_soft_clips ? query_seq : this->getQuerySeqAfterClipping(query_seq);
 	stringstream ss;
-	for (const auto & op : cigar) {
+	for (size_t i = 0; i < nbOps; i++) {
+		const CigarOp& op = cigar[i];
 		bool consumesRef = CigarOp::opConsumesReference(op.type);
 		bool consumesQuery = CigarOp::opConsumesQuery(op.type) && (include_soft_clips || op.type != BAM_CIGAR_SOFTCLIP_CHAR);
 		// Skips any cigar ops before start position
@@ -365,7 +425,7 @@ string portcullis::bam::BamAlignment::getPaddedQuerySeq(const string& query_seq,
 										  "Can't extract cigar op sequence from query string when length has been calculated as 0.")
 									  + "\nLimits: " + lexical_cast<string>(start) + "," + lexical_cast<string>(end)
 									  + "\nQuery sequence: " + query + " (" + lexical_cast<string>(query.size()) + ")"
-									  + "\nCigar: " + getCigarAsString()
+									  + "\nCigar: " + getCigarAsString(cigar, nbOps)
 									  + "\nCurrent op: " + op.toString()
 									  + "\nCurrent position in query: " + lexical_cast<string>(qPos)
 									  + "\nRequested length: " + lexical_cast<string>(len)
@@ -378,7 +438,7 @@ string portcullis::bam::BamAlignment::getPaddedQuerySeq(const string& query_seq,
 										  "Can't extract cigar op sequence from query string.")
 									  + "\nLimits: " + lexical_cast<string>(start) + "," + lexical_cast<string>(end)
 									  + "\nQuery sequence: " + query + " (" + lexical_cast<string>(query.size()) + ")"
-									  + "\nCigar: " + getCigarAsString()
+									  + "\nCigar: " + getCigarAsString(cigar, nbOps)
 									  + "\nCurrent op: " + op.toString()
 									  + "\nCurrent position in query: " + lexical_cast<string>(qPos)
 									  + "\nRequested length: " + lexical_cast<string>(len)
@@ -403,7 +463,12 @@ string portcullis::bam::BamAlignment::getPaddedQuerySeq(const string& query_seq,
 }
 
 string portcullis::bam::BamAlignment::getPaddedGenomeSeq(const string& genomeSeq, int32_t start, int32_t end, int32_t q_start, int32_t q_end, const bool include_soft_clips) const {
-	if (start > getEnd() || end < position)
+	decodeCigar();
+	return getPaddedGenomeSeq(cigar.data(), cigar.size(), position, alignedLength, genomeSeq, start, end, q_start, q_end, include_soft_clips);
+}
+
+string portcullis::bam::BamAlignment::getPaddedGenomeSeq(const CigarOp* cigar, const size_t nbOps, int32_t position, int32_t alignedLength, const string& genomeSeq, int32_t start, int32_t end, int32_t q_start, int32_t q_end, const bool include_soft_clips) {
+	if (start > position + alignedLength - 1 || end < position)
 		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
 								  "Found an alignment that does not have a presence in the requested region")));
 	//int32_t pos = 0;
@@ -420,7 +485,8 @@ string portcullis::bam::BamAlignment::getPaddedGenomeSeq(const string& genomeSeq
 								  "Query end position was beyond genomic region end position.  Query end: ") + lexical_cast<string>(q_end) + "; Genomic end: " + lexical_cast<string>(end)));
 	}
 	stringstream ss;
-	for (const auto & op : cigar) {
+	for (size_t i = 0; i < nbOps; i++) {
+		const CigarOp& op = cigar[i];
 		bool consumesRef = CigarOp::opConsumesReference(op.type);
 		bool consumesQuery = CigarOp::opConsumesQuery(op.type) && (include_soft_clips || op.type != BAM_CIGAR_SOFTCLIP_CHAR);
 		// Skips any cigar ops before start position
@@ -439,7 +505,7 @@ string portcullis::bam::BamAlignment::getPaddedGenomeSeq(const string& genomeSeq
 										  "Can't extract cigar op sequence from extracted genome region.\nCurrent position in extracted genome region: ")
 									  + lexical_cast<string>(seqOffset) +
 									  "; Genome region length: " + lexical_cast<string>(genomeSeq.size()) +
-									  "\nFull cigar: " + this->getCigarAsString() +
+									  "\nFull cigar: " + getCigarAsString(cigar, nbOps) +
 									  "\nCurrent cigar op: " + op.type + lexical_cast<string>(op.length) +
 									  "\nCurrent genomic position: " + lexical_cast<string>(rPos) +
 									  "\nAlignment region: " + lexical_cast<string>(position) + "," + lexical_cast<string>(position + alignedLength) +
@@ -466,6 +532,7 @@ string portcullis::bam::BamAlignment::toString() const {
 }
 
 string portcullis::bam::BamAlignment::toString(bool afterClipping) const {
+	decodeCigar();
 	uint32_t start = afterClipping && cigar.front().type == BAM_CIGAR_SOFTCLIP_CHAR ? position + cigar.front().length : position;
 	uint32_t end = afterClipping && cigar.back().type == BAM_CIGAR_SOFTCLIP_CHAR ? getEnd() - cigar.back().length : getEnd();
 	stringstream ss;
@@ -61,67 +61,49 @@ bool portcullis::bam::BamHelper::isCoordSortedBam(const path& bamFile) {
 	return found;
 }
 
-bool portcullis::bam::BamHelper::isNewerIndexPresent(const path& bamFile, bool useCsi) {
-	path idxFile = path(bamFile.string() + (useCsi ? ".csi" : ".bai"));
-	if (!exists(idxFile))
+bool portcullis::bam::BamHelper::haveSameTargets(const bam_hdr_t* a, const bam_hdr_t* b) {
+	if (a->n_targets != b->n_targets) {
 		return false;
-	time_t bamTime = last_write_time( bamFile ) ;
-	time_t idxTime = last_write_time( bamFile ) ;
-	return difftime(bamTime, idxTime) > 0;
+	}
+	for (int32_t i = 0; i < a->n_targets; i++) {
+		if (a->target_len[i] != b->target_len[i] || strcmp(a->target_name[i], b->target_name[i]) != 0) {
+			return false;
+		}
+	}
+	return true;
 }
 
-/**
- * Creates a command that can be used to merge multiple BAM files with samtools
- * @param samtoolsExe The path to samtools
- * @param bamFiles The paths to each BAM file to merge
- * @param mergedBamFile The output file
- * @param threads Number of threads to use during merging
- * @return Command line
- */
-string portcullis::bam::BamHelper::createMergeBamCmd(const vector<path>& bamFiles,
-		const path& mergedBamFile,
-		uint16_t threads) {
-	stringstream inputFiles;
-	for (path p : bamFiles) {
-		inputFiles << " " << p.c_str();
+shared_ptr<portcullis::bam::RefSeqPtrList> portcullis::bam::BamHelper::createRefList(const bam_hdr_t* header) {
+	shared_ptr<RefSeqPtrList> refs = make_shared<RefSeqPtrList>();
+	for (int32_t i = 0; i < header->n_targets; i++) {
+		refs->push_back(make_shared<RefSeq>(i, string(header->target_name[i]), header->target_len[i]));
 	}
-	return string("samtools merge -f -@ ") + lexical_cast<string>(threads) +
-		   " " + mergedBamFile.string() +
-		   inputFiles.str();
+	return refs;
 }
 
+shared_ptr<portcullis::bam::RefSeqPtrIndexMap> portcullis::bam::BamHelper::createRefMap(const RefSeqPtrList& list) {
+	shared_ptr<RefSeqPtrIndexMap> refMap = make_shared<RefSeqPtrIndexMap>();
+	for (auto & ref : list) {
+		(*refMap)[ref->index] = ref;
+	}
+	return refMap;
+}
 
-/**
- * Creates a samtools command that can be used to sort a bam file
- * @param samtoolsExe The path to samtools
- * @param unsortedFile The bam file that needs sorting
- * @param sortedFile The path to the new sorted bam file which will be created
- * @param sortByName If true, bam entries are sorted by name, otherwise by position
- * @param threads Number of threads to use
- * @param memory Amount of memory to request
- * @return The command that can be used to sort the bam file
- */
-string portcullis::bam::BamHelper::createSortBamCmd(const path& unsortedFile,
-		const path& sortedFile,
-		bool sortByName,
-		uint16_t threads,
-		const string& memory) {
-    path temp_path = sortedFile.parent_path();
-    temp_path /= sortedFile.stem().string() + "_temp";
-	return string("samtools sort -@ ") + lexical_cast<string>(threads) +
-           " -m " + memory + " " + (sortByName ? "-n " : "") +
-           "-T " + temp_path.string() + " -o " + sortedFile.string() + " " +
-           unsortedFile.string();
+bool portcullis::bam::BamHelper::isNewerIndexPresent(const path& bamFile, bool useCsi) {
+	path idxFile = path(bamFile.string() + (useCsi ? ".csi" : ".bai"));
+	if (!exists(idxFile))
+		return false;
+	time_t bamTime = last_write_time(bamFile);
+	time_t idxTime = last_write_time(idxFile);
+	return difftime(idxTime, bamTime) >= 0;
 }
 
-/**
- * Creates a samtools command that can be used to index a sorted bam file
- * @param samtoolsExe The path to samtools
- * @param sortedBam Path to a sorted bam file to index
- * @return The command that can be used to index the sorted bam file
- */
-string portcullis::bam::BamHelper::createIndexBamCmd(const path& sortedBam, bool useCsi) {
-	return string("samtools index ") + (useCsi ? "-c " : "") + sortedBam.string();
+void portcullis::bam::BamHelper::indexBam(const path& sortedBam, bool useCsi) {
+	// Same minimum interval size as "samtools index -c"
+	if (sam_index_build(sortedBam.c_str(), useCsi ? 14 : 0) != 0) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not index BAM file: ") + sortedBam.string()));
+	}
 }
 
 
@@ -15,6 +15,7 @@
 //  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
 //  *******************************************************************
 
+#include <algorithm>
 #include <memory>
 #include <iostream>
 #include <sstream>
@@ -47,15 +48,34 @@ using portcullis::bam::BamAlignment;
 using portcullis::bam::BamAlignmentPtr;
 
 #include <portcullis/bam/bam_reader.hpp>
+#include <portcullis/bam/bam_sorter.hpp>
 
 // ****** BamReader methods *********
 
 portcullis::bam::BamReader::BamReader(const path& _bamFile) {
 	bamFile = _bamFile;
+	bamFiles.push_back(_bamFile);
+	threads = 1;
+	fp = nullptr;
 	header = nullptr;
-	index = nullptr;
 	iter = nullptr;
+	regionSet = false;
+	firstTarget = 0;
+	lastTarget = -1;
+	targetsSet = false;
+	nextOffset = 0;
+	offsetsSet = false;
+	currentOffset = -1;
 	c = nullptr;
+	mergeStarted = false;
+	currentPart = 0;
+}
+
+portcullis::bam::BamReader::BamReader(const vector<path>& _bamFiles) :
+	BamReader(_bamFiles.empty() ? path() : _bamFiles[0]) {
+	if (_bamFiles.size() > 1) {
+		bamFiles = _bamFiles;
+	}
 }
 
 portcullis::bam::BamReader::~BamReader() {
@@ -65,9 +85,6 @@ portcullis::bam::BamReader::~BamReader() {
 	if (c != nullptr) {
 		bam_destroy1(c);
 	}
-	if (index != nullptr) {
-		hts_idx_destroy(index);
-	}
 	if (iter != nullptr) {
 		free(iter->off);
 		free(iter->bins.a);
@@ -76,6 +93,15 @@ portcullis::bam::BamReader::~BamReader() {
 }
 
 void portcullis::bam::BamReader::open() {
+	open(1);
+}
+
+void portcullis::bam::BamReader::open(const uint16_t threads) {
+	this->threads = threads;
+	if (bamFiles.size() > 1) {
+		openParts(threads);
+		return;
+	}
 	// split
 	fp = bgzf_open(bamFile.c_str(), "r");
 	if (fp == NULL) {
@@ -84,15 +110,57 @@ void portcullis::bam::BamReader::open() {
 	}
 	// Load header
 	header = bam_hdr_read(fp);
-	// Load the index
-	index = bam_index_load(bamFile.c_str());
+	// The index is only needed for regions, so unless one is shared with us it isn't
+	// loaded until a region is set
+	if (!sharedIndexes.empty()) {
+		index = sharedIndexes[0];
+	}
 	// Initialise an empty bam alignment
 	c = bam_init1();
 	b.setRaw(c);
 }
 
+void portcullis::bam::BamReader::openParts(const uint16_t threads) {
+	const uint16_t partThreads = std::max<size_t>(1, threads / bamFiles.size());
+	for (size_t i = 0; i < bamFiles.size(); i++) {
+		const path& f = bamFiles[i];
+		shared_ptr<BamReader> part = make_shared<BamReader>(f);
+		if (i < sharedIndexes.size()) {
+			part->setIndexes(vector<BamIndexPtr>{ sharedIndexes[i] });
+		}
+		part->open(partThreads);
+		if (header == nullptr) {
+			header = bam_hdr_dup(part->getHeader());
+		}
+		else if (!BamHelper::haveSameTargets(header, part->getHeader())) {
+			BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+									  "Target sequences do not match those in the first BAM file: ") + f.string()));
+		}
+		parts.push_back(part);
+	}
+	mergeStarted = false;
+	currentPart = parts.size();
+}
+
+vector<portcullis::bam::BamIndexPtr> portcullis::bam::BamReader::loadIndexes(const vector<path>& bamFiles) {
+	vector<BamIndexPtr> indexes;
+	for (auto & f : bamFiles) {
+		hts_idx_t* idx = bam_index_load(f.c_str());
+		indexes.push_back(idx == NULL ? BamIndexPtr() : BamIndexPtr(idx, hts_idx_destroy));
+	}
+	return indexes;
+}
+
 void portcullis::bam::BamReader::close() {
-	bgzf_close(fp);
+	for (auto & part : parts) {
+		part->close();
+	}
+	parts.clear();
+	pipeline.reset();
+	if (fp != nullptr) {
+		bgzf_close(fp);
+		fp = nullptr;
+	}
 }
 
 
@@ -101,12 +169,8 @@ void portcullis::bam::BamReader::close() {
  * @return
  */
 shared_ptr<RefSeqPtrList> portcullis::bam::BamReader::createRefList() {
-	shared_ptr<RefSeqPtrList> refs = make_shared<RefSeqPtrList>();
 	// Identify all the reference sequences in the BAM
-	for (int32_t i = 0; i < header->n_targets; i++) {
-		refs->push_back(make_shared<RefSeq>(i, string(header->target_name[i]), header->target_len[i]));
-	}
-	return refs;
+	return BamHelper::createRefList(header);
 }
 
 
@@ -124,29 +188,210 @@ shared_ptr<RefSeqPtrIndexMap> portcullis::bam::BamReader::createRefMap() {
  * @return
  */
 shared_ptr<RefSeqPtrIndexMap> portcullis::bam::BamReader::createRefMap(const RefSeqPtrList& list) {
-	shared_ptr<RefSeqPtrIndexMap> refMap = make_shared<RefSeqPtrIndexMap>();
-	for (auto & ref : list) {
-		(*refMap)[ref->index] = ref;
-	}
-	return refMap;
+	return BamHelper::createRefMap(list);
 }
 
 bool portcullis::bam::BamReader::next() {
+	if (!parts.empty()) {
+		return nextMerged();
+	}
+	if (offsetsSet) {
+		if (nextOffset >= offsets.size()) {
+			return false;
+		}
+		currentOffset = offsets[nextOffset++];
+		const int64_t pos = bgzf_tell(fp);
+		if ((currentOffset >> 16) == (pos >> 16) && currentOffset > pos && fp->block_length > 0) {
+			// Skip forward through the block we already have, rather than inflating it again
+			uint8_t skipped[4096];
+			int64_t remaining = currentOffset - pos;
+			while (remaining > 0) {
+				const size_t n = std::min<int64_t>(remaining, sizeof(skipped));
+				if (bgzf_read(fp, skipped, n) != (ssize_t)n) {
+					return false;
+				}
+				remaining -= n;
+			}
+		}
+		else if (currentOffset != pos && bgzf_seek(fp, currentOffset, SEEK_SET) < 0) {
+			BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+									  "Could not seek to alignment in BAM file: ") + bamFile.string()));
+		}
+		bool res = bam_read1(fp, c) >= 0;
+		b.setRaw(c);
+		return res;
+	}
+	if (targetsSet) {
+		while (true) {
+			currentOffset = bgzf_tell(fp);
+			if (bam_read1(fp, c) < 0 || c->core.tid < 0 || c->core.tid > lastTarget) {
+				// Stays finished until another region is set
+				targetsSet = false;
+				return false;
+			}
+			if (c->core.tid >= firstTarget) {
+				b.setRaw(c);
+				return true;
+			}
+		}
+	}
+	// Nothing to read in an empty region, don't fall back to reading sequentially
+	if (regionSet && iter == nullptr) {
+		return false;
+	}
+	// Use the decompression pipeline for multi-threaded sequential reads.  We can only
+	// do this for BGZF compressed files, and the records are only decoded for little
+	// endian hosts, so anything else is left to bam_read1.
+	if (iter == nullptr && threads > 1 && fp->is_compressed && !fp->is_gzip && !fp->is_be && !ed_is_big()) {
+		if (pipeline == nullptr) {
+			pipeline = unique_ptr<BgzfPipeline>(new BgzfPipeline(bamFile, bgzf_tell(fp), threads));
+		}
+		currentOffset = pipeline->tell();
+		bool res = pipeline->readRecord(c) >= 0;
+		b.setRaw(c);
+		return res;
+	}
+	currentOffset = iter == nullptr ? bgzf_tell(fp) : -1;
 	bool res = bam_iter_read(fp, iter, c) >= 0;
 	b.setRaw(c);
 	return res;
 }
 
+void portcullis::bam::BamReader::queueNext(const size_t part) {
+	if (parts[part]->next()) {
+		mergeQueue.push(MergeEntry(BamSorter::sortKey(parts[part]->current().getRaw()), part));
+	}
+}
+
+/**
+ * Takes the next alignment from whichever file has the lowest one.  Each file only
+ * moves on once its current alignment has been handed out.
+ */
+bool portcullis::bam::BamReader::nextMerged() {
+	if (!mergeStarted) {
+		mergeQueue = priority_queue<MergeEntry, vector<MergeEntry>, std::greater<MergeEntry>>();
+		for (size_t i = 0; i < parts.size(); i++) {
+			queueNext(i);
+		}
+		mergeStarted = true;
+	}
+	else if (currentPart < parts.size()) {
+		queueNext(currentPart);
+	}
+	if (mergeQueue.empty()) {
+		currentPart = parts.size();
+		return false;
+	}
+	currentPart = mergeQueue.top().second;
+	mergeQueue.pop();
+	return true;
+}
+
 const BamAlignment& portcullis::bam::BamReader::current() const {
-	return b;
+	return currentPart < parts.size() ? parts[currentPart]->current() : b;
 }
 
 void portcullis::bam::BamReader::setRegion(const int32_t seqIndex, const int32_t start, const int32_t end) {
-	iter = sam_itr_queryi(index, seqIndex, start, end);
+	if (!parts.empty()) {
+		for (auto & part : parts) {
+			part->setRegion(seqIndex, start, end);
+		}
+		mergeStarted = false;
+		currentPart = parts.size();
+		regionSet = true;
+		return;
+	}
+	// Release the iterator from any previous region before replacing it
+	if (iter != nullptr) {
+		hts_itr_destroy(iter);
+		iter = nullptr;
+	}
+	loadIndex();
+	iter = sam_itr_queryi(index.get(), seqIndex, start, end);
+	regionSet = true;
+	targetsSet = false;
+	offsetsSet = false;
+}
+
+void portcullis::bam::BamReader::setTargets(const int32_t firstSeqIndex, const int32_t lastSeqIndex) {
+	if (!parts.empty()) {
+		for (auto & part : parts) {
+			part->setTargets(firstSeqIndex, lastSeqIndex);
+		}
+		mergeStarted = false;
+		currentPart = parts.size();
+		regionSet = true;
+		return;
+	}
+	if (iter != nullptr) {
+		hts_itr_destroy(iter);
+		iter = nullptr;
+	}
+	loadIndex();
+	// With no iterator, an empty run of targets reads nothing
+	regionSet = true;
+	targetsSet = false;
+	offsetsSet = false;
+	// The chunks of a query are sorted by offset, so the first one holds the first
+	// alignment on the target
+	int64_t startOffset = -1;
+	for (int32_t t = firstSeqIndex; t <= lastSeqIndex && startOffset < 0; t++) {
+		hts_itr_t* it = sam_itr_queryi(index.get(), t, 0, header->target_len[t]);
+		if (it != nullptr) {
+			if (it->n_off > 0) {
+				startOffset = it->off[0].u;
+			}
+			hts_itr_destroy(it);
+		}
+	}
+	if (startOffset < 0) {
+		return;
+	}
+	if (bgzf_seek(fp, startOffset, SEEK_SET) < 0) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not seek to alignment in BAM file: ") + bamFile.string()));
+	}
+	firstTarget = firstSeqIndex;
+	lastTarget = lastSeqIndex;
+	targetsSet = true;
+}
+
+void portcullis::bam::BamReader::loadIndex() {
+	if (index == nullptr) {
+		index = loadIndexes(vector<path>{ bamFile })[0];
+	}
+	if (index == nullptr) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Cannot set a region on a BAM without an index: ") + bamFile.string()));
+	}
+}
+
+void portcullis::bam::BamReader::setOffsets(const vector<int64_t>& _offsets) {
+	if (!parts.empty()) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Cannot read by virtual offset from several BAM files at once, starting with: ") + bamFile.string()));
+	}
+	if (iter != nullptr) {
+		hts_itr_destroy(iter);
+		iter = nullptr;
+	}
+	regionSet = false;
+	targetsSet = false;
+	offsets = _offsets;
+	nextOffset = 0;
+	offsetsSet = true;
 }
 
 
 bool portcullis::bam::BamReader::isCoordSortedBam() {
+	if (!parts.empty()) {
+		for (auto & part : parts) {
+			if (!part->isCoordSortedBam()) {
+				return false;
+			}
+		}
+		return true;
+	}
 	string headerText = header->text;
 	return headerText.find("SO:coordinate") != std::string::npos;
 }
@@ -156,9 +401,11 @@ string portcullis::bam::BamReader::bamDetails() const {
 	string headerText = this->header->text;
 	vector<string> lines;
 	boost::split( lines, headerText, boost::is_any_of("\n"), boost::token_compress_on );
-	ss << "BAM details:" << endl
-	   << " - File path: " << bamFile << endl
-	   << " - # Target sequences: " << this->header->n_targets << endl;
+	ss << "BAM details:" << endl;
+	for (auto & f : bamFiles) {
+		ss << " - File path: " << f << endl;
+	}
+	ss << " - # Target sequences: " << this->header->n_targets << endl;
 	string hd = "@HD";
 	string pg = "@PG";
 	uint16_t programCount = 1;
@@ -0,0 +1,349 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+using std::max;
+using std::min;
+using std::priority_queue;
+using std::shared_ptr;
+using std::string;
+using std::thread;
+using std::vector;
+
+#include <boost/exception/all.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/path.hpp>
+#include <boost/lexical_cast.hpp>
+namespace bfs = boost::filesystem;
+using boost::filesystem::path;
+using boost::lexical_cast;
+
+#include <htslib/bgzf.h>
+#include <htslib/sam.h>
+
+#include <portcullis/bam/bam_master.hpp>
+#include <portcullis/bam/bam_alignment.hpp>
+#include <portcullis/bam/bam_reader.hpp>
+#include <portcullis/bam/bam_sorter.hpp>
+#include <portcullis/bam/bam_writer.hpp>
+
+namespace {
+
+// Don't bother splitting the buffer across threads for less than this many alignments
+const size_t MIN_ALIGNMENTS_PER_SORT_THREAD = 10000;
+
+// Number of blocks each compression thread works on at once
+const int COMPRESSION_BLOCKS_PER_THREAD = 256;
+
+// Roughly what malloc adds to each alignment we copy
+const uint64_t ALIGNMENT_OVERHEAD = sizeof(bam1_t) + 16;
+
+/**
+ * Copies the header, marking it as coordinate sorted
+ */
+bam_hdr_t* createSortedHeader(const bam_hdr_t* header) {
+	bam_hdr_t* sorted = bam_hdr_dup(header);
+	string text(header->text, header->l_text);
+	if (text.compare(0, 3, "@HD") == 0) {
+		const size_t eol = text.find('\n');
+		string hd = text.substr(0, eol);
+		const size_t so = hd.find("\tSO:");
+		if (so != string::npos) {
+			const size_t end = hd.find('\t', so + 1);
+			hd.replace(so, (end == string::npos ? hd.size() : end) - so, "\tSO:coordinate");
+		}
+		else {
+			hd += "\tSO:coordinate";
+		}
+		text = hd + (eol == string::npos ? string("\n") : text.substr(eol));
+	}
+	else {
+		text = "@HD\tVN:1.4\tSO:coordinate\n" + text;
+	}
+	free(sorted->text);
+	sorted->l_text = text.size();
+	sorted->text = (char*) malloc(text.size() + 1);
+	memcpy(sorted->text, text.c_str(), text.size() + 1);
+	return sorted;
+}
+
+/**
+ * Opens a BAM for writing sorted runs, compressing on the given number of threads
+ */
+BGZF* openOutput(const path& file, const char* mode, const bam_hdr_t* header, const uint16_t threads) {
+	BGZF* fp = bgzf_open(file.c_str(), mode);
+	if (fp == NULL) {
+		BOOST_THROW_EXCEPTION(portcullis::bam::BamException() << portcullis::bam::BamErrorInfo(string(
+								  "Could not open output BAM file: ") + file.string()));
+	}
+	if (threads > 1) {
+		bgzf_mt(fp, threads, COMPRESSION_BLOCKS_PER_THREAD);
+	}
+	if (bam_hdr_write(fp, header) != 0) {
+		bgzf_close(fp);
+		BOOST_THROW_EXCEPTION(portcullis::bam::BamException() << portcullis::bam::BamErrorInfo(string(
+								  "Could not write header into: ") + file.string()));
+	}
+	return fp;
+}
+
+void closeOutput(BGZF* fp, const path& file) {
+	if (bgzf_close(fp) != 0) {
+		BOOST_THROW_EXCEPTION(portcullis::bam::BamException() << portcullis::bam::BamErrorInfo(string(
+								  "Could not finish writing: ") + file.string()));
+	}
+}
+
+void writeAlignment(BGZF* fp, const bam1_t* b, const path& file) {
+	if (bam_write1(fp, b) < 0) {
+		BOOST_THROW_EXCEPTION(portcullis::bam::BamException() << portcullis::bam::BamErrorInfo(string(
+								  "Could not write alignment into: ") + file.string()));
+	}
+}
+
+}
+
+portcullis::bam::BamSorter::BamSorter(const path& _outputFile) {
+	outputFile = _outputFile;
+	threads = 1;
+	memory = 1LL << 30;
+	mergeSortedInputs = true;
+	buildIndex = false;
+	useCsi = false;
+	consumer = nullptr;
+	bufferSize = 0;
+}
+
+portcullis::bam::BamSorter::~BamSorter() {
+	clearBuffer();
+	for (auto & run : runs) {
+		bfs::remove(run);
+	}
+}
+
+uint64_t portcullis::bam::BamSorter::parseMemorySize(const string& size) {
+	size_t digits = 0;
+	while (digits < size.size() && isdigit(size[digits])) {
+		digits++;
+	}
+	const string suffix = size.substr(digits);
+	uint64_t multiplier = 1;
+	if (suffix.size() == 1) {
+		switch (toupper(suffix[0])) {
+		case 'K':
+			multiplier = 1ULL << 10;
+			break;
+		case 'M':
+			multiplier = 1ULL << 20;
+			break;
+		case 'G':
+			multiplier = 1ULL << 30;
+			break;
+		default:
+			multiplier = 0;
+		}
+	}
+	if (digits == 0 || multiplier == 0 || suffix.size() > 1) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Invalid memory size: ") + size));
+	}
+	return lexical_cast<uint64_t>(size.substr(0, digits)) * multiplier;
+}
+
+void portcullis::bam::BamSorter::clearBuffer() {
+	for (auto & e : buffer) {
+		bam_destroy1(e.b);
+	}
+	buffer.clear();
+	bufferSize = 0;
+}
+
+/**
+ * Sorts the buffer by splitting it into a part per thread, sorting each part,
+ * then merging neighbouring parts until only one is left.  All the sorts and
+ * merges are stable, so ties stay in input order.
+ */
+void portcullis::bam::BamSorter::sortBuffer() {
+	auto lessThan = [](const SortEntry & a, const SortEntry & b) { return a.key < b.key; };
+	const size_t parts = max<size_t>(1, min<size_t>(threads, buffer.size() / MIN_ALIGNMENTS_PER_SORT_THREAD));
+	vector<size_t> bounds;
+	for (size_t i = 0; i <= parts; i++) {
+		bounds.push_back(buffer.size() * i / parts);
+	}
+	vector<thread> workers;
+	for (size_t i = 0; i < parts; i++) {
+		workers.push_back(thread([this, &bounds, &lessThan, i] {
+			std::stable_sort(buffer.begin() + bounds[i], buffer.begin() + bounds[i + 1], lessThan);
+		}));
+	}
+	for (auto & w : workers) {
+		w.join();
+	}
+	while (bounds.size() > 2) {
+		workers.clear();
+		vector<size_t> merged;
+		for (size_t i = 0; i + 1 < bounds.size(); i += 2) {
+			merged.push_back(bounds[i]);
+			if (i + 2 < bounds.size()) {
+				workers.push_back(thread([this, &bounds, &lessThan, i] {
+					std::inplace_merge(buffer.begin() + bounds[i], buffer.begin() + bounds[i + 1], buffer.begin() + bounds[i + 2], lessThan);
+				}));
+			}
+		}
+		merged.push_back(bounds.back());
+		for (auto & w : workers) {
+			w.join();
+		}
+		bounds = merged;
+	}
+}
+
+path portcullis::bam::BamSorter::spillBuffer(const bam_hdr_t* header) {
+	sortBuffer();
+	const path run(outputFile.string() + ".tmp" + lexical_cast<string>(runs.size()) + ".bam");
+	runs.push_back(run);
+	// Runs are only read back once, so favour speed over size
+	BGZF* fp = openOutput(run, "w1", header, threads);
+	for (auto & e : buffer) {
+		writeAlignment(fp, e.b, run);
+	}
+	closeOutput(fp, run);
+	clearBuffer();
+	return run;
+}
+
+void portcullis::bam::BamSorter::sort(const vector<path>& inputs) {
+	if (inputs.empty()) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "No BAM files to sort")));
+	}
+	bam_hdr_t* header = nullptr;
+	// Sorted runs and inputs that were already sorted, in input order
+	vector<path> sources;
+	try {
+		for (auto & input : inputs) {
+			BamReader reader(input);
+			reader.open(threads);
+			if (header == nullptr) {
+				header = createSortedHeader(reader.getHeader());
+			}
+			else if (!BamHelper::haveSameTargets(header, reader.getHeader())) {
+				BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+										  "Target sequences do not match those in the first BAM file: ") + input.string()));
+			}
+			// Inputs that are already sorted can be merged in as they are.  Anything
+			// buffered from earlier inputs is spilled first, to keep ties in input order.
+			if (mergeSortedInputs && reader.isCoordSortedBam()) {
+				if (!buffer.empty()) {
+					sources.push_back(spillBuffer(header));
+				}
+				sources.push_back(input);
+				reader.close();
+				continue;
+			}
+			while (reader.next()) {
+				bam1_t* b = bam_dup1(reader.current().getRaw());
+				buffer.push_back(SortEntry{ sortKey(b), b });
+				bufferSize += b->m_data + ALIGNMENT_OVERHEAD + sizeof(SortEntry);
+				if (bufferSize >= memory) {
+					sources.push_back(spillBuffer(header));
+				}
+			}
+			reader.close();
+		}
+		sortBuffer();
+		merge(header, sources);
+	}
+	catch (...) {
+		if (header != nullptr) {
+			bam_hdr_destroy(header);
+		}
+		throw;
+	}
+	bam_hdr_destroy(header);
+	clearBuffer();
+	for (auto & run : runs) {
+		bfs::remove(run);
+	}
+	runs.clear();
+}
+
+/**
+ * Merges the sorted files and the sorted buffer into the output file.  The buffer
+ * holds the last of the input, so goes after the files, and ties go to the earliest
+ * source.  This keeps the sort stable overall.  Each alignment is also handed to the
+ * consumer, if there is one, as it is written.
+ */
+void portcullis::bam::BamSorter::merge(const bam_hdr_t* header, const vector<path>& files) {
+	const size_t bufferSource = files.size();
+	vector<shared_ptr<BamReader>> readers;
+	for (auto & f : files) {
+		shared_ptr<BamReader> reader = std::make_shared<BamReader>(f);
+		reader->open(max<size_t>(1, threads / (files.size() + 1)));
+		readers.push_back(reader);
+	}
+	vector<const bam1_t*> current(files.size() + 1, nullptr);
+	size_t nextInBuffer = 0;
+	typedef std::pair<uint64_t, size_t> HeapEntry;
+	priority_queue<HeapEntry, vector<HeapEntry>, std::greater<HeapEntry>> heap;
+	auto advance = [&](const size_t source) {
+		if (source == bufferSource) {
+			current[source] = nextInBuffer < buffer.size() ? buffer[nextInBuffer++].b : nullptr;
+		}
+		else {
+			current[source] = readers[source]->next() ? readers[source]->current().getRaw() : nullptr;
+		}
+		if (current[source] != nullptr) {
+			heap.push(HeapEntry(sortKey(current[source]), source));
+		}
+	};
+	for (size_t i = 0; i <= files.size(); i++) {
+		advance(i);
+	}
+	BamWriter writer(outputFile);
+	writer.setThreads(threads);
+	writer.setBuildIndex(buildIndex);
+	writer.setUseCsi(useCsi);
+	writer.open(header);
+	if (consumer != nullptr) {
+		consumer->start(header);
+	}
+	while (!heap.empty()) {
+		const size_t source = heap.top().second;
+		heap.pop();
+		writer.write(current[source]);
+		if (consumer != nullptr) {
+			consumer->consume(current[source]);
+		}
+		advance(source);
+	}
+	writer.close();
+	if (consumer != nullptr) {
+		consumer->finish();
+	}
+	for (auto & reader : readers) {
+		reader->close();
+	}
+}
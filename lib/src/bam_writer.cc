@@ -15,6 +15,9 @@
 //  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
 //  *******************************************************************
 
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
 #include <memory>
 #include <sstream>
 #include <string>
@@ -22,6 +25,7 @@
 using std::make_shared;
 using std::shared_ptr;
 using std::string;
+using std::unique_ptr;
 using std::vector;
 using std::stringstream;
 
@@ -29,11 +33,15 @@ using std::stringstream;
 #include <boost/filesystem/path.hpp>
 #include <boost/lexical_cast.hpp>
 #include <boost/filesystem.hpp>
+namespace bfs = boost::filesystem;
 using boost::filesystem::exists;
 using boost::filesystem::path;
 using boost::lexical_cast;
 
+#include <zlib.h>
+
 #include <htslib/faidx.h>
+#include <htslib/hts.h>
 #include <htslib/sam.h>
 #include <htslib/bgzf.h>
 
@@ -42,24 +50,249 @@ using portcullis::bam::BamAlignment;
 
 #include <portcullis/bam/bam_writer.hpp>
 
-void portcullis::bam::BamWriter::open(bam_hdr_t* header) {
-	// split
-	fp = bgzf_open(bamFile.c_str(), "w");
-	if (fp == NULL) {
+portcullis::bam::BamWriter::~BamWriter() {
+	if (fp != nullptr) {
+		bgzf_close(fp);
+	}
+	if (index != nullptr) {
+		hts_idx_destroy(index);
+	}
+}
+
+void portcullis::bam::BamWriter::open(const bam_hdr_t* header) {
+	if (ed_is_big()) {
+		fp = bgzf_open(bamFile.c_str(), "w");
+		if (fp == NULL) {
+			BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+									  "Could not open output file: ") + bamFile.string()));
+		}
+		if (threads > 1) {
+			bgzf_mt(fp, threads, 256);
+		}
+		if (bam_hdr_write(fp, header) != 0) {
+			BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+									  "Could not write header to: ") + bamFile.string()));
+		}
+		return;
+	}
+	out = unique_ptr<BgzfWriter>(new BgzfWriter(bamFile, Z_DEFAULT_COMPRESSION, threads));
+	// Same layout as bam_hdr_write on a little endian host
+	out->write("BAM\1", 4);
+	out->write(&header->l_text, 4);
+	if (header->l_text > 0) {
+		out->write(header->text, header->l_text);
+	}
+	out->write(&header->n_targets, 4);
+	for (int32_t i = 0; i < header->n_targets; i++) {
+		const int32_t nameLength = strlen(header->target_name[i]) + 1;
+		out->write(&nameLength, 4);
+		out->write(header->target_name[i], nameLength);
+		out->write(&header->target_len[i], 4);
+	}
+	out->flush();
+	if (buildIndex) {
+		// Same index parameters as bam_index_build, i.e. "samtools index"
+		int minShift = 14;
+		int nbLevels = 5;
+		if (useCsi) {
+			int64_t maxLength = 0;
+			for (int32_t i = 0; i < header->n_targets; i++) {
+				maxLength = std::max<int64_t>(maxLength, header->target_len[i]);
+			}
+			maxLength += 256;
+			nbLevels = 0;
+			for (int64_t s = 1 << minShift; maxLength > s; s <<= 3) {
+				nbLevels++;
+			}
+		}
+		index = hts_idx_init(header->n_targets, useCsi ? HTS_FMT_CSI : HTS_FMT_BAI,
+							 out->getVirtualOffset(out->tell()), minShift, nbLevels);
+		if (index == nullptr) {
+			BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+									  "Could not create index for: ") + bamFile.string()));
+		}
+	}
+}
+
+int portcullis::bam::BamWriter::write(const BamAlignment& ba) {
+	return write(ba.getRaw());
+}
+
+int portcullis::bam::BamWriter::write(const bam1_t* b) {
+	if (fp != nullptr) {
+		return bam_write1(fp, b);
+	}
+	// Same layout as bam_write1 on a little endian host
+	const bam1_core_t* c = &b->core;
+	const int32_t blockLength = 32 + b->l_data;
+	uint32_t x[8];
+	x[0] = c->tid;
+	x[1] = c->pos;
+	x[2] = (uint32_t)c->bin << 16 | c->qual << 8 | c->l_qname;
+	x[3] = (uint32_t)c->flag << 16 | c->n_cigar;
+	x[4] = c->l_qseq;
+	x[5] = c->mtid;
+	x[6] = c->mpos;
+	x[7] = c->isize;
+	out->reserve(4 + blockLength);
+	out->write(&blockLength, 4);
+	out->write(x, 32);
+	out->write(b->data, b->l_data);
+	if (index != nullptr) {
+		// Like bam_index_build, index each record against the offset just past it
+		PendingIndexEntry entry;
+		entry.tid = c->tid;
+		entry.start = c->pos;
+		entry.end = bam_endpos(b);
+		entry.mapped = !(c->flag & BAM_FUNMAP);
+		entry.after = out->tell();
+		pendingIndex.push_back(entry);
+		writeIndexEntries(false);
+	}
+	return 4 + blockLength;
+}
+
+/**
+ * Adds entries to the index once we know where their blocks are in the file
+ * @param all If true, waits for all the remaining blocks to be written
+ */
+void portcullis::bam::BamWriter::writeIndexEntries(const bool all) {
+	uint64_t block = UINT64_MAX;
+	int64_t blockOffset = 0;
+	while (!pendingIndex.empty()) {
+		const PendingIndexEntry& entry = pendingIndex.front();
+		if (entry.after.block != block) {
+			if (!all && !out->isPlaced(entry.after)) {
+				break;
+			}
+			BgzfPosition blockStart;
+			blockStart.block = entry.after.block;
+			block = blockStart.block;
+			blockOffset = out->getVirtualOffset(blockStart);
+		}
+		if (hts_idx_push(index, entry.tid, entry.start, entry.end, blockOffset | entry.after.offset, entry.mapped) < 0) {
+			BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+									  "Alignments must be coordinate sorted to index: ") + bamFile.string()));
+		}
+		pendingIndex.pop_front();
+	}
+}
+
+void portcullis::bam::BamWriter::writeChunk(const path& chunkFile, const BamChunk& chunk) {
+	if (index != nullptr) {
 		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
-								  "Could not open output BAM file: ") + bamFile.string()));
+								  "Can't copy chunks of alignments into a BAM that is being indexed: ") + bamFile.string()));
+	}
+	// Make sure anything already written ends on a block boundary
+	if (fp != nullptr) {
+		if (bgzf_flush(fp) != 0) {
+			BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+									  "Could not write to: ") + bamFile.string()));
+		}
+	}
+	else {
+		out->flush();
 	}
-	if (bam_hdr_write(fp, header) != 0) {
+	if (chunk.end <= chunk.start) {
+		return;
+	}
+	FILE* in = fopen(chunkFile.c_str(), "rb");
+	if (in == NULL || fseeko(in, chunk.start, SEEK_SET) != 0) {
+		if (in != NULL) {
+			fclose(in);
+		}
 		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
-								  "Could not write header into: ") + bamFile.string()));
+								  "Could not read alignments from: ") + chunkFile.string()));
+	}
+	vector<char> buffer(1 << 20);
+	int64_t remaining = chunk.end - chunk.start;
+	while (remaining > 0) {
+		size_t n = fread(buffer.data(), 1, std::min<int64_t>(remaining, buffer.size()), in);
+		if (n == 0) {
+			fclose(in);
+			BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+									  "Could not copy alignments from ") + chunkFile.string() + " to " + bamFile.string()));
+		}
+		if (fp != nullptr) {
+			if (bgzf_raw_write(fp, buffer.data(), n) != (ssize_t)n) {
+				fclose(in);
+				BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+										  "Could not copy alignments from ") + chunkFile.string() + " to " + bamFile.string()));
+			}
+		}
+		else {
+			out->writeRaw(buffer.data(), n);
+		}
+		remaining -= n;
 	}
+	fclose(in);
 }
 
-int portcullis::bam::BamWriter::write(const BamAlignment& ba) {
+void portcullis::bam::BamWriter::close() {
+	if (fp != nullptr) {
+		const int ret = bgzf_close(fp);
+		fp = nullptr;
+		if (ret != 0) {
+			BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+									  "Could not write to: ") + bamFile.string()));
+		}
+		if (buildIndex) {
+			const path indexFile(bamFile.string() + (useCsi ? ".csi" : ".bai"));
+			bfs::remove(indexFile);
+			if (bam_index_build(bamFile.c_str(), useCsi ? 14 : 0) != 0) {
+				BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+										  "Could not save index: ") + indexFile.string()));
+			}
+		}
+		return;
+	}
+	out->close();
+	if (index != nullptr) {
+		writeIndexEntries(true);
+		// bam_index_build finishes with the offset it reaches after reading past the
+		// end of file marker, so do the same to get an identical index
+		hts_idx_finish(index, (int64_t) bfs::file_size(bamFile) << 16);
+		// Don't write through a link to someone else's index
+		const path indexFile(bamFile.string() + (useCsi ? ".csi" : ".bai"));
+		bfs::remove(indexFile);
+		const int ret = hts_idx_save(index, bamFile.c_str(), useCsi ? HTS_FMT_CSI : HTS_FMT_BAI);
+		hts_idx_destroy(index);
+		index = nullptr;
+		if (ret != 0) {
+			BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+									  "Could not save index: ") + indexFile.string()));
+		}
+	}
+	out.reset();
+}
+
+void portcullis::bam::BamChunkWriter::open() {
+	fp = bgzf_open(chunkFile.c_str(), "w");
+	if (fp == NULL) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not open output file: ") + chunkFile.string()));
+	}
+	chunkStart = 0;
+}
+
+int portcullis::bam::BamChunkWriter::write(const BamAlignment& ba) {
 	return bam_write1(fp, ba.getRaw());
 }
 
-void portcullis::bam::BamWriter::close() {
+portcullis::bam::BamChunk portcullis::bam::BamChunkWriter::endChunk() {
+	if (bgzf_flush(fp) != 0) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not write to: ") + chunkFile.string()));
+	}
+	BamChunk chunk;
+	chunk.start = chunkStart;
+	chunk.end = bgzf_tell(fp) >> 16;
+	chunkStart = chunk.end;
+	return chunk;
+}
+
+void portcullis::bam::BamChunkWriter::close() {
 	bgzf_close(fp);
+	fp = nullptr;
 }
 
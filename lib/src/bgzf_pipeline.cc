@@ -0,0 +1,280 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+using std::lock_guard;
+using std::make_shared;
+using std::string;
+using std::unique_lock;
+using std::vector;
+
+#include <boost/exception/all.hpp>
+#include <boost/filesystem/path.hpp>
+using boost::filesystem::path;
+
+#include <zlib.h>
+
+#include <htslib/sam.h>
+
+#include <portcullis/bam/bam_master.hpp>
+#include <portcullis/bam/bgzf_pipeline.hpp>
+
+namespace {
+
+// Size of the fixed part of a BGZF block header, and of the CRC32 + ISIZE footer
+const size_t BGZF_HEADER_SIZE = 18;
+const size_t BGZF_FOOTER_SIZE = 8;
+
+// Number of blocks allowed to be read ahead of the consumer, per thread
+const size_t BLOCKS_PER_THREAD = 16;
+
+inline uint32_t unpackInt16(const uint8_t* buf) {
+	return buf[0] | (buf[1] << 8);
+}
+
+inline uint32_t unpackInt32(const uint8_t* buf) {
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+}
+
+portcullis::bam::BgzfPipeline::BgzfPipeline(const path& _bamFile, const int64_t virtualOffset, const uint16_t _threads) {
+	bamFile = _bamFile;
+	threads = _threads < 1 ? 1 : _threads;
+	maxBlocks = threads * BLOCKS_PER_THREAD;
+	eof = false;
+	terminate = false;
+	offset = 0;
+	startOffset = virtualOffset & 0xFFFF;
+	nextAddress = virtualOffset >> 16;
+	in = fopen(bamFile.c_str(), "rb");
+	if (in == NULL) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not open input BAM file: ") + bamFile.string()));
+	}
+	if (fseeko(in, virtualOffset >> 16, SEEK_SET) != 0) {
+		fclose(in);
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not seek to start of alignments in BAM file: ") + bamFile.string()));
+	}
+	reader = thread(&BgzfPipeline::readBlocks, this);
+	for (uint16_t i = 0; i < threads; i++) {
+		inflaters.push_back(thread(&BgzfPipeline::inflateBlocks, this));
+	}
+}
+
+portcullis::bam::BgzfPipeline::~BgzfPipeline() {
+	{
+		lock_guard<mutex> lock(blocksMutex);
+		terminate = true;
+	}
+	workAvailable.notify_all();
+	spaceAvailable.notify_all();
+	reader.join();
+	for (auto & t : inflaters) {
+		t.join();
+	}
+	fclose(in);
+}
+
+void portcullis::bam::BgzfPipeline::readBlocks() {
+	while (true) {
+		{
+			unique_lock<mutex> lock(blocksMutex);
+			spaceAvailable.wait(lock, [this] { return terminate || output.size() < maxBlocks; });
+			if (terminate) {
+				return;
+			}
+		}
+		BlockPtr block = make_shared<Block>();
+		block->address = nextAddress;
+		uint8_t header[BGZF_HEADER_SIZE];
+		size_t nbRead = fread(header, 1, BGZF_HEADER_SIZE, in);
+		if (nbRead == 0) {
+			lock_guard<mutex> lock(blocksMutex);
+			eof = true;
+			blockReady.notify_all();
+			return;
+		}
+		if (nbRead != BGZF_HEADER_SIZE ||
+				header[0] != 31 || header[1] != 139 || header[2] != 8 || (header[3] & 4) == 0 ||
+				unpackInt16(&header[10]) != 6 || header[12] != 'B' || header[13] != 'C' || unpackInt16(&header[14]) != 2) {
+			block->error = "Invalid BGZF block header";
+		}
+		else {
+			size_t blockSize = unpackInt16(&header[16]) + 1;
+			if (blockSize < BGZF_HEADER_SIZE + BGZF_FOOTER_SIZE) {
+				block->error = "Invalid BGZF block size";
+			}
+			else {
+				block->compressed.resize(blockSize);
+				memcpy(block->compressed.data(), header, BGZF_HEADER_SIZE);
+				size_t rest = blockSize - BGZF_HEADER_SIZE;
+				if (fread(block->compressed.data() + BGZF_HEADER_SIZE, 1, rest, in) != rest) {
+					block->error = "Truncated BGZF block";
+				}
+				nextAddress += blockSize;
+			}
+		}
+		lock_guard<mutex> lock(blocksMutex);
+		output.push_back(block);
+		if (!block->error.empty()) {
+			// Nothing more can be read, let the consumer report the problem when it gets here
+			block->ready = true;
+			eof = true;
+			blockReady.notify_all();
+			return;
+		}
+		work.push(block);
+		workAvailable.notify_one();
+	}
+}
+
+void portcullis::bam::BgzfPipeline::inflateBlocks() {
+	while (true) {
+		BlockPtr block;
+		{
+			unique_lock<mutex> lock(blocksMutex);
+			workAvailable.wait(lock, [this] { return terminate || !work.empty(); });
+			if (terminate) {
+				return;
+			}
+			block = work.front();
+			work.pop();
+		}
+		const size_t blockSize = block->compressed.size();
+		const uint32_t expectedSize = unpackInt32(&block->compressed[blockSize - 4]);
+		block->uncompressed.resize(expectedSize);
+		if (expectedSize > 0) {
+			z_stream zs;
+			zs.zalloc = NULL;
+			zs.zfree = NULL;
+			zs.opaque = NULL;
+			zs.next_in = block->compressed.data() + BGZF_HEADER_SIZE;
+			zs.avail_in = blockSize - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+			zs.next_out = block->uncompressed.data();
+			zs.avail_out = expectedSize;
+			if (inflateInit2(&zs, -15) != Z_OK) {
+				block->error = "Could not initialise zlib";
+			}
+			else {
+				if (inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out != expectedSize) {
+					block->error = "Could not inflate BGZF block";
+				}
+				inflateEnd(&zs);
+			}
+		}
+		// Release the compressed data now, we don't need it anymore
+		vector<uint8_t>().swap(block->compressed);
+		lock_guard<mutex> lock(blocksMutex);
+		block->ready = true;
+		blockReady.notify_all();
+	}
+}
+
+bool portcullis::bam::BgzfPipeline::nextBlock() {
+	{
+		unique_lock<mutex> lock(blocksMutex);
+		blockReady.wait(lock, [this] { return (!output.empty() && output.front()->ready) || (output.empty() && eof); });
+		if (output.empty()) {
+			current.reset();
+			return false;
+		}
+		current = output.front();
+		output.pop_front();
+	}
+	spaceAvailable.notify_one();
+	if (!current->error.empty()) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(current->error + " found while reading: " + bamFile.string()));
+	}
+	// Only the first block might start part way through
+	offset = startOffset;
+	startOffset = 0;
+	return true;
+}
+
+size_t portcullis::bam::BgzfPipeline::read(void* data, const size_t length) {
+	uint8_t* out = (uint8_t*)data;
+	size_t nbRead = 0;
+	while (nbRead < length) {
+		if (current == nullptr || offset >= current->uncompressed.size()) {
+			if (!nextBlock()) {
+				break;
+			}
+			continue;
+		}
+		size_t n = std::min(length - nbRead, current->uncompressed.size() - offset);
+		memcpy(out + nbRead, current->uncompressed.data() + offset, n);
+		offset += n;
+		nbRead += n;
+	}
+	return nbRead;
+}
+
+int64_t portcullis::bam::BgzfPipeline::tell() {
+	// Move on to the block holding the next byte, so the offset matches the start of
+	// the next record rather than the end of the previous block
+	while (current == nullptr || offset >= current->uncompressed.size()) {
+		if (!nextBlock()) {
+			return -1;
+		}
+	}
+	return (current->address << 16) | offset;
+}
+
+int portcullis::bam::BgzfPipeline::readRecord(bam1_t* b) {
+	// Follows the logic in htslib's bam_read1 on a little endian host.  BamReader
+	// only uses the pipeline on one.
+	bam1_core_t* c = &b->core;
+	int32_t blockLength;
+	uint32_t x[8];
+	size_t ret = read(&blockLength, 4);
+	if (ret != 4) {
+		return ret == 0 ? -1 : -2;
+	}
+	if (read(x, 32) != 32) return -3;
+	c->tid = x[0];
+	c->pos = x[1];
+	c->bin = x[2] >> 16;
+	c->qual = x[2] >> 8 & 0xff;
+	c->l_qname = x[2] & 0xff;
+	c->flag = x[3] >> 16;
+	c->n_cigar = x[3] & 0xffff;
+	c->l_qseq = x[4];
+	c->mtid = x[5];
+	c->mpos = x[6];
+	c->isize = x[7];
+	b->l_data = blockLength - 32;
+	if (b->l_data < 0 || c->l_qseq < 0 || c->l_qname < 1) return -4;
+	if ((char *)bam_get_aux(b) - (char *)b->data > b->l_data) return -4;
+	if (b->m_data < b->l_data) {
+		b->m_data = b->l_data;
+		kroundup32(b->m_data);
+		b->data = (uint8_t*)realloc(b->data, b->m_data);
+		if (!b->data) return -4;
+	}
+	if (read(b->data, b->l_data) != (size_t)b->l_data) return -4;
+	return 4 + blockLength;
+}
@@ -0,0 +1,290 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+using std::lock_guard;
+using std::make_shared;
+using std::string;
+using std::unique_lock;
+using std::vector;
+
+#include <boost/exception/all.hpp>
+#include <boost/filesystem/path.hpp>
+using boost::filesystem::path;
+
+#include <zlib.h>
+
+#include <portcullis/bam/bam_master.hpp>
+#include <portcullis/bam/bgzf_writer.hpp>
+
+namespace {
+
+// Fixed part of a BGZF block header, up to but not including the block size
+const uint8_t BGZF_HEADER[] = { 31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0 };
+const size_t BGZF_HEADER_SIZE = 18;
+const size_t BGZF_FOOTER_SIZE = 8;
+
+// Same limits as htslib, so any block deflates into a single BGZF block
+const size_t BGZF_BLOCK_SIZE = 0xff00;
+const size_t BGZF_MAX_BLOCK_SIZE = 0x10000;
+
+// An empty block, which marks the end of a BGZF file
+const uint8_t BGZF_EOF[] = { 31, 139, 8, 4, 0, 0, 0, 0, 0, 255, 6, 0, 'B', 'C', 2, 0, 27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+// Number of blocks allowed to be waiting to be written, per thread
+const size_t BLOCKS_PER_THREAD = 16;
+
+inline void packInt16(uint8_t* buf, const uint32_t value) {
+	buf[0] = value & 0xff;
+	buf[1] = value >> 8 & 0xff;
+}
+
+inline void packInt32(uint8_t* buf, const uint32_t value) {
+	buf[0] = value & 0xff;
+	buf[1] = value >> 8 & 0xff;
+	buf[2] = value >> 16 & 0xff;
+	buf[3] = value >> 24 & 0xff;
+}
+
+}
+
+portcullis::bam::BgzfWriter::BgzfWriter(const path& _file, const int _level, const uint16_t _threads) {
+	file = _file;
+	level = _level;
+	threads = _threads < 1 ? 1 : _threads;
+	maxBlocks = threads * BLOCKS_PER_THREAD;
+	finished = false;
+	terminate = false;
+	nbBlocks = 0;
+	addresses.push_back(0);
+	out = fopen(file.c_str(), "wb");
+	if (out == NULL) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not open output file: ") + file.string()));
+	}
+	current = make_shared<Block>();
+	writer = thread(&BgzfWriter::writeBlocks, this);
+	for (uint16_t i = 0; i < threads; i++) {
+		deflaters.push_back(thread(&BgzfWriter::deflateBlocks, this));
+	}
+}
+
+portcullis::bam::BgzfWriter::~BgzfWriter() {
+	{
+		lock_guard<mutex> lock(blocksMutex);
+		terminate = true;
+	}
+	workAvailable.notify_all();
+	blockReady.notify_all();
+	if (writer.joinable()) {
+		writer.join();
+	}
+	for (auto & t : deflaters) {
+		t.join();
+	}
+	if (out != NULL) {
+		fclose(out);
+	}
+}
+
+void portcullis::bam::BgzfWriter::writeBlocks() {
+	while (true) {
+		BlockPtr block;
+		{
+			unique_lock<mutex> lock(blocksMutex);
+			blockReady.wait(lock, [this] { return terminate || (!output.empty() && output.front()->ready) || (output.empty() && finished); });
+			if (terminate || output.empty()) {
+				return;
+			}
+			block = output.front();
+		}
+		string blockError = block->error;
+		if (blockError.empty() && fwrite(block->compressed.data(), 1, block->compressed.size(), out) != block->compressed.size()) {
+			blockError = "Could not write to";
+		}
+		{
+			lock_guard<mutex> lock(blocksMutex);
+			output.pop_front();
+			if (!blockError.empty() && error.empty()) {
+				error = blockError;
+			}
+			addresses.push_back(addresses.back() + block->compressed.size());
+		}
+		spaceAvailable.notify_one();
+		blockWritten.notify_all();
+	}
+}
+
+void portcullis::bam::BgzfWriter::deflateBlocks() {
+	while (true) {
+		BlockPtr block;
+		{
+			unique_lock<mutex> lock(blocksMutex);
+			workAvailable.wait(lock, [this] { return terminate || !work.empty(); });
+			if (terminate) {
+				return;
+			}
+			block = work.front();
+			work.pop();
+		}
+		const size_t length = block->uncompressed.size();
+		block->compressed.resize(BGZF_MAX_BLOCK_SIZE);
+		z_stream zs;
+		zs.zalloc = NULL;
+		zs.zfree = NULL;
+		zs.opaque = NULL;
+		zs.next_in = block->uncompressed.data();
+		zs.avail_in = length;
+		zs.next_out = block->compressed.data() + BGZF_HEADER_SIZE;
+		zs.avail_out = BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+		if (deflateInit2(&zs, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+			block->error = "Could not initialise zlib for";
+		}
+		else {
+			if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+				block->error = "Could not deflate BGZF block for";
+			}
+			deflateEnd(&zs);
+		}
+		if (block->error.empty()) {
+			const size_t blockSize = zs.total_out + BGZF_HEADER_SIZE + BGZF_FOOTER_SIZE;
+			uint8_t* buf = block->compressed.data();
+			memcpy(buf, BGZF_HEADER, sizeof(BGZF_HEADER));
+			packInt16(buf + sizeof(BGZF_HEADER), blockSize - 1);
+			packInt32(buf + blockSize - 8, crc32(crc32(0L, NULL, 0), block->uncompressed.data(), length));
+			packInt32(buf + blockSize - 4, length);
+			block->compressed.resize(blockSize);
+		}
+		// Release the uncompressed data now, we don't need it anymore
+		vector<uint8_t>().swap(block->uncompressed);
+		lock_guard<mutex> lock(blocksMutex);
+		block->ready = true;
+		blockReady.notify_all();
+	}
+}
+
+void portcullis::bam::BgzfWriter::queueBlock(BlockPtr block) {
+	unique_lock<mutex> lock(blocksMutex);
+	spaceAvailable.wait(lock, [this] { return output.size() < maxBlocks; });
+	if (!error.empty()) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(error + ": " + file.string()));
+	}
+	output.push_back(block);
+	nbBlocks++;
+	if (block->ready) {
+		blockReady.notify_all();
+	}
+	else {
+		work.push(block);
+		workAvailable.notify_one();
+	}
+}
+
+void portcullis::bam::BgzfWriter::write(const void* data, const size_t length) {
+	const uint8_t* in = (const uint8_t*) data;
+	size_t remaining = length;
+	while (remaining > 0) {
+		const size_t n = std::min(remaining, BGZF_BLOCK_SIZE - current->uncompressed.size());
+		current->uncompressed.insert(current->uncompressed.end(), in, in + n);
+		in += n;
+		remaining -= n;
+		if (current->uncompressed.size() >= BGZF_BLOCK_SIZE) {
+			flush();
+		}
+	}
+}
+
+void portcullis::bam::BgzfWriter::reserve(const size_t length) {
+	if (current->uncompressed.size() + length > BGZF_BLOCK_SIZE) {
+		flush();
+	}
+}
+
+void portcullis::bam::BgzfWriter::writeRaw(const void* data, const size_t length) {
+	flush();
+	if (length == 0) {
+		return;
+	}
+	BlockPtr block = make_shared<Block>();
+	block->compressed.assign((const uint8_t*) data, (const uint8_t*) data + length);
+	block->ready = true;
+	queueBlock(block);
+}
+
+void portcullis::bam::BgzfWriter::flush() {
+	if (current->uncompressed.empty()) {
+		return;
+	}
+	BlockPtr block = current;
+	current = make_shared<Block>();
+	current->uncompressed.reserve(BGZF_BLOCK_SIZE);
+	queueBlock(block);
+}
+
+portcullis::bam::BgzfPosition portcullis::bam::BgzfWriter::tell() const {
+	BgzfPosition position;
+	position.block = nbBlocks;
+	position.offset = current->uncompressed.size();
+	return position;
+}
+
+bool portcullis::bam::BgzfWriter::isPlaced(const BgzfPosition& position) {
+	lock_guard<mutex> lock(blocksMutex);
+	return position.block < addresses.size();
+}
+
+int64_t portcullis::bam::BgzfWriter::getVirtualOffset(const BgzfPosition& position) {
+	unique_lock<mutex> lock(blocksMutex);
+	blockWritten.wait(lock, [this, &position] { return position.block < addresses.size() || !error.empty(); });
+	if (!error.empty()) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(error + ": " + file.string()));
+	}
+	return (addresses[position.block] << 16) | position.offset;
+}
+
+void portcullis::bam::BgzfWriter::close() {
+	flush();
+	{
+		lock_guard<mutex> lock(blocksMutex);
+		finished = true;
+	}
+	blockReady.notify_all();
+	writer.join();
+	{
+		lock_guard<mutex> lock(blocksMutex);
+		terminate = true;
+	}
+	workAvailable.notify_all();
+	for (auto & t : deflaters) {
+		t.join();
+	}
+	deflaters.clear();
+	const bool ok = error.empty() && fwrite(BGZF_EOF, 1, sizeof(BGZF_EOF), out) == sizeof(BGZF_EOF);
+	const bool closed = fclose(out) == 0;
+	out = NULL;
+	if (!ok || !closed) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  error.empty() ? "Could not finish writing" : error) + ": " + file.string()));
+	}
+}
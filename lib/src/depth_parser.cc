@@ -47,9 +47,22 @@ using portcullis::bam::BamReader;
 
 // ******* Depth parser methods ********
 
+static inline int readNext(portcullis::bam::aux_t* aux, bam1_t* b) {
+	if (aux->reader != nullptr) {
+		if (!aux->reader->next()) {
+			return -1;
+		}
+		bam_copy1(b, aux->reader->current().getRaw());
+		return 0;
+	}
+	return aux->iter ? BamReader::bam_iter_read(aux->fp, aux->iter, b) :
+		   aux->pipeline ? aux->pipeline->readRecord(b) :
+		   bam_read1(aux->fp, b);
+}
+
 int portcullis::bam::DepthParser::read_bam(void *data, bam1_t *b) {
 	aux_t *aux = (aux_t*)data; // data in fact is a pointer to an auxiliary structure
-	int ret = aux->iter ? BamReader::bam_iter_read(aux->fp, aux->iter, b) : bam_read1(aux->fp, b);
+	int ret = readNext(aux, b);
 	if (!(b->core.flag & BAM_FUNMAP)) {
 		if ((int)b->core.qual < aux->min_mapQ) b->core.flag |= BAM_FUNMAP;
 		else if (aux->min_len && bam_cigar2qlen(b->core.n_cigar, bam_get_cigar(b)) < aux->min_len) b->core.flag |= BAM_FUNMAP;
@@ -63,7 +76,7 @@ int portcullis::bam::DepthParser::read_bam_skip_gapped(void *data, bam1_t *b) {
 	bool skip = false;
 	do {
 		skip = false;
-		ret = aux->iter ? BamReader::bam_iter_read(aux->fp, aux->iter, b) : bam_read1(aux->fp, b);
+		ret = readNext(aux, b);
 		uint32_t *cigar = bam_get_cigar(b);
 		for (int k = 0; k < b->core.n_cigar; ++k) {
 			int cop = cigar[k] & BAM_CIGAR_MASK; // operation
@@ -83,13 +96,37 @@ int portcullis::bam::DepthParser::read_bam_skip_gapped(void *data, bam1_t *b) {
 
 
 portcullis::bam::DepthParser::DepthParser(path _bamFile, uint8_t _strandSpecific, bool _allowGappedAlignments) :
-	bamFile(_bamFile), strandSpecific(_strandSpecific), allowGappedAlignments(_allowGappedAlignments) {
+	DepthParser(_bamFile, _strandSpecific, _allowGappedAlignments, 1) {
+}
+
+portcullis::bam::DepthParser::DepthParser(path _bamFile, uint8_t _strandSpecific, bool _allowGappedAlignments, uint16_t threads) :
+	DepthParser(vector<path>{ _bamFile }, _strandSpecific, _allowGappedAlignments, threads) {
+}
+
+portcullis::bam::DepthParser::DepthParser(const vector<path>& _bamFiles, uint8_t _strandSpecific, bool _allowGappedAlignments, uint16_t threads) :
+	bamFile(_bamFiles[0]), strandSpecific(_strandSpecific), allowGappedAlignments(_allowGappedAlignments) {
 	data = (aux_t**)calloc(1, sizeof(aux_t**));
 	data[0] = (aux_t*)calloc(1, sizeof(aux_t));
-	data[0]->fp = bgzf_open(bamFile.c_str(), "r");
 	data[0]->min_mapQ = 0;
 	data[0]->min_len  = 0;
-	header = bam_hdr_read(data[0]->fp);
+	if (_bamFiles.size() > 1) {
+		// Let the reader do the merging
+		reader = unique_ptr<BamReader>(new BamReader(_bamFiles));
+		reader->open(threads);
+		data[0]->reader = reader.get();
+		header = bam_hdr_dup(reader->getHeader());
+	}
+	else {
+		data[0]->fp = bgzf_open(bamFile.c_str(), "r");
+		header = bam_hdr_read(data[0]->fp);
+		// Decompress on multiple threads if requested and possible.  The pipeline only
+		// decodes records on little endian hosts.
+		BGZF* fp = data[0]->fp;
+		if (threads > 1 && fp->is_compressed && !fp->is_gzip && !fp->is_be && !ed_is_big()) {
+			pipeline = unique_ptr<BgzfPipeline>(new BgzfPipeline(bamFile, bgzf_tell(fp), threads));
+			data[0]->pipeline = pipeline.get();
+		}
+	}
 	mplp = allowGappedAlignments ?
 		   bam_mplp_init(1, read_bam, (void**)data) :
 		   bam_mplp_init(1, read_bam_skip_gapped, (void**)data);
@@ -99,8 +136,14 @@ portcullis::bam::DepthParser::DepthParser(path _bamFile, uint8_t _strandSpecific
 
 portcullis::bam::DepthParser::~DepthParser() {
 	bam_mplp_destroy(mplp);
+	pipeline.reset();
 	bam_hdr_destroy(header);
-	bgzf_close(data[0]->fp);
+	if (reader != nullptr) {
+		reader->close();
+	}
+	else {
+		bgzf_close(data[0]->fp);
+	}
 	if (data[0]->iter) {
 		bam_itr_destroy(data[0]->iter);
 	}
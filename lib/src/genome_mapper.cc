@@ -84,6 +84,37 @@ void portcullis::bam::GenomeMapper::loadFastaIndex() {
 								  "Genome index file does not exist: ") + fastaIndexFile.string()));
 	}
 	fastaIndex = fai_load(genomeFile.c_str());
+	seqIndices.clear();
+	if (fastaIndex != nullptr) {
+		for (int32_t i = 0; i < faidx_nseq(fastaIndex); i++) {
+			seqIndices[faidx_iseq(fastaIndex, i)] = i;
+		}
+	}
+}
+
+/**
+ * Packs this genome file into two bits per base
+ */
+void portcullis::bam::GenomeMapper::buildPackedGenome() {
+	PackedGenome::build(genomeFile, getPackedGenomeFile());
+}
+
+/**
+ * Memory maps the packed genome for this genome file if it is up to date, and was
+ * packed for this host
+ */
+bool portcullis::bam::GenomeMapper::loadPackedGenome() {
+	const path packedFile = getPackedGenomeFile();
+	if (!exists(packedFile) || !PackedGenome::isCompatible(packedFile)) {
+		return false;
+	}
+	shared_ptr<PackedGenome> packed = make_shared<PackedGenome>();
+	packed->open(packedFile);
+	if (!packed->isPackingOf(genomeFile)) {
+		return false;
+	}
+	packedGenome = packed;
+	return true;
 }
 
 
@@ -110,9 +141,67 @@ string portcullis::bam::GenomeMapper::fetchBases(const char* reg, int* len) cons
  * @return      The sequence as a string; empty string if no seq found
  */
 string portcullis::bam::GenomeMapper::fetchBases(const char* name, int start, int end, int* len) const {
+	if (packedGenome != nullptr) {
+		string bases;
+		*len = fetchBases(name, start, end, bases);
+		return bases;
+	}
 	char* cseq = faidx_fetch_seq(fastaIndex, name, start, end, len);
 	string strseq = cseq == NULL ? string("") : string(cseq);
 	if (cseq != NULL)
 		free(cseq);
 	return strseq;
-}
\ No newline at end of file
+}
+
+/**
+ * @abstract    Fetch the sequence in a region into the caller's buffer.
+ * @param  name Region name
+ * @param  start    Start location on region (zero-based, inclusive)
+ * @param  end  End position (zero-based, inclusive)
+ * @param  bases    Filled with the sequence; empty if no seq found
+ * @return      Length of the region, or negative if no seq found
+ */
+int portcullis::bam::GenomeMapper::fetchBases(const char* name, int start, int end, string& bases) const {
+	if (packedGenome != nullptr) {
+		return packedGenome->fetch(packedGenome->getIndex(name), start, end, bases);
+	}
+	int len = 0;
+	char* cseq = faidx_fetch_seq(fastaIndex, name, start, end, &len);
+	if (cseq != NULL) {
+		bases.assign(cseq, len);
+		free(cseq);
+	}
+	else {
+		bases.clear();
+	}
+	return len;
+}
+
+/**
+ * @abstract    Fetch the sequence in a region into the caller's buffer, without
+ *              looking up the region name again.  The packed genome is built from
+ *              the fasta index, so both number their sequences the same way.
+ * @param  index    Index of the region, from getSeqIndex
+ * @param  start    Start location on region (zero-based, inclusive)
+ * @param  end  End position (zero-based, inclusive)
+ * @param  bases    Filled with the sequence; empty if no seq found
+ * @return      Length of the region, or negative if no seq found
+ */
+int portcullis::bam::GenomeMapper::fetchBases(const int32_t index, int start, int end, string& bases) const {
+	if (packedGenome != nullptr) {
+		return packedGenome->fetch(index, start, end, bases);
+	}
+	if (index < 0 || index >= faidx_nseq(fastaIndex)) {
+		bases.clear();
+		return -2;
+	}
+	return fetchBases(faidx_iseq(fastaIndex, index), start, end, bases);
+}
+
+int32_t portcullis::bam::GenomeMapper::getSeqIndex(const char* name) const {
+	if (packedGenome != nullptr) {
+		return packedGenome->getIndex(name);
+	}
+	auto it = seqIndices.find(name);
+	return it == seqIndices.end() ? -1 : it->second;
+}
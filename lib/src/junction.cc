@@ -15,8 +15,11 @@
 //  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
 //  *******************************************************************
 
+#include <algorithm>
+#include <cmath>
 #include <cstdint>
 #include <iostream>
+#include <limits>
 #include <math.h>
 #include <string>
 #include <vector>
@@ -36,6 +39,7 @@ typedef std::unordered_map<size_t, uint16_t> SplicedAlignmentMap;
 
 #include <boost/algorithm/string.hpp>
 #include <boost/exception/all.hpp>
+#include <boost/functional/hash.hpp>
 #include <boost/lexical_cast.hpp>
 using boost::lexical_cast;
 
@@ -88,7 +92,8 @@ const vector<string> portcullis::Junction::METRIC_NAMES({
 	"coverage",
 	"up_aln",
 	"down_aln",
-    "nb_samples"
+    "nb_samples",
+	"nb_sampled_aln"
 });
 
 const vector<string> portcullis::Junction::JAD_NAMES({
@@ -120,7 +125,8 @@ const vector<string> portcullis::Junction::STRAND_NAMES = {
 	"consensus-strand"
 };
 
-void portcullis::AlignmentInfo::calcMatchStats(const Intron& i, const uint32_t leftStart, const uint32_t rightEnd, const string& ancLeft, const string& ancRight) {
+void portcullis::AlignmentInfo::calcMatchStats(const Intron& i, const uint32_t leftStart, const uint32_t rightEnd, const string& ancLeft, const string& ancRight,
+		const CigarOp* cigar, const uint8_t* bases) {
 
     if (leftStart > std::numeric_limits<int32_t>::max()) {
         BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
@@ -140,8 +146,7 @@ void portcullis::AlignmentInfo::calcMatchStats(const Intron& i, const uint32_t l
 	int32_t qRightStart = rightStart;
 	int32_t qRightEnd = (int32_t)rightEnd;
 
-    string query = ba->getQuerySeq();
-    if (query.size() <= 1) {
+    if (queryLength <= 1) {
         // In this case the genome and query sequences do not correspond with one another.  Most
         // likely the cause of this is that the query sequence is not present in the alignment.
         // In which case just assume everything is fine.
@@ -158,10 +163,15 @@ void portcullis::AlignmentInfo::calcMatchStats(const Intron& i, const uint32_t l
     }
     else {
 
-        string qAnchorLeft = ba->getPaddedQuerySeq(query, leftStart, leftEnd, qLeftStart, qLeftEnd, false);
-        string qAnchorRight = ba->getPaddedQuerySeq(query, rightStart, rightEnd, qRightStart, qRightEnd, false);
-        string gAnchorLeft = ba->getPaddedGenomeSeq(ancLeft, leftStart, leftEnd, qLeftStart, qLeftEnd, false);
-        string gAnchorRight = ba->getPaddedGenomeSeq(ancRight, rightStart, rightEnd, qRightStart, qRightEnd, false);
+        string query(queryLength, 'N');
+        for (int32_t j = 0; j < queryLength; j++) {
+            query[j] = seq_nt16_str[bam_seqi(bases, j)];
+        }
+        const string clippedQuery = BamAlignment::getQuerySeqAfterClipping(cigar, nbCigarOps, position, alignedLength, query);
+        string qAnchorLeft = BamAlignment::getPaddedQuerySeq(cigar, nbCigarOps, position, alignedLength, clippedQuery, leftStart, leftEnd, qLeftStart, qLeftEnd, false);
+        string qAnchorRight = BamAlignment::getPaddedQuerySeq(cigar, nbCigarOps, position, alignedLength, clippedQuery, rightStart, rightEnd, qRightStart, qRightEnd, false);
+        string gAnchorLeft = BamAlignment::getPaddedGenomeSeq(cigar, nbCigarOps, position, alignedLength, ancLeft, leftStart, leftEnd, qLeftStart, qLeftEnd, false);
+        string gAnchorRight = BamAlignment::getPaddedGenomeSeq(cigar, nbCigarOps, position, alignedLength, ancRight, rightStart, rightEnd, qRightStart, qRightEnd, false);
         bool error = false;
         if (qAnchorLeft.size() != gAnchorLeft.size() || qAnchorLeft.empty()) {
             error = true;
@@ -170,12 +180,10 @@ void portcullis::AlignmentInfo::calcMatchStats(const Intron& i, const uint32_t l
                                   << "Intron: " + i.toString() << endl
                                   << "Junction anchor limits: " + lexical_cast<string>(leftStart) + "," + lexical_cast<string>(rightEnd) << endl
                                   << "Genomic sequence: " + ancLeft << endl
-                                  << "Alignment coords (before soft clipping): " + ba->toString(false) << endl
-                                  << "Alignment coords (after soft clipping): " + ba->toString(true) << endl
-                                  << "Read name: " + ba->deriveName() << endl
-                                  << "Read seq (before soft clipping): " + ba->getQuerySeq() + " (" + lexical_cast<string>(ba->getQuerySeq().size()) + ")" << endl
-                                  << "Read seq (after soft clipping): " + ba->getQuerySeqAfterClipping() + " (" + lexical_cast<string>(ba->getQuerySeqAfterClipping().size()) + ")" << endl
-                                  << "Cigar: " + ba->getCigarAsString() << endl
+                                  << "Alignment coords: " + lexical_cast<string>(position) + "," + lexical_cast<string>(getEnd()) << endl
+                                  << "Read seq (before soft clipping): " + query + " (" + lexical_cast<string>(query.size()) + ")" << endl
+                                  << "Read seq (after soft clipping): " + clippedQuery + " (" + lexical_cast<string>(clippedQuery.size()) + ")" << endl
+                                  << "Cigar: " + BamAlignment::getCigarAsString(cigar, nbCigarOps) << endl
                                   << "Left Anchor query seq:  \n" + qAnchorLeft + " (" + lexical_cast<string>(qAnchorLeft.size()) + ")" << endl
                                   << "Left Anchor genome seq: \n" + gAnchorLeft + " (" + lexical_cast<string>(gAnchorLeft.size()) + ")" << endl << endl;
         }
@@ -186,12 +194,10 @@ void portcullis::AlignmentInfo::calcMatchStats(const Intron& i, const uint32_t l
                                   << "Intron: " + i.toString() << endl
                                   << "Junction anchor limits: " + lexical_cast<string>(leftStart) + "," + lexical_cast<string>(rightEnd) << endl
                                   << "Genomic sequence: " + ancRight << endl
-                                  << "Alignment coords (before soft clipping): " + ba->toString(false) << endl
-                                  << "Alignment coords (after soft clipping): " + ba->toString(true) << endl
-                                  << "Read name: " + ba->deriveName() << endl
-                                  << "Read seq (before soft clipping): " + ba->getQuerySeq() + " (" + lexical_cast<string>(ba->getQuerySeq().size()) + ")" << endl
-                                  << "Read seq (after soft clipping): " + ba->getQuerySeqAfterClipping() + " (" + lexical_cast<string>(ba->getQuerySeqAfterClipping().size()) + ")" << endl
-                                  << "Cigar: " + ba->getCigarAsString() << endl
+                                  << "Alignment coords: " + lexical_cast<string>(position) + "," + lexical_cast<string>(getEnd()) << endl
+                                  << "Read seq (before soft clipping): " + query + " (" + lexical_cast<string>(query.size()) + ")" << endl
+                                  << "Read seq (after soft clipping): " + clippedQuery + " (" + lexical_cast<string>(clippedQuery.size()) + ")" << endl
+                                  << "Cigar: " + BamAlignment::getCigarAsString(cigar, nbCigarOps) << endl
                                   << "Right Anchor query seq:  \n" + qAnchorRight + " (" + lexical_cast<string>(qAnchorRight.size()) + ")" << endl
                                   << "Right Anchor genome seq: \n" + gAnchorRight + " (" + lexical_cast<string>(gAnchorRight.size()) + ")" << endl << endl;
         }
@@ -289,6 +295,7 @@ portcullis::Junction::Junction(shared_ptr<Intron> _location, int32_t _leftAncSta
 	pfp = false;
 	canonicalSpliceSites = CanonicalSS::NO;
 	nbAlRaw = 0;
+	nbAlSampled = 0;
 	nbAlDistinct = 0;
 	nbAlMultiplySpliced = 0;
 	nbAlUniquelyMapped = 0;
@@ -299,6 +306,15 @@ portcullis::Junction::Junction(shared_ptr<Intron> _location, int32_t _leftAncSta
 	nbAlR1Neg = 0;
 	nbAlR2Pos = 0;
 	nbAlR2Neg = 0;
+	maxAlignments = 0;
+	nbReplacedAlignments = 0;
+	lastAlStart = -1;
+	lastAlEnd = -1;
+	nbAlPosStrand = 0;
+	nbAlNegStrand = 0;
+	nbAlUnknownStrand = 0;
+	nbAlProperlyPairedBy.fill(0);
+	nbAlReliableBy.fill(0);
 	entropy = 0;
 	meanMismatches = 0;
 	meanReadLength = 0;
@@ -326,8 +342,7 @@ portcullis::Junction::Junction(shared_ptr<Intron> _location, int32_t _leftAncSta
 	for (size_t i = 0; i < JAD_NAMES.size(); i++) {
 		junctionAnchorDepth.push_back(0);
 	}
-	alignments.clear();
-	alignmentCodes.clear();
+	clearAlignments();
 	trimmedCoverage.clear();
 	trimmedLogDevCov.clear();
 }
@@ -351,6 +366,7 @@ portcullis::Junction::Junction(const Junction& j, bool withAlignments) {
 	score = j.score;
 	canonicalSpliceSites = j.canonicalSpliceSites;
 	nbAlRaw = j.nbAlRaw;
+	nbAlSampled = j.nbAlSampled;
 	nbAlDistinct = j.nbAlDistinct;
 	nbAlMultiplySpliced = j.nbAlMultiplySpliced;
 	nbAlUniquelyMapped = j.nbAlUniquelyMapped;
@@ -361,6 +377,15 @@ portcullis::Junction::Junction(const Junction& j, bool withAlignments) {
 	nbAlR1Neg = j.nbAlR1Neg;
 	nbAlR2Pos = j.nbAlR2Pos;
 	nbAlR2Neg = j.nbAlR2Neg;
+	maxAlignments = j.maxAlignments;
+	nbReplacedAlignments = j.nbReplacedAlignments;
+	lastAlStart = j.lastAlStart;
+	lastAlEnd = j.lastAlEnd;
+	nbAlPosStrand = j.nbAlPosStrand;
+	nbAlNegStrand = j.nbAlNegStrand;
+	nbAlUnknownStrand = j.nbAlUnknownStrand;
+	nbAlProperlyPairedBy = j.nbAlProperlyPairedBy;
+	nbAlReliableBy = j.nbAlReliableBy;
 	entropy = j.entropy;
 	meanMismatches = j.meanMismatches;
 	meanReadLength = j.meanReadLength;
@@ -385,10 +410,13 @@ portcullis::Junction::Junction(const Junction& j, bool withAlignments) {
 	nbDownstreamFlankingAlignments = j.nbDownstreamFlankingAlignments;
     nbSamples = j.nbSamples;
 	if (withAlignments) {
-		for (size_t i = 0; i < j.alignments.size(); i++) {
-			this->alignments.push_back(make_shared<AlignmentInfo>(j.alignments[i]->ba));
-			this->alignmentCodes.push_back(j.alignments[i]->nameCode);
-		}
+		alignments = j.alignments;
+		alignmentCigars = j.alignmentCigars;
+		alignmentBases = j.alignmentBases;
+		alignmentCodes = j.alignmentCodes;
+		alignmentStarts = j.alignmentStarts;
+		alignmentIndex = j.alignmentIndex;
+		sampleRecords = j.sampleRecords;
 	}
 	trimmedCoverage.clear();
 	for (auto & x : j.trimmedCoverage) {
@@ -407,20 +435,202 @@ portcullis::Junction::Junction(const Junction& j, bool withAlignments) {
 // **** Destructor ****
 
 portcullis::Junction::~Junction() {
-	alignments.clear();
+	clearAlignments();
 	junctionAnchorDepth.clear();
 }
 
 void portcullis::Junction::clearAlignments() {
-	alignments.clear();
+	// Swap with empty vectors so that the memory is actually released
+	vector<AlignmentInfo>().swap(alignments);
+	vector<CigarOp>().swap(alignmentCigars);
+	vector<uint8_t>().swap(alignmentBases);
+	vector<std::pair<int32_t, uint32_t>>().swap(alignmentStarts);
+	vector<uint32_t>().swap(sampleRecords);
+	std::unordered_map<size_t, uint32_t>().swap(alignmentIndex);
+	nbReplacedAlignments = 0;
+}
+
+void portcullis::Junction::compactAlignments() {
+	// Drop the records no longer in the sample, along with their cigars and bases
+	const uint32_t dropped = std::numeric_limits<uint32_t>::max();
+	vector<uint32_t> newRecords(alignments.size(), dropped);
+	vector<AlignmentInfo> kept;
+	vector<CigarOp> cigars;
+	vector<uint8_t> bases;
+	for (size_t r = 0; r < alignments.size(); r++) {
+		AlignmentInfo a = alignments[r];
+		if (a.multiplicity == 0) {
+			continue;
+		}
+		const size_t nbBaseBytes = (a.queryLength + 1) / 2;
+		const uint32_t cigarOffset = cigars.size();
+		const uint32_t basesOffset = bases.size();
+		cigars.insert(cigars.end(), alignmentCigars.begin() + a.cigarOffset, alignmentCigars.begin() + a.cigarOffset + a.nbCigarOps);
+		bases.insert(bases.end(), alignmentBases.begin() + a.basesOffset, alignmentBases.begin() + a.basesOffset + nbBaseBytes);
+		a.cigarOffset = cigarOffset;
+		a.basesOffset = basesOffset;
+		newRecords[r] = kept.size();
+		kept.push_back(a);
+	}
+	for (auto it = alignmentIndex.begin(); it != alignmentIndex.end();) {
+		if (newRecords[it->second] == dropped) {
+			it = alignmentIndex.erase(it);
+		}
+		else {
+			it->second = newRecords[it->second];
+			++it;
+		}
+	}
+	for (auto & r : sampleRecords) {
+		r = newRecords[r];
+	}
+	alignments.swap(kept);
+	alignmentCigars.swap(cigars);
+	alignmentBases.swap(bases);
+	nbReplacedAlignments = 0;
+}
+
+uint32_t portcullis::Junction::addAlignmentRecord(const BamAlignment& al) {
+	// Only keep the parts of the alignment we need for calculating metrics, with the
+	// cigar and packed query bases appended to the buffers owned by this junction.
+	// Those metrics only depend on the position, cigar and bases, so alignments with
+	// the same ones share a record.
+	const bam1_t* b = al.getRaw();
+	const uint8_t* seq = bam_get_seq(b);
+	const size_t nbBaseBytes = (b->core.l_qseq + 1) / 2;
+	const vector<CigarOp>& cigar = al.getCigar();
+	const int32_t position = al.getStart();
+	size_t key = 0;
+	boost::hash_combine(key, position);
+	for (const auto & op : cigar) {
+		boost::hash_combine(key, op.type);
+		boost::hash_combine(key, op.length);
+	}
+	boost::hash_range(key, seq, seq + nbBaseBytes);
+	auto it = alignmentIndex.find(key);
+	if (it != alignmentIndex.end()) {
+		AlignmentInfo& a = alignments[it->second];
+		if (a.position == position && a.queryLength == b->core.l_qseq && a.nbCigarOps == cigar.size() &&
+				std::equal(cigar.begin(), cigar.end(), alignmentCigars.begin() + a.cigarOffset,
+						   [](const CigarOp& x, const CigarOp& y) { return x.type == y.type && x.length == y.length; }) &&
+				std::equal(seq, seq + nbBaseBytes, alignmentBases.begin() + a.basesOffset)) {
+			a.multiplicity++;
+			return it->second;
+		}
+	}
+	// A new record.  In the unlikely event its key clashes with a different alignment it
+	// just isn't indexed, so later copies of it get their own records.
+	const uint32_t r = alignments.size();
+	alignments.emplace_back(al, alignmentCigars.size(), alignmentBases.size());
+	alignmentCigars.insert(alignmentCigars.end(), cigar.begin(), cigar.end());
+	alignmentBases.insert(alignmentBases.end(), seq, seq + nbBaseBytes);
+	if (it == alignmentIndex.end()) {
+		alignmentIndex.emplace(key, r);
+	}
+	return r;
 }
 
 void portcullis::Junction::addJunctionAlignment(const BamAlignment& al) {
-	// Make sure we take a proper copy of this alignment for safe storage
-	AlignmentInfoPtr aip = make_shared<AlignmentInfo>(make_shared<BamAlignment>(al));
-	this->alignments.push_back(aip);
-	this->alignmentCodes.push_back(aip->nameCode);
-	this->nbAlRaw = this->alignments.size();
+	this->nbAlRaw++;
+	// Calculate a hash of the alignment name
+	const size_t code = al.hashName();
+	// Keep the alignment for the metrics that use the reads.  Past maxAlignments, each new
+	// alignment replaces a member of the sample with probability maxAlignments / nbAlRaw
+	// (reservoir sampling), so the sample stays uniform.  The choice is seeded from the
+	// intron so the sample doesn't depend on the threading.
+	if (this->maxAlignments == 0 || this->alignmentCodes.size() < this->maxAlignments) {
+		const uint32_t r = addAlignmentRecord(al);
+		this->alignmentCodes.push_back(code);
+		if (this->maxAlignments > 0) {
+			this->sampleRecords.push_back(r);
+		}
+	}
+	else {
+		uint64_t x = this->intron->key().hash() + this->nbAlRaw * 0x9E3779B97F4A7C15ULL;
+		x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+		x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+		x ^= x >> 31;
+		const uint64_t slot = x % this->nbAlRaw;
+		if (slot < this->maxAlignments) {
+			this->alignments[this->sampleRecords[slot]].multiplicity--;
+			this->sampleRecords[slot] = addAlignmentRecord(al);
+			this->alignmentCodes[slot] = code;
+			// Records with no alignments left in the sample stay behind until compacted
+			if (++this->nbReplacedAlignments >= this->maxAlignments) {
+				compactAlignments();
+			}
+		}
+	}
+	this->nbAlSampled = this->alignmentCodes.size();
+	// Everything else is tallied over every alignment as it's added
+	const int32_t start = al.getStart();
+	const int32_t end = start + al.getAlignedLength() - 1;
+	if (start != this->lastAlStart || end != this->lastAlEnd) {
+		this->nbAlDistinct++;
+		this->lastAlStart = start;
+		this->lastAlEnd = end;
+	}
+	auto it = std::lower_bound(this->alignmentStarts.begin(), this->alignmentStarts.end(), std::make_pair(start, (uint32_t) 0));
+	if (it != this->alignmentStarts.end() && it->first == start) {
+		it->second++;
+	}
+	else {
+		this->alignmentStarts.insert(it, std::make_pair(start, (uint32_t) 1));
+	}
+	switch (al.getStrand()) {
+	case Strand::POSITIVE:
+		this->nbAlPosStrand++;
+		break;
+	case Strand::NEGATIVE:
+		this->nbAlNegStrand++;
+		break;
+	case Strand::UNKNOWN:
+		this->nbAlUnknownStrand++;
+		break;
+	}
+	const bool uniquelyMapped = al.getMapQuality() >= MAP_QUALITY_THRESHOLD;
+	if (uniquelyMapped) {
+		this->nbAlUniquelyMapped++;
+	}
+	if ((al.getAlignmentFlag() & BAM_FPROPER_PAIR) != 0) {
+		this->nbAlBamProperlyPaired++;
+	}
+	// Proper pairing depends on the orientation, which isn't known until the metrics are
+	// calculated, so count for every orientation
+	const bool mateOnSameRef = al.getReferenceId() == al.getMateReferenceId();
+	for (size_t o = 0; o < this->nbAlProperlyPairedBy.size(); o++) {
+		const Orientation orientation = (Orientation) o;
+		bool reliable = uniquelyMapped;
+		if (doProperPairCheck(orientation)) {
+			if (BamAlignment::calcIfProperPair(al.getAlignmentFlag(), mateOnSameRef, start, al.getMatePos(), orientation)) {
+				this->nbAlProperlyPairedBy[o]++;
+			}
+			else {
+				reliable = false;
+			}
+		}
+		if (reliable) {
+			this->nbAlReliableBy[o]++;
+		}
+	}
+	uint32_t upjuncs = 0;
+	uint32_t downjuncs = 0;
+	int32_t pos = start;
+	for (const auto & op : al.getCigar()) {
+		if (CigarOp::opConsumesReference(op.type)) {
+			pos += op.length;
+		}
+		if (op.type == BAM_CIGAR_REFSKIP_CHAR) {
+			if (pos < this->intron->start) {
+				upjuncs++;
+			}
+			else if (pos > this->intron->end + 1) {
+				downjuncs++;
+			}
+		}
+	}
+	this->nbUpstreamJunctions = max(this->nbUpstreamJunctions, upjuncs);
+	this->nbDownstreamJunctions = max(this->nbDownstreamJunctions, downjuncs);
 	if (al.isFirstMate()) {
 		if (!al.isReverseStrand()) {
 			this->nbAlR1Pos++;
@@ -470,22 +680,9 @@ void portcullis::Junction::extendAnchors(int32_t otherStart, int32_t otherEnd) {
 }
 
 void portcullis::Junction::determineStrandFromReads() {
-	uint32_t nb_pos = 0;
-	uint32_t nb_neg = 0;
-	uint32_t nb_unk = 0;
-	for (const auto & a : alignments) {
-		switch (a->ba->getStrand()) {
-		case Strand::POSITIVE:
-			nb_pos++;
-			break;
-		case Strand::NEGATIVE:
-			nb_neg++;
-			break;
-		case Strand::UNKNOWN:
-			nb_unk++;
-			break;
-		}
-	}
+	const uint32_t nb_pos = nbAlPosStrand;
+	const uint32_t nb_neg = nbAlNegStrand;
+	const uint32_t nb_unk = nbAlUnknownStrand;
 	uint32_t total = nb_pos + nb_neg + nb_unk;
 	const double threshold = 0.95;
 	if ((double) nb_pos / (double) total >= threshold) {
@@ -503,11 +700,13 @@ void portcullis::Junction::processJunctionWindow(const GenomeMapper& genomeMappe
 	if (intron == nullptr)
 		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
 								  "Can't find genomic sequence for this junction as no intron is defined")));
+	// Sequence buffers are reused by each junction processed on this thread, and the
+	// target sequence is only looked up once
+	static thread_local string donor, acceptor, leftAnc, rightAnc, leftInt, rightInt;
+	const int32_t refIndex = genomeMapper.getSeqIndex(intron->ref.name.c_str());
 	// Process the predicted donor / acceptor regions and update junction
-	int donorLen = -1;
-	int acceptorLen = -1;
-	string donor = genomeMapper.fetchBases(intron->ref.name.c_str(), intron->start, intron->start + 1, &donorLen);
-	string acceptor = genomeMapper.fetchBases(intron->ref.name.c_str(), intron->end - 1, intron->end, &acceptorLen);
+	int donorLen = genomeMapper.fetchBases(refIndex, intron->start, intron->start + 1, donor);
+	int acceptorLen = genomeMapper.fetchBases(refIndex, intron->end - 1, intron->end, acceptor);
 	if (donorLen == -1)
 		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
 								  "Can't find donor site (left side splice site) region for junction: ") + this->intron->toString()));
@@ -528,14 +727,10 @@ void portcullis::Junction::processJunctionWindow(const GenomeMapper& genomeMappe
 	boost::to_upper(acceptor); // Removes any lowercase bases representing repeats
 	this->setDonorAndAcceptorMotif(donor, acceptor);
 	// Just access the whole junction region
-	int leftAncLen = -1;
-	int leftIntLen = -1;
-	int rightAncLen = -1;
-	int rightIntLen = -1;
-	string leftAnc = genomeMapper.fetchBases(intron->ref.name.c_str(), leftAncStart, intron->start - 1, &leftAncLen);
-	string rightAnc = genomeMapper.fetchBases(intron->ref.name.c_str(), intron->end + 1, rightAncEnd, &rightAncLen);
-	string leftInt = genomeMapper.fetchBases(intron->ref.name.c_str(), intron->start, intron->start + 9, &leftIntLen);
-	string rightInt = genomeMapper.fetchBases(intron->ref.name.c_str(), intron->end - 9, intron->end, &rightIntLen);
+	int leftAncLen = genomeMapper.fetchBases(refIndex, leftAncStart, intron->start - 1, leftAnc);
+	int rightAncLen = genomeMapper.fetchBases(refIndex, intron->end + 1, rightAncEnd, rightAnc);
+	int leftIntLen = genomeMapper.fetchBases(refIndex, intron->start, intron->start + 9, leftInt);
+	int rightIntLen = genomeMapper.fetchBases(refIndex, intron->end - 9, intron->end, rightInt);
 	if (leftAncLen == -1)
 		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
 								  "Can't find left anchor region for junction: ") + this->intron->toString()));
@@ -580,42 +775,18 @@ void portcullis::Junction::processJunctionWindow(const GenomeMapper& genomeMappe
 	string leftAnchor10 = leftAncLen < 10 ? leftAnc : leftAnc.substr(leftAncLen - 10, 10);
 	string rightAnchor10 = rightAncLen < 10 ? rightAnc : rightAnc.substr(0, 10);
 	this->calcHammingScores(leftAnchor10, leftInt, rightInt, rightAnchor10);
-	// Update match statistics for each alignment
-	for (const auto & a : alignments) {
-		a->calcMatchStats(*getIntron(), this->getLeftAncStart(), this->getRightAncEnd(), leftAnc, rightAnc);
+	// Update match statistics for each distinct alignment
+	for (auto & a : alignments) {
+		if (a.multiplicity == 0) {
+			continue;
+		}
+		a.calcMatchStats(*getIntron(), this->getLeftAncStart(), this->getRightAncEnd(), leftAnc, rightAnc,
+						 alignmentCigars.data() + a.cigarOffset, alignmentBases.data() + a.basesOffset);
 	}
 	// MaxMMES can now use info in alignments
 	this->calcMismatchStats();
 }
 
-void portcullis::Junction::processJunctionVicinity(BamReader& reader, int32_t refLength, int32_t maxQueryLength) {
-	int32_t refId = intron->ref.index;
-	uint32_t nbLeftFlankingAlignments = 0, nbRightFlankingAlignments = 0;
-	int32_t regionStart = leftAncStart - maxQueryLength - 1;
-	regionStart = regionStart < 0 ? 0 : regionStart;
-	int32_t regionEnd = rightAncEnd + maxQueryLength + 1;
-	regionEnd = regionEnd >= refLength ? refLength - 1 : regionEnd;
-	// Focus only on the (expanded... to be safe...) region of interest
-	reader.setRegion(refId, regionStart, regionEnd);
-	while (reader.next()) {
-		const BamAlignment& ba = reader.current();
-		int32_t pos = ba.getStart();
-		//TODO: Should we consider strand specific reads differently here?
-		// Look for left flanking alignments
-		if (intron->start > pos &&
-				leftAncStart <= ba.getEnd()) {
-			nbLeftFlankingAlignments++;
-		}
-		// Look for right flanking alignments
-		if (rightAncEnd >= pos &&
-				intron->end < pos) {
-			nbRightFlankingAlignments++;
-		}
-	}
-	this->nbUpstreamFlankingAlignments = nbLeftFlankingAlignments;
-	this->nbDownstreamFlankingAlignments = nbRightFlankingAlignments;
-}
-
 void portcullis::Junction::calcMetrics() {
 	this->calcMetrics(Orientation::UNKNOWN);
 }
@@ -656,15 +827,7 @@ void portcullis::Junction::calcMetrics(Orientation orientation) {
  * @return The entropy of this junction
  */
 double portcullis::Junction::calcEntropy() {
-	vector<int32_t> junctionPositions;
-	for (const auto & a : alignments) {
-		junctionPositions.push_back(a->ba->getStart());
-	}
-	// Should already be sorted but let's be sure.  This is critical to the rest
-	// of the algorithm.  It's possible after soft clips are removed that the reads
-	// are not strictly in the correct order.
-	std::sort(junctionPositions.begin(), junctionPositions.end());
-	return calcEntropy(junctionPositions);
+	return calcEntropy(alignmentStarts);
 }
 
 double portcullis::Junction::calcEntropy(const vector<int32_t> junctionPositions) {
@@ -688,69 +851,46 @@ double portcullis::Junction::calcEntropy(const vector<int32_t> junctionPositions
 	return entropy;
 }
 
-/**
- * Metrics: # Distinct Alignments, # Unique/Reliable Alignments, #mismatches
- * @return
- */
-void portcullis::Junction::calcAlignmentStats(Orientation orientation) {
-	int32_t lastStart = -1, lastEnd = -1;
-	nbAlDistinct = 0;
-	nbAlReliable = 0;
-	nbUpstreamJunctions = 0;
-	nbDownstreamJunctions = 0;
-	const bool properPairedCheck = doProperPairCheck(orientation);
-	//cout << junctionAlignments.size() << endl;
-	for (const auto & a : alignments) {
-		BamAlignmentPtr ba = a->ba;
-		const int32_t start = ba->getStart();
-		const int32_t end = ba->getEnd();
-		if (start != lastStart || end != lastEnd) {
-			nbAlDistinct++;
-			lastStart = start;
-			lastEnd = end;
-		}
-		bool reliable = true;
-		if (ba->getMapQuality() >= MAP_QUALITY_THRESHOLD) {
-			nbAlUniquelyMapped++;
-		}
-		else {
-			reliable = false;
-		}
-		// Get properly paired BAM flag regardless
-		if (ba->isProperPair()) {
-			nbAlBamProperlyPaired++;
+double portcullis::Junction::calcEntropy(const vector<std::pair<int32_t, uint32_t>>& startCounts) {
+	uint32_t nbJunctionAlignments = 0;
+	for (const auto & c : startCounts) {
+		nbJunctionAlignments += c.second;
+	}
+	if (nbJunctionAlignments <= 1)
+		return 0;
+	// Replays the offsets the position list version sees, and in the same order, so
+	// the sum comes out identical: the first alignment of each new position is counted
+	// along with the position before it.
+	double sum = 0.0;
+	const size_t nbPositions = startCounts.size();
+	for (size_t i = 0; i < nbPositions; i++) {
+		uint32_t readsAtOffset = startCounts[i].second;
+		if (nbPositions == 1) {
+			// Nothing else to do
 		}
-		if (properPairedCheck) {
-			bool pp = ba->calcIfProperPair(orientation);
-			if (pp) {
-				nbAlPortcullisProperlyPaired++;
-			}
-			else {
-				reliable = false;
-			}
+		else if (i == 0) {
+			readsAtOffset++;
 		}
-		if (reliable) {
-			nbAlReliable++;
+		else if (i == nbPositions - 1) {
+			readsAtOffset--;
 		}
-		uint32_t upjuncs = 0;
-		uint32_t downjuncs = 0;
-		int32_t pos = start;
-		for (CigarOp op : ba->getCigar()) {
-			if (CigarOp::opConsumesReference(op.type)) {
-				pos += op.length;
-			}
-			if (op.type == BAM_CIGAR_REFSKIP_CHAR) {
-				if (pos < intron->start) {
-					upjuncs++;
-				}
-				else if (pos > intron->end + 1) {
-					downjuncs++;
-				}
-			}
+		if (readsAtOffset > 0) {
+			double pI = (double) readsAtOffset / (double) nbJunctionAlignments;
+			sum += pI * log2(pI);
 		}
-		nbUpstreamJunctions = max(nbUpstreamJunctions, upjuncs);
-		nbDownstreamJunctions = max(nbDownstreamJunctions, downjuncs);
 	}
+	entropy = fabs(sum);
+	return entropy;
+}
+
+/**
+ * Metrics: # Distinct Alignments, # Unique/Reliable Alignments, #mismatches
+ * @return
+ */
+void portcullis::Junction::calcAlignmentStats(Orientation orientation) {
+	// The counts are tallied as alignments are added, so just pick the ones for this orientation
+	nbAlPortcullisProperlyPaired = nbAlProperlyPairedBy[(size_t) orientation];
+	nbAlReliable = nbAlReliableBy[(size_t) orientation];
 }
 
 /**
@@ -800,31 +940,43 @@ void portcullis::Junction::calcHammingScores(const string& leftAnchor, const str
  * Calculates MaxMMES, mismatches, and junction overhangs.
  */
 void portcullis::Junction::calcMismatchStats() {
+	// Each record stands for multiplicity identical alignments
+	uint32_t nbAlignments = 0;
 	uint32_t nbMismatches = 0;
 	uint32_t firstMismatch = 100000000;
 	for (const auto & a : alignments) {
+		if (a.multiplicity == 0) {
+			continue;
+		}
+		nbAlignments += a.multiplicity;
 		// Update maxMMES for this alignment
-		maxMMES = max(maxMMES, a->mmes);
+		maxMMES = max(maxMMES, a.mmes);
 		// Update total number of mismatches in this junction
-		nbMismatches += a->nbMismatches;
+		nbMismatches += a.nbMismatches * a.multiplicity;
 		// Keep a record of the first mismatch detected
-		if (a->minMatch > 0) {
-			firstMismatch = min(firstMismatch, a->minMatch);
+		if (a.minMatch > 0) {
+			firstMismatch = min(firstMismatch, a.minMatch);
 		}
 		// Update junction overhang vector
-		for (uint16_t i = 0; i < JAD_NAMES.size() && i < a->minMatch; i++) {
-			junctionAnchorDepth[i]++;
+		for (uint16_t i = 0; i < JAD_NAMES.size() && i < a.minMatch; i++) {
+			junctionAnchorDepth[i] += a.multiplicity;
 		}
 	}
 	// Set mean mismatches across junction
-	meanMismatches = (double) nbMismatches / (double) alignments.size();
+	meanMismatches = (double) nbMismatches / (double) nbAlignments;
+	// Scale the anchor depths up to estimate them over all the alignments, not just the sample
+	if (isSampled() && nbAlignments > 0) {
+		for (auto & d : junctionAnchorDepth) {
+			d = (uint32_t) std::round((double) d * (double) nbAlRaw / (double) nbAlignments);
+		}
+	}
 	// Assuming we have some mismatches determine if this junction has no overhangs
 	// extending beyond first mismatch.  If so determine if that distance is small
 	// enough to consider the junction as suspicious
 	if (nbMismatches > 0 && firstMismatch < 20) {
 		bool found = false;
 		for (const auto & a : alignments) {
-			if (a->minMatch > firstMismatch) {
+			if (a.multiplicity > 0 && a.minMatch > firstMismatch) {
 				found = true;
 				break;
 			}
@@ -838,11 +990,16 @@ void portcullis::Junction::calcMismatchStats() {
 /**
  * Calculates metric 18.  Multiple mapping score
  */
-void portcullis::Junction::calcMultipleMappingScore(SplicedAlignmentMap& map) {
+void portcullis::Junction::calcMultipleMappingScore(const SplicedAlignmentMap& map) {
 	size_t N = alignmentCodes.size();
 	uint32_t M = 0;
 	for (const auto & a : alignmentCodes) {
-		M += map[a]; // Number of multiple splitting patterns
+		// Number of multiple splitting patterns.  Lookup only, so that the map can be
+		// shared between threads.
+		auto it = map.find(a);
+		if (it != map.end()) {
+			M += it->second;
+		}
 	}
 	this->multipleMappingScore = (double) N / (double) M;
 }
@@ -860,13 +1017,12 @@ double portcullis::Junction::calcCoverage(int32_t a, int32_t b, const vector<uin
 }
 
 double portcullis::Junction::calcCoverage(const vector<uint32_t>& coverageLevels) {
-	const uint32_t REGION_LENGTH = 10;
-	int32_t donorStart = intron->start - 2 * REGION_LENGTH;
-	int32_t donorMid = intron->start - REGION_LENGTH;
+	int32_t donorStart = intron->start - 2 * COVERAGE_REGION_LENGTH;
+	int32_t donorMid = intron->start - COVERAGE_REGION_LENGTH;
 	int32_t donorEnd = intron->start;
 	int32_t acceptorStart = intron->end;
-	int32_t acceptorMid = intron->end + REGION_LENGTH;
-	int32_t acceptorEnd = intron->end + 2 * REGION_LENGTH;
+	int32_t acceptorMid = intron->end + COVERAGE_REGION_LENGTH;
+	int32_t acceptorEnd = intron->end + 2 * COVERAGE_REGION_LENGTH;
 	double donorCoverage =
 		calcCoverage(donorStart, donorMid - 1, coverageLevels) -
 		calcCoverage(donorMid, donorEnd, coverageLevels);
@@ -877,6 +1033,18 @@ double portcullis::Junction::calcCoverage(const vector<uint32_t>& coverageLevels
 	return coverage;
 }
 
+double portcullis::Junction::calcCoverage(const vector<uint32_t>& donorLevels, const vector<uint32_t>& acceptorLevels) {
+	// Same regions as above, but relative to the start of each window
+	double donorCoverage =
+		calcCoverage(0, COVERAGE_REGION_LENGTH - 1, donorLevels) -
+		calcCoverage(COVERAGE_REGION_LENGTH, 2 * COVERAGE_REGION_LENGTH, donorLevels);
+	double acceptorCoverage =
+		calcCoverage(COVERAGE_REGION_LENGTH, 2 * COVERAGE_REGION_LENGTH, acceptorLevels) -
+		calcCoverage(0, COVERAGE_REGION_LENGTH - 1, acceptorLevels);
+	coverage = donorCoverage + acceptorCoverage;
+	return coverage;
+}
+
 double portcullis::Junction::calcIntronScore(const uint32_t threshold) {
 	this->setIntronScore((uint32_t)this->intron->size() <= threshold ? 0.0 : log(this->intron->size() - threshold));
 	return this->intronScore;
@@ -1000,7 +1168,8 @@ void portcullis::Junction::outputDescription(std::ostream &strm, string delimite
 		 << "Coverage: " << coverage << delimiter
 		 << "# Upstream Non-Spliced Alignments: " << nbUpstreamFlankingAlignments << delimiter
 		 << "# Downstream Non-Spliced Alignments: " << nbDownstreamFlankingAlignments << delimiter
-         << "# Samples: " << nbSamples;
+         << "# Samples: " << nbSamples << delimiter
+		 << "# Sampled Alignments: " << nbAlSampled;
 }
 
 /**
@@ -1159,7 +1328,9 @@ shared_ptr<portcullis::Junction> portcullis::Junction::parse(const string& line)
 	vector<string> parts; // #2: Search for tokens
 	boost::split(parts, line, boost::is_any_of("\t"), boost::token_compress_on);
 	uint32_t expected_cols = 11 + Junction::STRAND_NAMES.size() + Junction::METRIC_NAMES.size() + Junction::JAD_NAMES.size();
-	if (parts.size() != expected_cols) {
+	// Tables written before nb_sampled_aln was added are one column short
+	const bool hasNbSampled = parts.size() == expected_cols;
+	if (!hasNbSampled && parts.size() != expected_cols - 1) {
 		BOOST_THROW_EXCEPTION(JunctionException() << JunctionErrorInfo(string(
 								  "Could not parse line due to incorrect number of columns.  This is probably a version mismatch.  Check file and portcullis versions.  Expected ")
 							  + std::to_string(expected_cols) + " columns.  Found "
@@ -1239,6 +1410,8 @@ shared_ptr<portcullis::Junction> portcullis::Junction::parse(const string& line)
 	j->setNbUpstreamFlankingAlignments(lexical_cast<uint32_t>(parts[i++]));
 	j->setNbDownstreamFlankingAlignments(lexical_cast<uint32_t>(parts[i++]));
     j->setNbSamples(lexical_cast<uint32_t>(parts[i++]));
+	// Older tables didn't sample alignments, so every alignment was used
+	j->setNbSampledAlignments(hasNbSampled ? lexical_cast<uint32_t>(parts[i++]) : j->getNbSplicedAlignments());
 	// Read Junction anchor depths
 	for (size_t k = 0; k < Junction::JAD_NAMES.size(); k++) {
 		j->setJunctionAnchorDepth(k, lexical_cast<uint32_t>(parts[i + k]));
@@ -1247,24 +1420,25 @@ shared_ptr<portcullis::Junction> portcullis::Junction::parse(const string& line)
 }
 
 double portcullis::Junction::calcCodingPotential(GenomeMapper& gmap, KmerMarkovModel& exon, KmerMarkovModel& intron) {
-	int len = 0;
-	const char* ref = this->intron->ref.name.c_str();
+	// Reused by each junction scored on this thread
+	static thread_local string left_exon, left_intron, right_intron, right_exon;
+	const int32_t ref = gmap.getSeqIndex(this->intron->ref.name.c_str());
 	const bool neg = getConsensusStrand() == Strand::NEGATIVE;
-	string left_exon = gmap.fetchBases(ref, this->intron->start - 82, this->intron->start - 2, &len);
+	gmap.fetchBases(ref, this->intron->start - 82, this->intron->start - 2, left_exon);
 	if (neg) {
-		left_exon = SeqUtils::reverseComplement(left_exon);
+		SeqUtils::reverseComplementInPlace(left_exon);
 	}
-	string left_intron = gmap.fetchBases(ref, this->intron->start, this->intron->start + 80, &len);
+	gmap.fetchBases(ref, this->intron->start, this->intron->start + 80, left_intron);
 	if (neg) {
-		left_intron = SeqUtils::reverseComplement(left_intron);
+		SeqUtils::reverseComplementInPlace(left_intron);
 	}
-	string right_intron = gmap.fetchBases(ref, this->intron->end - 80, this->intron->end, &len);
+	gmap.fetchBases(ref, this->intron->end - 80, this->intron->end, right_intron);
 	if (neg) {
-		right_intron = SeqUtils::reverseComplement(right_intron);
+		SeqUtils::reverseComplementInPlace(right_intron);
 	}
-	string right_exon = gmap.fetchBases(ref, this->intron->end + 1, this->intron->end + 81, &len);
+	gmap.fetchBases(ref, this->intron->end + 1, this->intron->end + 81, right_exon);
 	if (neg) {
-		right_exon = SeqUtils::reverseComplement(right_exon);
+		SeqUtils::reverseComplementInPlace(right_exon);
 	}
 	/*
 	cout << "Left exon   : " << this->consensusStrand << " : " << left_exon << endl;
@@ -1282,19 +1456,20 @@ double portcullis::Junction::calcCodingPotential(GenomeMapper& gmap, KmerMarkovM
 portcullis::SplicingScores portcullis::Junction::calcSplicingScores(GenomeMapper& gmap, KmerMarkovModel& donorT, KmerMarkovModel& donorF,
 		KmerMarkovModel& acceptorT, KmerMarkovModel& acceptorF,
 		PosMarkovModel& donorP, PosMarkovModel& acceptorP) {
-	int len = 0;
-	const char* ref = this->intron->ref.name.c_str();
+	// Reused by each junction scored on this thread
+	static thread_local string left, right;
+	const int32_t ref = gmap.getSeqIndex(this->intron->ref.name.c_str());
 	const bool neg = getConsensusStrand() == Strand::NEGATIVE;
-	string left = gmap.fetchBases(ref, intron->start - 3, intron->start + 20, &len);
+	gmap.fetchBases(ref, intron->start - 3, intron->start + 20, left);
 	if (neg) {
-		left = SeqUtils::reverseComplement(left);
+		SeqUtils::reverseComplementInPlace(left);
 	}
-	string right = gmap.fetchBases(ref, intron->end - 20, intron->end + 2, &len);
+	gmap.fetchBases(ref, intron->end - 20, intron->end + 2, right);
 	if (neg) {
-		right = SeqUtils::reverseComplement(right);
+		SeqUtils::reverseComplementInPlace(right);
 	}
-	string donorseq = neg ? right : left;
-	string acceptorseq = neg ? left : right;
+	const string& donorseq = neg ? right : left;
+	const string& acceptorseq = neg ? left : right;
 	SplicingScores ss;
 	ss.positionWeighting = donorP.getScore(donorseq) + acceptorP.getScore(acceptorseq);
 	ss.splicingSignal = (donorT.getScore(donorseq) - donorF.getScore(donorseq))
@@ -16,8 +16,10 @@
 //  *******************************************************************
 
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <memory>
+#include <queue>
 #include <unordered_map>
 #include <unordered_set>
 #include <utility>
@@ -38,9 +40,6 @@ using boost::lexical_cast;
 using boost::timer::auto_cpu_timer;
 namespace bfs = boost::filesystem;
 
-#include <portcullis/bam/depth_parser.hpp>
-using portcullis::bam::DepthParser;
-
 #include <portcullis/intron.hpp>
 #include <portcullis/junction.hpp>
 #include <portcullis/seq_utils.hpp>
@@ -52,6 +51,68 @@ using portcullis::SeqUtils;
 
 #include <portcullis/junction_system.hpp>
 
+const uint32_t portcullis::IntronTable::NONE;
+
+uint32_t portcullis::IntronTable::find(const IntronKey& key) const {
+	if (slots.empty()) {
+		return NONE;
+	}
+	const size_t mask = slots.size() - 1;
+	for (size_t i = key.hash() & mask; ; i = (i + 1) & mask) {
+		const Slot& slot = slots[i];
+		if (slot.row == NONE) {
+			return NONE;
+		}
+		if (slot.key == key) {
+			return slot.row;
+		}
+	}
+}
+
+void portcullis::IntronTable::insert(const IntronKey& key, const uint32_t row) {
+	// Keep the table at most half full, so probe sequences stay short
+	if ((count + 1) * 2 > slots.size()) {
+		grow();
+	}
+	const size_t mask = slots.size() - 1;
+	for (size_t i = key.hash() & mask; ; i = (i + 1) & mask) {
+		Slot& slot = slots[i];
+		if (slot.row == NONE) {
+			slot.key = key;
+			slot.row = row;
+			count++;
+			return;
+		}
+		if (slot.key == key) {
+			slot.row = row;
+			return;
+		}
+	}
+}
+
+void portcullis::IntronTable::grow() {
+	vector<Slot> old;
+	old.swap(slots);
+	slots.assign(std::max<size_t>(16, old.size() * 2), Slot{ IntronKey{ 0, 0, 0 }, NONE });
+	const size_t mask = slots.size() - 1;
+	for (auto & slot : old) {
+		if (slot.row != NONE) {
+			size_t i = slot.key.hash() & mask;
+			while (slots[i].row != NONE) {
+				i = (i + 1) & mask;
+			}
+			slots[i] = slot;
+		}
+	}
+}
+
+void portcullis::IntronTable::assign(const JunctionList& junctions) {
+	clear();
+	for (size_t i = 0; i < junctions.size(); i++) {
+		insert(junctions[i]->getIntron()->key(), i);
+	}
+}
+
 size_t portcullis::JunctionSystem::createJunctionGroup(size_t index, vector<JunctionPtr>& group) {
 	JunctionPtr junc = junctionList[index];
 	group.push_back(junc);
@@ -82,6 +143,7 @@ portcullis::JunctionSystem::JunctionSystem() {
 	minQueryLength = 0;
 	meanQueryLength = 0.0;
 	maxQueryLength = 0;
+	maxJunctionAlignments = 0;
 	distinctJunctions.clear();
 	junctionList.clear();
 }
@@ -122,7 +184,7 @@ void portcullis::JunctionSystem::setQueryLengthStats(int32_t min, double mean, i
 
 void portcullis::JunctionSystem::addJunction(JunctionPtr j) {
 	j->clearAlignments();
-	distinctJunctions[*(j->getIntron())] = j;
+	distinctJunctions.insert(j->getIntron()->key(), junctionList.size());
 	junctionList.push_back(j);
 }
 
@@ -137,7 +199,7 @@ void portcullis::JunctionSystem::append(JunctionSystem& other) {
 	}
 }
 
-bool portcullis::JunctionSystem::addJunctions(const BamAlignment& al, const size_t startOp, const int32_t offset) {
+bool portcullis::JunctionSystem::addJunctions(const BamAlignment& al, const size_t startOp, const int32_t offset, const int32_t regionStart, const int32_t regionEnd) {
 	bool foundJunction = false;
 	const size_t nbOps = al.getNbCigarOps();
 	const int32_t refId = al.getReferenceId();
@@ -172,32 +234,33 @@ bool portcullis::JunctionSystem::addJunctions(const BamAlignment& al, const size
 			if (rEndExc - 1 >= refLength) {
 				rEndExc = refLength;
 			}
-			// Create the intron
-			shared_ptr<Intron> location = make_shared<Intron>(
-											  RefSeq(refId, refs->at(refId)->name, refLength),
-											  lEndExc,
-											  rStart - 1);
-			// We should now have the complete junction location information
-			JunctionMapIterator it = distinctJunctions.find(*location);
-			// If we couldn't find this location in the hashmap, add a new
-			// location / junction pair.  If we've seen this location before
-			// then add this alignment to the existing junction
-			if (it == distinctJunctions.end()) {
-				JunctionPtr junction = make_shared<Junction>(location, lStart, rEndExc - 1);
-				junction->addJunctionAlignment(al);
-				distinctJunctions[*location] = junction;
-				junctionList.push_back(junction);
-			}
-			else {
-				JunctionPtr junction = it->second;
-				junction->addJunctionAlignment(al);
-				junction->extendAnchors(lStart, rEndExc - 1);
+			// Only record the junction if its intron starts in the region we own.
+			// Another region will pick it up otherwise.
+			if (lEndExc >= regionStart && lEndExc < regionEnd) {
+				// Look the junction up by its location.  If we couldn't find it, create the
+				// intron and add a new junction.  If we've seen this location before then
+				// add this alignment to the existing junction.
+				const IntronKey key{ refId, lEndExc, rStart - 1 };
+				const uint32_t row = distinctJunctions.find(key);
+				if (row == IntronTable::NONE) {
+					shared_ptr<Intron> location = make_shared<Intron>(*(refs->at(refId)), key.start, key.end);
+					JunctionPtr junction = make_shared<Junction>(location, lStart, rEndExc - 1);
+					junction->setMaxAlignments(maxJunctionAlignments);
+					junction->addJunctionAlignment(al);
+					distinctJunctions.insert(key, junctionList.size());
+					junctionList.push_back(junction);
+				}
+				else {
+					JunctionPtr junction = junctionList[row];
+					junction->addJunctionAlignment(al);
+					junction->extendAnchors(lStart, rEndExc - 1);
+				}
 			}
 			// Check if we have fully processed the cigar or not.  If not, then
 			// that means that this cigar contains additional junctions, so
 			// process those using recursion
 			if (j < nbOps) {
-				addJunctions(al, i + 1, rStart);
+				addJunctions(al, i + 1, rStart, regionStart, regionEnd);
 				break;
 			}
 		}
@@ -209,44 +272,196 @@ bool portcullis::JunctionSystem::addJunctions(const BamAlignment& al, const size
 	return foundJunction;
 }
 
-void portcullis::JunctionSystem::findFlankingAlignments(const path& alignmentsFile) {
-	auto_cpu_timer timer(1, " done. Wall time taken: %ws\n");
-	// Maybe try to multi-thread this part
-	BamReader reader(alignmentsFile);
-	// Open the file
-	reader.open();
-	// Read the alignments around every junction and set appropriate metrics
-	//size_t count = 0;
-	//cout << endl;
-	for (JunctionPtr j : junctionList) {
-		j->processJunctionVicinity(
-			reader,
-			j->getIntron()->ref.length,
-			maxQueryLength);
-		//cout << count++ << endl;
+void portcullis::FlankingCounts::init() {
+	for (JunctionPtr j : junctions) {
+		const Intron& i = *(j->getIntron());
+		startThresholds.push_back(i.start);
+		startThresholds.push_back(i.end + 1);
+		startThresholds.push_back(std::min(j->getRightAncEnd(), (int32_t)i.ref.length - 2) + 1);
+		endThresholds.push_back(j->getLeftAncStart());
+	}
+	std::sort(startThresholds.begin(), startThresholds.end());
+	startThresholds.erase(std::unique(startThresholds.begin(), startThresholds.end()), startThresholds.end());
+	std::sort(endThresholds.begin(), endThresholds.end());
+	endThresholds.erase(std::unique(endThresholds.begin(), endThresholds.end()), endThresholds.end());
+	startCounts.assign(startThresholds.size() + 1, 0);
+	endCounts.assign(endThresholds.size() + 1, 0);
+}
+
+void portcullis::FlankingCounts::setFlankingAlignments() {
+	// Convert counts into the number of alignments starting (or ending) before each threshold
+	for (size_t i = 1; i < startCounts.size(); i++) {
+		startCounts[i] += startCounts[i - 1];
+	}
+	for (size_t i = 1; i < endCounts.size(); i++) {
+		endCounts[i] += endCounts[i - 1];
+	}
+	auto startsBefore = [this](int32_t t) -> int64_t {
+		return startCounts[std::lower_bound(startThresholds.begin(), startThresholds.end(), t) - startThresholds.begin()];
+	};
+	auto endsBefore = [this](int32_t t) -> int64_t {
+		return endCounts[std::lower_bound(endThresholds.begin(), endThresholds.end(), t) - endThresholds.begin()];
+	};
+	for (JunctionPtr j : junctions) {
+		const Intron& i = *(j->getIntron());
+		// Upstream flanking alignments start before the intron and end inside the left
+		// anchor.  Because an alignment can't end before it starts, this is all alignments
+		// starting before the intron, minus those ending before the left anchor.
+		int64_t upstream = startsBefore(i.start) - endsBefore(j->getLeftAncStart());
+		// Downstream flanking alignments start after the intron and within the right anchor.
+		// Alignments starting on the last base of the target are excluded, as they were
+		// when each junction's window was queried from the index.
+		int64_t downstream = startsBefore(std::min(j->getRightAncEnd(), (int32_t)i.ref.length - 2) + 1) - startsBefore(i.end + 1);
+		j->setNbUpstreamFlankingAlignments(std::max(upstream, (int64_t)0));
+		j->setNbDownstreamFlankingAlignments(std::max(downstream, (int64_t)0));
 	}
-	reader.close();
 }
 
-void portcullis::JunctionSystem::calcCoverage(const path& alignmentsFile, Strandedness strandSpecific) {
-	auto_cpu_timer timer(1, " done. Wall time taken: %ws\n");
-	DepthParser dp(alignmentsFile, static_cast<uint8_t> (strandSpecific), false);
-	vector<uint32_t> batch;
-	while (dp.loadNextBatch(batch)) {
-		JunctionList subset;
-		findJunctions(dp.getCurrentRefIndex(), subset);
-		for (JunctionPtr j : subset) {
-			j->calcCoverage(batch);
+void portcullis::FlankDepths::init() {
+	// Windows are in the same coordinates as the coverage levels Junction::calcCoverage
+	// works with, which are one along from the reference position of each base.  Levels
+	// outside of [1, target length - 1] were never populated, so are left out here.
+	const int32_t lastLevel = (int32_t)junctions.front()->getIntron()->ref.length - 1;
+	vector<std::pair<int32_t, int32_t>> windows;
+	for (JunctionPtr j : junctions) {
+		const Intron& i = *(j->getIntron());
+		windows.push_back(std::make_pair(i.start - 2 * COVERAGE_REGION_LENGTH, i.start + 1));
+		windows.push_back(std::make_pair(i.end, i.end + 2 * COVERAGE_REGION_LENGTH + 1));
+	}
+	std::sort(windows.begin(), windows.end());
+	size_t offset = 0;
+	for (auto & w : windows) {
+		const int32_t start = std::max(w.first, 1);
+		const int32_t end = std::min(w.second, lastLevel + 1);
+		if (start >= end) {
+			continue;
+		}
+		if (!windowEnds.empty() && start <= windowEnds.back()) {
+			if (end > windowEnds.back()) {
+				offset += end - windowEnds.back();
+				windowEnds.back() = end;
+			}
+		}
+		else {
+			// Leave an extra slot after the previous window for its trailing difference
+			if (!windowEnds.empty()) {
+				offset++;
+			}
+			windowStarts.push_back(start);
+			windowEnds.push_back(end);
+			windowOffsets.push_back(offset);
+			offset += end - start;
 		}
 	}
+	depths.assign(windowStarts.empty() ? 0 : offset + 1, 0);
+}
+
+void portcullis::FlankDepths::add(const int32_t start, const int32_t end) {
+	const int32_t a = start + 1;
+	const int32_t b = end + 1;
+	size_t w = std::upper_bound(windowEnds.begin(), windowEnds.end(), a) - windowEnds.begin();
+	for (; w < windowStarts.size() && windowStarts[w] < b; w++) {
+		depths[windowOffsets[w] + std::max(a, windowStarts[w]) - windowStarts[w]]++;
+		depths[windowOffsets[w] + std::min(b, windowEnds[w]) - windowStarts[w]]--;
+	}
 }
 
-void portcullis::JunctionSystem::calcMultipleMappingStats(SplicedAlignmentMap& map) {
+uint32_t portcullis::FlankDepths::getDepth(const int32_t level) const {
+	size_t w = std::upper_bound(windowStarts.begin(), windowStarts.end(), level) - windowStarts.begin();
+	if (w == 0 || level >= windowEnds[w - 1]) {
+		return 0;
+	}
+	return depths[windowOffsets[w - 1] + level - windowStarts[w - 1]];
+}
+
+void portcullis::FlankDepths::setCoverage() {
+	// Convert the differences into depths
+	for (size_t w = 0; w < windowStarts.size(); w++) {
+		const size_t first = windowOffsets[w];
+		const size_t last = first + windowEnds[w] - windowStarts[w];
+		for (size_t i = first + 1; i < last; i++) {
+			depths[i] += depths[i - 1];
+		}
+	}
+	vector<uint32_t> donorLevels(2 * COVERAGE_REGION_LENGTH + 1);
+	vector<uint32_t> acceptorLevels(2 * COVERAGE_REGION_LENGTH + 1);
+	for (JunctionPtr j : junctions) {
+		const Intron& i = *(j->getIntron());
+		for (int32_t k = 0; k <= 2 * COVERAGE_REGION_LENGTH; k++) {
+			donorLevels[k] = getDepth(i.start - 2 * COVERAGE_REGION_LENGTH + k);
+			acceptorLevels[k] = getDepth(i.end + k);
+		}
+		j->calcCoverage(donorLevels, acceptorLevels);
+	}
+}
+
+void portcullis::FlankDepths::add(const BamAlignment& al) {
+	// Spliced reads were skipped by the pileup, and unmapped reads have no depth
+	if (!al.isMapped() || al.isSplicedRead()) {
+		return;
+	}
+	// Depths used to come from htslib's pileup, which stops accepting reads starting at
+	// its current position once it holds too many reads.  When a read is pushed, the
+	// pileup has moved up to the start of the previous read, and has let go of every
+	// read ending before that position.  A read starting at a new position is always
+	// taken.  Tracking the ends of the reads it holds drops exactly the same reads.
+	const int32_t pos = al.getStart();
+	const int32_t end = bam_endpos(al.getRaw());
+	if (pos != lastPos) {
+		while (!buffered.empty() && buffered.top() < pos) {
+			buffered.pop();
+		}
+		buffered.push(end);
+		lastPos = pos;
+	}
+	else {
+		// The pileup's count includes two nodes that do not hold reads
+		if (buffered.size() + 2 > PILEUP_MAX_DEPTH) {
+			return;
+		}
+		if (end > pos) {
+			buffered.push(end);
+		}
+	}
+	int32_t refPos = pos;
+	const size_t nbOps = al.getNbCigarOps();
+	for (size_t i = 0; i < nbOps; i++) {
+		const CigarOp op = al.getCigarOpAt(i);
+		if (op.type == BAM_CIGAR_MATCH_CHAR || op.type == BAM_CIGAR_EQUAL_CHAR || op.type == BAM_CIGAR_DIFF_CHAR) {
+			add(refPos, refPos + op.length);
+		}
+		if (CigarOp::opConsumesReference(op.type)) {
+			refPos += op.length;
+		}
+	}
+}
+
+void portcullis::JunctionSystem::calcMultipleMappingStats(const SplicedAlignmentMap& map) {
 	for (JunctionPtr j : junctionList) {
 		j->calcMultipleMappingScore(map);
 	}
 }
 
+void portcullis::JunctionSystem::calcUnsplicedMetrics(BamReader& reader, const int32_t refId, const JunctionList& junctions) {
+	if (junctions.empty()) {
+		return;
+	}
+	FlankingCounts counts;
+	FlankDepths depths;
+	counts.junctions = junctions;
+	depths.junctions = junctions;
+	counts.init();
+	depths.init();
+	reader.setRegion(refId, 0, junctions.front()->getIntron()->ref.length);
+	while (reader.next()) {
+		const BamAlignment& ba = reader.current();
+		counts.add(ba.getStart(), ba.getEnd());
+		depths.add(ba);
+	}
+	counts.setFlankingAlignments();
+	depths.setCoverage();
+}
+
 void portcullis::JunctionSystem::calcJunctionStats() {
 	if (junctionList.empty()) {
 		return;
@@ -319,8 +534,26 @@ void portcullis::JunctionSystem::calcJunctionStats() {
 	}
 }
 
+void portcullis::JunctionSystem::restrictTo(const TargetRegions& targets) {
+	JunctionList kept;
+	for (JunctionPtr j : junctionList) {
+		const Intron& i = *(j->getIntron());
+		if (targets.overlaps(i.ref.name, i.start, i.end + 1)) {
+			kept.push_back(j);
+		}
+	}
+	junctionList.swap(kept);
+	if (!distinctJunctions.empty()) {
+		distinctJunctions.assign(junctionList);
+	}
+}
+
 void portcullis::JunctionSystem::sort() {
 	std::sort(junctionList.begin(), junctionList.end(), JunctionComparator());
+	// Junctions loaded without the lookup table stay without it
+	if (!distinctJunctions.empty()) {
+		distinctJunctions.assign(junctionList);
+	}
 }
 
 void portcullis::JunctionSystem::index() {
@@ -434,22 +667,18 @@ void portcullis::JunctionSystem::load(const path& junctionTabFile, const bool si
 		boost::trim(line);
 		if (!line.empty() && line.find("index") == std::string::npos) {
 			shared_ptr<Junction> j = Junction::parse(line);
-			junctionList.push_back(j);
 			if (!simple) {
-				distinctJunctions[*(j->getIntron())] = j;
+				distinctJunctions.insert(j->getIntron()->key(), junctionList.size());
 			}
+			junctionList.push_back(j);
 		}
 	}
 	ifs.close();
 }
 
 JunctionPtr portcullis::JunctionSystem::getJunction(Intron& intron) const {
-	try {
-		return this->distinctJunctions.at(intron);
-	}
-	catch (std::out_of_range ex) {
-		return nullptr;
-	}
+	const uint32_t row = distinctJunctions.find(intron.key());
+	return row == IntronTable::NONE ? nullptr : junctionList[row];
 }
 
 std::pair<Orientation, Strandedness> portcullis::JunctionSystem::determineStrandedness(bool verbose) const {
@@ -0,0 +1,105 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <fstream>
+#include <string>
+#include <vector>
+using std::endl;
+using std::ifstream;
+using std::ofstream;
+using std::string;
+using std::vector;
+
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+namespace bfs = boost::filesystem;
+using boost::lexical_cast;
+
+#include <portcullis/manifest.hpp>
+
+void portcullis::Manifest::setAll(const Manifest& other, const string& prefix) {
+	for (auto & e : other.entries) {
+		if (e.first.compare(0, prefix.size(), prefix) == 0) {
+			entries[e.first] = e.second;
+		}
+	}
+}
+
+bool portcullis::Manifest::matches(const Manifest& other, const string& prefix) const {
+	Manifest mine;
+	Manifest theirs;
+	mine.setAll(*this, prefix);
+	theirs.setAll(other, prefix);
+	return mine.entries == theirs.entries;
+}
+
+bool portcullis::Manifest::filesUnchanged(const string& prefix) const {
+	bool found = false;
+	for (auto & e : entries) {
+		if (e.first.compare(0, prefix.size(), prefix) == 0) {
+			// The location of the file comes after the size and modification time
+			const size_t sep = e.second.find(' ', e.second.find(' ') + 1);
+			if (sep == string::npos || fingerprint(e.second.substr(sep + 1)) != e.second) {
+				return false;
+			}
+			found = true;
+		}
+	}
+	return found;
+}
+
+bool portcullis::Manifest::canReuse(const Manifest& previous, const vector<string>& dependsOn, const string& outputs) const {
+	for (auto & prefix : dependsOn) {
+		if (!matches(previous, prefix)) {
+			return false;
+		}
+	}
+	return previous.filesUnchanged(outputs);
+}
+
+void portcullis::Manifest::load(const path& file) {
+	entries.clear();
+	ifstream in(file.string());
+	string line;
+	while (std::getline(in, line)) {
+		const size_t tab = line.find('\t');
+		if (tab != string::npos) {
+			entries[line.substr(0, tab)] = line.substr(tab + 1);
+		}
+	}
+}
+
+void portcullis::Manifest::save(const path& file) const {
+	ofstream out(file.string());
+	for (auto & e : entries) {
+		out << e.first << "\t" << e.second << endl;
+	}
+	out.close();
+	if (!out) {
+		BOOST_THROW_EXCEPTION(ManifestException() << ManifestErrorInfo(string(
+								  "Could not write manifest: ") + file.string()));
+	}
+}
+
+string portcullis::Manifest::fingerprint(const path& file) {
+	if (!bfs::exists(file)) {
+		return "missing";
+	}
+	return lexical_cast<string>(bfs::file_size(file)) + " " +
+		   lexical_cast<string>(bfs::last_write_time(file)) + " " +
+		   bfs::canonical(file).string();
+}
@@ -60,8 +60,9 @@ portcullis::ml::ModelFeatures::ModelFeatures() : L95(0) {
 void portcullis::ml::ModelFeatures::initGenomeMapper(const path& genomeFile) {
 	// Initialise
 	gmap.setGenomeFile(genomeFile);
-	// Load the fasta index
+	// Load the fasta index, and the packed genome for faster fetches if there is one
 	gmap.loadFastaIndex();
+	gmap.loadPackedGenome();
 }
 
 uint32_t portcullis::ml::ModelFeatures::calcIntronThreshold(const JunctionList& juncs) {
@@ -77,11 +78,12 @@ uint32_t portcullis::ml::ModelFeatures::calcIntronThreshold(const JunctionList&
 void portcullis::ml::ModelFeatures::trainCodingPotentialModel(const JunctionList& in) {
 	vector<string> exons;
 	vector<string> introns;
+	string left_exon, intron, right_exon;
 	for (auto & j : in) {
-		int len = 0;
-		string left_exon = gmap.fetchBases(j->getIntron()->ref.name.c_str(), j->getIntron()->start - 202, j->getIntron()->start - 2, &len);
+		const int32_t ref = gmap.getSeqIndex(j->getIntron()->ref.name.c_str());
+		gmap.fetchBases(ref, j->getIntron()->start - 202, j->getIntron()->start - 2, left_exon);
 		if (j->getConsensusStrand() == Strand::NEGATIVE) {
-			left_exon = SeqUtils::reverseComplement(left_exon);
+			SeqUtils::reverseComplementInPlace(left_exon);
 		}
 		exons.push_back(left_exon);
 		/*string left_intron = gmap.fetchBases(j->getIntron()->ref.name.c_str(), j->getIntron()->start, j->getIntron()->start+80, &len);
@@ -95,14 +97,14 @@ void portcullis::ml::ModelFeatures::trainCodingPotentialModel(const JunctionList
 		    right_intron = SeqUtils::reverseComplement(right_intron);
 		}
 		introns.push_back(right_intron);*/
-		string intron = gmap.fetchBases(j->getIntron()->ref.name.c_str(), j->getIntron()->start, j->getIntron()->end, &len);
+		gmap.fetchBases(ref, j->getIntron()->start, j->getIntron()->end, intron);
 		if (j->getConsensusStrand() == Strand::NEGATIVE) {
-			intron = SeqUtils::reverseComplement(intron);
+			SeqUtils::reverseComplementInPlace(intron);
 		}
 		introns.push_back(intron);
-		string right_exon = gmap.fetchBases(j->getIntron()->ref.name.c_str(), j->getIntron()->end + 1, j->getIntron()->end + 201, &len);
+		gmap.fetchBases(ref, j->getIntron()->end + 1, j->getIntron()->end + 201, right_exon);
 		if (j->getConsensusStrand() == Strand::NEGATIVE) {
-			right_exon = SeqUtils::reverseComplement(right_exon);
+			SeqUtils::reverseComplementInPlace(right_exon);
 		}
 		exons.push_back(right_exon);
 	}
@@ -113,15 +115,16 @@ void portcullis::ml::ModelFeatures::trainCodingPotentialModel(const JunctionList
 void portcullis::ml::ModelFeatures::trainSplicingModels(const JunctionList& pass, const JunctionList& fail) {
 	vector<string> donors;
 	vector<string> acceptors;
+	string left, right;
 	for (auto & j : pass) {
-		int len = 0;
-		string left = gmap.fetchBases(j->getIntron()->ref.name.c_str(), j->getIntron()->start - 3, j->getIntron()->start + 20, &len);
+		const int32_t ref = gmap.getSeqIndex(j->getIntron()->ref.name.c_str());
+		gmap.fetchBases(ref, j->getIntron()->start - 3, j->getIntron()->start + 20, left);
 		if (j->getConsensusStrand() == Strand::NEGATIVE) {
-			left = SeqUtils::reverseComplement(left);
+			SeqUtils::reverseComplementInPlace(left);
 		}
-		string right = gmap.fetchBases(j->getIntron()->ref.name.c_str(), j->getIntron()->end - 20, j->getIntron()->end + 2, &len);
+		gmap.fetchBases(ref, j->getIntron()->end - 20, j->getIntron()->end + 2, right);
 		if (j->getConsensusStrand() == Strand::NEGATIVE) {
-			right = SeqUtils::reverseComplement(right);
+			SeqUtils::reverseComplementInPlace(right);
 		}
 		if (j->getConsensusStrand() == Strand::NEGATIVE) {
 			donors.push_back(right);
@@ -139,14 +142,14 @@ void portcullis::ml::ModelFeatures::trainSplicingModels(const JunctionList& pass
 	donors.clear();
 	acceptors.clear();
 	for (auto & j : fail) {
-		int len = 0;
-		string left = gmap.fetchBases(j->getIntron()->ref.name.c_str(), j->getIntron()->start - 3, j->getIntron()->start + 20, &len);
+		const int32_t ref = gmap.getSeqIndex(j->getIntron()->ref.name.c_str());
+		gmap.fetchBases(ref, j->getIntron()->start - 3, j->getIntron()->start + 20, left);
 		if (j->getConsensusStrand() == Strand::NEGATIVE) {
-			left = SeqUtils::reverseComplement(left);
+			SeqUtils::reverseComplementInPlace(left);
 		}
-		string right = gmap.fetchBases(j->getIntron()->ref.name.c_str(), j->getIntron()->end - 20, j->getIntron()->end + 2, &len);
+		gmap.fetchBases(ref, j->getIntron()->end - 20, j->getIntron()->end + 2, right);
 		if (j->getConsensusStrand() == Strand::NEGATIVE) {
-			right = SeqUtils::reverseComplement(right);
+			SeqUtils::reverseComplementInPlace(right);
 		}
 		if (j->getConsensusStrand() == Strand::NEGATIVE) {
 			donors.push_back(right);
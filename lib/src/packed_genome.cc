@@ -0,0 +1,365 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+using std::ofstream;
+using std::string;
+using std::vector;
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/exception/all.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/path.hpp>
+namespace bfs = boost::filesystem;
+using boost::filesystem::path;
+
+#include <htslib/faidx.h>
+
+#include <portcullis/bam/bam_master.hpp>
+#include <portcullis/bam/packed_genome.hpp>
+
+namespace {
+
+// Identifies the file type
+const char PACKED_GENOME_MAGIC[3] = { 'P', 'G', 'N' };
+
+// Layout version, which follows the magic.  Version 1 had no byte order marker.
+const uint8_t PACKED_GENOME_VERSION = 2;
+
+// Written in the byte order of the host building the file, so a host with the other
+// byte order reads it back differently
+const uint32_t PACKED_GENOME_BYTE_ORDER = 0x01020304;
+
+// Magic, version, byte order, number of sequences, reserved, fasta size, fasta time
+// and directory offset
+const size_t PACKED_GENOME_HEADER_SIZE = 40;
+
+const char PACKED_BASES[4] = { 'A', 'C', 'G', 'T' };
+
+// Everything in the data section starts on an 8 byte boundary, so the runs can be
+// used straight from the mapped file
+const size_t PACKED_GENOME_ALIGNMENT = 8;
+
+template<typename T>
+void writeValue(ofstream& out, const T& value) {
+	out.write((const char*) &value, sizeof(T));
+}
+
+void writePadding(ofstream& out) {
+	const char zeros[PACKED_GENOME_ALIGNMENT] = { 0 };
+	const size_t pos = out.tellp();
+	if (pos % PACKED_GENOME_ALIGNMENT != 0) {
+		out.write(zeros, PACKED_GENOME_ALIGNMENT - pos % PACKED_GENOME_ALIGNMENT);
+	}
+}
+
+/**
+ * Reads a value from the mapped file, checking it's all there
+ */
+template<typename T>
+T readValue(const uint8_t* data, const size_t size, size_t& pos, const path& file) {
+	if (pos + sizeof(T) > size) {
+		BOOST_THROW_EXCEPTION(portcullis::bam::BamException() << portcullis::bam::BamErrorInfo(string(
+								  "Truncated packed genome: ") + file.string()));
+	}
+	T value;
+	memcpy(&value, data + pos, sizeof(T));
+	pos += sizeof(T);
+	return value;
+}
+
+/**
+ * Checks the magic, version and byte order at the start of a packed genome
+ * @return Why the file can't be used on this host, or an empty string if it can
+ */
+string headerProblem(const uint8_t* header, const size_t size) {
+	if (size < PACKED_GENOME_HEADER_SIZE || memcmp(header, PACKED_GENOME_MAGIC, sizeof(PACKED_GENOME_MAGIC)) != 0) {
+		return "Not a packed genome";
+	}
+	if (header[sizeof(PACKED_GENOME_MAGIC)] != PACKED_GENOME_VERSION) {
+		return "Packed genome was made by a different version of portcullis";
+	}
+	uint32_t byteOrder;
+	memcpy(&byteOrder, header + sizeof(PACKED_GENOME_MAGIC) + 1, sizeof(byteOrder));
+	if (byteOrder != PACKED_GENOME_BYTE_ORDER) {
+		return "Packed genome was made on a host with a different byte order";
+	}
+	return "";
+}
+
+inline int8_t baseCode(const char base) {
+	switch (base) {
+	case 'A':
+		return 0;
+	case 'C':
+		return 1;
+	case 'G':
+		return 2;
+	case 'T':
+		return 3;
+	default:
+		return -1;
+	}
+}
+
+}
+
+void portcullis::bam::PackedGenome::build(const path& fastaFile, const path& packedFile) {
+	faidx_t* fai = fai_load(fastaFile.c_str());
+	if (fai == NULL) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not load genome index for: ") + fastaFile.string()));
+	}
+	ofstream out(packedFile.string(), std::ios::binary);
+	const int32_t nbSeqs = faidx_nseq(fai);
+	out.write(PACKED_GENOME_MAGIC, sizeof(PACKED_GENOME_MAGIC));
+	writeValue(out, PACKED_GENOME_VERSION);
+	writeValue(out, PACKED_GENOME_BYTE_ORDER);
+	writeValue(out, nbSeqs);
+	writeValue(out, (uint32_t) 0);
+	writeValue(out, (uint64_t) bfs::file_size(fastaFile));
+	writeValue(out, (int64_t) bfs::last_write_time(fastaFile));
+	writeValue(out, (uint64_t) 0);
+	vector<uint64_t> directory;
+	vector<uint8_t> packed;
+	vector<PackedBaseRun> exceptions;
+	vector<PackedMaskRun> masks;
+	for (int32_t i = 0; i < nbSeqs && out; i++) {
+		const char* name = faidx_iseq(fai, i);
+		const int length = faidx_seq_len(fai, name);
+		int fetched = 0;
+		char* seq = length > 0 ? faidx_fetch_seq(fai, name, 0, length - 1, &fetched) : NULL;
+		if (fetched != length) {
+			free(seq);
+			fai_destroy(fai);
+			BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+									  "Could not read sequence ") + name + " from: " + fastaFile.string()));
+		}
+		packed.assign((length + 3) / 4, 0);
+		exceptions.clear();
+		masks.clear();
+		for (int p = 0; p < length; p++) {
+			const char c = seq[p];
+			const char upper = toupper(c);
+			const int8_t code = baseCode(upper);
+			if (code < 0) {
+				if (!exceptions.empty() && exceptions.back().base == upper &&
+						exceptions.back().start + exceptions.back().length == (uint64_t) p) {
+					exceptions.back().length++;
+				}
+				else {
+					exceptions.push_back(PackedBaseRun{ (uint64_t) p, 1, upper, { 0, 0, 0 } });
+				}
+			}
+			else {
+				packed[p >> 2] |= code << ((3 - (p & 3)) * 2);
+			}
+			if (islower(c)) {
+				if (!masks.empty() && masks.back().start + masks.back().length == (uint64_t) p) {
+					masks.back().length++;
+				}
+				else {
+					masks.push_back(PackedMaskRun{ (uint64_t) p, 1 });
+				}
+			}
+		}
+		free(seq);
+		directory.push_back(out.tellp());
+		out.write((const char*) packed.data(), packed.size());
+		writePadding(out);
+		directory.push_back(out.tellp());
+		out.write((const char*) exceptions.data(), exceptions.size() * sizeof(PackedBaseRun));
+		directory.push_back(out.tellp());
+		out.write((const char*) masks.data(), masks.size() * sizeof(PackedMaskRun));
+		directory.push_back(exceptions.size());
+		directory.push_back(masks.size());
+	}
+	// The directory goes at the end, now we know where everything is
+	const uint64_t directoryOffset = out.tellp();
+	for (int32_t i = 0; i < nbSeqs && out; i++) {
+		const char* name = faidx_iseq(fai, i);
+		writeValue(out, (uint32_t) strlen(name));
+		out.write(name, strlen(name));
+		writeValue(out, (int64_t) faidx_seq_len(fai, name));
+		for (size_t j = 0; j < 5; j++) {
+			writeValue(out, directory[i * 5 + j]);
+		}
+	}
+	out.seekp(PACKED_GENOME_HEADER_SIZE - sizeof(uint64_t));
+	writeValue(out, directoryOffset);
+	fai_destroy(fai);
+	out.close();
+	if (!out) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not write packed genome: ") + packedFile.string()));
+	}
+}
+
+void portcullis::bam::PackedGenome::open(const path& _packedFile) {
+	close();
+	packedFile = _packedFile;
+	int fd = ::open(packedFile.c_str(), O_RDONLY);
+	if (fd < 0) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not open packed genome: ") + packedFile.string()));
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t) st.st_size < PACKED_GENOME_HEADER_SIZE) {
+		::close(fd);
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Not a packed genome: ") + packedFile.string()));
+	}
+	void* mapped = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (mapped == MAP_FAILED) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not memory map packed genome: ") + packedFile.string()));
+	}
+	data = (uint8_t*) mapped;
+	size = st.st_size;
+	try {
+		const string problem = headerProblem(data, size);
+		if (!problem.empty()) {
+			BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(problem + ": " + packedFile.string()));
+		}
+		size_t pos = sizeof(PACKED_GENOME_MAGIC) + 1 + sizeof(PACKED_GENOME_BYTE_ORDER);
+		const int32_t nbSeqs = readValue<int32_t>(data, size, pos, packedFile);
+		pos += sizeof(uint32_t);
+		fastaSize = readValue<uint64_t>(data, size, pos, packedFile);
+		fastaTime = readValue<int64_t>(data, size, pos, packedFile);
+		pos = readValue<uint64_t>(data, size, pos, packedFile);
+		for (int32_t i = 0; i < nbSeqs; i++) {
+			const uint32_t nameLength = readValue<uint32_t>(data, size, pos, packedFile);
+			if (pos + nameLength > size) {
+				BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+										  "Truncated packed genome: ") + packedFile.string()));
+			}
+			Sequence s;
+			s.name = string((const char*) data + pos, nameLength);
+			pos += nameLength;
+			s.length = readValue<int64_t>(data, size, pos, packedFile);
+			const uint64_t basesOffset = readValue<uint64_t>(data, size, pos, packedFile);
+			const uint64_t exceptionsOffset = readValue<uint64_t>(data, size, pos, packedFile);
+			const uint64_t masksOffset = readValue<uint64_t>(data, size, pos, packedFile);
+			s.nbExceptions = readValue<uint64_t>(data, size, pos, packedFile);
+			s.nbMasks = readValue<uint64_t>(data, size, pos, packedFile);
+			if (basesOffset + (s.length + 3) / 4 > size ||
+					exceptionsOffset + s.nbExceptions * sizeof(PackedBaseRun) > size ||
+					masksOffset + s.nbMasks * sizeof(PackedMaskRun) > size) {
+				BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+										  "Truncated packed genome: ") + packedFile.string()));
+			}
+			s.bases = data + basesOffset;
+			s.exceptions = (const PackedBaseRun*) (data + exceptionsOffset);
+			s.masks = (const PackedMaskRun*) (data + masksOffset);
+			names[s.name] = i;
+			sequences.push_back(s);
+		}
+	}
+	catch (...) {
+		close();
+		throw;
+	}
+}
+
+bool portcullis::bam::PackedGenome::isCompatible(const path& packedFile) {
+	uint8_t header[PACKED_GENOME_HEADER_SIZE];
+	std::ifstream in(packedFile.string(), std::ios::binary);
+	in.read((char*) header, PACKED_GENOME_HEADER_SIZE);
+	return headerProblem(header, in.gcount()).empty();
+}
+
+void portcullis::bam::PackedGenome::close() {
+	if (data != nullptr) {
+		munmap(data, size);
+	}
+	data = nullptr;
+	size = 0;
+	sequences.clear();
+	names.clear();
+}
+
+bool portcullis::bam::PackedGenome::isPackingOf(const path& fastaFile) const {
+	return bfs::exists(fastaFile) &&
+		   bfs::file_size(fastaFile) == fastaSize &&
+		   bfs::last_write_time(fastaFile) == fastaTime;
+}
+
+int portcullis::bam::PackedGenome::fetch(const int32_t index, int start, int end, string& bases) const {
+	if (index < 0 || index >= (int32_t) sequences.size()) {
+		bases.clear();
+		return -2;
+	}
+	const Sequence& s = sequences[index];
+	if (s.length == 0) {
+		bases.clear();
+		return 0;
+	}
+	// Same clamping as faidx_fetch_seq
+	if (end < start) {
+		start = end;
+	}
+	if (start < 0) {
+		start = 0;
+	}
+	else if (s.length <= start) {
+		start = s.length - 1;
+	}
+	if (end < 0) {
+		end = 0;
+	}
+	else if (s.length <= end) {
+		end = s.length - 1;
+	}
+	const int length = end - start + 1;
+	bases.resize(length);
+	for (int p = start; p <= end; p++) {
+		bases[p - start] = PACKED_BASES[(s.bases[p >> 2] >> ((3 - (p & 3)) * 2)) & 3];
+	}
+	// Overlay the odd bases, then the soft masking, from the first run that could overlap
+	auto firstException = std::upper_bound(s.exceptions, s.exceptions + s.nbExceptions, (uint64_t) start,
+										   [](const uint64_t pos, const PackedBaseRun & r) { return pos < r.start; });
+	for (auto r = firstException == s.exceptions ? firstException : firstException - 1;
+			r != s.exceptions + s.nbExceptions && r->start <= (uint64_t) end; ++r) {
+		const int64_t from = std::max<int64_t>(start, r->start);
+		const int64_t to = std::min<int64_t>(end + 1, r->start + r->length);
+		for (int64_t p = from; p < to; p++) {
+			bases[p - start] = r->base;
+		}
+	}
+	auto firstMask = std::upper_bound(s.masks, s.masks + s.nbMasks, (uint64_t) start,
+									  [](const uint64_t pos, const PackedMaskRun & r) { return pos < r.start; });
+	for (auto r = firstMask == s.masks ? firstMask : firstMask - 1;
+			r != s.masks + s.nbMasks && r->start <= (uint64_t) end; ++r) {
+		const int64_t from = std::max<int64_t>(start, r->start);
+		const int64_t to = std::min<int64_t>(end + 1, r->start + r->length);
+		for (int64_t p = from; p < to; p++) {
+			bases[p - start] = tolower(bases[p - start]);
+		}
+	}
+	return length;
+}
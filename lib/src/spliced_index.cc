@@ -0,0 +1,209 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+using std::ifstream;
+using std::max;
+using std::min;
+using std::ofstream;
+using std::string;
+using std::vector;
+
+#include <boost/exception/all.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/filesystem/path.hpp>
+namespace bfs = boost::filesystem;
+using boost::filesystem::path;
+
+#include <htslib/sam.h>
+
+#include <portcullis/bam/bam_master.hpp>
+#include <portcullis/bam/bam_alignment.hpp>
+#include <portcullis/bam/bam_reader.hpp>
+#include <portcullis/bam/spliced_index.hpp>
+
+namespace {
+
+// Identifies the file type and layout version
+const char SPLICED_INDEX_MAGIC[4] = { 'P', 'S', 'I', 2 };
+
+template<typename T>
+void writeValue(ofstream& out, const T& value) {
+	out.write((const char*) &value, sizeof(T));
+}
+
+template<typename T>
+void readValue(ifstream& in, T& value) {
+	in.read((char*) &value, sizeof(T));
+}
+
+}
+
+void portcullis::bam::SplicedIndex::build(const path& bamFile, const uint16_t threads) {
+	BamReader reader(bamFile);
+	reader.open(threads);
+	const bam_hdr_t* header = reader.getHeader();
+	const int32_t nbTargets = header->n_targets;
+	records.assign(nbTargets, vector<SplicedRecord>());
+	maxLengths.assign(nbTargets, 0);
+	unspliced.assign(nbTargets, AlignmentStats());
+	spliced.assign(nbTargets, AlignmentStats());
+	while (reader.next()) {
+		const BamAlignment& al = reader.current();
+		const int32_t refId = al.getReferenceId();
+		// Unplaced reads are all at the end of a coordinate sorted BAM
+		if (refId < 0) {
+			break;
+		}
+		const int32_t pos = al.getPosition();
+		if (pos >= (int64_t) header->target_len[refId]) {
+			continue;
+		}
+		const bool isSpliced = al.isSplicedRead();
+		if (isSpliced) {
+			const int32_t end = bam_endpos(al.getRaw());
+			records[refId].push_back(SplicedRecord{ pos, end, reader.getCurrentOffset(), al.hashName() });
+			maxLengths[refId] = max(maxLengths[refId], end - pos);
+		}
+		AlignmentStats& stats = isSpliced ? spliced[refId] : unspliced[refId];
+		const int32_t len = al.getLength();
+		stats.count++;
+		stats.sumQueryLengths += len;
+		stats.minQueryLength = min(stats.minQueryLength, len);
+		stats.maxQueryLength = max(stats.maxQueryLength, len);
+	}
+	reader.close();
+	bamSize = bfs::file_size(bamFile);
+	bamTime = bfs::last_write_time(bamFile);
+}
+
+void portcullis::bam::SplicedIndex::save(const path& indexFile) const {
+	ofstream out(indexFile.string(), std::ios::binary);
+	out.write(SPLICED_INDEX_MAGIC, sizeof(SPLICED_INDEX_MAGIC));
+	writeValue(out, bamSize);
+	writeValue(out, bamTime);
+	writeValue(out, (int32_t) records.size());
+	for (size_t i = 0; i < records.size(); i++) {
+		for (const AlignmentStats* stats : { &unspliced[i], &spliced[i] }) {
+			writeValue(out, stats->count);
+			writeValue(out, stats->sumQueryLengths);
+			writeValue(out, stats->minQueryLength);
+			writeValue(out, stats->maxQueryLength);
+		}
+		writeValue(out, maxLengths[i]);
+		writeValue(out, (uint64_t) records[i].size());
+		for (const auto & r : records[i]) {
+			writeValue(out, r.start);
+			writeValue(out, r.end);
+			writeValue(out, r.offset);
+			writeValue(out, r.nameHash);
+		}
+	}
+	out.close();
+	if (!out) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Could not write spliced alignment index: ") + indexFile.string()));
+	}
+}
+
+void portcullis::bam::SplicedIndex::load(const path& indexFile) {
+	ifstream in(indexFile.string(), std::ios::binary);
+	char magic[sizeof(SPLICED_INDEX_MAGIC)];
+	in.read(magic, sizeof(magic));
+	if (!in || memcmp(magic, SPLICED_INDEX_MAGIC, sizeof(magic) - 1) != 0) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Not a spliced alignment index: ") + indexFile.string()));
+	}
+	// An index from an older version is just out of date, so leave it empty for
+	// isIndexOf to reject
+	if (magic[sizeof(magic) - 1] != SPLICED_INDEX_MAGIC[sizeof(magic) - 1]) {
+		bamSize = 0;
+		bamTime = 0;
+		records.clear();
+		maxLengths.clear();
+		unspliced.clear();
+		spliced.clear();
+		return;
+	}
+	int32_t nbTargets = 0;
+	readValue(in, bamSize);
+	readValue(in, bamTime);
+	readValue(in, nbTargets);
+	records.assign(max(nbTargets, 0), vector<SplicedRecord>());
+	maxLengths.assign(records.size(), 0);
+	unspliced.assign(records.size(), AlignmentStats());
+	spliced.assign(records.size(), AlignmentStats());
+	for (size_t i = 0; i < records.size() && in; i++) {
+		for (AlignmentStats* stats : { &unspliced[i], &spliced[i] }) {
+			readValue(in, stats->count);
+			readValue(in, stats->sumQueryLengths);
+			readValue(in, stats->minQueryLength);
+			readValue(in, stats->maxQueryLength);
+		}
+		readValue(in, maxLengths[i]);
+		uint64_t nbRecords = 0;
+		readValue(in, nbRecords);
+		for (uint64_t j = 0; j < nbRecords && in; j++) {
+			SplicedRecord r;
+			readValue(in, r.start);
+			readValue(in, r.end);
+			readValue(in, r.offset);
+			readValue(in, r.nameHash);
+			records[i].push_back(r);
+		}
+	}
+	if (!in) {
+		BOOST_THROW_EXCEPTION(BamException() << BamErrorInfo(string(
+								  "Truncated spliced alignment index: ") + indexFile.string()));
+	}
+}
+
+bool portcullis::bam::SplicedIndex::isIndexOf(const path& bamFile) const {
+	return bfs::exists(bamFile) &&
+		   bfs::file_size(bamFile) == bamSize &&
+		   bfs::last_write_time(bamFile) == bamTime;
+}
+
+vector<int64_t> portcullis::bam::SplicedIndex::findOffsets(const int32_t refId, const int32_t start, const int32_t end) const {
+	vector<int64_t> offsets;
+	if (refId < 0 || refId >= (int32_t) records.size()) {
+		return offsets;
+	}
+	// Records are in position order, and nothing starting before this can reach the region
+	const vector<SplicedRecord>& refRecords = records[refId];
+	const int64_t first = (int64_t) start - maxLengths[refId];
+	auto it = std::lower_bound(refRecords.begin(), refRecords.end(), first,
+							   [](const SplicedRecord & r, const int64_t pos) { return r.start < pos; });
+	for (; it != refRecords.end() && it->start < end; ++it) {
+		if (it->end > start) {
+			offsets.push_back(it->offset);
+		}
+	}
+	return offsets;
+}
+
+uint64_t portcullis::bam::SplicedIndex::getNbSplicedAlignments() const {
+	uint64_t count = 0;
+	for (const auto & r : records) {
+		count += r.size();
+	}
+	return count;
+}
@@ -0,0 +1,214 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+using std::max;
+using std::min;
+using std::ifstream;
+using std::istringstream;
+using std::string;
+using std::vector;
+
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+namespace bfs = boost::filesystem;
+using boost::lexical_cast;
+
+#include <portcullis/target_regions.hpp>
+
+void portcullis::TargetRegions::load(const path& bedFile) {
+	if (!bfs::exists(bedFile)) {
+		BOOST_THROW_EXCEPTION(TargetRegionsException() << TargetRegionsErrorInfo(string(
+								  "Could not find regions file at: ") + bedFile.string()));
+	}
+	ifstream in(bedFile.string());
+	string line;
+	uint64_t lineNb = 0;
+	while (std::getline(in, line)) {
+		lineNb++;
+		if (line.empty() || line[0] == '#' || line.compare(0, 5, "track") == 0 || line.compare(0, 7, "browser") == 0) {
+			continue;
+		}
+		istringstream fields(line);
+		string name;
+		int64_t start = -1;
+		int64_t end = -1;
+		if (!(fields >> name >> start >> end) || start < 0 || end < start || end > INT32_MAX) {
+			BOOST_THROW_EXCEPTION(TargetRegionsException() << TargetRegionsErrorInfo(string(
+									  "Invalid region on line ") + lexical_cast<string>(lineNb) + " of " + bedFile.string() + ": " + line));
+		}
+		if (end > start) {
+			intervals[name].push_back(std::make_pair((int32_t) start, (int32_t) end));
+		}
+	}
+	// Sort and merge the regions on each sequence
+	for (auto & seq : intervals) {
+		vector<pair<int32_t, int32_t>>& regions = seq.second;
+		std::sort(regions.begin(), regions.end());
+		size_t last = 0;
+		for (size_t i = 1; i < regions.size(); i++) {
+			if (regions[i].first <= regions[last].second) {
+				regions[last].second = std::max(regions[last].second, regions[i].second);
+			}
+			else {
+				regions[++last] = regions[i];
+			}
+		}
+		regions.resize(last + 1);
+	}
+}
+
+size_t portcullis::TargetRegions::size() const {
+	size_t count = 0;
+	for (auto & seq : intervals) {
+		count += seq.second.size();
+	}
+	return count;
+}
+
+vector<portcullis::TargetRegion> portcullis::TargetRegions::getRegions(const RefSeqPtrList& refs) const {
+	vector<TargetRegion> regions;
+	for (auto & ref : refs) {
+		auto it = intervals.find(ref->name);
+		if (it == intervals.end()) {
+			continue;
+		}
+		for (auto & r : it->second) {
+			const int32_t end = std::min<int64_t>(r.second, ref->length);
+			if (r.first < end) {
+				regions.push_back(TargetRegion{ ref->index, r.first, end });
+			}
+		}
+	}
+	return regions;
+}
+
+vector<string> portcullis::TargetRegions::getUnknownSequences(const RefSeqPtrList& refs) const {
+	vector<string> unknown;
+	for (auto & seq : intervals) {
+		bool found = false;
+		for (auto & ref : refs) {
+			if (ref->name == seq.first) {
+				found = true;
+				break;
+			}
+		}
+		if (!found) {
+			unknown.push_back(seq.first);
+		}
+	}
+	std::sort(unknown.begin(), unknown.end());
+	return unknown;
+}
+
+bool portcullis::TargetRegions::overlaps(const string& refName, const int32_t start, const int32_t end) const {
+	auto it = intervals.find(refName);
+	if (it == intervals.end()) {
+		return false;
+	}
+	// Find the first region ending after the start, and see if it begins before the end
+	const vector<pair<int32_t, int32_t>>& regions = it->second;
+	auto r = std::upper_bound(regions.begin(), regions.end(), start,
+							  [](const int32_t pos, const pair<int32_t, int32_t>& region) { return pos < region.second; });
+	return r != regions.end() && r->first < end;
+}
+
+bool portcullis::TargetRegions::widen(const TargetRegion& target, const int32_t refLength, const int32_t minStep,
+									  const IntronFinder& findIntrons, TargetWindow& window) {
+	int32_t start = target.start;
+	int32_t end = target.end;
+	int32_t step = max(end - start, minStep);
+	set<pair<int32_t, int32_t>> introns;
+	while (true) {
+		int32_t maxSpan = 0;
+		findIntrons(start, end, introns, maxSpan);
+		// Junctions owned by the window, in the order the junction system sorts them,
+		// noting which overlap the target
+		vector<pair<int32_t, int32_t>> owned;
+		int32_t firstOverlap = -1;
+		int32_t lastOverlap = -1;
+		int32_t minStart = start;
+		int32_t maxEnd = -1;
+		for (auto & i : introns) {
+			const bool overlaps = i.first < target.end && i.second >= target.start;
+			if (overlaps) {
+				minStart = min(minStart, i.first);
+				maxEnd = max(maxEnd, i.second);
+			}
+			if (i.first < start || i.first >= end) {
+				continue;
+			}
+			if (overlaps) {
+				if (firstOverlap < 0) {
+					firstOverlap = owned.size();
+				}
+				lastOverlap = owned.size();
+			}
+			owned.push_back(i);
+		}
+		// Nothing to analyse for this target
+		if (maxEnd < 0) {
+			return false;
+		}
+		// The window must own every junction overlapping the target
+		if (minStart < start) {
+			start = minStart;
+			continue;
+		}
+		bool leftDone = start == 0;
+		bool rightDone = end >= refLength;
+		for (size_t i = 0; i + 1 < owned.size(); i++) {
+			if (owned[i].first != owned[i + 1].first && owned[i].second != owned[i + 1].second) {
+				leftDone = leftDone || (int32_t) i < firstOverlap;
+				rightDone = rightDone || (int32_t) i >= lastOverlap;
+			}
+		}
+		if (leftDone && rightDone) {
+			window.region = TargetRegion{ target.refIndex, start, end };
+			window.maxSpan = maxSpan;
+			window.maxEnd = maxEnd;
+			return true;
+		}
+		if (!leftDone) {
+			start = (int32_t) std::max<int64_t>(0, (int64_t) start - step);
+		}
+		if (!rightDone) {
+			end = (int32_t) std::min<int64_t>(refLength, (int64_t) end + step);
+		}
+		step = (int32_t) std::min<int64_t>(INT32_MAX, (int64_t) step * 2);
+	}
+}
+
+vector<portcullis::TargetRegion> portcullis::TargetRegions::merge(vector<TargetRegion> regions) {
+	std::sort(regions.begin(), regions.end(), [](const TargetRegion & a, const TargetRegion & b) {
+		return a.refIndex < b.refIndex || (a.refIndex == b.refIndex && a.start < b.start);
+	});
+	vector<TargetRegion> merged;
+	for (auto & r : regions) {
+		if (!merged.empty() && merged.back().refIndex == r.refIndex && r.start <= merged.back().end) {
+			merged.back().end = max(merged.back().end, r.end);
+		}
+		else {
+			merged.push_back(r);
+		}
+	}
+	return merged;
+}
@@ -652,6 +652,12 @@ class TabJunction(ExonJunction):
 	def setRaw(self, raw_count):
 		self.metrics[self.metric_names().index("nb_raw_aln")] = raw_count
 
+	def getNbSampled(self):
+		return int(self.metrics[self.metric_names().index("nb_sampled_aln")])
+
+	def setNbSampled(self, sampled_count):
+		self.metrics[self.metric_names().index("nb_sampled_aln")] = sampled_count
+
 	@staticmethod
 	def metric_names():
 		return ["canonical_ss",              #0
@@ -694,7 +700,8 @@ class TabJunction(ExonJunction):
 				"coverage",
 				"up_aln",
 				"down_aln",
-				"nb_samples"]
+				"nb_samples",
+				"nb_sampled_aln"]
 
 	@staticmethod
 	def jo_names():
@@ -744,8 +751,9 @@ class TabJunction(ExonJunction):
 		if parts[0] == "index" or len(parts) <= 1:
 			return None
 
-		if len(parts) != 75 and len(parts) > 1:
-			msg = "Unexpected number of columns in TAB file.  Expected 75, found " + str(len(parts))
+		# Tables written before nb_sampled_aln was added have 75 columns
+		if len(parts) != 76 and len(parts) != 75 and len(parts) > 1:
+			msg = "Unexpected number of columns in TAB file.  Expected 75 or 76, found " + str(len(parts))
 			raise ValueError(msg)
 
 		self.refseq = parts[2]
@@ -765,7 +773,13 @@ class TabJunction(ExonJunction):
 			self.ss_strand = parts[10]
 
 			jostart = 14+len(TabJunction.metric_names())
-			self.metrics = parts[14:jostart]
+			if len(parts) == 75:
+				# Older tables didn't sample alignments, so every alignment was used
+				jostart -= 1
+				self.metrics = parts[14:jostart]
+				self.metrics.append(self.metrics[TabJunction.metric_names().index("nb_raw_aln")])
+			else:
+				self.metrics = parts[14:jostart]
 
 			endpart = jostart+len(TabJunction.jo_names())
 			self.jo = parts[jostart:endpart]
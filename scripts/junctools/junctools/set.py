@@ -157,6 +157,7 @@ def setops(args):
 					lefts = []
 					rights = []
 					counts = []
+					sampled = []
 					for line in merged[b]:
 						j = JuncFactory.create_from_ext(last_ext).parse_line(line)
 						juncs.append(j)
@@ -165,6 +166,7 @@ def setops(args):
 						rights.append(j.right)
 						if type(j) is TabJunction:
 							counts.append(j.getRaw())
+							sampled.append(j.getNbSampled())
 
 
 					merged_junc = juncs[0]
@@ -176,6 +178,7 @@ def setops(args):
 					if type(merged_junc) is TabJunction:
 						merged_junc.setNbSamples(nb_samples)
 						merged_junc.setRaw(CalcOp.SUM.execute(counts))
+						merged_junc.setNbSampled(CalcOp.SUM.execute(sampled))
 
 					i += 1
 
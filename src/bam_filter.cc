@@ -43,9 +43,13 @@ using namespace portcullis::bam;
 #include "bam_filter.hpp"
 
 
-portcullis::BamFilter::BamFilter(const path& _junctionFile, const path& _bamFile, const path& _outputBam) {
+portcullis::BamFilter::BamFilter(const path& _junctionFile, const path& _bamFile, const path& _outputBam) :
+	BamFilter(_junctionFile, vector<path>{ _bamFile }, _outputBam) {
+}
+
+portcullis::BamFilter::BamFilter(const path& _junctionFile, const vector<path>& _bamFiles, const path& _outputBam) {
 	junctionFile = _junctionFile;
-	bamFile = _bamFile;
+	bamFiles = _bamFiles;
 	outputBam = _outputBam;
 	verbose = false;
 	//strandSpecific = Strandedness::UNKNOWN;
@@ -53,15 +57,23 @@ portcullis::BamFilter::BamFilter(const path& _junctionFile, const path& _bamFile
 	clipMode = ClipMode::HARD;
 	saveMSRs = false;
 	useCsi = false;
+	threads = 1;
+	regionsFile = "";
 	// Test if provided genome exists
 	if (!bfs::exists(junctionFile)) {
 		BOOST_THROW_EXCEPTION(BamFilterException() << BamFilterErrorInfo(string(
 								  "Could not find junction file at: ") + junctionFile.string()));
 	}
-	// Test if provided BAM exists
-	if (!bfs::exists(bamFile)) {
+	// Test if provided BAMs exist
+	if (bamFiles.empty()) {
 		BOOST_THROW_EXCEPTION(BamFilterException() << BamFilterErrorInfo(string(
-								  "Could not find BAM file at: ") + bamFile.string()));
+								  "No BAM files to filter")));
+	}
+	for (auto & bamFile : bamFiles) {
+		if (!bfs::exists(bamFile)) {
+			BOOST_THROW_EXCEPTION(BamFilterException() << BamFilterErrorInfo(string(
+									  "Could not find BAM file at: ") + bamFile.string()));
+		}
 	}
 }
 
@@ -154,8 +166,12 @@ void portcullis::BamFilter::filter() {
 	// Load junction system
 	JunctionSystem js(junctionFile);
 	cout << " - Found " << js.size() << " junctions" << endl << endl;
-	BamReader reader(bamFile);
-	reader.open();
+	TargetRegions targets;
+	if (!regionsFile.empty()) {
+		targets.load(regionsFile);
+	}
+	BamReader reader(bamFiles);
+	reader.open(threads);
 	shared_ptr<RefSeqPtrList> refs = reader.createRefList();
 	js.setRefs(refs);
 	path outDir = outputBam.parent_path();
@@ -169,8 +185,14 @@ void portcullis::BamFilter::filter() {
 		BOOST_THROW_EXCEPTION(BamFilterException() << BamFilterErrorInfo(string(
 								  "File exists with name of suggested output directory: ") + outDir.string()));
 	}
-	cout << " - Processing alignments from: " << bamFile << endl;
+	for (auto & bamFile : bamFiles) {
+		cout << " - Processing alignments from: " << bamFile << endl;
+	}
+	// Alignments come out in the same order they go in, so the output can be indexed as it is written
 	BamWriter writer(outputBam);
+	writer.setThreads(threads);
+	writer.setBuildIndex(true);
+	writer.setUseCsi(useCsi);
 	writer.open(reader.getHeader());
 	cout << " - Saving filtered alignments to: " << outputBam << endl;
 	BamWriter mod(outputBam.string() + ".mod.bam");
@@ -184,8 +206,7 @@ void portcullis::BamFilter::filter() {
 	uint64_t nbReadsIn = 0;
 	uint64_t nbReadsOut = 0;
 	uint64_t nbReadsModifiedOut = 0;
-	while (reader.next()) {
-		const BamAlignment& al = reader.current();
+	auto filterAlignment = [&](const BamAlignment & al) {
 		nbReadsIn++;
 		//bool write = false;
 		if (al.isSplicedRead()) {
@@ -216,6 +237,30 @@ void portcullis::BamFilter::filter() {
 			writer.write(al);
 			nbReadsOut++;
 		}
+	};
+	if (targets.empty()) {
+		while (reader.next()) {
+			filterAlignment(reader.current());
+		}
+	}
+	else {
+		cout << " - Only filtering alignments overlapping the regions in: " << regionsFile << endl;
+		// Neighbouring regions can overlap the same alignment, so skip alignments starting
+		// before the end of the previous region, which have already been seen.  This also
+		// keeps the output in order.
+		int32_t lastRefIndex = -1;
+		int32_t lastEnd = 0;
+		for (const TargetRegion& region : targets.getRegions(*refs)) {
+			reader.setRegion(region.refIndex, region.start, region.end);
+			while (reader.next()) {
+				const BamAlignment& al = reader.current();
+				if (region.refIndex != lastRefIndex || al.getPosition() >= lastEnd) {
+					filterAlignment(al);
+				}
+			}
+			lastRefIndex = region.refIndex;
+			lastEnd = region.end;
+		}
 	}
 	reader.close();
 	writer.close();
@@ -226,31 +271,22 @@ void portcullis::BamFilter::filter() {
 	cout << "done." << endl;
 	uint32_t diff = nbReadsIn - nbReadsOut;
 	cout << "Filtered out " << diff << " alignments.  In: " << nbReadsIn << "; Out: " << nbReadsOut << " (Modified: " << nbReadsModifiedOut << ");" << endl << endl;
-	cout << "Indexing:" << endl;
-	cout << " - filtered alignments ... ";
-	cout.flush();
-	// Create BAM index
-	string indexCmd = BamHelper::createIndexBamCmd(outputBam, useCsi);
-	int indexExitCode = system(indexCmd.c_str());
-	if (indexExitCode != 0) {
-        BOOST_THROW_EXCEPTION(BamFilterException() << BamFilterErrorInfo(string(
-									  "Problem indexing output BAM: ") + outputBam.string()));
-    }
-    
-    cout << "done." << endl;
+	cout << "Filtered alignments indexed at: " << outputBam.string() << (useCsi ? ".csi" : ".bai") << endl;
 }
 
 
 int portcullis::BamFilter::main(int argc, char *argv[]) {
 	// Portcullis args
 	path junctionFile;
-	path bamFile;
+	vector<path> bamFiles;
 	path outputBam;
 	//string strandSpecific;
 	//string orientation;
 	string clipMode;
 	bool saveMSRs;
 	bool useCsi;
+	path regionsFile;
+	uint16_t threads;
 	bool verbose;
 	bool help;
 	struct winsize w;
@@ -272,6 +308,10 @@ int portcullis::BamFilter::main(int argc, char *argv[]) {
 	 "Whether or not to output modified MSRs to a separate file.  If true will output to a file with name specified by output with \".msr.bam\" extension")
 	("use_csi,c", po::bool_switch(&useCsi)->default_value(false),
 	 "Whether to use CSI indexing rather than BAI indexing.  CSI has the advantage that it supports very long target sequences (probably not an issue unless you are working on huge genomes).  BAI has the advantage that it is more widely supported (useful for viewing in genome browsers).")
+	("regions", po::value<path>(&regionsFile),
+	 "BED file of regions to restrict filtering to.  Only alignments overlapping these regions are read, using the BAM index, and output.")
+	("threads,t", po::value<uint16_t>(&threads)->default_value(DEFAULT_BAM_FILTER_THREADS),
+	 "The number of threads to use for decompressing the input BAM.")
 	("verbose,v", po::bool_switch(&verbose)->default_value(false),
 	 "Print extra information")
 	("help", po::bool_switch(&help)->default_value(false), "Produce help message")
@@ -281,12 +321,12 @@ int portcullis::BamFilter::main(int argc, char *argv[]) {
 	po::options_description hidden_options("Hidden options");
 	hidden_options.add_options()
 	("junction-file,g", po::value<path>(&junctionFile), "Path to the junction file containing good junctions.")
-	("bam-file,g", po::value<path>(&bamFile), "Path to the BAM file to filter.")
+	("bam-file,g", po::value<vector<path>>(&bamFiles), "Path to the BAM file(s) to filter.  Several coordinate sorted BAMs are filtered as if they had been merged.")
 	;
 	// Positional option for the input bam file
 	po::positional_options_description p;
 	p.add("junction-file", 1);
-	p.add("bam-file", 1);
+	p.add("bam-file", -1);
 	// Combine non-positional options
 	po::options_description cmdline_options;
 	cmdline_options.add(generic_options).add(hidden_options);
@@ -306,12 +346,14 @@ int portcullis::BamFilter::main(int argc, char *argv[]) {
 	cout << "Running portcullis in BAM filter mode" << endl
 		 << "-------------------------------------" << endl << endl;
 	// Create the prepare class
-	BamFilter filter(junctionFile, bamFile, outputBam);
+	BamFilter filter(junctionFile, bamFiles, outputBam);
 	//filter.setStrandSpecific(strandednessFromString(strandSpecific));
 	//filter.setOrientation(orientationFromString(orientation));
 	filter.setClipMode(clipFromString(clipMode));
 	filter.setSaveMSRs(saveMSRs);
 	filter.setUseCsi(useCsi);
+	filter.setThreads(threads);
+	filter.setRegionsFile(regionsFile);
 	filter.setVerbose(verbose);
 	filter.filter();
 	return 0;
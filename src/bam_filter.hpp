@@ -44,6 +44,8 @@ using portcullis::bam::BamAlignmentPtr;
 
 namespace portcullis {
 
+const uint16_t DEFAULT_BAM_FILTER_THREADS = 1;
+
 typedef boost::error_info<struct BamFilterError, string> BamFilterErrorInfo;
 struct BamFilterException: virtual boost::exception, virtual std::exception { };
 
@@ -84,19 +86,27 @@ class BamFilter {
 private:
 
 	path junctionFile;
-	path bamFile;
+	vector<path> bamFiles;
 	path outputBam;
+	path regionsFile;
 	//Strandedness strandSpecific;
 	//Orientation orientation;
 	ClipMode clipMode;
 	bool saveMSRs;
 	bool useCsi;
+	uint16_t threads;
 	bool verbose;
 
 public:
 
 	BamFilter(const path& _junctionFile, const path& _bamFile, const path& _outputBam);
 
+	/**
+	 * Filters alignments from several coordinate sorted BAMs, which are read as if
+	 * they had been merged into one
+	 */
+	BamFilter(const path& _junctionFile, const vector<path>& _bamFiles, const path& _outputBam);
+
 	virtual ~BamFilter() {
 	}
 
@@ -117,12 +127,12 @@ protected:
 
 public:
 
-	path getBamFile() const {
-		return bamFile;
+	vector<path> getBamFiles() const {
+		return bamFiles;
 	}
 
-	void setBamFile(path bamFile) {
-		this->bamFile = bamFile;
+	void setBamFiles(const vector<path>& bamFiles) {
+		this->bamFiles = bamFiles;
 	}
 
 	path getJunctionFile() const {
@@ -140,6 +150,18 @@ public:
 	void setOutputBam(path outputBam) {
 		this->outputBam = outputBam;
 	}
+
+	path getRegionsFile() const {
+		return regionsFile;
+	}
+
+	/**
+	 * Only filter the alignments overlapping the regions in a BED file, which are read
+	 * using the BAM index.  Everything else is left out of the output.
+	 */
+	void setRegionsFile(path regionsFile) {
+		this->regionsFile = regionsFile;
+	}
 	/*
 	    Strandedness getStrandSpecific() const {
 	        return strandSpecific;
@@ -181,6 +203,14 @@ public:
 		this->useCsi = useCsi;
 	}
 
+	uint16_t getThreads() const {
+		return threads;
+	}
+
+	void setThreads(uint16_t threads) {
+		this->threads = threads;
+	}
+
 	bool isVerbose() const {
 		return verbose;
 	}
@@ -204,7 +234,7 @@ public:
 	}
 
 	static string usage() {
-		return string("portcullis bamfilt [options] <junction-file> <bam-file>");
+		return string("portcullis bamfilt [options] <junction-file> <bam-file>...");
 	}
 
 
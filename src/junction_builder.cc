@@ -16,12 +16,15 @@
 //  *******************************************************************
 
 #include <sys/ioctl.h>
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <iomanip>
 #include <vector>
 #include <memory>
 #include <mutex>
+#include <queue>
+#include <tuple>
 using std::boolalpha;
 using std::string;
 using std::cout;
@@ -61,7 +64,10 @@ using portcullis::JunctionSystem;
 using portcullis::JBThreadPool;
 
 portcullis::JunctionBuilder::JunctionBuilder(const path& _prepDir, const path& _output) {
-	prepData = PreparedFiles(_prepDir);
+	// There's no prepared data when reading unsorted alignments
+	if (!_prepDir.empty()) {
+		prepData = PreparedFiles(_prepDir);
+	}
 	outputDir = _output.empty() ? path(".") : _output.parent_path();
 	outputPrefix = _output.empty() ? "portcullis" : _output.leaf().string();
 	threads = 1;
@@ -70,9 +76,16 @@ portcullis::JunctionBuilder::JunctionBuilder(const path& _prepDir, const path& _
 	strandSpecific = Strandedness::UNKNOWN;
 	source = "portcullis";
 	verbose = false;
+	streamed = false;
+	memory = BamSorter::parseMemorySize(DEFAULT_PREP_SORT_MEMORY);
+	maxJunctionAlignments = DEFAULT_JUNC_MAX_ALIGNMENTS;
+	sortStream.reset(new SortedAlignmentStream(this));
 }
 
 portcullis::JunctionBuilder::~JunctionBuilder() {
+	// Stop any threads still working on streamed regions before freeing their alignments
+	sortStream.reset();
+	regionAlignments.reset();
 	splicedAlignmentMap.clear();
 }
 
@@ -89,32 +102,84 @@ void portcullis::JunctionBuilder::process() {
 									  "Could not create output directory at: ") + outputDir.string()));
 		}
 	}
-	if (!bfs::exists(prepData.getSortedBamFilePath())) {
-		BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
-								  "Could not find prepared BAM file at: ") + prepData.getSortedBamFilePath().string()));
+	if (!unsortedFile.empty()) {
+		processUnsorted();
+		return;
+	}
+	for (auto & sortedBam : prepData.getSortedBamFilePaths()) {
+		if (!bfs::exists(sortedBam)) {
+			BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
+									  "Could not find prepared BAM file at: ") + sortedBam.string()));
+		}
 	}
 	// Test if we have all the required data
 	if (!prepData.valid(useCsi)) {
 		BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
 								  "Prepared data is not complete: ") + prepData.getPrepDir().string()));
 	}
+	if (!regionsFile.empty()) {
+		targets.load(regionsFile);
+	}
+	// Nothing to do if the outputs were made from the same prepared data with the same
+	// settings, and haven't been touched since
+	const path manifestFile = getManifestFile();
+	Manifest manifest = createManifest();
+	if (!streamed && bfs::exists(manifestFile)) {
+		Manifest previous;
+		previous.load(manifestFile);
+		if (manifest.canReuse(previous, { "input", "setting" }, "output")) {
+			cout << "Junctions at " << outputDir.string() + "/" + outputPrefix << " are up to date with the prepared data and settings, so not finding them again." << endl << endl;
+			return;
+		}
+	}
+	bfs::remove(manifestFile);
 	const path sortedBamFile = prepData.getSortedBamFilePath();
-	// Acquire list of reference sequences
-	BamReader reader(prepData.getSortedBamFilePath());
+	BamReader reader(prepData.getSortedBamFilePaths());
 	reader.open();
-	refs = reader.createRefList();
-	refMap = reader.createRefMap(*refs);
-	reader.close();
-	junctionSystem.setRefs(refs);
-	if (refs->size() < threads) {
-		cerr << "Warning: User requested " << threads << " threads but there are only " << refs->size() << " target sequences to process.  Setting number of threads to " << refs->size() << "." << endl << endl;
-		threads = refs->size();
+	// The target sequences and regions are already set up if the alignments were
+	// streamed from the sort
+	if (!streamed) {
+		// Acquire list of reference sequences
+		refs = reader.createRefList();
+		refMap = reader.createRefMap(*refs);
+		junctionSystem.setRefs(refs);
 	}
+	reader.close();
 	// Must separate BAMs if extra metrics are requested
 	if (extra && !separate) {
 		separate = true;
 		cerr << "Warning: User requested that separated BAMS should not be output but user did request extra metrics to be calculated.  This requires separated BAMs to be produced." << endl << endl;
 	}
+	// Only the alignments in the widened target regions are read, so that's all that
+	// can be separated
+	if (separate && !targets.empty()) {
+		cerr << "Warning: User requested separated BAMs for target regions.  The separated BAMs will only hold the alignments in the regions read around the targets, not the whole genome." << endl << endl;
+	}
+	if (!streamed) {
+		// Separating BAMs requires every alignment, otherwise we only need the spliced ones.
+		// When restricted to target regions the index also gives us the genome wide stats.
+		if (!separate || !targets.empty()) {
+			loadSplicedIndex();
+		}
+		// The BAM index is only needed for reading regions.  It's loaded once for all the
+		// threads to share, and also gives the number of alignments on each target sequence.
+		if (splicedIndex == nullptr || separate) {
+			bamIndexes = BamReader::loadIndexes(prepData.getSortedBamFilePaths());
+		}
+		loadPackedGenome();
+		// Split the target sequences into regions that can be processed independently
+		if (targets.empty()) {
+			createRegions();
+		}
+		else {
+			createTargetedRegions();
+		}
+		if (results.size() < threads) {
+			const size_t nbThreads = std::max<size_t>(results.size(), 1);
+			cerr << "Warning: User requested " << threads << " threads but there are only " << results.size() << " regions to process.  Setting number of threads to " << nbThreads << "." << endl << endl;
+			threads = nbThreads;
+		}
+	}
 	// Output settings requested
 	cout << "Settings:" << endl
 		 << std::boolalpha
@@ -123,18 +188,29 @@ void portcullis::JunctionBuilder::process() {
 		 << " - BAM Indexing mode: " << (useCsi ? "CSI" : "BAI") << endl
 		 << " - Threads: " << threads << endl
 		 << " - Separate BAMs: " << separate << endl
+		 << " - Target regions: " << (regionsFile.empty() ? "whole genome" : regionsFile.string()) << endl
 		 //<< " - Calculate additional metrics: " << extra << endl
 		 << endl;
 	cout << reader.bamDetails() << endl;
-	// Separate spliced from unspliced reads and save to file if requested
-	if (separate) {
-		separateBams();
-	}
-	// The core interesting work is done here
+	// The core interesting work is done here.  Spliced, unspliced and unmapped reads
+	// are also separated and saved to file here if requested.
 	findJunctions();
 	if (extra) {
 		calcExtraMetrics();
 	}
+	saveJunctions();
+	// Record what the outputs were made from, so a re-run can skip all this
+	const vector<path> outputs = getOutputFiles();
+	for (size_t i = 0; i < outputs.size(); i++) {
+		manifest.setFile("output." + lexical_cast<string>(i + 1), outputs[i]);
+	}
+	manifest.save(manifestFile);
+}
+
+/**
+ * Saves the junctions, and determines the strandedness of the data from them
+ */
+void portcullis::JunctionBuilder::saveJunctions() {
 	cout << "Saving junctions: " << endl;
 	junctionSystem.saveAll(path(outputDir.string() + "/" + outputPrefix), source, false, this->outputExonGFF, this->outputIntronGFF);
 
@@ -149,103 +225,589 @@ void portcullis::JunctionBuilder::process() {
 	}
 }
 
-void portcullis::JunctionBuilder::separateBams() {
+vector<path> portcullis::JunctionBuilder::getOutputFiles() {
+	const string prefix = outputDir.string() + "/" + outputPrefix;
+	vector<path> files { path(prefix + ".junctions.tab"), path(prefix + ".junctions.bed") };
+	if (outputExonGFF) {
+		files.push_back(path(prefix + ".junctions.exon.gff3"));
+	}
+	if (outputIntronGFF) {
+		files.push_back(path(prefix + ".junctions.intron.gff3"));
+	}
+	if (separate) {
+		files.push_back(getSplicedBamFile());
+		files.push_back(getUnsplicedBamFile());
+		files.push_back(getUnmappedBamFile());
+	}
+	return files;
+}
+
+Manifest portcullis::JunctionBuilder::createManifest() {
+	Manifest manifest;
+	const vector<path> sortedBams = prepData.getSortedBamFilePaths();
+	manifest.set("input.bams", lexical_cast<string>(sortedBams.size()));
+	for (size_t i = 0; i < sortedBams.size(); i++) {
+		manifest.setFile("input.bam." + lexical_cast<string>(i + 1), sortedBams[i]);
+	}
+	manifest.setFile("input.genome", prepData.getGenomeFilePath());
+	// Extra metrics always separate the BAM.  Threads don't affect the output.
+	manifest.set("setting.strandedness", strandednessToString(strandSpecific));
+	manifest.set("setting.orientation", orientationToString(orientation));
+	manifest.set("setting.separate", lexical_cast<string>(separate || extra));
+	manifest.set("setting.extra", lexical_cast<string>(extra));
+	manifest.set("setting.use_csi", lexical_cast<string>(useCsi));
+	manifest.set("setting.exon_gff", lexical_cast<string>(outputExonGFF));
+	manifest.set("setting.intron_gff", lexical_cast<string>(outputIntronGFF));
+	manifest.set("setting.source", source);
+	manifest.set("setting.max_junc_alignments", lexical_cast<string>(maxJunctionAlignments));
+	if (!regionsFile.empty()) {
+		manifest.setFile("input.regions", regionsFile);
+	}
+	return manifest;
+}
+
+portcullis::SeparatedChunks portcullis::SeparatedWriters::endChunks(const uint16_t writerId) {
+	SeparatedChunks chunks;
+	chunks.writerId = writerId;
+	chunks.spliced = spliced.endChunk();
+	chunks.unspliced = unspliced.endChunk();
+	chunks.unmapped = unmapped.endChunk();
+	return chunks;
+}
+
+/**
+ * Creates the outputs for separating the BAM.  Each thread writes the alignments
+ * from its regions to its own files, and there is one extra set of files for the
+ * unplaced reads at the end of the BAM.
+ */
+void portcullis::JunctionBuilder::openSeparatedBams() {
+	separatedWriters.clear();
+	for (uint16_t i = 0; i <= threads; i++) {
+		const string suffix = ".part" + lexical_cast<string>(i);
+		shared_ptr<SeparatedWriters> writers = make_shared<SeparatedWriters>(
+				path(getSplicedBamFile().string() + suffix),
+				path(getUnsplicedBamFile().string() + suffix),
+				path(getUnmappedBamFile().string() + suffix));
+		writers->spliced.open();
+		writers->unspliced.open();
+		writers->unmapped.open();
+		separatedWriters.push_back(writers);
+	}
+}
+
+void portcullis::JunctionBuilder::separateAlignment(const BamAlignment& al, SeparatedWriters& writers) {
+	if (al.isSplicedRead()) {
+		writers.spliced.write(al);
+		writers.splicedCount++;
+	}
+	else if (al.isMapped()) {
+		writers.unspliced.write(al);
+		writers.unsplicedCount++;
+	}
+	else {
+		writers.unmapped.write(al);
+		writers.unmappedCount++;
+	}
+}
+
+/**
+ * Unplaced reads are not covered by any region, so are separated here
+ */
+void portcullis::JunctionBuilder::separateUnplacedAlignments() {
+	SeparatedWriters& writers = *(separatedWriters.back());
+	BamReader reader(prepData.getSortedBamFilePaths());
+	reader.open();
+	reader.setRegion(HTS_IDX_NOCOOR, 0, 0);
+	while (reader.next()) {
+		const BamAlignment& al = reader.current();
+		if (al.getReferenceId() < 0) {
+			separateAlignment(al, writers);
+		}
+	}
+	reader.close();
+	unplacedChunks = writers.endChunks(threads);
+}
+
+/**
+ * Stitches together the alignments written by each thread, in region order, to
+ * create the separated BAMs, then indexes them
+ */
+void portcullis::JunctionBuilder::mergeSeparatedBams() {
 	auto_cpu_timer timer(1, " = Wall time taken: %ws\n\n");
 	uint64_t splicedCount = 0;
 	uint64_t unsplicedCount = 0;
 	uint64_t unmappedCount = 0;
-	const path unsplicedFile = getUnsplicedBamFile();
-	const path splicedFile = getSplicedBamFile();
-	const path unmappedFile = getUnmappedBamFile();
-	BamWriter unsplicedWriter(unsplicedFile);
-	BamWriter splicedWriter(splicedFile);
-	BamWriter unmappedWriter(unmappedFile);
-	BamReader reader(prepData.getSortedBamFilePath());
+	for (auto & writers : separatedWriters) {
+		writers->spliced.close();
+		writers->unspliced.close();
+		writers->unmapped.close();
+		splicedCount += writers->splicedCount;
+		unsplicedCount += writers->unsplicedCount;
+		unmappedCount += writers->unmappedCount;
+	}
+	BamReader reader(prepData.getSortedBamFilePaths());
 	reader.open();
-	cout << "Splitting BAM:" << endl;
-	if (threads > 1) {
-		cerr << " - Note: this part of the pipeline is single threaded." << endl;
-	}
-	cout << " - Saving unspliced alignments to: " << unsplicedFile << endl;
-	unsplicedWriter.open(reader.getHeader());
-	cout << " - Saving spliced alignments to: " << splicedFile << endl;
-	splicedWriter.open(reader.getHeader());
-	cout << " - Saving unmapped reads to: " << unmappedFile << endl;
-	unmappedWriter.open(reader.getHeader());
-	cout << " - Processing BAM ...";
-	cout.flush();
-	while (reader.next()) {
-		const BamAlignment& al = reader.current();
-		if (al.isSplicedRead()) {
-			splicedWriter.write(al);
-			splicedCount++;
-			if (extra) {
-				// Record alignment name in map
-				size_t code = std::hash<string>()(al.deriveName());
-				splicedAlignmentMap[code]++;
-			}
-		}
-		else if (al.isMapped()) {
-			unsplicedWriter.write(al);
-			unsplicedCount++;
-		}
-		else {
-			unmappedWriter.write(al);
-			unmappedCount++;
+	cout << "Separating BAM:" << endl;
+	const path files[] = { getUnsplicedBamFile(), getSplicedBamFile(), getUnmappedBamFile() };
+	const string descriptions[] = { "unspliced alignments", "spliced alignments", "unmapped reads" };
+	BamChunkWriter SeparatedWriters::* outputs[] = { &SeparatedWriters::unspliced, &SeparatedWriters::spliced, &SeparatedWriters::unmapped };
+	BamChunk SeparatedChunks::* chunks[] = { &SeparatedChunks::unspliced, &SeparatedChunks::spliced, &SeparatedChunks::unmapped };
+	for (size_t i = 0; i < 3; i++) {
+		cout << " - Saving " << descriptions[i] << " to: " << files[i] << endl;
+		BamWriter writer(files[i]);
+		writer.open(reader.getHeader());
+		for (const RegionResult& res : results) {
+			const SeparatedWriters& writers = *(separatedWriters[res.chunks.writerId]);
+			writer.writeChunk((writers.*outputs[i]).getChunkFile(), res.chunks.*chunks[i]);
 		}
+		writer.writeChunk((separatedWriters.back().get()->*outputs[i]).getChunkFile(), unplacedChunks.*chunks[i]);
+		writer.close();
 	}
-	cout << " done." << endl;
+	reader.close();
+	for (auto & writers : separatedWriters) {
+		bfs::remove(writers->spliced.getChunkFile());
+		bfs::remove(writers->unspliced.getChunkFile());
+		bfs::remove(writers->unmapped.getChunkFile());
+	}
+	separatedWriters.clear();
 	cout << " - Found " << splicedCount << " spliced alignments." << endl;
 	cout << " - Found " << unsplicedCount << " unspliced alignments." << endl;
 	cout << " - Found " << unmappedCount << " unmapped reads." << endl;
-	reader.close();
-	unsplicedWriter.close();
-	splicedWriter.close();
-	unmappedWriter.close();
 	cout << " - Indexing unspliced alignments ... ";
 	cout.flush();
-	// Create BAM index
-	string unsplicedIndexCmd = BamHelper::createIndexBamCmd(unsplicedFile, useCsi);
-	int unsExitCode = system(unsplicedIndexCmd.c_str());
-	if (unsExitCode != 0) {
-        BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
-									  "Problem indexing unspliced BAM: ") + unsplicedFile.string()));
-    }
-
-    cout << "done." << endl;
+	BamHelper::indexBam(getUnsplicedBamFile(), useCsi);
+	cout << "done." << endl;
 	cout << " - Indexing spliced alignments ... ";
 	cout.flush();
-	// Create BAM index
-	string splicedIndexCmd = BamHelper::createIndexBamCmd(splicedFile, useCsi);
-	int sExitCode = system(splicedIndexCmd.c_str());
-    if (sExitCode != 0) {
-        BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
-									  "Problem indexing spliced BAM: ") + splicedFile.string()));
-    }
+	BamHelper::indexBam(getSplicedBamFile(), useCsi);
 	cout << "done." << endl;
 }
 
-void portcullis::JunctionBuilder::findJunctions() {
+/**
+ * Loads the spliced alignment index created by prep, if there is one and it is
+ * still up to date with the sorted BAM
+ */
+void portcullis::JunctionBuilder::loadSplicedIndex() {
+	splicedIndex.reset();
+	const path indexFile = prepData.getSplicedIndexFilePath();
+	// Offsets only make sense within a single BAM
+	if (prepData.getSortedBamFilePaths().size() > 1 || !bfs::exists(indexFile)) {
+		return;
+	}
+	shared_ptr<SplicedIndex> index = make_shared<SplicedIndex>();
+	index->load(indexFile);
+	if (!index->isIndexOf(prepData.getSortedBamFilePath()) || index->getNbTargets() != refs->size()) {
+		cerr << "Warning: Spliced alignment index is out of date, reading all alignments instead: " << indexFile << endl << endl;
+		return;
+	}
+	cout << "Using spliced alignment index: " << indexFile << endl << endl;
+	splicedIndex = index;
+}
+
+/**
+ * Loads the packed genome created by prep, if there is one, it is still up to date
+ * with the genome and it was packed for this host.  Otherwise each thread fetches
+ * bases via the fasta index, so a packed genome that can't be used isn't fatal.
+ */
+void portcullis::JunctionBuilder::loadPackedGenome() {
+	packedGenome.reset();
+	GenomeMapper gmap(getGenomeFile());
+	try {
+		if (gmap.loadPackedGenome()) {
+			cout << "Using packed genome: " << gmap.getPackedGenomeFile() << endl << endl;
+			packedGenome = gmap.getPackedGenome();
+		}
+		else if (bfs::exists(gmap.getPackedGenomeFile())) {
+			cerr << "Warning: Packed genome " << gmap.getPackedGenomeFile() << " is out of date or was packed on an incompatible host, using the genome index instead" << endl << endl;
+		}
+	}
+	catch (boost::exception& e) {
+		cerr << "Warning: Could not load packed genome, using the genome index instead" << endl
+			 << boost::diagnostic_information(e);
+	}
+}
+
+/**
+ * Estimates the number of alignments the thread pool will read for each target
+ * sequence, from the spliced alignment index or the BAM index, whichever is used
+ * for reading.  Empty if neither has been loaded, such as when the alignments are
+ * streamed.
+ */
+vector<uint64_t> portcullis::JunctionBuilder::estimateAlignments() const {
+	vector<uint64_t> estimates;
+	if (splicedIndex != nullptr && !separate) {
+		for (size_t i = 0; i < splicedIndex->getNbTargets(); i++) {
+			estimates.push_back(splicedIndex->getSplicedStats(i).count);
+		}
+	}
+	else if (!bamIndexes.empty()) {
+		estimates.assign(refs->size(), 0);
+		for (auto & index : bamIndexes) {
+			for (size_t i = 0; i < refs->size(); i++) {
+				uint64_t mapped = 0;
+				uint64_t unmapped = 0;
+				if (index != nullptr && hts_idx_get_stat(index.get(), i, &mapped, &unmapped) == 0) {
+					estimates[i] += mapped + unmapped;
+				}
+			}
+		}
+	}
+	return estimates;
+}
+
+/**
+ * Splits each target sequence into one or more regions, each of which becomes a
+ * task for the thread pool.  When running single threaded there is nothing to
+ * gain from splitting, so each target sequence becomes a single region.  Otherwise
+ * regions are sized so that each thread gets several to work on, which stops
+ * one or two large target sequences from dominating the runtime.
+ *
+ * Runs of small target sequences, such as the scaffolds of a draft assembly, are
+ * batched into a single region, so the cost of each task doesn't swamp the work
+ * done for a handful of alignments.  Batches are sized by the estimated number of
+ * alignments, or by length if there's no estimate.
+ */
+void portcullis::JunctionBuilder::createRegions() {
+	results.clear();
+	uint64_t genomeLength = 0;
+	for (auto & ref : *refs) {
+		genomeLength += ref->length;
+	}
+	int64_t regionSize = INT32_MAX;
+	if (threads > 1) {
+		regionSize = std::max<int64_t>(DEFAULT_JUNC_MIN_REGION_SIZE,
+									   genomeLength / ((uint64_t) threads * DEFAULT_JUNC_REGIONS_PER_THREAD) + 1);
+	}
+	const vector<uint64_t> estimates = estimateAlignments();
+	uint64_t batchAlignments = 0;
+	for (auto & e : estimates) {
+		batchAlignments += e;
+	}
+	batchAlignments = std::max<uint64_t>(1, batchAlignments / ((uint64_t) threads * DEFAULT_JUNC_REGIONS_PER_THREAD));
+	uint64_t batchSize = 0;
+	bool batchOpen = false;
+	for (auto & ref : *refs) {
+		const int64_t length = ref->length;
+		if (length < DEFAULT_JUNC_MIN_REGION_SIZE) {
+			const uint64_t size = estimates.empty() ? length : estimates[ref->index];
+			const uint64_t maxSize = estimates.empty() ? DEFAULT_JUNC_MIN_REGION_SIZE : batchAlignments;
+			if (batchOpen && batchSize + size <= maxSize) {
+				RegionResult& batch = results.back();
+				batch.lastRefIndex = ref->index;
+				batch.end = (int32_t) length;
+				batch.name = refs->at(batch.refIndex)->name + ".." + ref->name;
+				batchSize += size;
+				continue;
+			}
+			RegionResult res;
+			res.refIndex = ref->index;
+			res.lastRefIndex = ref->index;
+			res.start = 0;
+			res.end = (int32_t) length;
+			res.name = ref->name;
+			results.push_back(std::move(res));
+			batchSize = size;
+			batchOpen = true;
+			continue;
+		}
+		batchOpen = false;
+		const int64_t nbRegions = std::max<int64_t>(1, (length + regionSize - 1) / regionSize);
+		for (int64_t i = 0; i < nbRegions; i++) {
+			RegionResult res;
+			res.refIndex = ref->index;
+			res.lastRefIndex = ref->index;
+			res.start = (int32_t) (length * i / nbRegions);
+			res.end = (int32_t) (length * (i + 1) / nbRegions);
+			res.split = nbRegions > 1;
+			res.name = ref->name;
+			results.push_back(std::move(res));
+		}
+	}
+}
+
+/**
+ * Creates a region for each target region, widened to take in the other junctions
+ * that the junctions overlapping the target are compared with, so they get the same
+ * metrics as they would from the whole genome.  When calculating extra metrics the
+ * regions are also padded to take in the unspliced alignments flanking the junctions.
+ */
+void portcullis::JunctionBuilder::createTargetedRegions() {
 	auto_cpu_timer timer(1, " = Wall time taken: %ws\n\n");
-	// Add each target sequence as a chunk of work for the thread pool
 	results.clear();
-	results.resize(refs->size());
-	// Create the thread pool and start the threads
-	cout << "Creating " << threads << " threads, each with BAM and genome indicies loaded ...";
+	for (auto & name : targets.getUnknownSequences(*refs)) {
+		cerr << "Warning: Target sequence " << name << " in " << regionsFile.string() << " is not in the BAM file, ignoring its regions." << endl;
+	}
+	const vector<TargetRegion> targetRegions = targets.getRegions(*refs);
+	cout << "Finding the junctions needed to analyse " << targetRegions.size() << " target regions ...";
 	cout.flush();
-	JBThreadPool pool(this, threads);
-	cout << " done." << endl;
-	cout << "Finding junctions and calculating basic metrics:" << endl;
-	cout << " - Queueing " << refs->size() << " target sequences for processing in the thread pool" << endl;
-	cout << " - Processing: " << endl;
-	for (size_t i = 0; i < refs->size(); i++) {
-		results[i].js.setRefs(refs); // Make sure junction system has reference sequence list available
-		results[i].name = refs->at(i)->name;
-		pool.enqueue(refs->at(i)->index);
-	}
-	// Waits for all threads to complete
-	pool.shutDown();
-	cout << " - All threads completed." << endl << " - Combining results from threads." << endl << endl;
+	// Allow twice the read length for the unspliced alignments flanking a junction, in
+	// case they contain deletions.  Without the index the spliced alignments will do.
+	int32_t maxQueryLength = 0;
+	if (splicedIndex != nullptr) {
+		for (size_t i = 0; i < splicedIndex->getNbTargets(); i++) {
+			maxQueryLength = max(maxQueryLength, splicedIndex->getUnsplicedStats(i).maxQueryLength);
+			maxQueryLength = max(maxQueryLength, splicedIndex->getSplicedStats(i).maxQueryLength);
+		}
+	}
+	BamReader reader(prepData.getSortedBamFilePaths());
+	reader.open();
+	vector<TargetRegion> windows;
+	for (const TargetRegion& target : targetRegions) {
+		const int32_t refLength = refs->at(target.refIndex)->length;
+		TargetWindow window;
+		const bool found = TargetRegions::widen(target, refLength, DEFAULT_JUNC_TARGET_CONTEXT,
+		[&](const int32_t start, const int32_t end, set<std::pair<int32_t, int32_t>>& introns, int32_t& maxSpan) {
+			findIntrons(reader, target.refIndex, start, end, introns, maxSpan);
+		}, window);
+		if (!found) {
+			continue;
+		}
+		TargetRegion& w = window.region;
+		if (extra) {
+			w.start = (int32_t) std::max<int64_t>(0, (int64_t) w.start - window.maxSpan - 2 * max(maxQueryLength, window.maxSpan) - 2 * COVERAGE_REGION_LENGTH);
+			w.end = (int32_t) std::min<int64_t>(refLength, (int64_t) max(w.end, window.maxEnd + 1) + window.maxSpan + 2 * COVERAGE_REGION_LENGTH);
+		}
+		windows.push_back(w);
+	}
+	reader.close();
+	// Widened windows may now overlap, in which case they are merged
+	for (auto & w : TargetRegions::merge(windows)) {
+		RegionResult res;
+		res.refIndex = w.refIndex;
+		res.lastRefIndex = w.refIndex;
+		res.start = w.start;
+		res.end = w.end;
+		res.name = refs->at(w.refIndex)->name;
+		results.push_back(std::move(res));
+	}
+	for (auto & res : results) {
+		res.split = res.start > 0 || res.end < (int32_t) refs->at(res.refIndex)->length;
+	}
+	cout << " done." << endl
+		 << " - Created " << results.size() << " regions holding the junctions overlapping the targets and their neighbours" << endl;
+}
+
+void portcullis::JunctionBuilder::findIntrons(BamReader& reader, const int32_t refIndex, const int32_t start, const int32_t end,
+		set<std::pair<int32_t, int32_t>>& introns, int32_t& maxSpan) {
+	introns.clear();
+	maxSpan = 0;
+	const int32_t refLength = refs->at(refIndex)->length;
+	if (splicedIndex != nullptr) {
+		reader.setOffsets(splicedIndex->findOffsets(refIndex, start, end));
+	}
+	else {
+		reader.setRegion(refIndex, start, end);
+	}
+	while (reader.next()) {
+		const BamAlignment& al = reader.current();
+		if (!al.isSplicedRead()) {
+			continue;
+		}
+		maxSpan = max(maxSpan, (int32_t) bam_endpos(al.getRaw()) - al.getPosition());
+		// Introns are placed the same way as JunctionSystem::addJunctions places them,
+		// including those running off the end of the target sequence
+		int32_t pos = al.getPosition();
+		for (size_t i = 0; i < al.getNbCigarOps(); i++) {
+			const CigarOp op = al.getCigarOpAt(i);
+			if (op.type == BAM_CIGAR_REFSKIP_CHAR) {
+				int32_t rStart = pos + op.length;
+				if (rStart - 1 >= refLength) {
+					rStart = refLength - 1;
+				}
+				introns.insert(std::make_pair(pos, rStart - 1));
+				pos = rStart;
+			}
+			else if (CigarOp::opConsumesReference(op.type)) {
+				pos += op.length;
+			}
+		}
+	}
+}
+
+string portcullis::JunctionBuilder::getRegionName(const int32_t regionId) const {
+	const RegionResult& res = results[regionId];
+	return res.split ?
+		   res.name + ":" + lexical_cast<string>(res.start + 1) + "-" + lexical_cast<string>(res.end) :
+		   res.name;
+}
+
+vector<portcullis::RegionSpan> portcullis::JunctionBuilder::getRegionSpans() const {
+	return vector<RegionSpan>(results.begin(), results.end());
+}
+
+/**
+ * Called by the stream from the sorter in prep before the first sorted alignment.  Sets
+ * up the regions, so they can be worked on as soon as the sort has moved past them.
+ */
+bool portcullis::JunctionBuilder::startStreaming(const bam_hdr_t* header) {
+	// Separating BAMs needs every alignment, so must read the sorted BAM instead
+	if (separate || extra || !regionsFile.empty()) {
+		return false;
+	}
+	refs = BamHelper::createRefList(header);
+	refMap = BamHelper::createRefMap(*refs);
+	junctionSystem.setRefs(refs);
+	createRegions();
+	if (results.size() < threads) {
+		threads = results.size();
+	}
+	for (auto & res : results) {
+		res.js.setRefs(refs); // Make sure junction system has reference sequence list available
+		res.js.setMaxJunctionAlignments(maxJunctionAlignments);
+	}
+	regionAlignments.reset(new RegionAlignments(getRegionSpans(), *refs));
+	threadAlignmentMaps.assign(threads, SplicedAlignmentMap());
+	loadPackedGenome();
+	return true;
+}
+
+/**
+ * Finds junctions straight from alignments in any order, without prepared data.
+ * Spliced alignments are partitioned into the regions they overlap, spilling to
+ * temporary files if there are too many to hold in memory, and the unspliced
+ * alignments are summarised for each target sequence.  Each region is then sorted
+ * by the thread pool, so the metrics that depend on alignment order come out just
+ * as they would from the sorted BAM.
+ */
+void portcullis::JunctionBuilder::processUnsorted() {
+	if (separate || extra || !regionsFile.empty()) {
+		BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
+								  "Separating BAMs, extra metrics and target regions all need prepared data, so can't be used with an unsorted input")));
+	}
+	const path genome = getGenomeFile();
+	if (!bfs::exists(genome)) {
+		BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
+								  "Could not find genome file at: ") + genome.string() + ".  Use --genome to give the genome the alignments are against."));
+	}
+	GenomeMapper gmap(genome);
+	if (!bfs::exists(gmap.getFastaIndexFile())) {
+		cout << "Indexing genome ...";
+		cout.flush();
+		gmap.buildFastaIndex();
+		cout << " done." << endl << endl;
+	}
+	const bool fromStdin = unsortedFile.string() == "-";
+	samFile* fp = sam_open(unsortedFile.c_str(), "r");
+	if (fp == nullptr) {
+		BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
+								  "Could not open alignments: ") + unsortedFile.string()));
+	}
+	bam_hdr_t* header = sam_hdr_read(fp);
+	if (header == nullptr) {
+		sam_close(fp);
+		BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
+								  "Could not read header of alignments: ") + unsortedFile.string()));
+	}
+	refs = BamHelper::createRefList(header);
+	refMap = BamHelper::createRefMap(*refs);
+	junctionSystem.setRefs(refs);
+	createRegions();
+	if (results.size() < threads) {
+		const size_t nbThreads = std::max<size_t>(results.size(), 1);
+		cerr << "Warning: User requested " << threads << " threads but there are only " << results.size() << " regions to process.  Setting number of threads to " << nbThreads << "." << endl << endl;
+		threads = nbThreads;
+	}
+	for (auto & res : results) {
+		res.js.setRefs(refs); // Make sure junction system has reference sequence list available
+		res.js.setMaxJunctionAlignments(maxJunctionAlignments);
+	}
+	UnsortedAlignmentBuffer* buffer = new UnsortedAlignmentBuffer(getRegionSpans(), *refs, memory, getSpillPrefix());
+	regionAlignments.reset(buffer);
+	threadAlignmentMaps.assign(threads, SplicedAlignmentMap());
+	// Output settings requested
+	cout << "Settings:" << endl
+		 << " - Unsorted alignments: " << (fromStdin ? "standard input" : unsortedFile.string()) << endl
+		 << " - Genome: " << genome.string() << endl
+		 << " - BAM Strandedness: " << strandednessToString(strandSpecific) << endl
+		 << " - BAM Read Orientation: " << orientationToString(orientation) << endl
+		 << " - Threads: " << threads << endl
+		 << " - Memory: " << memory << " bytes" << endl
+		 << endl;
+	{
+		auto_cpu_timer timer(1, " = Wall time taken: %ws\n\n");
+		cout << "Partitioning spliced alignments into " << results.size() << " regions ...";
+		cout.flush();
+		bam1_t* b = bam_init1();
+		int res = 0;
+		while ((res = sam_read1(fp, header, b)) >= 0) {
+			buffer->add(b);
+		}
+		bam_destroy1(b);
+		bam_hdr_destroy(header);
+		sam_close(fp);
+		if (res < -1) {
+			BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
+									  "Could not read alignment from: ") + unsortedFile.string()));
+		}
+		cout << " done." << endl;
+		if (buffer->getNbSpills() > 0) {
+			cout << " - Spilled alignments to temporary files " << buffer->getNbSpills() << " times, as they didn't fit in memory" << endl;
+		}
+	}
+	loadPackedGenome();
+	{
+		JBThreadPool pool(this, threads, JBTask::FIND_STREAMED_JUNCTIONS);
+		for (size_t i = 0; i < results.size(); i++) {
+			pool.enqueue(i);
+		}
+		pool.shutDown();
+	}
+	buffer->removeRuns();
+	streamed = true;
+	findJunctions();
+	saveJunctions();
+}
+
+void portcullis::JunctionBuilder::findJunctions() {
+	auto_cpu_timer timer(1, " = Wall time taken: %ws\n\n");
+	if (streamed) {
+		cout << "Finding junctions and calculating basic metrics:" << endl;
+		cout << " - Processed " << results.size() << " regions from " << refs->size() << " target sequences "
+			 << (unsortedFile.empty() ? "while sorting the BAM" : "after partitioning the alignments") << endl;
+		// The unspliced alignments were summarised for each target sequence, which
+		// the first region on that target sequence takes
+		for (auto & res : results) {
+			if (res.start == 0) {
+				for (int32_t i = res.refIndex; i <= res.lastRefIndex; i++) {
+					const AlignmentStats& stats = regionAlignments->getUnsplicedStats(i);
+					res.unsplicedCount += stats.count;
+					res.sumQueryLengths += stats.sumQueryLengths;
+					res.minQueryLength = min(res.minQueryLength, stats.minQueryLength);
+					res.maxQueryLength = max(res.maxQueryLength, stats.maxQueryLength);
+				}
+			}
+		}
+		cout << " - Combining results from threads." << endl << endl;
+	}
+	else {
+		// Create the thread pool and start the threads.  The BAM index, if needed for
+		// reading regions, was loaded once for all the threads to share.
+		cout << "Creating " << threads << " threads, sharing the BAM and genome indicies ...";
+		cout.flush();
+		if (separate) {
+			openSeparatedBams();
+		}
+		threadAlignmentMaps.assign(threads, SplicedAlignmentMap());
+		JBThreadPool pool(this, threads);
+		cout << " done." << endl;
+		cout << "Finding junctions and calculating basic metrics:" << endl;
+		cout << " - Queueing " << results.size() << " regions from " << refs->size() << " target sequences for processing in the thread pool" << endl;
+		cout << " - Processing: " << endl;
+		// Add each region as a chunk of work for the thread pool
+		for (size_t i = 0; i < results.size(); i++) {
+			results[i].js.setRefs(refs); // Make sure junction system has reference sequence list available
+			results[i].js.setMaxJunctionAlignments(maxJunctionAlignments);
+			pool.enqueue(i);
+		}
+		// Unplaced reads are not in any region, so separate them while the threads work
+		if (separate) {
+			separateUnplacedAlignments();
+		}
+		// Waits for all threads to complete
+		pool.shutDown();
+		bamIndexes.clear();
+		cout << " - All threads completed." << endl << " - Combining results from threads." << endl << endl;
+	}
 	uint64_t unsplicedCount = 0;
 	uint64_t splicedCount = 0;
 	uint64_t sumQueryLengths = 0;
@@ -255,17 +817,29 @@ void portcullis::JunctionBuilder::findJunctions() {
 		 << std::right << std::setw(12) << "unspliced" << "\t"
 		 << std::right << std::setw(12) << "spliced" << "\t"
 		 << std::right << std::setw(12) << "total" << endl;
-	for (auto & res : results) {
+	// Regions from the same target sequence are adjacent, so sum them up to report
+	// a single line per target sequence.  Batches of small target sequences get a
+	// single line for the batch.
+	uint64_t refUnsplicedCount = 0;
+	uint64_t refSplicedCount = 0;
+	for (size_t i = 0; i < results.size(); i++) {
+		RegionResult& res = results[i];
 		junctionSystem.append(res.js);
 		unsplicedCount += res.unsplicedCount;
 		splicedCount += res.splicedCount;
 		sumQueryLengths += res.sumQueryLengths;
 		minQueryLength = min(minQueryLength, res.minQueryLength);
 		maxQueryLength = max(maxQueryLength, res.maxQueryLength);
-		cout << std::left << std::setw(12) << res.name << "\t"
-			 << std::right << std::setw(12) << res.unsplicedCount << "\t"
-			 << std::right << std::setw(12) << res.splicedCount << "\t"
-			 << std::right << std::setw(12) << res.splicedCount + res.unsplicedCount << endl;
+		refUnsplicedCount += res.unsplicedCount;
+		refSplicedCount += res.splicedCount;
+		if (i + 1 == results.size() || results[i + 1].refIndex != res.refIndex) {
+			cout << std::left << std::setw(12) << res.name << "\t"
+				 << std::right << std::setw(12) << refUnsplicedCount << "\t"
+				 << std::right << std::setw(12) << refSplicedCount << "\t"
+				 << std::right << std::setw(12) << refSplicedCount + refUnsplicedCount << endl;
+			refUnsplicedCount = 0;
+			refSplicedCount = 0;
+		}
 	}
 	cout << endl << "Sorting and reindexing merged junctions...";
 	cout.flush();
@@ -274,6 +848,26 @@ void portcullis::JunctionBuilder::findJunctions() {
 	cout << " done." << endl << endl;
 	// Calculate some alignment stats
 	uint64_t totalAlignments = splicedCount + unsplicedCount;
+	// Only the alignments around the target regions were read, so the query length stats
+	// for the whole genome come from the spliced alignment index
+	if (!targets.empty() && splicedIndex != nullptr) {
+		uint64_t count = 0;
+		sumQueryLengths = 0;
+		minQueryLength = INT32_MAX;
+		maxQueryLength = 0;
+		for (size_t i = 0; i < splicedIndex->getNbTargets(); i++) {
+			for (const AlignmentStats* stats : { &splicedIndex->getUnsplicedStats(i), &splicedIndex->getSplicedStats(i) }) {
+				count += stats->count;
+				sumQueryLengths += stats->sumQueryLengths;
+				minQueryLength = min(minQueryLength, stats->minQueryLength);
+				maxQueryLength = max(maxQueryLength, stats->maxQueryLength);
+			}
+		}
+		totalAlignments = count;
+	}
+	else if (!targets.empty()) {
+		cerr << "Warning: No spliced alignment index available, so the mean read length and multiple mapping scores only reflect the alignments around the target regions." << endl;
+	}
 	double meanQueryLength = (double) sumQueryLengths / (double) totalAlignments;
 	junctionSystem.setQueryLengthStats(minQueryLength, meanQueryLength, maxQueryLength);
 	cout << "Final stats:" << endl
@@ -281,79 +875,255 @@ void portcullis::JunctionBuilder::findJunctions() {
 		 << " - Alignment query length statistics: min: " << minQueryLength << "; mean: " << meanQueryLength << "; max: " << maxQueryLength << ";" << endl
 		 << " - Found " << junctionSystem.size() << " junctions from " << splicedCount << " spliced alignments." << endl
 		 << " - Found " << unsplicedCount << " unspliced alignments." << endl;
+	if (maxJunctionAlignments > 0) {
+		size_t nbSampled = 0;
+		for (const auto & j : junctionSystem.getJunctions()) {
+			if (j->isSampled()) {
+				nbSampled++;
+			}
+		}
+		cout << " - Estimated the mismatch, anchor depth and multiple mapping metrics of " << nbSampled
+			 << " junctions with more than " << maxJunctionAlignments << " alignments from a sample of " << maxJunctionAlignments << " alignments each." << endl;
+	}
 	// Calculate additional junction stats
-	if (junctionSystem.size() > 1) {
+	if (junctionSystem.size() > 1 || (!targets.empty() && junctionSystem.size() > 0)) {
 		cout << " - Calculating junctions stats that require comparisons with other junctions...";
 		cout.flush();
 		junctionSystem.calcJunctionStats();
 		cout << " done." << endl;
 	}
+	// Combine the spliced alignment counts from each thread.  This is cheap enough to
+	// always do, so the multiple mapping score doesn't depend on extra metrics being requested.
+	cout << " - Calculating multiple mapping stats ...";
+	cout.flush();
+	splicedAlignmentMap.clear();
+	const bool genomeWideIndex = !targets.empty() && splicedIndex != nullptr;
+	if (genomeWideIndex) {
+		for (size_t i = 0; i < splicedIndex->getNbTargets(); i++) {
+			for (auto & r : splicedIndex->getRecords(i)) {
+				splicedAlignmentMap[r.nameHash]++;
+			}
+		}
+	}
+	for (auto & threadMap : threadAlignmentMaps) {
+		if (!genomeWideIndex) {
+			if (splicedAlignmentMap.empty()) {
+				splicedAlignmentMap.swap(threadMap);
+			}
+			else {
+				for (auto & code : threadMap) {
+					splicedAlignmentMap[code.first] += code.second;
+				}
+			}
+		}
+		SplicedAlignmentMap().swap(threadMap);
+	}
+	junctionSystem.calcMultipleMappingStats(splicedAlignmentMap);
+	SplicedAlignmentMap().swap(splicedAlignmentMap);
+	cout << " done." << endl;
+	// Now the junctions have been compared with their neighbours, only keep the ones
+	// overlapping the targets
+	if (!targets.empty()) {
+		const size_t nbFound = junctionSystem.size();
+		junctionSystem.restrictTo(targets);
+		junctionSystem.index();
+		cout << " - Kept " << junctionSystem.size() << " of " << nbFound << " junctions, which overlap the target regions." << endl;
+	}
+	if (separate) {
+		cout << endl;
+		mergeSeparatedBams();
+	}
 }
 
 void portcullis::JunctionBuilder::calcExtraMetrics() {
 	auto_cpu_timer timer(1, " = Wall time taken: %ws\n\n");
 	cout << "Calculating extra junction metrics:" << endl;
-	if (threads > 1) {
-		cerr << " - Note: this part of the pipeline is single threaded." << endl;
+	// Requires BAMs to be separated.  Each target sequence becomes a task for the
+	// thread pool, and only touches the junctions on that target sequence.
+	refJunctions.clear();
+	for (JunctionPtr j : junctionSystem.getJunctions()) {
+		const int32_t refIndex = j->getIntron()->ref.index;
+		if (refJunctions.empty() || refJunctions.back().first != refIndex) {
+			refJunctions.push_back(std::make_pair(refIndex, JunctionList()));
+		}
+		refJunctions.back().second.push_back(j);
 	}
-	// Requires BAMs to be separated
-	cout << " - Calculating multiple mapping stats ...";
+	cout << " - Calculating flanking alignments and coverage for junctions on " << refJunctions.size() << " target sequences ...";
 	cout.flush();
-	junctionSystem.calcMultipleMappingStats(splicedAlignmentMap);
-	cout << " done" << endl;
-	// Count the number of alignments found in upstream and downstream flanking
-	// regions for each junction
-	cout << " - Analysing unspliced alignments around junctions ...";
-	cout.flush();
-	junctionSystem.findFlankingAlignments(getUnsplicedBamFile());
-	cout << " - Calculating unspliced alignment coverage around junctions ...";
-	cout.flush();
-	junctionSystem.calcCoverage(getUnsplicedBamFile(), strandSpecific);
+	bamIndexes = BamReader::loadIndexes(vector<path>{ getUnsplicedBamFile() });
+	JBThreadPool pool(this, threads, JBTask::EXTRA_METRICS);
+	for (size_t i = 0; i < refJunctions.size(); i++) {
+		pool.enqueue(i);
+	}
+	pool.shutDown();
+	bamIndexes.clear();
+	refJunctions.clear();
+	cout << " done." << endl;
+}
+
+void portcullis::JunctionBuilder::calcExtraMetrics(BamReader& reader, const int32_t groupId) {
+	const int32_t refIndex = refJunctions[groupId].first;
+	const JunctionList& junctions = refJunctions[groupId].second;
+	JunctionSystem::calcUnsplicedMetrics(reader, refIndex, junctions);
 }
 
-void portcullis::JunctionBuilder::findJuncs(BamReader& reader, GenomeMapper& gmap, int32_t seq) {
+/**
+ * Finds the junctions in a region, and gathers the stats for the alignments starting
+ * in the region.  Alignments come from next, which returns nullptr when there are no
+ * more, and must include every alignment overlapping the region that could support a
+ * junction.
+ */
+template<typename NextAlignment>
+void portcullis::JunctionBuilder::findRegionJuncs(GenomeMapper& gmap, const int32_t regionId, const uint16_t threadId, const AlignmentStats& unsplicedStats, NextAlignment next) {
+	RegionResult& res = results[regionId];
+	const int32_t refLength = refs->at(res.lastRefIndex)->length;
+	// The first and last regions of a target sequence also own anything that
+	// falls off either end of it.  Batches always own the whole of their targets.
+	const int32_t ownedStart = res.start == 0 ? INT32_MIN : res.start;
+	const int32_t ownedEnd = res.end >= refLength ? INT32_MAX : res.end;
 	uint64_t splicedCount = 0;
-	uint64_t unsplicedCount = 0;
-	uint32_t lastCalculatedJunctionIndex = 0;
-	uint64_t sumQueryLengths = 0;
-	int32_t minQueryLength = INT32_MAX;
-	int32_t maxQueryLength = 0;
-	reader.setRegion(seq, 0, refs->at(seq)->length);
-	while (reader.next()) {
-		const BamAlignment& al = reader.current();
-		while (results[seq].js.size() > 0 && lastCalculatedJunctionIndex < results[seq].js.size() &&
-				al.getPosition() > results[seq].js.getJunctionAt(lastCalculatedJunctionIndex)->getIntron()->end) {
-			JunctionPtr j = results[seq].js.getJunctionAt(lastCalculatedJunctionIndex);
-			j->calcMetrics(this->orientation);
-			j->processJunctionWindow(gmap);
-			j->clearAlignments();
-			lastCalculatedJunctionIndex++;
+	uint64_t unsplicedCount = unsplicedStats.count;
+	uint64_t sumQueryLengths = unsplicedStats.sumQueryLengths;
+	int32_t minQueryLength = unsplicedStats.minQueryLength;
+	int32_t maxQueryLength = unsplicedStats.maxQueryLength;
+	// Junctions still collecting alignments, ordered by where their intron ends.  A
+	// junction is done once the alignments have moved past the end of its intron, or
+	// onto the next target sequence in a batch, so each is finished as soon as it can
+	// be, rather than waiting behind any longer introns found before it.
+	typedef std::tuple<int32_t, int32_t, uint32_t> OpenJunction;
+	std::priority_queue<OpenJunction, vector<OpenJunction>, std::greater<OpenJunction>> open;
+	auto finishJunction = [&](const uint32_t row) {
+		JunctionPtr j = res.js.getJunctionAt(row);
+		j->calcMetrics(this->orientation);
+		j->processJunctionWindow(gmap);
+		j->clearAlignments();
+	};
+	while (const BamAlignment* current = next()) {
+		const BamAlignment& al = *current;
+		const int32_t refId = al.getReferenceId();
+		const int32_t pos = al.getPosition();
+		while (!open.empty() && (std::get<0>(open.top()) < refId ||
+								 (std::get<0>(open.top()) == refId && std::get<1>(open.top()) < pos))) {
+			finishJunction(std::get<2>(open.top()));
+			open.pop();
+		}
+		const size_t nbJunctions = res.js.getJunctions().size();
+		const bool spliced = res.js.addJunctionsInRegion(al, ownedStart, ownedEnd);
+		for (size_t i = nbJunctions; i < res.js.getJunctions().size(); i++) {
+			const Intron& intron = *(res.js.getJunctionAt(i)->getIntron());
+			open.push(OpenJunction(intron.ref.index, intron.end, i));
+		}
+		// Only count alignments that start in this region
+		if (al.getPosition() < ownedStart || al.getPosition() >= ownedEnd) {
+			continue;
+		}
+		if (separate) {
+			separateAlignment(al, *(separatedWriters[threadId]));
+		}
+		// Record the name of each spliced alignment, for the multiple mapping score
+		if (al.isSplicedRead()) {
+			threadAlignmentMaps[threadId][al.hashName()]++;
 		}
 		// Calc alignment stats
 		int32_t len = al.getLength();
 		minQueryLength = min(minQueryLength, len);
 		maxQueryLength = max(maxQueryLength, len);
 		sumQueryLengths += len;
-		if (results[seq].js.addJunctions(al)) {
+		if (spliced) {
 			splicedCount++;
 		}
 		else {
 			unsplicedCount++;
 		}
 	}
-	while (results[seq].js.size() > 0 && lastCalculatedJunctionIndex < results[seq].js.size()) {
-		JunctionPtr j = results[seq].js.getJunctionAt(lastCalculatedJunctionIndex);
-		j->calcMetrics(this->orientation);
-		j->processJunctionWindow(gmap);
-		j->clearAlignments();
-		lastCalculatedJunctionIndex++;
+	while (!open.empty()) {
+		finishJunction(std::get<2>(open.top()));
+		open.pop();
+	}
+	// Region boundaries fall on block boundaries in the separated outputs, so they can
+	// be put back together in order later
+	if (separate) {
+		res.chunks = separatedWriters[threadId]->endChunks(threadId);
 	}
 	// Update result vector
-	results[seq].splicedCount = splicedCount;
-	results[seq].unsplicedCount = unsplicedCount;
-	results[seq].minQueryLength = minQueryLength;
-	results[seq].maxQueryLength = maxQueryLength;
-	results[seq].sumQueryLengths = sumQueryLengths;
+	res.splicedCount = splicedCount;
+	res.unsplicedCount = unsplicedCount;
+	res.minQueryLength = minQueryLength;
+	res.maxQueryLength = maxQueryLength;
+	res.sumQueryLengths = sumQueryLengths;
+}
+
+void portcullis::JunctionBuilder::findJuncs(BamReader& reader, GenomeMapper& gmap, int32_t regionId, const uint16_t threadId) {
+	const RegionResult& res = results[regionId];
+	// This returns every alignment overlapping the region, so we are guaranteed
+	// to see all the alignments supporting the junctions owned by this region,
+	// even those that start in a previous region.  With the spliced alignment index
+	// we only read the spliced alignments, and the first region on each target
+	// sequence takes the summary of the unspliced alignments instead.
+	AlignmentStats unsplicedStats;
+	if (splicedIndex != nullptr && !separate) {
+		if (res.lastRefIndex > res.refIndex) {
+			// Offsets for a batch are in file order, as its target sequences are
+			vector<int64_t> offsets;
+			for (int32_t i = res.refIndex; i <= res.lastRefIndex; i++) {
+				const vector<int64_t> refOffsets = splicedIndex->findOffsets(i, 0, refs->at(i)->length);
+				offsets.insert(offsets.end(), refOffsets.begin(), refOffsets.end());
+			}
+			reader.setOffsets(offsets);
+		}
+		else {
+			reader.setOffsets(splicedIndex->findOffsets(res.refIndex, res.start, res.end));
+		}
+		if (res.start == 0 && targets.empty()) {
+			for (int32_t i = res.refIndex; i <= res.lastRefIndex; i++) {
+				const AlignmentStats& stats = splicedIndex->getUnsplicedStats(i);
+				unsplicedStats.count += stats.count;
+				unsplicedStats.sumQueryLengths += stats.sumQueryLengths;
+				unsplicedStats.minQueryLength = min(unsplicedStats.minQueryLength, stats.minQueryLength);
+				unsplicedStats.maxQueryLength = max(unsplicedStats.maxQueryLength, stats.maxQueryLength);
+			}
+		}
+	}
+	else if (res.lastRefIndex > res.refIndex) {
+		reader.setTargets(res.refIndex, res.lastRefIndex);
+	}
+	else {
+		reader.setRegion(res.refIndex, res.start, res.end);
+	}
+	findRegionJuncs(gmap, regionId, threadId, unsplicedStats, [&reader]() -> const BamAlignment* {
+		return reader.next() ? &reader.current() : nullptr;
+	});
+}
+
+void portcullis::JunctionBuilder::findJuncs(GenomeMapper& gmap, const int32_t regionId, const uint16_t threadId) {
+	// The unspliced alignments are added in once all the regions are done
+	vector<bam1_t*> alignments = regionAlignments->take(regionId);
+	// Alignments read from an unsorted input are sorted now, in the same order as prep
+	// would sort them
+	if (!unsortedFile.empty()) {
+		std::stable_sort(alignments.begin(), alignments.end(), [](const bam1_t* a, const bam1_t* b) {
+			return BamSorter::sortKey(a) < BamSorter::sortKey(b);
+		});
+	}
+	size_t nextAlignment = 0;
+	unique_ptr<BamAlignment> current;
+	findRegionJuncs(gmap, regionId, threadId, AlignmentStats(), [&]() -> const BamAlignment* {
+		if (nextAlignment >= alignments.size()) {
+			return nullptr;
+		}
+		bam1_t* b = alignments[nextAlignment++];
+		if (current) {
+			current->setRaw(b);
+		}
+		else {
+			current.reset(new BamAlignment(b, false, Strandedness::UNKNOWN, Orientation::UNKNOWN));
+		}
+		return current.get();
+	});
+	// Junctions keep their own copies of the alignments they need
+	for (auto & b : alignments) {
+		bam_destroy1(b);
+	}
 }
 
 int portcullis::JunctionBuilder::main(int argc, char *argv[]) {
@@ -369,6 +1139,11 @@ int portcullis::JunctionBuilder::main(int argc, char *argv[]) {
 	bool exongff;
 	bool introngff;
 	string source;
+	string regions;
+	string unsorted;
+	string genome;
+	string memory;
+	uint32_t maxJuncAlignments;
 	bool verbose;
 	bool help;
 	struct winsize w;
@@ -377,7 +1152,7 @@ int portcullis::JunctionBuilder::main(int argc, char *argv[]) {
 	po::options_description system_options("System options", w.ws_col, (unsigned) ((double) w.ws_col / 1.5));
 	system_options.add_options()
 	("threads,t", po::value<uint16_t>(&threads)->default_value(1),
-	 "The number of threads to use.  Note that increasing the number of threads will also increase memory requirements.")
+	 "The number of threads to use.  The BAM and genome indexes are loaded once and shared between the threads, but each thread holds the junctions it is working on.")
 	("separate", po::bool_switch(&separate)->default_value(false),
 	 "Separate spliced from unspliced reads.  Creates two new BAM files.")
 	("orientation", po::value<string>(&orientation)->default_value(orientationToString(Orientation::UNKNOWN)),
@@ -386,6 +1161,16 @@ int portcullis::JunctionBuilder::main(int argc, char *argv[]) {
 	 "Whether BAM alignments were generated using a type of strand specific RNAseq library: \"unstranded\" (Standard Illumina); \"firststrand\" (dUTP, NSR, NNSR); \"secondstrand\" (Ligation, Standard SOLiD, flux sim reads); \"UNKNOWN\" (default, portcullis will workaround any calculations requiring strandedness information)")
 	("use_csi,c", po::bool_switch(&useCsi)->default_value(false),
 	 "Whether to use CSI indexing rather than BAI indexing.  CSI has the advantage that it supports very long target sequences (probably not an issue unless you are working on huge genomes).  BAI has the advantage that it is more widely supported (useful for viewing in genome browsers).")
+	("regions", po::value<string>(&regions),
+	 "BED file of the regions to analyse, such as the genes in a panel.  Only the alignments around these regions are read, and only the junctions overlapping them are output, with the same metrics a whole genome run would give them.  Works best with the spliced alignment index made by prep.  Separated BAMs (--separate, or --extra) only hold the alignments in the regions read around the targets.")
+	("unsorted", po::value<string>(&unsorted),
+	 "Find junctions straight from a BAM or SAM file in any order, or from standard input if this is \"-\", without running prep first.  The prepared data directory isn't needed, but the genome is.  Can't be used with --separate or --regions.")
+	("genome,g", po::value<string>(&genome),
+	 "The genome the unsorted alignments are against.  Defaults to the genome in the prepared data directory.")
+	("memory,m", po::value<string>(&memory)->default_value(DEFAULT_PREP_SORT_MEMORY),
+	 "Approximate amount of memory to use for holding the spliced alignments from an unsorted input, e.g. 512M or 4G.  Alignments are spilled to temporary files next to the output when this is used up.")
+	("max_junc_alignments", po::value<uint32_t>(&maxJuncAlignments)->default_value(DEFAULT_JUNC_MAX_ALIGNMENTS),
+	 "The most alignments to keep for each junction, to bound the memory and time spent on very deep junctions.  Beyond this a random sample of the alignments is used to estimate the mismatch, anchor depth and multiple mapping metrics, while the alignment counts, strand, entropy and anchor lengths stay exact.  0 (default) keeps every alignment.")
 	("verbose,v", po::bool_switch(&verbose)->default_value(false),
 	 "Print extra information")
 	("help", po::bool_switch(&help)->default_value(false), "Produce help message")
@@ -443,6 +1228,11 @@ int portcullis::JunctionBuilder::main(int argc, char *argv[]) {
 	jb.setExtra(extra);
 	jb.setSeparate(separate);
 	jb.setSource(source);
+	jb.setRegionsFile(regions);
+	jb.setUnsortedFile(unsorted);
+	jb.setGenomeFile(genome);
+	jb.setMemory(BamSorter::parseMemorySize(memory));
+	jb.setMaxJunctionAlignments(maxJuncAlignments);
 	jb.setStrandSpecific(strandednessFromString(strandSpecific));
 	jb.setOrientation(orientationFromString(orientation));
 	jb.setUseCsi(useCsi);
@@ -456,12 +1246,17 @@ int portcullis::JunctionBuilder::main(int argc, char *argv[]) {
 
 // ********* Thread Pool ************
 
-portcullis::JBThreadPool::JBThreadPool(JunctionBuilder* jb, const uint16_t threads) : terminate(false), stopped(false) {
+portcullis::JBThreadPool::JBThreadPool(JunctionBuilder* jb, const uint16_t threads) :
+	JBThreadPool(jb, threads, JBTask::FIND_JUNCTIONS) {
+}
+
+portcullis::JBThreadPool::JBThreadPool(JunctionBuilder* jb, const uint16_t threads, const JBTask _task) : terminate(false), stopped(false) {
 	junctionBuilder = jb;
+	task = _task;
 	// Create number of required threads and add them to the thread pool vector.
 	for (int i = 0; i < threads; i++) {
 		// Add the thread onto the thread pool (providing an index so we can get the the correct BAM reader again)
-		threadPool.emplace_back(thread(&portcullis::JBThreadPool::invoke, this));
+		threadPool.emplace_back(thread(&portcullis::JBThreadPool::invoke, this, i));
 	}
 }
 
@@ -477,15 +1272,39 @@ void portcullis::JBThreadPool::enqueue(const int32_t index) {
 	condition.notify_one();
 }
 
-void portcullis::JBThreadPool::invoke() {
+void portcullis::JBThreadPool::waitForSpace(const size_t maxTasks) {
+	unique_lock<mutex> lock(tasksMutex);
+	taskTaken.wait(lock, [this, maxTasks] {
+		return tasks.size() <= maxTasks;
+	});
+}
+
+void portcullis::JBThreadPool::invoke(const uint16_t threadId) {
+	const bool streamed = task == JBTask::FIND_STREAMED_JUNCTIONS;
+	const bool findJunctions = task == JBTask::FIND_JUNCTIONS || streamed;
 	// Create the genome mapper
-	GenomeMapper gmap(junctionBuilder->getPreparedFiles().getGenomeFilePath());
-	// Load the fasta index
-	gmap.loadFastaIndex();
-	// Create a BAM reader for this thread
-	BamReader reader(junctionBuilder->getPreparedFiles().getSortedBamFilePath());
-	// Open the BAM file... this will load the index, which might take some time on large BAMs
-	reader.open();
+	GenomeMapper gmap(junctionBuilder->getGenomeFile());
+	// Load the fasta index, which is only needed when finding junctions.  The packed
+	// genome is used instead if there is one, which all threads share.
+	if (findJunctions) {
+		if (junctionBuilder->getPackedGenome() != nullptr) {
+			gmap.setPackedGenome(junctionBuilder->getPackedGenome());
+		}
+		else {
+			gmap.loadFastaIndex();
+		}
+	}
+	// Create a BAM reader for this thread.  Extra metrics only need the unspliced alignments.
+	BamReader reader(findJunctions ?
+					 junctionBuilder->getPreparedFiles().getSortedBamFilePaths() :
+					 vector<path>{ junctionBuilder->getUnsplicedBamFile() });
+	// Open the BAM file, sharing the index the junction builder loaded rather than loading
+	// another copy for each thread.  Streamed alignments are handed over while the BAM is
+	// still being written, so there's nothing to open.
+	if (!streamed) {
+		reader.setIndexes(junctionBuilder->getBamIndexes());
+		reader.open();
+	}
 	int32_t id;
 	while (true) {
 		// Scope based locking.
@@ -504,12 +1323,23 @@ void portcullis::JBThreadPool::invoke() {
 			}
 			// Get next task in the queue.
 			id = tasks.front();
-			cout << "   - " << junctionBuilder->getRefName(id) << endl;
+			if (findJunctions && !streamed) {
+				cout << "   - " << junctionBuilder->getRegionName(id) << endl;
+			}
 			// Remove it from the queue.
 			tasks.pop();
 		}
+		taskTaken.notify_all();
 		// Execute the task.
-		junctionBuilder->findJuncs(reader, gmap, id);
+		if (streamed) {
+			junctionBuilder->findJuncs(gmap, id, threadId);
+		}
+		else if (findJunctions) {
+			junctionBuilder->findJuncs(reader, gmap, id, threadId);
+		}
+		else {
+			junctionBuilder->calcExtraMetrics(reader, id);
+		}
 	}
 }
 
@@ -22,6 +22,7 @@
 #include <vector>
 #include <memory>
 #include <queue>
+#include <set>
 #include <thread>
 #include <mutex>
 #include <condition_variable>
@@ -33,8 +34,10 @@ using std::endl;
 using std::mutex;
 using std::ofstream;
 using std::queue;
+using std::set;
 using std::thread;
 using std::condition_variable;
+using std::unique_ptr;
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/path.hpp>
@@ -48,14 +51,34 @@ using namespace boost::filesystem;
 using boost::filesystem::path;
 namespace po = boost::program_options;
 
+#include <portcullis/bam/bam_reader.hpp>
+#include <portcullis/bam/bam_sorter.hpp>
+#include <portcullis/bam/bam_writer.hpp>
+#include <portcullis/bam/packed_genome.hpp>
+#include <portcullis/bam/spliced_index.hpp>
+using portcullis::bam::BamChunk;
+using portcullis::bam::BamChunkWriter;
+using portcullis::bam::BamIndexPtr;
+using portcullis::bam::PackedGenome;
+using portcullis::bam::SortedAlignmentConsumer;
+using portcullis::bam::SplicedIndex;
+using portcullis::bam::AlignmentStats;
+
 #include <portcullis/intron.hpp>
 #include <portcullis/junction.hpp>
 #include <portcullis/junction_system.hpp>
+#include <portcullis/target_regions.hpp>
 using portcullis::Intron;
 using portcullis::Junction;
 using portcullis::JunctionSystem;
+using portcullis::TargetRegion;
+using portcullis::TargetRegions;
+using portcullis::TargetWindow;
+
+#include "region_alignments.hpp"
 
 #include "prepare.hpp"
+using portcullis::Manifest;
 using portcullis::PreparedFiles;
 
 
@@ -65,11 +88,54 @@ namespace portcullis {
 const string DEFAULT_JUNC_OUTPUT = "portcullis_junc/portcullis";
 const string DEFAULT_JUNC_SOURCE = "portcullis";
 const uint16_t DEFAULT_JUNC_THREADS = 1;
+const int32_t DEFAULT_JUNC_MIN_REGION_SIZE = 100000;
+const uint16_t DEFAULT_JUNC_REGIONS_PER_THREAD = 4;
+const int32_t DEFAULT_JUNC_TARGET_CONTEXT = 1000;
+const uint32_t DEFAULT_JUNC_MAX_ALIGNMENTS = 0;
 
 typedef boost::error_info<struct JunctionBuilderError, string> JunctionBuilderErrorInfo;
 struct JunctionBuilderException: virtual boost::exception, virtual std::exception { };
 
-struct RegionResult {
+/**
+ * Locations of the alignments written by a single task when separating the BAM
+ */
+struct SeparatedChunks {
+	uint16_t writerId = 0;
+	BamChunk spliced;
+	BamChunk unspliced;
+	BamChunk unmapped;
+};
+
+/**
+ * A thread's outputs for the spliced, unspliced and unmapped alignments when
+ * separating the BAM.  Each task ends its chunks when it completes, so the
+ * outputs can be stitched together in order afterwards.
+ */
+struct SeparatedWriters {
+	BamChunkWriter spliced;
+	BamChunkWriter unspliced;
+	BamChunkWriter unmapped;
+	uint64_t splicedCount = 0;
+	uint64_t unsplicedCount = 0;
+	uint64_t unmappedCount = 0;
+
+	SeparatedWriters(const path& splicedFile, const path& unsplicedFile, const path& unmappedFile) :
+		spliced(splicedFile), unspliced(unsplicedFile), unmapped(unmappedFile) {
+	}
+
+	SeparatedChunks endChunks(const uint16_t writerId);
+};
+
+
+/**
+ * A unit of work for the thread pool, which covers a window of a target sequence, or
+ * a batch of whole target sequences, and holds the results for it.  Junctions are
+ * owned by the region containing the start of their intron, and alignments are counted
+ * by the region containing their start position, so nothing is counted twice when a
+ * target sequence is split.
+ */
+struct RegionResult : public RegionSpan {
+	bool split = false;
 	uint64_t splicedCount = 0;
 	uint64_t unsplicedCount = 0;
 	uint64_t sumQueryLengths = 0;
@@ -77,9 +143,34 @@ struct RegionResult {
 	int32_t maxQueryLength = 0;
 	string name;
 	JunctionSystem js;
+	SeparatedChunks chunks;
+};
+
+/**
+ * The kind of work carried out by the thread pool.  Tasks either find junctions in a
+ * region of a target sequence, or calculate the extra metrics for all the junctions
+ * on a target sequence.  Junctions are found either by reading the region from the
+ * prepared BAM, or from the spliced alignments handed over while prep sorts the BAM.
+ */
+enum class JBTask {
+	FIND_JUNCTIONS,
+	FIND_STREAMED_JUNCTIONS,
+	EXTRA_METRICS
 };
 
+class JBThreadPool;
+
+/**
+ * Finds junctions from a prepared BAM.  Its sort consumer can also be attached to
+ * the BamSorter in prep, in which case the junctions are found from the sorted
+ * alignments as the sorted BAM is being written (see SortedAlignmentStream).
+ * Separating BAMs still needs the sorted BAM, so nothing is streamed in that case.  Alignments can also be read in any order
+ * straight from a BAM or SAM file, in which case the spliced alignments are partitioned
+ * by region and each region is sorted by the thread pool before its junctions are found.
+ */
 class JunctionBuilder {
+	friend class JBThreadPool;
+	friend class SortedAlignmentStream;
 private:
 
 	// Can set these from the outside via the constructor
@@ -95,8 +186,16 @@ private:
 	bool outputExonGFF;
 	bool outputIntronGFF;
 	string source;
+	path regionsFile;
+	path unsortedFile;
+	path genomeFile;
+	uint64_t memory;
+	uint32_t maxJunctionAlignments;
 	bool verbose;
 
+	// Regions to restrict the analysis to, if any
+	TargetRegions targets;
+
 	// The set of distinct junctions found in the BAM file
 	JunctionSystem junctionSystem;
 	SplicedAlignmentMap splicedAlignmentMap;
@@ -110,6 +209,31 @@ private:
 	// Results from threads
 	vector<RegionResult> results;
 
+	// Counts of spliced alignments by name, for each thread
+	vector<SplicedAlignmentMap> threadAlignmentMaps;
+
+	// Outputs for separating the BAM, one for each thread plus one for unplaced reads
+	vector<shared_ptr<SeparatedWriters>> separatedWriters;
+	SeparatedChunks unplacedChunks;
+
+	// Junctions grouped by target sequence, for calculating the extra metrics
+	vector<std::pair<int32_t, JunctionList>> refJunctions;
+
+	// Locations of the spliced alignments from prep, if available and not separating BAMs
+	shared_ptr<SplicedIndex> splicedIndex;
+
+	// Packed genome from prep, if available, shared by the genome mappers on every thread
+	shared_ptr<PackedGenome> packedGenome;
+
+	// Indexes of the BAMs the thread pool is reading, loaded once and shared by every thread
+	vector<BamIndexPtr> bamIndexes;
+
+	// Junction finding from alignments handed over region by region, either streamed
+	// from the sort in prep or partitioned from an unsorted input, rather than read
+	// from the prepared BAM
+	bool streamed;
+	unique_ptr<RegionAlignments> regionAlignments;
+	unique_ptr<SortedAlignmentStream> sortStream;
 
 
 protected:
@@ -130,10 +254,66 @@ protected:
 		return path(bamFile.string() + ".bai");
 	}
 
-	void separateBams();
+	path getManifestFile() {
+		return path(outputDir.string() + "/" + outputPrefix + MANIFEST_EXTENSION);
+	}
+
+	path getSpillPrefix() {
+		return path(outputDir.string() + "/" + outputPrefix + ".unsorted");
+	}
+
+	/**
+	 * Lists the output files, which depend on the settings
+	 */
+	vector<path> getOutputFiles();
+
+	/**
+	 * Records the prepared data and settings the outputs are made from
+	 */
+	Manifest createManifest();
+
+	vector<uint64_t> estimateAlignments() const;
+
+	void createRegions();
+
+	void createTargetedRegions();
+
+	/**
+	 * Collects the introns from the spliced alignments overlapping a region of a target
+	 * sequence, and the longest stretch of the target covered by any of those alignments
+	 */
+	void findIntrons(BamReader& reader, const int32_t refIndex, const int32_t start, const int32_t end,
+					 set<std::pair<int32_t, int32_t>>& introns, int32_t& maxSpan);
+
+	void loadSplicedIndex();
+
+	void loadPackedGenome();
+
+	void openSeparatedBams();
+
+	void separateAlignment(const BamAlignment& al, SeparatedWriters& writers);
+
+	void separateUnplacedAlignments();
+
+	void mergeSeparatedBams();
+
+	vector<RegionSpan> getRegionSpans() const;
+
+	/**
+	 * Sets up the regions for the alignments streamed from the sort in prep
+	 * @return False if the sorted BAM is needed, so nothing can be streamed
+	 */
+	bool startStreaming(const bam_hdr_t* header);
+
+	void processUnsorted();
 
 	void findJunctions();
 
+	void saveJunctions();
+
+	template<typename NextAlignment>
+	void findRegionJuncs(GenomeMapper& gmap, const int32_t regionId, const uint16_t threadId, const AlignmentStats& unsplicedStats, NextAlignment next);
+
 	void calcExtraMetrics();
 
 
@@ -146,10 +326,27 @@ public:
 
 	string getRefName(const int32_t seqId) { return refs->at(seqId)->name; }
 
-	void findJuncs(BamReader& reader, GenomeMapper& gmap, const int32_t seq);
+	string getRegionName(const int32_t regionId) const;
+
+	void findJuncs(BamReader& reader, GenomeMapper& gmap, const int32_t regionId, const uint16_t threadId);
+
+	/**
+	 * Finds junctions in a region from the spliced alignments streamed from the sort
+	 */
+	void findJuncs(GenomeMapper& gmap, const int32_t regionId, const uint16_t threadId);
+
+	void calcExtraMetrics(BamReader& reader, const int32_t groupId);
 
 	PreparedFiles& getPreparedFiles() { return prepData; }
 
+	shared_ptr<PackedGenome> getPackedGenome() const {
+		return packedGenome;
+	}
+
+	const vector<BamIndexPtr>& getBamIndexes() const {
+		return bamIndexes;
+	}
+
 	bool isExtra() const {
 		return extra;
 	}
@@ -190,6 +387,65 @@ public:
 		this->source = source;
 	}
 
+	path getRegionsFile() const {
+		return regionsFile;
+	}
+
+	/**
+	 * Restricts the analysis to the regions in a BED file.  The junctions overlapping
+	 * the regions get the same metrics as they would from the whole genome.
+	 */
+	void setRegionsFile(path regionsFile) {
+		this->regionsFile = regionsFile;
+	}
+
+	path getUnsortedFile() const {
+		return unsortedFile;
+	}
+
+	/**
+	 * Finds junctions straight from a BAM or SAM file in any order, or from standard
+	 * input if this is "-", rather than from prepared data.  Needs the genome to be set.
+	 */
+	void setUnsortedFile(path unsortedFile) {
+		this->unsortedFile = unsortedFile;
+	}
+
+	/**
+	 * @return The genome, which is the one from the prepared data unless set
+	 */
+	path getGenomeFile() const {
+		return genomeFile.empty() ? prepData.getGenomeFilePath() : genomeFile;
+	}
+
+	void setGenomeFile(path genomeFile) {
+		this->genomeFile = genomeFile;
+	}
+
+	uint64_t getMemory() const {
+		return memory;
+	}
+
+	/**
+	 * @param memory Approximate number of bytes of spliced alignments from an unsorted
+	 * input to hold in memory before spilling them to temporary files
+	 */
+	void setMemory(uint64_t memory) {
+		this->memory = memory;
+	}
+
+	uint32_t getMaxJunctionAlignments() const {
+		return maxJunctionAlignments;
+	}
+
+	/**
+	 * @param maxJunctionAlignments The most alignments each junction keeps for the metrics
+	 * that need the reads themselves, or 0 to keep them all
+	 */
+	void setMaxJunctionAlignments(uint32_t maxJunctionAlignments) {
+		this->maxJunctionAlignments = maxJunctionAlignments;
+	}
+
 	Strandedness getStrandSpecific() const {
 		return strandSpecific;
 	}
@@ -234,6 +490,21 @@ public:
 
 
 
+	/**
+	 * Whether junctions were found from the alignments streamed from the sort in prep
+	 */
+	bool isStreamed() const {
+		return streamed;
+	}
+
+	/**
+	 * Receives the sorted alignments from the sorter in prep, so the junctions can be
+	 * found while the sorted BAM is being written
+	 */
+	SortedAlignmentConsumer* getSortConsumer() {
+		return sortStream.get();
+	}
+
 	/**
 	 * Populates the set of distinct junctions.
 	 *
@@ -248,11 +519,13 @@ public:
 	static string description() {
 		return string("Analyses all potential junctions found in the input BAM file.\n") +
 			   "Run \"portcullis prep ...\" to generate data suitable for junction finding\n" +
-			   "before running \"portcullis junc ...\"";
+			   "before running \"portcullis junc ...\", or use --unsorted to find junctions\n" +
+			   "straight from an alignment file in any order";
 	}
 
 	static string usage() {
-		return string("portcullis junc [options] <prep_data_dir>");
+		return string("portcullis junc [options] <prep_data_dir>\n") +
+			   "       portcullis junc [options] --unsorted <bam|sam|-> --genome <fasta>";
 	}
 
 	static int main(int argc, char *argv[]);
@@ -264,12 +537,18 @@ public:
 	// Constructor.
 	JBThreadPool(JunctionBuilder* jb, const uint16_t threads);
 
+	// Constructor for a pool running a specific kind of task.
+	JBThreadPool(JunctionBuilder* jb, const uint16_t threads, const JBTask task);
+
 	// Destructor.
 	~JBThreadPool();
 
 	// Adds task to a task queue.
 	void enqueue(const int32_t index);
 
+	// Waits until no more than the given number of tasks are waiting in the queue.
+	void waitForSpace(const size_t maxTasks);
+
 	// Shut down the pool.
 	void shutDown();
 
@@ -278,6 +557,9 @@ private:
 	// JunctionBuider
 	JunctionBuilder* junctionBuilder;
 
+	// The kind of task run by this pool
+	JBTask task;
+
 	// Thread pool storage.
 	vector<thread> threadPool;
 
@@ -290,6 +572,9 @@ private:
 	// Condition variable.
 	condition_variable condition;
 
+	// Signalled when a task is taken off the queue.
+	condition_variable taskTaken;
+
 	// Indicates that pool needs to be shut down.
 	bool terminate;
 
@@ -297,7 +582,7 @@ private:
 	bool stopped;
 
 	// Function that will be invoked by our threads.
-	void invoke();
+	void invoke(const uint16_t threadId);
 };
 
 }
@@ -75,6 +75,7 @@ portcullis::JunctionFilter::JunctionFilter(const path& _prepDir, const path& _ju
     output = _output;
     filterFile = "";
     referenceFile = "";
+    regionsFile = "";
     saveBad = false;
     threads = 1;
     maxLength = 0;
@@ -120,6 +121,10 @@ void portcullis::JunctionFilter::filter() {
         BOOST_THROW_EXCEPTION(JuncFilterException() << JuncFilterErrorInfo(string(
                 "Could not find reference BED file at: ") + referenceFile.string()));
     }
+    TargetRegions targets;
+    if (!regionsFile.empty()) {
+        targets.load(regionsFile);
+    }
     if (!exists(outputDir)) {
         if (!bfs::create_directories(outputDir)) {
             BOOST_THROW_EXCEPTION(JuncFilterException() << JuncFilterErrorInfo(string(
@@ -473,6 +478,15 @@ void portcullis::JunctionFilter::filter() {
             filteredJuncs.getJunctions(),
             discardedJuncs.getJunctions(),
             string("Overall results"));
+    // Everything above was decided using all the junctions, so restricting the output
+    // to the target regions doesn't change the result for any junction
+    if (!targets.empty()) {
+        filteredJuncs.restrictTo(targets);
+        discardedJuncs.restrictTo(targets);
+        refKeptJuncs.restrictTo(targets);
+        cout << endl << "Restricted output to the " << filteredJuncs.size() << " passing and " << discardedJuncs.size()
+                << " failing junctions overlapping the regions in " << regionsFile.string() << endl;
+    }
     cout << endl << "Saving junctions passing filter to disk:" << endl;
     filteredJuncs.saveAll(outputDir.string() + "/" + outputPrefix + ".pass", source + "_pass", true, this->outputExonGFF, this->outputIntronGFF);
     if (saveBad) {
@@ -647,6 +661,7 @@ int portcullis::JunctionFilter::main(int argc, char *argv[]) {
     path genuineFile;
     path filterFile;
     path referenceFile;
+    path regionsFile;
     path output;
     uint16_t threads;
     bool no_ml;
@@ -688,6 +703,8 @@ int portcullis::JunctionFilter::main(int argc, char *argv[]) {
             "Output intron-based junctions in GFF format.")
             ("source", po::value<string>(&source)->default_value(DEFAULT_FILTER_SOURCE),
             "The value to enter into the \"source\" field in GFF files.")
+            ("regions", po::value<path>(&regionsFile),
+            "BED file of regions to restrict the output to.  Only junctions overlapping these regions are saved, but all the junctions are used for filtering, so each junction gets the same result as without this option.")
             ;
     po::options_description filtering_options("Filtering options", w.ws_col, w.ws_col / 1.5);
     filtering_options.add_options()
@@ -777,6 +794,7 @@ int portcullis::JunctionFilter::main(int argc, char *argv[]) {
     filter.setSaveFeatures(save_features);
     filter.setSaveLayers(save_layers);
     filter.setReferenceFile(referenceFile);
+    filter.setRegionsFile(regionsFile);
     filter.setThreshold(threshold);
     filter.setSmote(!no_smote);
     filter.setENN(enn);
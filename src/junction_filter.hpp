@@ -92,6 +92,7 @@ namespace portcullis {
         path filterFile;
         path genuineFile;
         path referenceFile;
+        path regionsFile;
         path output;
         bool train;
         uint16_t threads;
@@ -185,6 +186,19 @@ namespace portcullis {
             this->referenceFile = referenceFile;
         }
 
+        path getRegionsFile() const {
+            return regionsFile;
+        }
+
+        /**
+         * Only output the junctions overlapping the regions in a BED file.  All the
+         * junctions are still used to train the model and filter, so the result for
+         * each junction is the same as without the regions.
+         */
+        void setRegionsFile(path regionsFile) {
+            this->regionsFile = regionsFile;
+        }
+
         bool isTrain() const {
             return train;
         }
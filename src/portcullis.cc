@@ -175,6 +175,7 @@ int mainFull(int argc, char *argv[]) {
     bool extra;
     bool copy;
     bool keep_temp;
+    string sortMemory;
     bool force;
     bool useCsi;
     bool saveBad;
@@ -222,6 +223,8 @@ int mainFull(int argc, char *argv[]) {
             "Whether to copy files from input data to prepared data where possible, otherwise will use symlinks.  Will require more time and disk space to prepare input but is potentially more robust.")
             ("keep_temp", po::bool_switch(&keep_temp)->default_value(false),
             "Whether keep any temporary files created during the prepare stage of portcullis.  This might include BAM files and indexes.")
+            ("sort_memory", po::value<string>(&sortMemory)->default_value(portcullis::DEFAULT_PREP_SORT_MEMORY),
+            "Approximate amount of memory to use for sorting the BAM files (if required), e.g. 512M or 4G.")
             ("use_csi", po::bool_switch(&useCsi)->default_value(false),
             "Whether to use CSI indexing rather than BAI indexing.  CSI has the advantage that it supports very long target sequences (probably not an issue unless you are working on huge genomes).  BAI has the advantage that it is more widely supported (useful for viewing in genome browsers).")
             ;
@@ -312,17 +315,37 @@ int mainFull(int argc, char *argv[]) {
         }
     }
 
+    path prepDir = path(outputDir.string() + "/1-prep");
+    path juncDir = outputDir.string() + "/2-junc";
+    path juncOut = juncDir.string() + "/portcullis_all";
+    // Set up the junction builder first, so that it can find junctions from the
+    // sorted alignments while prep is writing the sorted BAM
+    JunctionBuilder jb(prepDir, juncOut);
+    jb.setThreads(threads);
+    jb.setExtra(false); // Run in fast mode
+    jb.setSeparate(false); // Run in fast mode
+    jb.setStrandSpecific(strandednessFromString(strandSpecific));
+    jb.setOrientation(orientationFromString(orientation));
+    jb.setExtra(extra);
+    jb.setSeparate(separate);
+    jb.setSource(source);
+    jb.setUseCsi(useCsi);
+    jb.setOutputExonGFF(exongff);
+    jb.setOutputIntronGFF(introngff);
+    jb.setVerbose(verbose);
+
     // ************ Prepare input data (BAMs + genome) ***********
     cout << "Preparing input data (BAMs + genome)" << endl
             << "----------------------------------" << endl << endl;
-    path prepDir = path(outputDir.string() + "/1-prep");
     // Create the prepare class
     Prepare prep(prepDir);
     prep.setForce(force);
     prep.setUseLinks(!copy);
     prep.setUseCsi(useCsi);
     prep.setThreads(threads);
+    prep.setSortMemory(sortMemory);
     prep.setVerbose(verbose);
+    prep.setSortConsumer(jb.getSortConsumer());
     // Prep the input to produce a usable indexed and sorted bam plus, indexed
     // genome and queryable coverage information
     prep.prepare(transformedBams, genomeFile);
@@ -330,22 +353,8 @@ int mainFull(int argc, char *argv[]) {
     // ************ Identify all junctions and calculate metrics ***********
     cout << "Identifying junctions and calculating metrics" << endl
             << "---------------------------------------------" << endl << endl;
-    path juncDir = outputDir.string() + "/2-junc";
-    path juncOut = juncDir.string() + "/portcullis_all";
-    // Identify junctions and calculate metrics
-    JunctionBuilder jb(prepDir, juncOut);
-    jb.setThreads(threads);
-    jb.setExtra(false); // Run in fast mode
-    jb.setSeparate(false); // Run in fast mode
-    jb.setStrandSpecific(strandednessFromString(strandSpecific));
-    jb.setOrientation(orientationFromString(orientation));
-    jb.setExtra(extra);
-    jb.setSeparate(separate);
-    jb.setSource(source);
-    jb.setUseCsi(useCsi);
-    jb.setOutputExonGFF(exongff);
-    jb.setOutputIntronGFF(introngff);
-    jb.setVerbose(verbose);
+    // Identify junctions and calculate metrics.  If prep had to sort the BAM then the
+    // junctions have been found already, and this just collects the results.
     jb.process();
 
     // ************ Use default filtering strategy *************
@@ -374,12 +383,12 @@ int mainFull(int argc, char *argv[]) {
         cout << "Filtering BAMs" << endl
                 << "--------------" << endl << endl;
         path filtJuncTab = path(filtOut.string() + ".pass.junctions.tab");
-        path bamFile = path(prepDir.string() + "/portcullis.sorted.alignments.bam");
         path filteredBam = path(outputDir.string() + "/portcullis.filtered.bam");
-        BamFilter bamFilter(filtJuncTab.string(), bamFile.string(), filteredBam.string());
+        BamFilter bamFilter(filtJuncTab, prep.getOutput()->getSortedBamFilePaths(), filteredBam);
         //bamFilter.setStrandSpecific(strandednessFromString(strandSpecific));
         //bamFilter.setOrientation(orientationFromString(orientation));
         bamFilter.setUseCsi(useCsi);
+        bamFilter.setThreads(threads);
         bamFilter.setVerbose(verbose);
         bamFilter.filter();
     }
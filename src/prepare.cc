@@ -24,6 +24,7 @@
 #include <iterator>
 #include <vector>
 #include <algorithm>
+using std::cerr;
 using std::boolalpha;
 using std::ifstream;
 using std::string;
@@ -47,21 +48,40 @@ using bfs::path;
 namespace po = boost::program_options;
 
 #include <portcullis/bam/bam_master.hpp>
+#include <portcullis/bam/bam_reader.hpp>
+#include <portcullis/bam/bam_sorter.hpp>
 #include <portcullis/bam/genome_mapper.hpp>
+#include <portcullis/bam/spliced_index.hpp>
 #include <portcullis/portcullis_fs.hpp>
 using portcullis::PortcullisFS;
 using namespace portcullis::bam;
 
 #include "prepare.hpp"
 
-bool portcullis::PreparedFiles::valid(bool useCsi) const {
+vector<path> portcullis::PreparedFiles::getSortedBamFilePaths() const {
+	vector<path> files;
 	if (!bfs::exists(getSortedBamFilePath()) && !bfs::symbolic_link_exists(getSortedBamFilePath())) {
-		BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
-								  "Could not find sorted BAM files at: ") + getSortedBamFilePath().string()));
+		for (size_t i = 1; bfs::exists(getSortedBamPartFilePath(i)); i++) {
+			files.push_back(getSortedBamPartFilePath(i));
+		}
 	}
-	if (!bfs::exists(getBamIndexFilePath(useCsi)) && !bfs::symbolic_link_exists(getBamIndexFilePath(useCsi))) {
-		BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
-								  "Could not find BAM index at: ") + getBamIndexFilePath(useCsi).string()));
+	if (files.empty()) {
+		files.push_back(getSortedBamFilePath());
+	}
+	return files;
+}
+
+bool portcullis::PreparedFiles::valid(bool useCsi) const {
+	for (auto & sortedBam : getSortedBamFilePaths()) {
+		if (!bfs::exists(sortedBam) && !bfs::symbolic_link_exists(sortedBam)) {
+			BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
+									  "Could not find sorted BAM files at: ") + sortedBam.string()));
+		}
+		const path indexFile(sortedBam.string() + (useCsi ? CSI_EXTENSION : BAI_EXTENSION));
+		if (!bfs::exists(indexFile) && !bfs::symbolic_link_exists(indexFile)) {
+			BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
+									  "Could not find BAM index at: ") + indexFile.string()));
+		}
 	}
 	if (!bfs::exists(getGenomeFilePath()) && !bfs::symbolic_link_exists(getGenomeFilePath())) {
 		BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
@@ -75,14 +95,30 @@ bool portcullis::PreparedFiles::valid(bool useCsi) const {
 }
 
 void portcullis::PreparedFiles::clean() {
+	cleanBams();
+	cleanGenome();
+	bfs::remove(getBcfFilePath());
+	bfs::remove(getBcfIndexFilePath());
+	bfs::remove(getManifestFilePath());
+}
+
+void portcullis::PreparedFiles::cleanBams() {
+	for (size_t i = 1; bfs::exists(getSortedBamPartFilePath(i)) || bfs::symbolic_link_exists(getSortedBamPartFilePath(i)); i++) {
+		bfs::remove(getSortedBamPartFilePath(i));
+		bfs::remove(getSortedBamPartFilePath(i).string() + BAI_EXTENSION);
+		bfs::remove(getSortedBamPartFilePath(i).string() + CSI_EXTENSION);
+	}
 	bfs::remove(getUnsortedBamFilePath());
 	bfs::remove(getSortedBamFilePath());
 	bfs::remove(getBamIndexFilePath(false));
 	bfs::remove(getBamIndexFilePath(true));
+	bfs::remove(getSplicedIndexFilePath());
+}
+
+void portcullis::PreparedFiles::cleanGenome() {
 	bfs::remove(getGenomeFilePath());
 	bfs::remove(getGenomeIndexFilePath());
-	bfs::remove(getBcfFilePath());
-	bfs::remove(getBcfIndexFilePath());
+	bfs::remove(getPackedGenomeFilePath());
 }
 
 
@@ -92,7 +128,10 @@ portcullis::Prepare::Prepare(const path& _outputPrefix) {
 	useLinks = true;
 	useCsi = false;
 	threads = 1;
+	sortMemory = DEFAULT_PREP_SORT_MEMORY;
 	verbose = false;
+	sortConsumer = nullptr;
+	sortStreamed = false;
 }
 
 bool portcullis::Prepare::copy(const path& from, const path& to, const string& msg, const bool requireInputFileExists) {
@@ -144,119 +183,151 @@ bool portcullis::Prepare::genomeIndex() {
 	return bfs::exists(indexFile);
 }
 
-
-/**
- * Merge together a set of BAM files, use the output prefix to construct a
- * file name for the merged file
- * @param bamFiles The set of bam files to merge
- * @return
- */
-bool portcullis::Prepare::bamMerge(vector<path> bamFiles) {
-	path mergedBam = output->getSortedBamFilePath();
-	bool mergedBamExists = bfs::exists(mergedBam) || bfs::symbolic_link_exists(mergedBam);
-	if (mergedBamExists) {
-		cout << "Pre-merged BAM detected: " << mergedBam << endl;
-	}
-	else {
-		auto_cpu_timer timer(1, " - BAM Merge - Wall time taken: %ws\n\n");
-		cout << "Found " << bamFiles.size() << " BAM files." << endl;
-		vector<path> mergeIn;
-		// Sort the individual inputs if necessary
-		uint16_t inCount = 1;
-		for (auto & f : bamFiles) {
-			path tempSorted = path(output->getPrepDir());
-			tempSorted /= "temp" + lexical_cast<string>(inCount++) + ".bam";
-			// Sort the data (if required, will auto-detect if necessary)
-			if (!bamSort(f, tempSorted)) {
-				BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
-										  "Could not sort: ") + output->getUnsortedBamFilePath().string()));
-			}
-			mergeIn.push_back(tempSorted);
-		}
-		string mergeCmd = BamHelper::createMergeBamCmd(mergeIn, mergedBam, threads);
-		cout << "Merging BAM using command \"" << mergeCmd << "\" ... ";
-		cout.flush();
-		int exitCode = system(mergeCmd.c_str());
-		if (exitCode != 0 || !bfs::exists(mergedBam)) {
-			BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
-									  "Failed to successfully merge: ") + mergedBam.string()));
-		}
-		cout << "done." << endl
-			 << "Merged BAM file created at: " << mergedBam << endl;
-		cout << "Deleteing temporary unmerged files ...";
-		cout.flush();
-		for (auto & f : mergeIn) {
-			bfs::remove(f);
-		}
-		cout << "done." << endl;
+bool portcullis::Prepare::genomePack() {
+	GenomeMapper gmap(output->getGenomeFilePath());
+	if (gmap.loadPackedGenome()) {
+		cout << "Pre-packed genome detected: " << output->getPackedGenomeFilePath() << endl;
+		return true;
 	}
-	// Return true if the merged BAM exists now, which is should do
-	return bfs::exists(mergedBam) || bfs::symbolic_link_exists(mergedBam);
+	auto_cpu_timer timer(1, " - Genome Pack - Wall time taken: %ws\n\n");
+	cout << "Packing genome " << output->getGenomeFilePath() << " ... ";
+	cout.flush();
+	gmap.buildPackedGenome();
+	cout << "done." << endl
+		 << "Packed genome file created at: " << output->getPackedGenomeFilePath() << endl;
+	return gmap.loadPackedGenome();
 }
 
+
 /**
- * Sorts the unsorted bam file if required or forced
- * @param inputBam
+ * Sorts the alignments in the input BAMs into a single output BAM if required or
+ * forced.  Multiple inputs are merged as they are sorted.
+ * @param inputs Paths to input BAMs to sort
+ * @param output Sorted BAM file
  * @return
  */
-bool portcullis::Prepare::bamSort(const path& input, const path& output) {
-	const path unsortedBam = input;
+bool portcullis::Prepare::bamSort(const vector<path>& inputs, const path& output) {
 	const path sortedBam = output;
 	bool sortedBamExists = bfs::exists(sortedBam) || bfs::symbolic_link_exists(sortedBam);
 	if (sortedBamExists) {
 		cout << "Prepped sorted BAM detected: " << sortedBam << endl;
 	}
 	else {
-		if (BamHelper::isCoordSortedBam(unsortedBam.string()) && !force) {
+		if (inputs.size() == 1 && BamHelper::isCoordSortedBam(inputs[0].string()) && !force) {
 			cout << "Provided BAM appears to be sorted already, just creating symlink instead." << endl;
-			bfs::create_symlink(bfs::canonical(unsortedBam), sortedBam);
-			cout << "Created symlink from " << bfs::canonical(unsortedBam) << " to " << sortedBam << endl;
+			bfs::create_symlink(bfs::canonical(inputs[0]), sortedBam);
+			cout << "Created symlink from " << bfs::canonical(inputs[0]) << " to " << sortedBam << endl;
 		}
 		else {
 			auto_cpu_timer timer(1, " - BAM Sort - Wall time taken: %ws\n\n");
-			// Sort the BAM file by coordinate
-            string sortCmd = BamHelper::createSortBamCmd(unsortedBam, sortedBam, false, threads, "2G");
-			cout << "Sorting BAM using command \"" << sortCmd << "\" ... ";
+			// Sort (and merge) the BAM files by coordinate
+			BamSorter sorter(sortedBam);
+			sorter.setThreads(threads);
+			sorter.setMemory(BamSorter::parseMemorySize(sortMemory));
+			sorter.setMergeSortedInputs(!force);
+			// Index while writing the sorted BAM, rather than reading it all back in afterwards
+			sorter.setBuildIndex(true);
+			sorter.setUseCsi(useCsi);
+			sorter.setConsumer(sortConsumer);
+			cout << "Sorting " << inputs.size() << " BAM file" << (inputs.size() > 1 ? "s" : "")
+				 << " using " << threads << " threads and " << sortMemory << " of memory ... ";
 			cout.flush();
-			int exitCode = system(sortCmd.c_str());
-			path badNameMergeFile = path(sortedBam.string() + ".bam");
-			if (bfs::exists(badNameMergeFile) || bfs::symbolic_link_exists(badNameMergeFile)) {
-				boost::filesystem::rename(badNameMergeFile, sortedBam);
-			}
-			if (exitCode != 0 || !bfs::exists(sortedBam) || !BamHelper::isCoordSortedBam(sortedBam)) {
+			sorter.sort(inputs);
+			if (!bfs::exists(sortedBam) || !BamHelper::isCoordSortedBam(sortedBam)) {
 				BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
-										  "Failed to successfully sort: ") + unsortedBam.string()));
+										  "Failed to successfully sort: ") + inputs[0].string()));
 			}
+			sortStreamed = sortConsumer != nullptr;
 			cout << "done." << endl
-				 << "Sorted BAM file created at: " << sortedBam << endl;
+				 << "Sorted BAM file created at: " << sortedBam << endl
+				 << "BAM index created at: " << sortedBam.string() + (useCsi ? CSI_EXTENSION : BAI_EXTENSION) << endl;
 		}
 	}
 	// Return true if the sorted BAM exists now, which is should do
 	return bfs::exists(sortedBam) || bfs::symbolic_link_exists(sortedBam);
 }
 
+/**
+ * Links in several BAMs that are already coordinate sorted, so that later stages can
+ * read them as one without us having to write out a merged copy
+ * @param inputs Paths to the sorted BAMs
+ * @return
+ */
+bool portcullis::Prepare::bamLink(const vector<path>& inputs) {
+	// Make sure the BAMs can be read together before going any further
+	BamReader reader(inputs);
+	reader.open();
+	reader.close();
+	for (size_t i = 0; i < inputs.size(); i++) {
+		const path part = output->getSortedBamPartFilePath(i + 1);
+		if (!copy(inputs[i], part, "sorted BAM", true)) {
+			return false;
+		}
+		// Use the existing index if there is one, otherwise we'll create it later
+		copy(inputs[i].string() + (useCsi ? CSI_EXTENSION : BAI_EXTENSION), part.string() + (useCsi ? CSI_EXTENSION : BAI_EXTENSION), "BAM index", false);
+	}
+	return true;
+}
+
 bool portcullis::Prepare::bamIndex(const bool copied) {
+	bool indexed = true;
+	for (auto & sortedBam : output->getSortedBamFilePaths()) {
+		const path indexedFile(sortedBam.string() + (useCsi ? CSI_EXTENSION : BAI_EXTENSION));
+		bool indexedBamExists = bfs::exists(indexedFile) || bfs::symbolic_link_exists(indexedFile);
+		// An index older than the BAM may not match it, so create a new one
+		if (bfs::exists(indexedFile) && !BamHelper::isNewerIndexPresent(sortedBam, useCsi)) {
+			cout << "BAM index is older than the BAM, so recreating it: " << indexedFile << endl;
+			bfs::remove(indexedFile);
+			indexedBamExists = false;
+		}
+		if (indexedBamExists && !copied) {
+			if (verbose) cout << "Prepped indexed BAM detected: " << indexedFile << endl;
+		}
+		else if (!indexedBamExists) {
+			auto_cpu_timer timer(1, " - BAM Index - Wall time taken: %ws\n\n");
+			// Create BAM index.  Normally the index is created while sorting, so we only get
+			// here if the provided BAM was sorted already.
+			cout << "Indexing BAM " << sortedBam << " ... ";
+			cout.flush();
+			BamHelper::indexBam(sortedBam, useCsi);
+			if (!exists(indexedFile)) {
+				BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
+										  "Failed to successfully index: ") + sortedBam.string()));
+			}
+			cout << "done." << endl
+				 << "BAM index created at: " << indexedFile << endl;
+		}
+		indexed = indexed && (bfs::exists(indexedFile) || bfs::symbolic_link_exists(indexedFile));
+	}
+	return indexed;
+}
+
+bool portcullis::Prepare::bamSplicedIndex() {
+	if (output->getSortedBamFilePaths().size() > 1) {
+		cout << "Spliced alignment index is only used with a single sorted BAM, so not creating one." << endl;
+		return true;
+	}
 	const path sortedBam = output->getSortedBamFilePath();
-	const path indexedFile = output->getBamIndexFilePath(useCsi);
-	bool indexedBamExists = bfs::exists(indexedFile) || bfs::symbolic_link_exists(indexedFile);
-	if (indexedBamExists && !copied) {
-		if (verbose) cout << "Prepped indexed BAM detected: " << indexedFile << endl;
-	}
-	else if (!indexedBamExists) {
-		auto_cpu_timer timer(1, " - BAM Index - Wall time taken: %ws\n\n");
-		// Create BAM index
-		string indexCmd = BamHelper::createIndexBamCmd(sortedBam, useCsi);
-		cout << "Indexing BAM using command \"" << indexCmd << "\" ... ";
-		cout.flush();
-		int exitCode = system(indexCmd.c_str());
-		if (exitCode != 0 || !exists(output->getBamIndexFilePath(useCsi))) {
-			BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
-									  "Failed to successfully index: ") + sortedBam.string()));
+	const path indexFile = output->getSplicedIndexFilePath();
+	if (bfs::exists(indexFile)) {
+		SplicedIndex index;
+		index.load(indexFile);
+		if (index.isIndexOf(sortedBam)) {
+			if (verbose) cout << "Prepped spliced alignment index detected: " << indexFile << endl;
+			return true;
 		}
-		cout << "done." << endl
-			 << "BAM index created at: " << output->getBamIndexFilePath(useCsi) << endl;
+		cout << "Spliced alignment index is out of date, recreating: " << indexFile << endl;
 	}
-	return bfs::exists(indexedFile) || bfs::symbolic_link_exists(indexedFile);
+	auto_cpu_timer timer(1, " - Spliced Alignment Index - Wall time taken: %ws\n\n");
+	cout << "Indexing spliced alignments in " << sortedBam << " ... ";
+	cout.flush();
+	SplicedIndex index;
+	index.build(sortedBam, threads);
+	index.save(indexFile);
+	cout << "done." << endl
+		 << "Found " << index.getNbSplicedAlignments() << " spliced alignments." << endl
+		 << "Spliced alignment index created at: " << indexFile << endl;
+	return bfs::exists(indexFile);
 }
 
 void portcullis::Prepare::prepare(vector<path> bamFiles, const path& originalGenomeFile) {
@@ -266,7 +337,8 @@ void portcullis::Prepare::prepare(vector<path> bamFiles, const path& originalGen
 			 << " - Force prep (cleans output directory): " << boolalpha << force << endl
 			 << " - Use symbolic links instead of copy where possible: " << boolalpha << useLinks << endl
 			 << " - Indexing type: " << (useCsi ? "CSI" : "BAI") << endl
-			 << " - Threads (for sorting BAM): " << threads << endl << endl;
+			 << " - Threads (for sorting BAM): " << threads << endl
+			 << " - Memory (for sorting BAM): " << sortMemory << endl << endl;
 	}
 	if (force) {
 		cout << "Cleaning output dir: " << output->getPrepDir() << " ... ";
@@ -274,6 +346,40 @@ void portcullis::Prepare::prepare(vector<path> bamFiles, const path& originalGen
 		output->clean();
 		cout << "done." << endl << endl;
 	}
+	// Work out which of the prepared files are still valid, from what they were made
+	// from last time.  Without a manifest we just trust whatever is there.
+	const path manifestFile = output->getManifestFilePath();
+	Manifest manifest;
+	manifest.setFile("input.genome", originalGenomeFile);
+	manifest.setFile("input.genome_index", originalGenomeFile.string() + FASTA_INDEX_EXTENSION);
+	manifest.set("input.bams", lexical_cast<string>(bamFiles.size()));
+	for (size_t i = 0; i < bamFiles.size(); i++) {
+		manifest.setFile("input.bam." + lexical_cast<string>(i + 1), bamFiles[i]);
+	}
+	// Settings that change what the outputs are.  Threads and memory don't.
+	manifest.set("setting.use_links", lexical_cast<string>(useLinks));
+	manifest.set("setting.use_csi", lexical_cast<string>(useCsi));
+	if (bfs::exists(manifestFile)) {
+		Manifest previous;
+		previous.load(manifestFile);
+		if (manifest.canReuse(previous, { "input.genome", "setting.use_links" }, "output.genome")) {
+			manifest.setAll(previous, "output.genome");
+		}
+		else {
+			cout << "Prepared genome is out of date or incomplete, preparing it again." << endl;
+			output->cleanGenome();
+		}
+		if (manifest.canReuse(previous, { "input.bam", "setting.use_links", "setting.use_csi" }, "output.bam")) {
+			manifest.setAll(previous, "output.bam");
+		}
+		else {
+			cout << "Prepared BAM files are out of date or incomplete, preparing them again." << endl;
+			output->cleanBams();
+		}
+	}
+	// Outputs are only recorded once they are complete, so if we get interrupted the
+	// next run knows to redo them
+	manifest.save(manifestFile);
 	// Copy / Symlink the genome file to the output dir
 	if (!copy(originalGenomeFile, output->getGenomeFilePath(), "genome", true)) {
 		BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
@@ -286,6 +392,18 @@ void portcullis::Prepare::prepare(vector<path> bamFiles, const path& originalGen
 									  "Could not create genome index")));
 		}
 	}
+	// Pack the genome for fast fetching of bases.  Junction finding can still use the
+	// fasta index without it, so this isn't fatal.
+	try {
+		if (!genomePack()) {
+			cerr << "Warning: Could not load packed genome, junction finding will use the genome index instead" << endl;
+		}
+	}
+	catch (boost::exception& e) {
+		cerr << "Warning: Could not pack genome, junction finding will use the genome index instead" << endl
+			 << boost::diagnostic_information(e);
+		bfs::remove(output->getPackedGenomeFilePath());
+	}
 	bool validIndexingMode = checkIndexMode(output->getGenomeIndexFilePath(), useCsi);
 	if (!validIndexingMode) {
 		BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
@@ -296,12 +414,24 @@ void portcullis::Prepare::prepare(vector<path> bamFiles, const path& originalGen
 		BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
 								  "No BAM files to process")));
 	}
-	path mergedBamFile = doMerge ? output->getUnsortedBamFilePath() : bamFiles[0];
 	bool indexCopied = false;
-	// Merge the bams to output a sorted bam file if required, otherwise just
+	// Sort and merge the bams to output a sorted bam file if required, otherwise just
 	// copy / symlink the file provided
 	if (doMerge) {
-		if (!bamMerge(bamFiles)) {
+		cout << "Found " << bamFiles.size() << " BAM files." << endl;
+		bool allSorted = !force && !bfs::exists(output->getSortedBamFilePath());
+		for (size_t i = 0; i < bamFiles.size() && allSorted; i++) {
+			allSorted = BamHelper::isCoordSortedBam(bamFiles[i]);
+		}
+		if (allSorted) {
+			// No need to merge, later stages can read the sorted BAMs as one
+			cout << "Provided BAMs appear to be sorted already, linking them in to be read together rather than merging them." << endl;
+			if (!bamLink(bamFiles)) {
+				BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
+										  "Could not copy/symlink BAM files to: ") + output->getPrepDir().string()));
+			}
+		}
+		else if (!bamSort(bamFiles, output->getSortedBamFilePath())) {
 			BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
 									  "Could not merge BAM files")));
 		}
@@ -315,7 +445,7 @@ void portcullis::Prepare::prepare(vector<path> bamFiles, const path& originalGen
 		// Copy / Symlink the index file to the output dir if it exists... otherwise we'll create it later
 		indexCopied = copy(bamFiles[0].string() + (useCsi ? CSI_EXTENSION : BAI_EXTENSION), output->getBamIndexFilePath(useCsi), "BAM index", false);
 		// Sort the data (if required, will auto-detect if necessary)
-		if (!bamSort(output->getUnsortedBamFilePath(), output->getSortedBamFilePath())) {
+		if (!bamSort(vector<path>{ output->getUnsortedBamFilePath() }, output->getSortedBamFilePath())) {
 			BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
 									  "Could not sort: ") + output->getUnsortedBamFilePath().string()));
 		}
@@ -329,6 +459,22 @@ void portcullis::Prepare::prepare(vector<path> bamFiles, const path& originalGen
 		BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
 								  "Failed to index: ") + output->getSortedBamFilePath().string()));
 	}
+	// Record where the spliced alignments are (if required).  Still needed if the sorted
+	// alignments have already been handed on for junction finding, as later junc runs
+	// on this prep directory will use it.
+	if (!bamSplicedIndex()) {
+		BOOST_THROW_EXCEPTION(PrepareException() << PrepareErrorInfo(string(
+								  "Failed to index spliced alignments in: ") + output->getSortedBamFilePath().string()));
+	}
+	// Record what the prepared files were made from, so re-runs know what they can skip
+	manifest.setFile("output.genome", output->getGenomeFilePath());
+	manifest.setFile("output.genome_index", output->getGenomeIndexFilePath());
+	manifest.setFile("output.genome_packed", output->getPackedGenomeFilePath());
+	const vector<path> sortedBams = output->getSortedBamFilePaths();
+	for (size_t i = 0; i < sortedBams.size(); i++) {
+		manifest.setFile("output.bam." + lexical_cast<string>(i + 1), sortedBams[i]);
+	}
+	manifest.save(manifestFile);
 }
 
 vector<path> portcullis::Prepare::globFiles(vector<path> input) {
@@ -380,6 +526,7 @@ int portcullis::Prepare::main(int argc, char *argv[]) {
 	bool copy;
 	bool useCsi;
 	uint16_t threads;
+	string sortMemory;
 	bool verbose;
 	bool help;
 	struct winsize w;
@@ -396,7 +543,9 @@ int portcullis::Prepare::main(int argc, char *argv[]) {
 	("use_csi,c", po::bool_switch(&useCsi)->default_value(false),
 	 "Whether to use CSI indexing rather than BAI indexing.  CSI has the advantage that it supports very long target sequences (probably not an issue unless you are working on huge genomes).  BAI has the advantage that it is more widely supported (useful for viewing in genome browsers).")
 	("threads,t", po::value<uint16_t>(&threads)->default_value(DEFAULT_PREP_THREADS),
-	 (string("The number of threads to used to sort the BAM file (if required).  Default: ") + lexical_cast<string>(DEFAULT_PREP_THREADS)).c_str())
+	 (string("The number of threads to used to sort the BAM file (if required), and to decompress it while indexing the spliced alignments.  Default: ") + lexical_cast<string>(DEFAULT_PREP_THREADS)).c_str())
+	("memory,m", po::value<string>(&sortMemory)->default_value(DEFAULT_PREP_SORT_MEMORY),
+	 (string("Approximate amount of memory to use for sorting the BAM files (if required), e.g. 512M or 4G.  Alignments are spilled to temporary files in the output directory when this is used up.  Default: ") + DEFAULT_PREP_SORT_MEMORY).c_str())
 	("verbose,v", po::bool_switch(&verbose)->default_value(false),
 	 "Print extra information")
 	("help", po::bool_switch(&help)->default_value(false), "Produce help message")
@@ -455,6 +604,7 @@ int portcullis::Prepare::main(int argc, char *argv[]) {
 	prep.setUseLinks(!copy);
 	prep.setUseCsi(useCsi);
 	prep.setThreads(threads);
+	prep.setSortMemory(sortMemory);
 	prep.setVerbose(verbose);
 	// Prep the input to produce a usable indexed and sorted bam plus, indexed
 	// genome and queryable coverage information
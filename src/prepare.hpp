@@ -21,10 +21,12 @@
 #include <fstream>
 #include <string>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <vector>
 using std::boolalpha;
 using std::ifstream;
+using std::map;
 using std::string;
 using std::shared_ptr;
 using std::vector;
@@ -44,9 +46,13 @@ using bfs::path;
 namespace po = boost::program_options;
 
 #include <portcullis/bam/bam_master.hpp>
+#include <portcullis/bam/bam_sorter.hpp>
+using portcullis::bam::SortedAlignmentConsumer;
 using portcullis::bam::Strandedness;
 
+#include <portcullis/manifest.hpp>
 #include <portcullis/portcullis_fs.hpp>
+using portcullis::Manifest;
 using portcullis::PortcullisFS;
 
 
@@ -58,18 +64,21 @@ struct PrepareException: virtual boost::exception, virtual std::exception { };
 
 const string DEFAULT_PREP_OUTPUT_DIR = "portcullis_prep";
 const uint16_t DEFAULT_PREP_THREADS = 1;
+const string DEFAULT_PREP_SORT_MEMORY = "2G";
 
 const string PORTCULLIS = "portcullis";
 
 const string FASTA_EXTENSION = ".fa";
 const string FASTA_INDEX_EXTENSION = ".fai";
+const string PACKED_GENOME_EXTENSION = ".packed";
 const string BAM_EXTENSION = ".bam";
 const string BAI_EXTENSION = ".bai";
 const string CSI_EXTENSION = ".csi";
 const string BCF_EXTENSION = ".bcf";
 const string BCF_INDEX_EXTENSION = ".bci";
 const string BAM_DEPTH_EXTENSION = ".bdp";
-
+const string SPLICED_INDEX_EXTENSION = ".spi";
+const string MANIFEST_EXTENSION = ".manifest";
 
 class PreparedFiles {
 
@@ -119,10 +128,28 @@ public:
 		return path(prepDir.string() + "/" + PORTCULLIS + ".sorted.alignments" + BAM_EXTENSION);
 	}
 
+	/**
+	 * Path to one of several sorted BAMs.  These are used when prep is given several
+	 * BAMs that are already sorted, which are then read as one rather than merged.
+	 * @param part Number of the BAM, starting from 1
+	 */
+	path getSortedBamPartFilePath(const size_t part) const {
+		return path(prepDir.string() + "/" + PORTCULLIS + ".sorted.alignments." + lexical_cast<string>(part) + BAM_EXTENSION);
+	}
+
+	/**
+	 * The sorted BAM, or the sorted BAMs to read as one if prep didn't merge them
+	 */
+	vector<path> getSortedBamFilePaths() const;
+
 	path getBamIndexFilePath(bool useCsi) const {
 		return path(getSortedBamFilePath().string() + (useCsi ? CSI_EXTENSION : BAI_EXTENSION));
 	}
 
+	path getSplicedIndexFilePath() const {
+		return path(getSortedBamFilePath().string() + SPLICED_INDEX_EXTENSION);
+	}
+
 	path getBcfFilePath() const {
 		return path(getSortedBamFilePath().string() + BCF_EXTENSION);
 	}
@@ -139,9 +166,36 @@ public:
 		return path(getGenomeFilePath().string() + FASTA_INDEX_EXTENSION);
 	}
 
+	/**
+	 * Two bits per base copy of the genome, for fast fetches when finding junctions
+	 */
+	path getPackedGenomeFilePath() const {
+		return path(getGenomeFilePath().string() + PACKED_GENOME_EXTENSION);
+	}
+
+	/**
+	 * Records what the prepared files were made from
+	 */
+	path getManifestFilePath() const {
+		return path(prepDir.string() + "/" + PORTCULLIS + MANIFEST_EXTENSION);
+	}
+
 	bool valid(bool useCsi) const;
 
+	/**
+	 * Removes all the prepared files
+	 */
 	void clean();
+
+	/**
+	 * Removes the prepared BAMs and everything derived from them
+	 */
+	void cleanBams();
+
+	/**
+	 * Removes the prepared genome, its index and its packed copy
+	 */
+	void cleanGenome();
 };
 
 
@@ -153,8 +207,11 @@ private:
 	bool force;
 	bool useLinks;
 	uint16_t threads;
+	string sortMemory;
 	bool useCsi;
 	bool verbose;
+	SortedAlignmentConsumer* sortConsumer;
+	bool sortStreamed;
 
 
 public:
@@ -185,6 +242,14 @@ public:
 		this->threads = threads;
 	}
 
+	string getSortMemory() const {
+		return sortMemory;
+	}
+
+	void setSortMemory(const string& sortMemory) {
+		this->sortMemory = sortMemory;
+	}
+
 	bool isUseCsi() const {
 		return useCsi;
 	}
@@ -209,6 +274,25 @@ public:
 		this->verbose = verbose;
 	}
 
+	SortedAlignmentConsumer* getSortConsumer() const {
+		return sortConsumer;
+	}
+
+	/**
+	 * @param sortConsumer Something to hand the sorted alignments to while the sorted
+	 * BAM is written, if the BAM needs sorting.  Not owned by this object.
+	 */
+	void setSortConsumer(SortedAlignmentConsumer* sortConsumer) {
+		this->sortConsumer = sortConsumer;
+	}
+
+	/**
+	 * Whether the BAM was sorted with the sorted alignments handed to the sort consumer
+	 */
+	bool isSortStreamed() const {
+		return sortStreamed;
+	}
+
 
 	virtual ~Prepare() {
 	}
@@ -220,25 +304,40 @@ protected:
 
 	bool genomeIndex();
 
+	/**
+	 * Packs the genome into two bits per base, unless there is an up to date packed
+	 * genome already
+	 * @return Whether there is an up to date packed genome
+	 */
+	bool genomePack();
+
 
 	/**
-	 * Merge together a set of BAM files, use the output prefix to construct a
-	 * file name for the merged file
-	 * @param bamFiles The set of bam files to merge
+	 * Sorts the alignments in the input BAMs into a single output BAM if required
+	 * or forced.  A single input that is already sorted is just symlinked.
+	 * @param inputs Paths to input BAMs to sort
+	 * @param output Sorted BAM file
 	 * @return
 	 */
-	bool bamMerge(vector<path> bamFiles);
+	bool bamSort(const vector<path>& inputs, const path& output);
 
 	/**
-	 * Sorts the unsorted bam file if required or forced
-	 * @param input Path to input BAM to sort
-	 * @param output Sorted BAM file
+	 * Links in several BAMs that are already coordinate sorted, so that they can be
+	 * read as one without merging them
+	 * @param inputs Paths to the sorted BAMs
 	 * @return
 	 */
-	bool bamSort(const path& input, const path& output);
+	bool bamLink(const vector<path>& inputs);
 
 	bool bamIndex(const bool copied);
 
+	/**
+	 * Records where the spliced alignments are in the sorted BAM, so that junction
+	 * finding can skip over the unspliced alignments
+	 * @return
+	 */
+	bool bamSplicedIndex();
+
 	/**
 	 * Checks whether the specified indexing method can support the genome sequence lengths
 	 * @param genomeFile
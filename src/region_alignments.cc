@@ -0,0 +1,247 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <algorithm>
+#include <string>
+#include <vector>
+using std::max;
+using std::min;
+using std::string;
+using std::vector;
+
+#include <boost/filesystem.hpp>
+#include <boost/lexical_cast.hpp>
+namespace bfs = boost::filesystem;
+using boost::lexical_cast;
+
+#include <portcullis/bam/bam_alignment.hpp>
+using portcullis::bam::BamAlignment;
+using portcullis::bam::Orientation;
+using portcullis::bam::Strandedness;
+
+#include "junction_builder.hpp"
+#include "region_alignments.hpp"
+
+portcullis::RegionAlignments::RegionAlignments(const vector<RegionSpan>& regions, const RefSeqPtrList& refs) :
+	regions(regions), alignments(regions.size()), unspliced(refs.size()) {
+	for (auto & ref : refs) {
+		refLengths.push_back(ref->length);
+	}
+}
+
+size_t portcullis::RegionAlignments::add(const bam1_t* b) {
+	const int32_t refId = b->core.tid;
+	const int32_t pos = b->core.pos;
+	if (refId < 0 || pos >= refLengths[refId]) {
+		return 0;
+	}
+	BamAlignment al(const_cast<bam1_t*>(b), false, Strandedness::UNKNOWN, Orientation::UNKNOWN);
+	if (!al.isSplicedRead()) {
+		AlignmentStats& stats = unspliced[refId];
+		const int32_t len = al.getLength();
+		stats.count++;
+		stats.sumQueryLengths += len;
+		stats.minQueryLength = min(stats.minQueryLength, len);
+		stats.maxQueryLength = max(stats.maxQueryLength, len);
+		return 0;
+	}
+	// Regions are in target sequence then position order, so find the last one starting
+	// at or before the alignment, which may be a batch of target sequences
+	auto first = std::upper_bound(regions.begin(), regions.end(), std::make_pair(refId, pos),
+	[](const std::pair<int32_t, int32_t>& p, const RegionSpan & r) {
+		return p.first < r.refIndex || (p.first == r.refIndex && p.second < r.start);
+	});
+	const int32_t alEnd = bam_endpos(b);
+	size_t copies = 0;
+	for (size_t i = first == regions.begin() ? 0 : first - regions.begin() - 1; i < regions.size() && regions[i].refIndex <= refId &&
+			(regions[i].refIndex < refId || regions[i].start < alEnd); i++) {
+		alignments[i].push_back(bam_dup1(b));
+		copies++;
+	}
+	return copies;
+}
+
+vector<bam1_t*> portcullis::RegionAlignments::take(const size_t regionId) {
+	vector<bam1_t*> taken;
+	taken.swap(alignments[regionId]);
+	return taken;
+}
+
+void portcullis::RegionAlignments::clear() {
+	for (auto & region : alignments) {
+		for (auto & b : region) {
+			bam_destroy1(b);
+		}
+		vector<bam1_t*>().swap(region);
+	}
+}
+
+portcullis::UnsortedAlignmentBuffer::UnsortedAlignmentBuffer(const vector<RegionSpan>& regions, const RefSeqPtrList& refs,
+		const uint64_t memory, const path& runPrefix) :
+	RegionAlignments(regions, refs), memory(memory), runPrefix(runPrefix), bufferedBytes(0), spilled(regions.size()) {
+}
+
+void portcullis::UnsortedAlignmentBuffer::add(const bam1_t* b) {
+	bufferedBytes += RegionAlignments::add(b) * (sizeof(bam1_t) + b->l_data);
+	if (bufferedBytes > memory) {
+		spill();
+	}
+}
+
+/**
+ * Writes the buffered spliced alignments for every region to a new temporary run, as
+ * BGZF compressed BAM records so they are read back through htslib whatever the host,
+ * and frees them
+ */
+void portcullis::UnsortedAlignmentBuffer::spill() {
+	const path run(runPrefix.string() + ".tmp" + lexical_cast<string>(runs.size()) + ".bam");
+	runs.push_back(run);
+	// Runs are only read back once, so favour speed over size
+	BGZF* fp = bgzf_open(run.c_str(), "w1");
+	if (fp == nullptr) {
+		BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
+								  "Could not open temporary file: ") + run.string()));
+	}
+	for (size_t i = 0; i < alignments.size(); i++) {
+		vector<bam1_t*>& region = alignments[i];
+		if (region.empty()) {
+			continue;
+		}
+		spilled[i].push_back(SpilledRange{ runs.size() - 1, bgzf_tell(fp), region.size() });
+		for (auto & b : region) {
+			if (bam_write1(fp, b) < 0) {
+				bgzf_close(fp);
+				BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
+										  "Could not write alignments to temporary file: ") + run.string()));
+			}
+		}
+		for (auto & b : region) {
+			bam_destroy1(b);
+		}
+		vector<bam1_t*>().swap(region);
+	}
+	if (bgzf_close(fp) != 0) {
+		BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
+								  "Could not finish writing temporary file: ") + run.string()));
+	}
+	bufferedBytes = 0;
+}
+
+vector<bam1_t*> portcullis::UnsortedAlignmentBuffer::take(const size_t regionId) {
+	vector<bam1_t*> taken;
+	vector<SpilledRange>& ranges = spilled[regionId];
+	for (auto & range : ranges) {
+		const path& run = runs[range.run];
+		BGZF* fp = bgzf_open(run.c_str(), "r");
+		bool ok = fp != nullptr && bgzf_seek(fp, range.offset, SEEK_SET) == 0;
+		for (size_t i = 0; ok && i < range.count; i++) {
+			bam1_t* b = bam_init1();
+			// A run that ends early has been truncated or damaged since it was written
+			ok = bam_read1(fp, b) >= 0;
+			if (ok) {
+				taken.push_back(b);
+			}
+			else {
+				bam_destroy1(b);
+			}
+		}
+		if (fp != nullptr) {
+			bgzf_close(fp);
+		}
+		if (!ok) {
+			for (auto & a : taken) {
+				bam_destroy1(a);
+			}
+			BOOST_THROW_EXCEPTION(JunctionBuilderException() << JunctionBuilderErrorInfo(string(
+									  "Could not read alignments from temporary file: ") + run.string()));
+		}
+	}
+	vector<SpilledRange>().swap(ranges);
+	vector<bam1_t*> buffered = RegionAlignments::take(regionId);
+	taken.insert(taken.end(), buffered.begin(), buffered.end());
+	return taken;
+}
+
+void portcullis::UnsortedAlignmentBuffer::removeRuns() {
+	for (auto & run : runs) {
+		bfs::remove(run);
+	}
+	runs.clear();
+}
+
+portcullis::SortedAlignmentStream::SortedAlignmentStream(JunctionBuilder* junctionBuilder) :
+	junctionBuilder(junctionBuilder), alignments(nullptr), threads(1), nextRegion(0), streaming(false) {
+}
+
+portcullis::SortedAlignmentStream::~SortedAlignmentStream() {
+	pool.reset();
+}
+
+void portcullis::SortedAlignmentStream::start(const bam_hdr_t* header) {
+	streaming = junctionBuilder->startStreaming(header);
+	if (!streaming) {
+		return;
+	}
+	alignments = junctionBuilder->regionAlignments.get();
+	threads = junctionBuilder->threads;
+	nextRegion = 0;
+	pool.reset(new JBThreadPool(junctionBuilder, threads, JBTask::FIND_STREAMED_JUNCTIONS));
+}
+
+void portcullis::SortedAlignmentStream::consume(const bam1_t* b) {
+	if (!streaming) {
+		return;
+	}
+	const int32_t refId = b->core.tid;
+	// Unplaced reads are all at the end, so every region is complete
+	if (refId < 0) {
+		queueRegions(alignments->size());
+		return;
+	}
+	// Nothing after this alignment can overlap a region that ends before it
+	const int32_t pos = b->core.pos;
+	size_t end = nextRegion;
+	while (end < alignments->size() &&
+			(alignments->getRegion(end).lastRefIndex < refId || (alignments->getRegion(end).lastRefIndex == refId && alignments->getRegion(end).end <= pos))) {
+		end++;
+	}
+	queueRegions(end);
+	alignments->add(b);
+}
+
+void portcullis::SortedAlignmentStream::finish() {
+	if (!streaming) {
+		return;
+	}
+	queueRegions(alignments->size());
+	pool->shutDown();
+	pool.reset();
+	streaming = false;
+	junctionBuilder->streamed = true;
+}
+
+/**
+ * Hands regions up to the given one over to the thread pool.  Waits for the threads
+ * to catch up if they are falling behind, so the spliced alignments waiting to be
+ * processed don't build up in memory.
+ */
+void portcullis::SortedAlignmentStream::queueRegions(const size_t end) {
+	for (; nextRegion < end; nextRegion++) {
+		pool->waitForSpace(threads);
+		pool->enqueue(nextRegion);
+	}
+}
@@ -0,0 +1,210 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#pragma once
+
+#include <memory>
+#include <vector>
+using std::unique_ptr;
+using std::vector;
+
+#include <boost/filesystem/path.hpp>
+using boost::filesystem::path;
+
+#include <htslib/sam.h>
+
+#include <portcullis/bam/bam_master.hpp>
+#include <portcullis/bam/bam_sorter.hpp>
+#include <portcullis/bam/spliced_index.hpp>
+using portcullis::bam::AlignmentStats;
+using portcullis::bam::RefSeqPtrList;
+using portcullis::bam::SortedAlignmentConsumer;
+
+namespace portcullis {
+
+class JunctionBuilder;
+class JBThreadPool;
+
+/**
+ * Where a unit of work for the junction builder lies: a window of a target sequence,
+ * or a batch of whole target sequences
+ */
+struct RegionSpan {
+	int32_t refIndex = 0;
+	int32_t lastRefIndex = 0;	// Same as refIndex unless this is a batch
+	int32_t start = 0;			// On the first target sequence
+	int32_t end = 0;			// On the last target sequence
+};
+
+/**
+ * Spliced alignments held for each region until the region's junctions are found,
+ * with the unspliced alignments summarised for each target sequence.  This mirrors
+ * the spliced alignment index: a spliced alignment is copied into every region it
+ * overlaps.
+ */
+class RegionAlignments {
+protected:
+
+	vector<RegionSpan> regions;
+	vector<int32_t> refLengths;
+	vector<vector<bam1_t*>> alignments;
+	vector<AlignmentStats> unspliced;
+
+public:
+
+	RegionAlignments() {}
+
+	RegionAlignments(const vector<RegionSpan>& regions, const RefSeqPtrList& refs);
+
+	virtual ~RegionAlignments() {
+		clear();
+	}
+
+	size_t size() const {
+		return regions.size();
+	}
+
+	const RegionSpan& getRegion(const size_t regionId) const {
+		return regions[regionId];
+	}
+
+	const AlignmentStats& getUnsplicedStats(const int32_t refIndex) const {
+		return unspliced[refIndex];
+	}
+
+	/**
+	 * Keeps a copy of a spliced alignment for every region it overlaps, or adds an
+	 * unspliced alignment to the summary for its target sequence.  Unplaced alignments,
+	 * and those starting past the end of their target sequence, are left out.
+	 * @param b The alignment, which is copied
+	 * @return The number of regions the alignment was copied into
+	 */
+	size_t add(const bam1_t* b);
+
+	/**
+	 * Hands the spliced alignments for a region over to the caller, who must free them
+	 * @param regionId The region
+	 * @return The region's spliced alignments, in the order they were added
+	 */
+	virtual vector<bam1_t*> take(const size_t regionId);
+
+	/**
+	 * Frees the spliced alignments still held
+	 */
+	void clear();
+};
+
+/**
+ * Where a region's spliced alignments from an unsorted input went in one of the
+ * temporary runs they were spilled to
+ */
+struct SpilledRange {
+	size_t run;
+	int64_t offset;		// BGZF virtual offset of the region's first alignment
+	size_t count;
+};
+
+/**
+ * Region alignments read from an unsorted input, held within a memory budget.  When
+ * the budget is used up the spliced alignments are spilled to a temporary run of BGZF
+ * compressed BAM records, holding every region's alignments in region order, and the
+ * range each region took up in the run is kept so they can be read back.
+ */
+class UnsortedAlignmentBuffer : public RegionAlignments {
+private:
+
+	uint64_t memory;
+	path runPrefix;
+	uint64_t bufferedBytes;
+	vector<path> runs;
+	vector<vector<SpilledRange>> spilled;
+
+	void spill();
+
+public:
+
+	/**
+	 * @param regions The regions to partition the alignments into
+	 * @param refs The target sequences
+	 * @param memory Bytes of spliced alignments to hold before spilling them
+	 * @param runPrefix Path prefix of the temporary runs
+	 */
+	UnsortedAlignmentBuffer(const vector<RegionSpan>& regions, const RefSeqPtrList& refs, const uint64_t memory, const path& runPrefix);
+
+	virtual ~UnsortedAlignmentBuffer() {
+		removeRuns();
+	}
+
+	size_t getNbSpills() const {
+		return runs.size();
+	}
+
+	void add(const bam1_t* b);
+
+	/**
+	 * Reads back the spliced alignments spilled for a region, which come before the ones
+	 * still in memory in input order.  Each run is opened separately, so regions can be
+	 * read back on different threads.
+	 */
+	virtual vector<bam1_t*> take(const size_t regionId);
+
+	/**
+	 * Removes the temporary runs, once every region has been taken
+	 */
+	void removeRuns();
+};
+
+/**
+ * Receives the sorted alignments from the sorter in prep, and feeds them to the
+ * junction builder region by region.  Each region is queued for the builder's thread
+ * pool as soon as the sort has moved past it, so junction finding overlaps the sort
+ * and doesn't need to read the sorted BAM back in afterwards.
+ */
+class SortedAlignmentStream : public SortedAlignmentConsumer {
+private:
+
+	JunctionBuilder* junctionBuilder;
+	RegionAlignments* alignments;
+	unique_ptr<JBThreadPool> pool;
+	uint16_t threads;
+	size_t nextRegion;
+	bool streaming;
+
+	void queueRegions(const size_t end);
+
+public:
+
+	SortedAlignmentStream(JunctionBuilder* junctionBuilder);
+
+	// Stops any threads still working on regions
+	virtual ~SortedAlignmentStream();
+
+	/**
+	 * Sets up the builder's regions and starts its thread pool, unless the builder
+	 * needs the sorted BAM
+	 */
+	virtual void start(const bam_hdr_t* header);
+
+	virtual void consume(const bam1_t* b);
+
+	/**
+	 * Waits for the thread pool to finish off the remaining regions
+	 */
+	virtual void finish();
+};
+
+}
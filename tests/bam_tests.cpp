@@ -19,9 +19,13 @@
 
 #include <iostream>
 #include <fstream>
+#include <map>
+#include <set>
 #include <string>
+#include <utility>
 using std::cout;
 using std::endl;
+using std::pair;
 using std::stringstream;
 
 
@@ -34,46 +38,112 @@ using bfs::path;
 #include <portcullis/bam/bam_master.hpp>
 #include <portcullis/bam/bam_alignment.hpp>
 #include <portcullis/bam/bam_reader.hpp>
+#include <portcullis/bam/bam_sorter.hpp>
+#include <portcullis/bam/bam_writer.hpp>
 #include <portcullis/bam/depth_parser.hpp>
 #include <portcullis/bam/genome_mapper.hpp>
+#include <portcullis/bam/spliced_index.hpp>
 using namespace portcullis::bam;
 
-/**        
-TEST(bam, sort) {
-    
-    string unsortedBam = RESOURCESDIR "/unsorted.bam";
-    string sortedBam = RESOURCESDIR "/sorted.test.bam";
-    
-    string cmd = BamHelper::createSortBamCmd(unsortedBam, sortedBam);
-    
-    stringstream ss;
-    ss << "samtools sort -@ 1 -m 1G " << RESOURCESDIR << "/unsorted.bam " 
-            << RESOURCESDIR << "/sorted.test.bam";
-    string correct = ss.str();
-    
-    //cout << "cmd=" << cmd << endl;
-    
-    // Check the sorted bam file exists
-    EXPECT_EQ(cmd, correct);
+TEST(bam, native_sort) {
+
+    // Sorting with a tiny memory budget forces several runs to be spilled and merged.
+    // The result should hold the same alignments as the input, in coordinate order.
+    // The input's header claims it is sorted when it isn't, so don't trust it.
+    bfs::create_directories("temp");
+    path sortedBam("temp/native_sort.bam");
+
+    EXPECT_EQ(BamSorter::parseMemorySize("512"), 512);
+    EXPECT_EQ(BamSorter::parseMemorySize("2K"), 2048);
+    EXPECT_EQ(BamSorter::parseMemorySize("3g"), 3ULL << 30);
+    EXPECT_THROW(BamSorter::parseMemorySize("G"), BamException);
+    EXPECT_THROW(BamSorter::parseMemorySize("1GB"), BamException);
+
+    BamSorter sorter(sortedBam);
+    sorter.setThreads(2);
+    sorter.setMemory(2048);
+    sorter.setMergeSortedInputs(false);
+    sorter.sort(vector<path>{ path(RESOURCESDIR "/unsorted.bam") });
+
+    std::multiset<string> original;
+    BamReader reader(RESOURCESDIR "/unsorted.bam");
+    reader.open();
+    while(reader.next()) {
+        original.insert(reader.current().deriveName() + reader.current().getCigarAsString());
+    }
+    reader.close();
+
+    std::multiset<string> result;
+    bool ordered = true;
+    uint64_t lastKey = 0;
+    BamReader sorted(sortedBam);
+    sorted.open();
+    EXPECT_EQ(sorted.isCoordSortedBam(), true);
+    while(sorted.next()) {
+        const uint64_t key = BamSorter::sortKey(sorted.current().getRaw());
+        ordered = ordered && key >= lastKey;
+        lastKey = key;
+        result.insert(sorted.current().deriveName() + sorted.current().getCigarAsString());
+    }
+    sorted.close();
+
+    EXPECT_GT(original.size(), 1);
+    EXPECT_EQ(ordered, true);
+    EXPECT_EQ(original == result, true);
+    EXPECT_EQ(bfs::exists("temp/native_sort.bam.tmp0.bam"), false);
+
+    bfs::remove(sortedBam);
 }
-**/
 
-TEST(bam, merge) {
-    
-    // Merge a couple of BAMs together
-    vector<path> bamFiles;
-    bamFiles.push_back(RESOURCESDIR "/bam1.bam");
-    bamFiles.push_back(RESOURCESDIR "/bam2.bam");
-    
-    path mergedBam = RESOURCESDIR "/merged.bam";
-    string cmd = BamHelper::createMergeBamCmd(bamFiles, mergedBam, 1);
-    
-    stringstream ss;
-    ss << "samtools merge -f -@ 1 " << RESOURCESDIR << "/merged.bam " 
-            << RESOURCESDIR << "/bam1.bam " << RESOURCESDIR << "/bam2.bam";
-    string correct = ss.str();
-    
-    EXPECT_EQ(cmd, correct);
+// Records what a sorter hands over while writing its output
+class RecordingConsumer : public SortedAlignmentConsumer {
+public:
+    int32_t nbTargets = -1;
+    vector<uint64_t> keys;
+    bool finished = false;
+
+    void start(const bam_hdr_t* header) {
+        nbTargets = header->n_targets;
+    }
+
+    void consume(const bam1_t* b) {
+        keys.push_back(BamSorter::sortKey(b));
+    }
+
+    void finish() {
+        finished = true;
+    }
+};
+
+TEST(bam, sort_consumer) {
+
+    // The consumer should see exactly what ends up in the sorted BAM, in the same order
+    bfs::create_directories("temp");
+    path sortedBam("temp/sort_consumer.bam");
+
+    RecordingConsumer consumer;
+    BamSorter sorter(sortedBam);
+    sorter.setThreads(2);
+    sorter.setMemory(2048);
+    sorter.setMergeSortedInputs(false);
+    sorter.setConsumer(&consumer);
+    sorter.sort(vector<path>{ path(RESOURCESDIR "/unsorted.bam") });
+
+    vector<uint64_t> keys;
+    BamReader sorted(sortedBam);
+    sorted.open();
+    const int32_t nbTargets = sorted.getHeader()->n_targets;
+    while(sorted.next()) {
+        keys.push_back(BamSorter::sortKey(sorted.current().getRaw()));
+    }
+    sorted.close();
+
+    EXPECT_EQ(consumer.nbTargets, nbTargets);
+    EXPECT_GT(keys.size(), 1);
+    EXPECT_EQ(consumer.keys == keys, true);
+    EXPECT_EQ(consumer.finished, true);
+
+    bfs::remove(sortedBam);
 }
 
 TEST(bam, is_sorted1) {
@@ -95,6 +165,27 @@ TEST(bam, is_sorted2) {
 }
 
 
+TEST(bam, newer_index) {
+
+    // An index is only any good if it is at least as new as the BAM
+    bfs::create_directories("temp");
+    path bam("temp/newer_index.bam");
+    path bai("temp/newer_index.bam.bai");
+    bfs::copy_file(RESOURCESDIR "/sorted.bam", bam, bfs::copy_option::overwrite_if_exists);
+    EXPECT_EQ(BamHelper::isNewerIndexPresent(bam, false), false);
+
+    bfs::copy_file(RESOURCESDIR "/sorted.bam.bai", bai, bfs::copy_option::overwrite_if_exists);
+    const std::time_t now = bfs::last_write_time(bam);
+    bfs::last_write_time(bai, now + 10);
+    EXPECT_EQ(BamHelper::isNewerIndexPresent(bam, false), true);
+
+    bfs::last_write_time(bai, now - 10);
+    EXPECT_EQ(BamHelper::isNewerIndexPresent(bam, false), false);
+
+    bfs::remove(bam);
+    bfs::remove(bai);
+}
+
 TEST(bam, depth_test_1) {
     
     DepthParser dp1(RESOURCESDIR "/sorted.bam", 0, true);
@@ -132,6 +223,379 @@ TEST(bam, depth_test_1) {
     EXPECT_LE(count2, count1);
 }
 
+TEST(bam, multithreaded_read) {
+
+    // Reading with a decompression pipeline should give exactly the same records
+    // in exactly the same order as reading on a single thread
+    BamReader r1(RESOURCESDIR "/clipped3.bam");
+    r1.open();
+    BamReader r4(RESOURCESDIR "/clipped3.bam");
+    r4.open(4);
+
+    uint32_t count = 0;
+    bool same = true;
+    while(r1.next()) {
+        if (!r4.next()) {
+            same = false;
+            break;
+        }
+        const BamAlignment& a1 = r1.current();
+        const BamAlignment& a4 = r4.current();
+        if (a1.deriveName() != a4.deriveName() || a1.getPosition() != a4.getPosition() ||
+                a1.getCigarAsString() != a4.getCigarAsString() || a1.getQuerySeq() != a4.getQuerySeq()) {
+            same = false;
+        }
+        count++;
+    }
+    EXPECT_EQ(r4.next(), false);
+    r1.close();
+    r4.close();
+
+    EXPECT_EQ(same, true);
+    EXPECT_GT(count, 0);
+
+    DepthParser dp1(RESOURCESDIR "/clipped3.bam", 0, true);
+    DepthParser dp4(RESOURCESDIR "/clipped3.bam", 0, true, 4);
+    vector<uint32_t> batch1, batch4;
+    while(dp1.loadNextBatch(batch1)) {
+        EXPECT_EQ(dp4.loadNextBatch(batch4), true);
+        EXPECT_EQ(batch1 == batch4, true);
+    }
+    EXPECT_EQ(dp4.loadNextBatch(batch4), false);
+}
+
+TEST(bam, chunked_write) {
+
+    // Write alternate halves of a BAM into chunks using two writers, then stitch
+    // them back together in order.  The result should be the same as the original.
+    bfs::create_directories("temp");
+    path part1("temp/chunks1.part");
+    path part2("temp/chunks2.part");
+    path stitched("temp/stitched.bam");
+
+    BamReader reader(RESOURCESDIR "/clipped3.bam");
+    reader.open();
+    vector<string> original;
+    while(reader.next()) {
+        original.push_back(reader.current().deriveName() + reader.current().getCigarAsString());
+    }
+    reader.close();
+
+    BamReader reader2(RESOURCESDIR "/clipped3.bam");
+    reader2.open();
+    BamChunkWriter w1(part1);
+    BamChunkWriter w2(part2);
+    w1.open();
+    w2.open();
+    vector<BamChunk> chunks;
+    for(size_t i = 0; i < original.size() && reader2.next(); i++) {
+        (i < original.size() / 2 ? w1 : w2).write(reader2.current());
+        if (i + 1 == original.size() / 2) {
+            chunks.push_back(w1.endChunk());
+        }
+    }
+    chunks.push_back(w2.endChunk());
+    w1.close();
+    w2.close();
+
+    BamWriter writer(stitched);
+    writer.open(reader2.getHeader());
+    writer.writeChunk(part1, chunks[0]);
+    writer.writeChunk(part2, chunks[1]);
+    writer.close();
+    reader2.close();
+
+    BamReader reader3(stitched);
+    reader3.open();
+    vector<string> result;
+    while(reader3.next()) {
+        result.push_back(reader3.current().deriveName() + reader3.current().getCigarAsString());
+    }
+    reader3.close();
+
+    EXPECT_GT(original.size(), 1);
+    EXPECT_EQ(original == result, true);
+
+    bfs::remove(part1);
+    bfs::remove(part2);
+    bfs::remove(stitched);
+}
+
+TEST(bam, indexed_write) {
+
+    // An index built while writing should be exactly what htslib builds from the
+    // finished file, and should give the same region queries as the original
+    bfs::create_directories("temp");
+    for (int csi = 0; csi < 2; csi++) {
+        const string ext = csi ? ".csi" : ".bai";
+        path indexed("temp/indexed.bam");
+        path indexFile(indexed.string() + ext);
+        path rebuilt("temp/rebuilt.bam");
+
+        BamReader reader(RESOURCESDIR "/clipped3.bam");
+        reader.open();
+        BamWriter writer(indexed);
+        writer.setThreads(4);
+        writer.setBuildIndex(true);
+        writer.setUseCsi(csi);
+        writer.open(reader.getHeader());
+        while(reader.next()) {
+            writer.write(reader.current());
+        }
+        writer.close();
+        EXPECT_EQ(bfs::exists(indexFile), true);
+
+        bfs::copy_file(indexed, rebuilt, bfs::copy_option::overwrite_if_exists);
+        BamHelper::indexBam(rebuilt, csi);
+        std::ifstream a(indexFile.string(), std::ios::binary);
+        std::ifstream b(rebuilt.string() + ext, std::ios::binary);
+        const string aBytes((std::istreambuf_iterator<char>(a)), std::istreambuf_iterator<char>());
+        const string bBytes((std::istreambuf_iterator<char>(b)), std::istreambuf_iterator<char>());
+        EXPECT_GT(aBytes.size(), 0);
+        EXPECT_EQ(aBytes == bBytes, true);
+
+        BamReader check(indexed);
+        check.open();
+        shared_ptr<RefSeqPtrList> refs = check.createRefList();
+        for (auto & ref : *refs) {
+            const int32_t mid = ref->length / 2;
+            vector<string> expected;
+            reader.setRegion(ref->index, mid, (int32_t) ref->length);
+            while(reader.next()) {
+                expected.push_back(reader.current().deriveName() + reader.current().getCigarAsString());
+            }
+            vector<string> result;
+            check.setRegion(ref->index, mid, (int32_t) ref->length);
+            while(check.next()) {
+                result.push_back(check.current().deriveName() + check.current().getCigarAsString());
+            }
+            EXPECT_EQ(expected == result, true);
+        }
+        check.close();
+        reader.close();
+
+        bfs::remove(indexed);
+        bfs::remove(indexFile);
+        bfs::remove(rebuilt);
+        bfs::remove(rebuilt.string() + ext);
+    }
+}
+
+TEST(bam, merged_read) {
+
+    // Splitting a sorted BAM in two and reading the halves together should give back
+    // the same alignments in the same coordinate order, both sequentially and by region.
+    // Alignments at the same position may come back in either order.
+    bfs::create_directories("temp");
+    const path parts[] = { "temp/part1.bam", "temp/part2.bam" };
+    BamReader reader(RESOURCESDIR "/clipped3.bam");
+    reader.open();
+    vector<string> original;
+    vector<pair<int32_t, int32_t>> originalCoords;
+    {
+        BamWriter w1(parts[0]);
+        BamWriter w2(parts[1]);
+        w1.setBuildIndex(true);
+        w2.setBuildIndex(true);
+        w1.open(reader.getHeader());
+        w2.open(reader.getHeader());
+        for(size_t i = 0; reader.next(); i++) {
+            original.push_back(reader.current().deriveName() + reader.current().getCigarAsString());
+            originalCoords.push_back(std::make_pair(reader.current().getReferenceId(), reader.current().getPosition()));
+            (i % 2 == 0 ? w1 : w2).write(reader.current());
+        }
+        w1.close();
+        w2.close();
+    }
+
+    BamReader merged(vector<path>{ parts[0], parts[1] });
+    merged.open(2);
+    EXPECT_EQ(merged.isCoordSortedBam(), true);
+    vector<string> result;
+    vector<pair<int32_t, int32_t>> resultCoords;
+    while(merged.next()) {
+        result.push_back(merged.current().deriveName() + merged.current().getCigarAsString());
+        resultCoords.push_back(std::make_pair(merged.current().getReferenceId(), merged.current().getPosition()));
+    }
+    EXPECT_GT(original.size(), 1);
+    EXPECT_EQ(originalCoords == resultCoords, true);
+    std::multiset<string> expectedSet(original.begin(), original.end());
+    std::multiset<string> resultSet(result.begin(), result.end());
+    EXPECT_EQ(expectedSet == resultSet, true);
+
+    shared_ptr<RefSeqPtrList> refs = merged.createRefList();
+    for (auto & ref : *refs) {
+        const int32_t mid = ref->length / 2;
+        vector<int32_t> expected;
+        reader.setRegion(ref->index, mid, (int32_t) ref->length);
+        while(reader.next()) {
+            expected.push_back(reader.current().getPosition());
+        }
+        vector<int32_t> positions;
+        merged.setRegion(ref->index, mid, (int32_t) ref->length);
+        while(merged.next()) {
+            positions.push_back(merged.current().getPosition());
+        }
+        EXPECT_EQ(expected == positions, true);
+    }
+    merged.close();
+    reader.close();
+
+    for (auto & part : parts) {
+        bfs::remove(part);
+        bfs::remove(part.string() + ".bai");
+    }
+}
+
+TEST(bam, shared_index) {
+
+    // Readers sharing one loaded index should see the same regions as a reader that
+    // loads its own
+    vector<path> bams{ RESOURCESDIR "/clipped3.bam" };
+    vector<BamIndexPtr> indexes = BamReader::loadIndexes(bams);
+    EXPECT_EQ(indexes.size(), 1);
+    EXPECT_EQ(indexes[0] != nullptr, true);
+
+    BamReader own(bams);
+    own.open();
+    BamReader shared1(bams);
+    shared1.setIndexes(indexes);
+    shared1.open();
+    BamReader shared2(bams);
+    shared2.setIndexes(indexes);
+    shared2.open();
+
+    shared_ptr<RefSeqPtrList> refs = own.createRefList();
+    for (auto & ref : *refs) {
+        const int32_t mid = ref->length / 2;
+        vector<int32_t> expected;
+        own.setRegion(ref->index, mid, (int32_t) ref->length);
+        while(own.next()) {
+            expected.push_back(own.current().getPosition());
+        }
+        for (BamReader* reader : { &shared1, &shared2 }) {
+            vector<int32_t> positions;
+            reader->setRegion(ref->index, mid, (int32_t) ref->length);
+            while(reader->next()) {
+                positions.push_back(reader->current().getPosition());
+            }
+            EXPECT_EQ(expected == positions, true);
+        }
+    }
+    own.close();
+    shared1.close();
+    shared2.close();
+}
+
+TEST(bam, read_targets) {
+
+    // Reading a run of target sequences in one go should give the same alignments as
+    // reading each of them as a region
+    const path bam = RESOURCESDIR "/clipped3.bam";
+    BamReader regions(bam);
+    regions.open();
+    BamReader run(bam);
+    run.open();
+
+    shared_ptr<RefSeqPtrList> refs = regions.createRefList();
+    const int32_t nbRefs = refs->size();
+    for (int32_t first = 0; first < nbRefs; first++) {
+        for (int32_t last : { first, std::min(first + 1, nbRefs - 1), nbRefs - 1 }) {
+            vector<std::pair<int32_t, int32_t>> expected;
+            for (int32_t i = first; i <= last; i++) {
+                regions.setRegion(i, 0, (int32_t) refs->at(i)->length);
+                while(regions.next()) {
+                    expected.push_back(std::make_pair(regions.current().getReferenceId(), regions.current().getPosition()));
+                }
+            }
+            vector<std::pair<int32_t, int32_t>> actual;
+            run.setTargets(first, last);
+            while(run.next()) {
+                actual.push_back(std::make_pair(run.current().getReferenceId(), run.current().getPosition()));
+            }
+            EXPECT_EQ(expected == actual, true);
+        }
+    }
+    regions.close();
+    run.close();
+}
+
+TEST(bam, hash_name) {
+
+    // Alignments should hash to the same value if and only if their derived names match
+    BamReader reader(RESOURCESDIR "/sorted.bam");
+    reader.open();
+    std::map<string, size_t> hashes;
+    std::set<size_t> distinct;
+    bool consistent = true;
+    while(reader.next()) {
+        const string name = reader.current().deriveName();
+        const size_t hash = reader.current().hashName();
+        auto it = hashes.find(name);
+        if (it == hashes.end()) {
+            hashes[name] = hash;
+            distinct.insert(hash);
+        }
+        else if (it->second != hash) {
+            consistent = false;
+        }
+    }
+    reader.close();
+
+    EXPECT_GT(hashes.size(), 1);
+    EXPECT_EQ(consistent, true);
+    EXPECT_EQ(distinct.size(), hashes.size());
+}
+
+TEST(bam, spliced_index) {
+
+    // Reading via the spliced index should give exactly the spliced alignments that
+    // a region query would, and the index should survive a round trip to disk
+    bfs::create_directories("temp");
+    path indexFile("temp/clipped3.bam.spi");
+
+    SplicedIndex built;
+    built.build(RESOURCESDIR "/clipped3.bam", 4);
+    built.save(indexFile);
+    SplicedIndex index;
+    index.load(indexFile);
+    EXPECT_EQ(index.isIndexOf(RESOURCESDIR "/clipped3.bam"), true);
+    EXPECT_EQ(index.getNbSplicedAlignments(), built.getNbSplicedAlignments());
+    EXPECT_GT(index.getNbSplicedAlignments(), 0);
+
+    BamReader reader(RESOURCESDIR "/clipped3.bam");
+    reader.open();
+    shared_ptr<RefSeqPtrList> refs = reader.createRefList();
+    uint64_t nbAlignments = 0;
+    for (auto & ref : *refs) {
+        const int32_t mid = ref->length / 2;
+        const int32_t starts[] = { 0, mid };
+        const int32_t ends[] = { mid, (int32_t) ref->length };
+        for (size_t i = 0; i < 2; i++) {
+            vector<string> expected;
+            reader.setRegion(ref->index, starts[i], ends[i]);
+            while(reader.next()) {
+                if (reader.current().isSplicedRead()) {
+                    expected.push_back(reader.current().deriveName() + reader.current().getCigarAsString());
+                }
+            }
+            vector<string> result;
+            reader.setOffsets(index.findOffsets(ref->index, starts[i], ends[i]));
+            while(reader.next()) {
+                result.push_back(reader.current().deriveName() + reader.current().getCigarAsString());
+            }
+            EXPECT_EQ(expected == result, true);
+            nbAlignments += result.size();
+        }
+        nbAlignments += index.getUnsplicedStats(ref->index).count;
+    }
+    reader.close();
+
+    EXPECT_GT(nbAlignments, index.getNbSplicedAlignments());
+
+    bfs::remove(indexFile);
+}
+
 TEST(bam, genome_mapper_ecoli) {
     
     // Create a new faidx
@@ -179,6 +643,99 @@ TEST(bam, genome_mapper_ecoli) {
     bfs::remove(faidxFile);
 }
 
+TEST(bam, packed_genome) {
+
+    // Mixed case, Ns and other odd bases, including at the ends of lines and sequences
+    bfs::create_directories("temp");
+    path fasta("temp/packed.fa");
+    std::ofstream out(fasta.c_str());
+    out << ">one desc" << endl
+        << "NNACGTacgtNNnn" << endl
+        << "RYacGTTTTTNNNN" << endl
+        << "ac" << endl
+        << ">two" << endl
+        << "GATTACA" << endl
+        << ">three" << endl
+        << "n" << endl;
+    out.close();
+
+    GenomeMapper faidx(fasta);
+    faidx.buildFastaIndex();
+    faidx.loadFastaIndex();
+    faidx.buildPackedGenome();
+
+    GenomeMapper packed(fasta);
+    EXPECT_EQ(packed.loadPackedGenome(), true);
+    EXPECT_EQ(packed.getNbSeqs(), 3);
+    EXPECT_EQ(packed.getPackedGenome()->getIndex("two"), 1);
+    EXPECT_EQ(packed.getPackedGenome()->getIndex("four"), -1);
+
+    // Every region, including ones that need clamping, should match the fasta index
+    const char* names[] = { "one", "two", "three" };
+    // ... and so should fetching by sequence index from either one
+    string bases;
+    for (auto name : names) {
+        const int32_t faidxIndex = faidx.getSeqIndex(name);
+        const int32_t packedIndex = packed.getSeqIndex(name);
+        EXPECT_EQ(faidxIndex, packedIndex);
+        for (int start = -3; start < 35; start++) {
+            for (int end = -3; end < 35; end++) {
+                int expectedLen = 0;
+                int len = 0;
+                string expected = faidx.fetchBases(name, start, end, &expectedLen);
+                string actual = packed.fetchBases(name, start, end, &len);
+                EXPECT_EQ(actual, expected) << name << ":" << start << "-" << end;
+                EXPECT_EQ(len, expectedLen);
+                EXPECT_EQ(faidx.fetchBases(faidxIndex, start, end, bases), expectedLen);
+                EXPECT_EQ(bases, expected);
+                EXPECT_EQ(packed.fetchBases(packedIndex, start, end, bases), expectedLen);
+                EXPECT_EQ(bases, expected);
+            }
+        }
+    }
+    EXPECT_EQ(faidx.getSeqIndex("four"), -1);
+    EXPECT_EQ(faidx.fetchBases(faidx.getSeqIndex("four"), 0, 9, bases), -2);
+    EXPECT_EQ(bases, "");
+    EXPECT_EQ(packed.fetchBases("one", 0, 9, bases), 10);
+    EXPECT_EQ(bases, "NNACGTacgt");
+    EXPECT_EQ(packed.fetchBases("four", 0, 9, bases), -2);
+    EXPECT_EQ(bases, "");
+
+    // A packed genome is out of date once the fasta changes
+    bfs::last_write_time(fasta, bfs::last_write_time(fasta) + 10);
+    EXPECT_EQ(packed.getPackedGenome()->isPackingOf(fasta), false);
+    GenomeMapper stale(fasta);
+    EXPECT_EQ(stale.loadPackedGenome(), false);
+
+    // A packed genome from another layout version, or from a host with the other byte
+    // order, is rejected rather than misread
+    const path packedFile = faidx.getPackedGenomeFile();
+    EXPECT_EQ(PackedGenome::isCompatible(packedFile), true);
+    string original;
+    {
+        std::ifstream in(packedFile.string(), std::ios::binary);
+        original.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    }
+    bfs::last_write_time(fasta, bfs::last_write_time(fasta) - 10);
+    for (size_t offset : { 3, 4 }) {
+        string changed = original;
+        changed[offset] ^= 0x7f;
+        {
+            std::ofstream modified(packedFile.string(), std::ios::binary | std::ios::trunc);
+            modified << changed;
+        }
+        EXPECT_EQ(PackedGenome::isCompatible(packedFile), false) << offset;
+        GenomeMapper incompatible(fasta);
+        EXPECT_EQ(incompatible.loadPackedGenome(), false) << offset;
+        PackedGenome pg;
+        EXPECT_THROW(pg.open(packedFile), BamException) << offset;
+    }
+
+    bfs::remove(fasta);
+    bfs::remove(faidx.getFastaIndexFile());
+    bfs::remove(faidx.getPackedGenomeFile());
+}
+
 TEST(bam, padding) {
     
     vector<CigarOp> cigar = CigarOp::createFullCigarFromString("2S14M2I1M1737N8M14S");
@@ -17,24 +17,107 @@
 
 #include <gtest/gtest.h>
 
+#include <algorithm>
+#include <fstream>
 #include <iostream>
+#include <sstream>
 using std::cout;
 using std::endl;
+using std::ofstream;
+using std::stringstream;
 
+#include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
+namespace bfs = boost::filesystem;
+
+#include <htslib/sam.h>
+
+#include <portcullis/bam/bam_alignment.hpp>
+#include <portcullis/bam/bam_reader.hpp>
+#include <portcullis/bam/bam_writer.hpp>
+#include <portcullis/bam/depth_parser.hpp>
+#include <portcullis/bam/genome_mapper.hpp>
+using portcullis::bam::BamAlignment;
+using portcullis::bam::BamReader;
+using portcullis::bam::BamWriter;
+using portcullis::bam::DepthParser;
+using portcullis::bam::GenomeMapper;
+using portcullis::bam::Orientation;
+using portcullis::bam::Strandedness;
 
 #include <portcullis/intron.hpp>
 #include <portcullis/junction.hpp>
+#include <portcullis/junction_system.hpp>
+#include <portcullis/target_regions.hpp>
 using portcullis::CanonicalSS;
+using portcullis::COVERAGE_REGION_LENGTH;
+using portcullis::FlankDepths;
 using portcullis::Intron;
+using portcullis::IntronKey;
+using portcullis::IntronTable;
 using portcullis::Junction;
 using portcullis::JunctionException;
+using portcullis::JunctionSystem;
+using portcullis::TargetRegion;
+using portcullis::TargetRegions;
+using portcullis::TargetWindow;
 
 bool is_critical( JunctionException const& ex ) { return true; }
 
 const RefSeq rd2(2, "seq_2", 100);
 const RefSeq rd5(5, "seq_5", 100);
 
+// A target sequence with an intron at 100-199, for feeding junctions alignments
+const RefSeq rdg(0, "seq_g", 300);
+const string genomeSeq = [] {
+    string s;
+    for (int i = 0; i < 300; i++) {
+        s += "ACGT"[(i * 7 + i / 5) % 4];
+    }
+    s[100] = 'G'; s[101] = 'T'; s[198] = 'A'; s[199] = 'G';
+    return s;
+}();
+
+/**
+ * Writes the target sequence to a fasta file and loads it
+ */
+shared_ptr<GenomeMapper> writeGenome(const path& fasta) {
+    bfs::create_directories(fasta.parent_path());
+    {
+        ofstream out(fasta.string());
+        out << ">" << rdg.name << endl << genomeSeq << endl;
+    }
+    shared_ptr<GenomeMapper> gmap = make_shared<GenomeMapper>(fasta);
+    gmap->buildFastaIndex();
+    gmap->loadFastaIndex();
+    return gmap;
+}
+
+/**
+ * Builds an alignment spanning the intron on the target sequence, starting at the
+ * given position and with the given length of right anchor.  The read matches the
+ * genome unless a base is given to change.
+ */
+BamAlignment spliceAlignment(const string& name, int32_t pos, int32_t rightLen, int32_t changeAt = -1) {
+    const int32_t leftLen = 100 - pos;
+    string bases = genomeSeq.substr(pos, leftLen) + genomeSeq.substr(200, rightLen);
+    if (changeAt >= 0) {
+        bases[changeAt] = bases[changeAt] == 'A' ? 'C' : 'A';
+    }
+    stringstream sam;
+    sam << name << "\t0\t" << rdg.name << "\t" << pos + 1 << "\t60\t" << leftLen << "M100N" << rightLen << "M\t*\t0\t0\t" << bases << "\t*";
+    const string header = string("@SQ\tSN:") + rdg.name + "\tLN:300\n";
+    bam_hdr_t* h = sam_hdr_parse(header.size(), header.c_str());
+    string line = sam.str();
+    kstring_t ks = { line.size(), line.size() + 1, &line[0] };
+    bam1_t* b = bam_init1();
+    EXPECT_EQ(sam_parse1(&ks, h, b), 0);
+    BamAlignment al(b, true, Strandedness::UNKNOWN, Orientation::UNKNOWN);
+    bam_destroy1(b);
+    bam_hdr_destroy(h);
+    return al;
+}
+
 
 TEST(junction, intron) {
     
@@ -106,6 +189,32 @@ TEST(junction, entropy) {
     EXPECT_GT(e1, e2);
 }
 
+TEST(junction, entropy_from_start_counts) {
+
+    shared_ptr<Intron> l(new Intron(rd5, 20, 30));
+    Junction j(l, 10, 40);
+
+    // The counts of alignments at each start must give exactly the same entropy as the
+    // list of start positions
+    vector<vector<int32_t>> positions = {
+        {16},
+        {16, 16, 16, 16},
+        {13, 15, 17, 19},
+        {12, 12, 14, 18, 18, 18},
+        {12, 12, 12, 14, 15, 15, 19}
+    };
+    for (const auto & p : positions) {
+        vector<std::pair<int32_t, uint32_t>> counts;
+        for (const auto & pos : p) {
+            if (counts.empty() || counts.back().first != pos) {
+                counts.push_back(std::make_pair(pos, 0));
+            }
+            counts.back().second++;
+        }
+        EXPECT_EQ(j.calcEntropy(p), j.calcEntropy(counts));
+    }
+}
+
 /**
  * This IS what you'd expect to see in a real junction
  */
@@ -146,3 +255,460 @@ TEST(junction, coverage2) {
     
     EXPECT_LT(cvg2, 0);
 }
+
+/**
+ * Coverage from just the windows around the splice sites should be exactly the
+ * same as coverage from the full set of levels
+ */
+TEST(junction, coverage_windows) {
+
+    shared_ptr<Intron> l(new Intron(rd5, 20, 30));
+    Junction j1(l, 10, 40);
+
+    vector<uint32_t> coverage1{ 10,10,10,10,10,10,10,10,10,10,
+                                10,10,10,10,10,8,6,4,3,2,
+                                0,0,0,0,0,0,0,0,0,0,
+                                2,3,4,7,8,10,10,10,10,10,
+                                10,10,10,10,10,10,10,10,10,10};
+
+    // The acceptor window runs off the end of the levels, which counts as zero depth
+    vector<uint32_t> donor(coverage1.begin(), coverage1.begin() + 21);
+    vector<uint32_t> acceptor(coverage1.begin() + 30, coverage1.end());
+    acceptor.push_back(0);
+
+    EXPECT_EQ(j1.calcCoverage(coverage1), j1.calcCoverage(donor, acceptor));
+}
+
+/**
+ * Depths in the junction flanks should be exactly what htslib's pileup gives, even
+ * where the pileup stops taking reads at a position because it holds too many
+ */
+TEST(junction, coverage_deep) {
+
+    bfs::create_directories("temp");
+    path deepBam("temp/deep.bam");
+    const RefSeq rdd(0, "seq_d", 3000);
+    const string header = string("@HD\tVN:1.0\tSO:coordinate\n@SQ\tSN:") + rdd.name + "\tLN:3000\n";
+    bam_hdr_t* h = sam_hdr_parse(header.size(), header.c_str());
+    h->l_text = header.size();
+    h->text = strdup(header.c_str());
+
+    // Runs of reads, in coordinate order: position, cigar, number of reads and flag
+    struct Run {
+        int32_t pos;
+        string cigar;
+        uint32_t count;
+        uint16_t flag;
+    };
+    const vector<Run> runs = {
+        // Reads with no length at the start of the target
+        { 0, "10S", 1, 0 }, { 0, "40M", 8000, 0 },
+        // More reads than the cap at one position, then more starting just after
+        { 470, "100M", 7990, 0 }, { 475, "20M", 30, 0 }, { 476, "10M5D10M", 5, 0 },
+        { 484, "10S", 3, 0 }, { 484, "30M", 20, 0 },
+        // Reads ending at the next read's position are still held when it is pushed
+        { 1690, "10M", 4000, 0 }, { 1695, "30M", 3990, 0 }, { 1700, "40M", 100, 0 },
+        { 1705, "10M", 20, 0 },
+        // Unmapped and spliced reads don't count towards the cap
+        { 2470, "50M", 7000, 0 }, { 2470, "50M", 2000, 4 }, { 2470, "10M100N10M", 2000, 0 },
+        { 2470, "50M", 1100, 0 }
+    };
+    {
+        BamWriter writer(deepBam);
+        writer.setBuildIndex(true);
+        writer.open(h);
+        bam1_t* b = bam_init1();
+        uint32_t n = 0;
+        for (const auto & r : runs) {
+            for (uint32_t i = 0; i < r.count; i++) {
+                stringstream sam;
+                sam << "r" << n++ << "\t" << r.flag << "\t" << rdd.name << "\t" << r.pos + 1 << "\t60\t" << r.cigar << "\t*\t0\t0\t*\t*";
+                string line = sam.str();
+                kstring_t ks = { line.size(), line.size() + 1, &line[0] };
+                ASSERT_EQ(sam_parse1(&ks, h, b), 0);
+                writer.write(b);
+            }
+        }
+        bam_destroy1(b);
+        writer.close();
+    }
+    bam_hdr_destroy(h);
+
+    JunctionList junctions;
+    for (int32_t start : { 30, 500, 1500, 2500 }) {
+        junctions.push_back(make_shared<Junction>(make_shared<Intron>(rdd, start, start + 199), start - 10, start + 209));
+    }
+
+    // Depths from the pileup, as coverage used to be calculated
+    DepthParser dp(deepBam, 0, false);
+    vector<uint32_t> levels;
+    ASSERT_EQ(dp.loadNextBatch(levels), true);
+    vector<double> expected;
+    for (auto & j : junctions) {
+        expected.push_back(j->calcCoverage(levels));
+    }
+
+    BamReader reader(deepBam);
+    reader.open();
+    FlankDepths depths;
+    depths.junctions = junctions;
+    depths.init();
+    reader.setRegion(0, 0, rdd.length);
+    while (reader.next()) {
+        depths.add(reader.current());
+    }
+    reader.close();
+    depths.setCoverage();
+
+    // The cap has to have dropped reads for this to test anything
+    EXPECT_LT(levels[1], 8000);
+    EXPECT_LT(levels[490], 7990 + 30);
+    EXPECT_LT(levels[1710], 3990 + 100);
+    EXPECT_LT(levels[2490], 8100);
+    for (size_t k = 0; k < junctions.size(); k++) {
+        const Intron& i = *(junctions[k]->getIntron());
+        for (int32_t l = i.start - 2 * COVERAGE_REGION_LENGTH; l <= i.start; l++) {
+            EXPECT_EQ(depths.getDepth(l), levels[l]) << l;
+        }
+        for (int32_t l = i.end; l <= i.end + 2 * COVERAGE_REGION_LENGTH; l++) {
+            EXPECT_EQ(depths.getDepth(l), levels[l]) << l;
+        }
+        EXPECT_DOUBLE_EQ(junctions[k]->getCoverage(), expected[k]);
+    }
+
+    bfs::remove(deepBam);
+    bfs::remove(deepBam.string() + ".bai");
+}
+
+/**
+ * Splitting a target sequence into regions should assign each junction to exactly
+ * one region, and that region should see all the alignments supporting it, even
+ * though they start in the previous region
+ */
+TEST(junction, region_ownership) {
+
+    BamReader reader(RESOURCESDIR "/clipped3.bam");
+    reader.open();
+    shared_ptr<RefSeqPtrList> refs = reader.createRefList();
+
+    JunctionSystem all(refs);
+    while (reader.next()) {
+        all.addJunctions(reader.current());
+    }
+    ASSERT_EQ(all.size(), 1);
+    const int32_t split = all.getJunctionAt(0)->getIntron()->start;
+
+    JunctionSystem left(refs);
+    JunctionSystem right(refs);
+    reader.setRegion(0, 0, split);
+    while (reader.next()) {
+        left.addJunctionsInRegion(reader.current(), INT32_MIN, split);
+    }
+    reader.setRegion(0, split, refs->at(0)->length);
+    while (reader.next()) {
+        right.addJunctionsInRegion(reader.current(), split, INT32_MAX);
+    }
+    reader.close();
+
+    EXPECT_EQ(left.size(), 0);
+    ASSERT_EQ(right.size(), 1);
+    EXPECT_EQ(*(right.getJunctionAt(0)->getIntron()), *(all.getJunctionAt(0)->getIntron()));
+    EXPECT_EQ(right.getJunctionAt(0)->getNbSplicedAlignments(), all.getJunctionAt(0)->getNbSplicedAlignments());
+}
+
+TEST(junction, target_regions) {
+
+    bfs::create_directories("temp");
+    path bed("temp/target_regions.bed");
+    {
+        ofstream out(bed.string());
+        out << "track name=targets" << endl
+            << "# A comment" << endl
+            << "seq_5\t50\t60" << endl
+            << "seq_5\t10\t20\tgene1" << endl
+            << "seq_5\t15\t30\tgene2" << endl
+            << "seq_9\t0\t10" << endl;
+    }
+    TargetRegions targets(bed);
+    EXPECT_EQ(targets.size(), 3);
+
+    // Overlapping regions are merged, and unknown sequences left out
+    RefSeqPtrList refs { make_shared<RefSeq>(rd2), make_shared<RefSeq>(rd5) };
+    vector<TargetRegion> regions = targets.getRegions(refs);
+    ASSERT_EQ(regions.size(), 2);
+    EXPECT_EQ(regions[0].refIndex, 5);
+    EXPECT_EQ(regions[0].start, 10);
+    EXPECT_EQ(regions[0].end, 30);
+    EXPECT_EQ(regions[1].start, 50);
+    ASSERT_EQ(targets.getUnknownSequences(refs).size(), 1);
+    EXPECT_EQ(targets.getUnknownSequences(refs)[0], "seq_9");
+
+    // Introns within or spanning a region overlap it, those either side of it don't
+    JunctionSystem js;
+    js.addJunction(make_shared<Junction>(make_shared<Intron>(rd5, 20, 40), 10, 50));
+    js.addJunction(make_shared<Junction>(make_shared<Intron>(rd5, 31, 45), 25, 55));
+    js.addJunction(make_shared<Junction>(make_shared<Intron>(rd5, 5, 70), 0, 80));
+    js.addJunction(make_shared<Junction>(make_shared<Intron>(rd2, 20, 40), 10, 50));
+    js.restrictTo(targets);
+    ASSERT_EQ(js.size(), 2);
+    EXPECT_EQ(js.getJunctionAt(0)->getIntron()->start, 20);
+    EXPECT_EQ(js.getJunctionAt(1)->getIntron()->start, 5);
+
+    bfs::remove(bed);
+}
+
+/**
+ * Finds the introns whose alignments, which have 10bp anchors, overlap a window
+ */
+static portcullis::IntronFinder fakeIntronFinder(const vector<std::pair<int32_t, int32_t>>& all) {
+    return [all](const int32_t start, const int32_t end, std::set<std::pair<int32_t, int32_t>>& introns, int32_t& maxSpan) {
+        introns.clear();
+        maxSpan = 0;
+        for (auto & i : all) {
+            if (i.first - 10 < end && i.second + 11 > start) {
+                introns.insert(i);
+                maxSpan = std::max(maxSpan, i.second - i.first + 21);
+            }
+        }
+    };
+}
+
+TEST(junction, target_widening) {
+
+    const vector<std::pair<int32_t, int32_t>> introns {
+        { 1000, 1200 }, { 2000, 2200 },     // Neighbours to the left
+        { 4900, 5020 }, { 5050, 5300 },     // Overlap the target, the first from before it
+        { 8000, 8100 }, { 9000, 9100 },     // Neighbours to the right
+        { 30000, 30200 }, { 30000, 30300 }  // Share a splice site, near the end
+    };
+    const portcullis::IntronFinder finder = fakeIntronFinder(introns);
+
+    // The window first moves back to own the junction starting before the target, then
+    // both sides double until each holds a pair of neighbours not sharing a splice site
+    TargetWindow window;
+    ASSERT_TRUE(TargetRegions::widen(TargetRegion{ 0, 5000, 5100 }, 32000, 1000, finder, window));
+    EXPECT_EQ(window.region.refIndex, 0);
+    EXPECT_EQ(window.region.start, 1900);
+    EXPECT_EQ(window.region.end, 8100);
+    EXPECT_EQ(window.maxEnd, 5300);
+    EXPECT_EQ(window.maxSpan, 271);
+
+    // Nothing to analyse without a junction overlapping the target
+    EXPECT_FALSE(TargetRegions::widen(TargetRegion{ 0, 6000, 7000 }, 32000, 1000, finder, window));
+
+    // Junctions sharing a splice site don't count as a pair, so the right side stops at
+    // the end of the target sequence
+    ASSERT_TRUE(TargetRegions::widen(TargetRegion{ 0, 30100, 30150 }, 32000, 1000, finder, window));
+    EXPECT_EQ(window.region.end, 32000);
+    EXPECT_EQ(window.region.start, 0);
+
+    // Windows of neighbouring targets that overlap or touch are merged, those on other
+    // target sequences or with a gap between them aren't
+    ASSERT_TRUE(TargetRegions::widen(TargetRegion{ 0, 5200, 5250 }, 32000, 1000, finder, window));
+    EXPECT_EQ(window.region.start, 4050);
+    EXPECT_EQ(window.region.end, 8250);
+    vector<TargetRegion> merged = TargetRegions::merge({
+        window.region, TargetRegion{ 1, 0, 500 }, TargetRegion{ 0, 1900, 8100 },
+        TargetRegion{ 0, 8100, 8200 }, TargetRegion{ 0, 8300, 8400 }, TargetRegion{ 1, 500, 600 } });
+    ASSERT_EQ(merged.size(), 3);
+    EXPECT_EQ(merged[0].refIndex, 0);
+    EXPECT_EQ(merged[0].start, 1900);
+    EXPECT_EQ(merged[0].end, 8250);
+    EXPECT_EQ(merged[1].start, 8300);
+    EXPECT_EQ(merged[2].refIndex, 1);
+    EXPECT_EQ(merged[2].start, 0);
+    EXPECT_EQ(merged[2].end, 600);
+}
+
+/**
+ * Capping the alignments kept should leave the exact counts alone, flag the junction
+ * as sampled in the table, bound the records held, and scale the anchor depths back
+ * up to all the alignments
+ */
+TEST(junction, sampled_alignments) {
+
+    shared_ptr<GenomeMapper> gmap = writeGenome("temp/sampled.fa");
+
+    // Every alignment is distinct, and matches the genome with both anchors at least
+    // as long as the anchor depths go, so every anchor depth is the number of alignments
+    vector<BamAlignment> als;
+    for (int32_t pos = 0; pos < 80; pos++) {
+        for (int32_t rightLen = 20; rightLen < 23; rightLen++) {
+            als.push_back(spliceAlignment("r" + std::to_string(als.size()), pos, rightLen));
+        }
+    }
+    const uint32_t cap = 16;
+    shared_ptr<Intron> intron = make_shared<Intron>(rdg, 100, 199);
+    Junction all(intron, 0, 221);
+    Junction sampled(intron, 0, 221);
+    sampled.setMaxAlignments(cap);
+    size_t mostRecords = 0;
+    for (const auto & al : als) {
+        all.addJunctionAlignment(al);
+        sampled.addJunctionAlignment(al);
+        mostRecords = std::max(mostRecords, sampled.getNbAlignmentRecords());
+    }
+    all.processJunctionWindow(*gmap);
+    sampled.processJunctionWindow(*gmap);
+    all.calcMetrics();
+    sampled.calcMetrics();
+
+    EXPECT_EQ(all.isSampled(), false);
+    EXPECT_EQ(sampled.isSampled(), true);
+    EXPECT_EQ(all.getNbSampledAlignments(), als.size());
+    EXPECT_EQ(sampled.getNbSampledAlignments(), cap);
+    EXPECT_EQ(all.getNbAlignmentRecords(), als.size());
+
+    // Replaced alignments are dropped before they outnumber the sample
+    EXPECT_LT(mostRecords, 2 * cap);
+
+    // The counts are tallied over every alignment
+    EXPECT_EQ(sampled.getNbSplicedAlignments(), all.getNbSplicedAlignments());
+    EXPECT_EQ(sampled.getNbDistinctAlignments(), all.getNbDistinctAlignments());
+    EXPECT_EQ(sampled.getNbUniquelyMappedAlignments(), all.getNbUniquelyMappedAlignments());
+    EXPECT_EQ(sampled.getNbReliableAlignments(), all.getNbReliableAlignments());
+    EXPECT_EQ(sampled.getEntropy(), all.getEntropy());
+    EXPECT_EQ(sampled.getMaxMinAnchor(), all.getMaxMinAnchor());
+    EXPECT_EQ(sampled.getMeanMismatches(), all.getMeanMismatches());
+    for (size_t i = 0; i < Junction::JAD_NAMES.size(); i++) {
+        EXPECT_EQ(all.getJunctionAnchorDepth(i), als.size());
+        EXPECT_EQ(sampled.getJunctionAnchorDepth(i), all.getJunctionAnchorDepth(i));
+    }
+
+    // The sample size goes in the table, so readers can tell which junctions were sampled
+    stringstream row;
+    row << sampled;
+    shared_ptr<Junction> parsed = Junction::parse(row.str());
+    EXPECT_EQ(parsed->getNbSampledAlignments(), cap);
+    EXPECT_EQ(parsed->getNbSplicedAlignments(), als.size());
+
+    // Tables written before the sample size was added still parse, as if every
+    // alignment was used
+    const string rowStr = row.str();
+    vector<string> cols;
+    boost::split(cols, rowStr, boost::is_any_of("\t"));
+    const size_t sampledCol = 14 + std::distance(Junction::METRIC_NAMES.begin(),
+            std::find(Junction::METRIC_NAMES.begin(), Junction::METRIC_NAMES.end(), "nb_sampled_aln"));
+    cols.erase(cols.begin() + sampledCol);
+    EXPECT_EQ(cols.size(), 75);
+    shared_ptr<Junction> old = Junction::parse(boost::algorithm::join(cols, "\t"));
+    EXPECT_EQ(old->getNbSampledAlignments(), als.size());
+    EXPECT_EQ(old->getNbSplicedAlignments(), als.size());
+    EXPECT_EQ(old->getNbSamples(), parsed->getNbSamples());
+    EXPECT_EQ(old->getJunctionAnchorDepth(0), parsed->getJunctionAnchorDepth(0));
+
+    bfs::remove("temp/sampled.fa");
+    bfs::remove("temp/sampled.fa.fai");
+}
+
+/**
+ * Identical alignments share a record, but the mismatch stats and anchor depths should
+ * come out as if every alignment had been kept separately
+ */
+TEST(junction, duplicate_alignments) {
+
+    shared_ptr<GenomeMapper> gmap = writeGenome("temp/duplicates.fa");
+    shared_ptr<Intron> intron = make_shared<Intron>(rdg, 100, 199);
+
+    // Exact duplicates, near duplicates with the same position and cigar but different
+    // bases, and mismatches both near to and far from the junction
+    vector<BamAlignment> als;
+    for (int i = 0; i < 3; i++) {
+        als.push_back(spliceAlignment("a" + std::to_string(i), 70, 25));
+    }
+    for (int i = 0; i < 2; i++) {
+        als.push_back(spliceAlignment("b" + std::to_string(i), 70, 25, 5));
+    }
+    als.push_back(spliceAlignment("c", 70, 25, 28));
+    for (int i = 0; i < 2; i++) {
+        als.push_back(spliceAlignment("d" + std::to_string(i), 60, 30, 45));
+    }
+    als.push_back(spliceAlignment("e", 80, 20));
+
+    Junction j(intron, 0, 229);
+    for (const auto & al : als) {
+        j.addJunctionAlignment(al);
+    }
+    EXPECT_EQ(j.getNbAlignmentRecords(), 5);
+    j.processJunctionWindow(*gmap);
+
+    // Work the stats out from a junction for each alignment on its own
+    double totalMismatches = 0.0;
+    uint32_t maxMMES = 0;
+    vector<uint32_t> jad(Junction::JAD_NAMES.size(), 0);
+    for (const auto & al : als) {
+        Junction single(intron, 0, 229);
+        single.addJunctionAlignment(al);
+        single.processJunctionWindow(*gmap);
+        totalMismatches += single.getMeanMismatches();
+        maxMMES = std::max(maxMMES, single.getMaxMMES());
+        for (size_t i = 0; i < jad.size(); i++) {
+            jad[i] += single.getJunctionAnchorDepth(i);
+        }
+    }
+    EXPECT_GT(totalMismatches, 0.0);
+    EXPECT_DOUBLE_EQ(j.getMeanMismatches(), totalMismatches / als.size());
+    EXPECT_EQ(j.getMaxMMES(), maxMMES);
+    for (size_t i = 0; i < jad.size(); i++) {
+        EXPECT_EQ(j.getJunctionAnchorDepth(i), jad[i]) << Junction::JAD_NAMES[i];
+    }
+    EXPECT_LT(j.getJunctionAnchorDepth(2), als.size());
+
+    // Once sampling evicts the only alignment with mismatches its record is left with
+    // no alignments until the records are compacted, and shouldn't count in the stats
+    const uint32_t cap = 4;
+    Junction sampled(intron, 0, 229);
+    sampled.setMaxAlignments(cap);
+    sampled.addJunctionAlignment(spliceAlignment("bad", 70, 25, 28));
+    int n = 0;
+    bool evicted = false;
+    while (!evicted && n < 1000) {
+        sampled.addJunctionAlignment(spliceAlignment("good" + std::to_string(n++), 70, 25));
+        Junction probe(sampled);
+        probe.processJunctionWindow(*gmap);
+        evicted = probe.getMeanMismatches() == 0.0;
+    }
+    ASSERT_EQ(evicted, true);
+    EXPECT_EQ(sampled.isSampled(), true);
+    EXPECT_EQ(sampled.getNbAlignmentRecords(), 2);
+    sampled.processJunctionWindow(*gmap);
+    EXPECT_EQ(sampled.getMeanMismatches(), 0.0);
+    for (size_t i = 0; i < Junction::JAD_NAMES.size(); i++) {
+        EXPECT_EQ(sampled.getJunctionAnchorDepth(i), sampled.getNbSplicedAlignments());
+    }
+
+    bfs::remove("temp/duplicates.fa");
+    bfs::remove("temp/duplicates.fa.fai");
+}
+
+TEST(junction, intron_table) {
+
+    // Enough keys to make the table grow several times, with neighbouring introns
+    // that only differ by one base
+    IntronTable table;
+    for (int32_t i = 0; i < 1000; i++) {
+        table.insert(IntronKey{ i % 3, i, i + 10 }, i);
+    }
+    EXPECT_EQ(table.size(), 1000);
+    for (int32_t i = 0; i < 1000; i++) {
+        EXPECT_EQ(table.find(IntronKey{ i % 3, i, i + 10 }), (uint32_t) i);
+    }
+    EXPECT_EQ(table.find(IntronKey{ 1, 0, 10 }), IntronTable::NONE);
+    EXPECT_EQ(table.find(IntronKey{ 0, 0, 11 }), IntronTable::NONE);
+
+    // Inserting an intron again replaces its row
+    table.insert(IntronKey{ 0, 0, 10 }, 5000);
+    EXPECT_EQ(table.size(), 1000);
+    EXPECT_EQ(table.find(IntronKey{ 0, 0, 10 }), 5000);
+
+    // Junctions can still be found after sorting moves them around
+    JunctionSystem js;
+    js.addJunction(make_shared<Junction>(make_shared<Intron>(rd5, 60, 70), 50, 80));
+    js.addJunction(make_shared<Junction>(make_shared<Intron>(rd5, 20, 45), 10, 55));
+    js.sort();
+    Intron intron(rd5, 60, 70);
+    ASSERT_EQ(js.getJunction(intron) != nullptr, true);
+    EXPECT_EQ(*(js.getJunction(intron)->getIntron()), intron);
+    Intron missing(rd2, 60, 70);
+    EXPECT_EQ(js.getJunction(missing) == nullptr, true);
+}
@@ -0,0 +1,90 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+#include <gtest/gtest.h>
+
+#include <ctime>
+#include <fstream>
+using std::endl;
+using std::ofstream;
+
+#include <boost/filesystem.hpp>
+namespace bfs = boost::filesystem;
+using bfs::path;
+
+#include <portcullis/manifest.hpp>
+using portcullis::Manifest;
+
+TEST(manifest, reuse) {
+
+    bfs::create_directories("temp");
+    const path input("temp/manifest_input.txt");
+    const path output("temp/manifest_output.txt");
+    const path file("temp/test.manifest");
+    {
+        ofstream in(input.string());
+        in << "input" << endl;
+        ofstream out(output.string());
+        out << "output" << endl;
+    }
+    const std::time_t now = bfs::last_write_time(input);
+
+    // Record a run, then read it back as a re-run would
+    Manifest run;
+    run.setFile("input.file", input);
+    run.set("setting.use_csi", "0");
+    run.setFile("output.file", output);
+    run.save(file);
+    Manifest previous;
+    previous.load(file);
+
+    // Same inputs and settings, and untouched outputs, can be skipped
+    Manifest rerun;
+    rerun.setFile("input.file", input);
+    rerun.set("setting.use_csi", "0");
+    EXPECT_EQ(rerun.canReuse(previous, { "input", "setting" }, "output"), true);
+
+    // Changing a setting the outputs depend on means redoing them...
+    Manifest csi;
+    csi.setFile("input.file", input);
+    csi.set("setting.use_csi", "1");
+    EXPECT_EQ(csi.canReuse(previous, { "input", "setting" }, "output"), false);
+    // ... unless the outputs don't depend on it
+    EXPECT_EQ(csi.canReuse(previous, { "input" }, "output"), true);
+
+    // So does a modified input, or a modified output
+    bfs::last_write_time(input, now + 10);
+    Manifest modified;
+    modified.setFile("input.file", input);
+    modified.set("setting.use_csi", "0");
+    EXPECT_EQ(modified.canReuse(previous, { "input", "setting" }, "output"), false);
+    bfs::last_write_time(output, now + 10);
+    EXPECT_EQ(rerun.canReuse(previous, { "setting" }, "output"), false);
+
+    // As do outputs that were never recorded, e.g. when the last run was interrupted
+    EXPECT_EQ(rerun.canReuse(previous, { "setting" }, "output.other"), false);
+
+    // Reused outputs are carried over to the new manifest
+    Manifest carried;
+    carried.setAll(previous, "output");
+    EXPECT_EQ(carried.matches(previous, "output"), true);
+    EXPECT_EQ(carried.matches(previous, "input"), false);
+
+    bfs::remove(input);
+    bfs::remove(output);
+    bfs::remove(file);
+}
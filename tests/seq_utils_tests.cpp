@@ -44,5 +44,9 @@ TEST(seq_utils, rev) {
 TEST(seq_utils, rev_comp) {
     
     EXPECT_EQ(SeqUtils::reverseComplement("ATGC"), "GCAT");    
+    
+    string seq("AAGCTNR");
+    SeqUtils::reverseComplementInPlace(seq);
+    EXPECT_EQ(seq, SeqUtils::reverseComplement("AAGCTNR"));
 }
 
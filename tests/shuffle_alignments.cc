@@ -0,0 +1,83 @@
+//  ********************************************************************
+//  This file is part of Portcullis.
+//
+//  Portcullis is free software: you can redistribute it and/or modify
+//  it under the terms of the GNU General Public License as published by
+//  the Free Software Foundation, either version 3 of the License, or
+//  (at your option) any later version.
+//
+//  Portcullis is distributed in the hope that it will be useful,
+//  but WITHOUT ANY WARRANTY; without even the implied warranty of
+//  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//  GNU General Public License for more details.
+//
+//  You should have received a copy of the GNU General Public License
+//  along with Portcullis.  If not, see <http://www.gnu.org/licenses/>.
+//  *******************************************************************
+
+// Writes the alignments from a BAM file in a fixed random order, as BAM, or as SAM if
+// the output ends in .sam, so the tests can make unsorted input without samtools
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+
+#include <boost/algorithm/string.hpp>
+
+#include <htslib/sam.h>
+
+#include <portcullis/bam/bam_reader.hpp>
+using portcullis::bam::BamReader;
+
+int main(int argc, char *argv[]) {
+
+	if (argc != 3) {
+		cerr << "Usage: shuffle_alignments <input.bam> <output.bam|output.sam>" << endl;
+		return 1;
+	}
+	const string output(argv[2]);
+	BamReader reader(argv[1]);
+	reader.open();
+	vector<bam1_t*> alignments;
+	while (reader.next()) {
+		alignments.push_back(bam_dup1(reader.current().getRaw()));
+	}
+	// The header mustn't claim the alignments are still sorted
+	bam_hdr_t* header = bam_hdr_dup(reader.getHeader());
+	reader.close();
+	string text(header->text, header->l_text);
+	boost::replace_all(text, "SO:coordinate", "SO:unsorted");
+	free(header->text);
+	header->l_text = text.size();
+	header->text = (char*) malloc(text.size() + 1);
+	memcpy(header->text, text.c_str(), text.size() + 1);
+
+	std::mt19937 rng(1);
+	std::shuffle(alignments.begin(), alignments.end(), rng);
+
+	samFile* out = sam_open(output.c_str(), boost::ends_with(output, ".sam") ? "w" : "wb");
+	int res = out != nullptr && sam_hdr_write(out, header) == 0 ? 0 : -1;
+	for (auto & b : alignments) {
+		if (res >= 0) {
+			res = sam_write1(out, header, b);
+		}
+		bam_destroy1(b);
+	}
+	if (out != nullptr && sam_close(out) != 0) {
+		res = -1;
+	}
+	bam_hdr_destroy(header);
+	if (res < 0) {
+		cerr << "Could not write alignments to: " << output << endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,25 @@
+#! /bin/sh
+
+. ./compat.sh
+
+# Junctions found straight from unsorted alignments should be exactly the ones found
+# by prep then junc on the same alignments, whether they are held in memory or spilled
+# to disk
+mkdir -p temp/unsorted_test
+./shuffle_alignments ${data}/spombe.gsnap.III.25K.bam temp/unsorted_test/shuffled.bam
+./shuffle_alignments ${data}/spombe.gsnap.III.25K.bam temp/unsorted_test/shuffled.sam
+$PORTCULLIS prep -o temp/unsorted_test/prep ${data}/spombe.III.fa temp/unsorted_test/shuffled.bam
+$PORTCULLIS junc -o temp/unsorted_test/sorted temp/unsorted_test/prep
+
+$PORTCULLIS junc --unsorted temp/unsorted_test/shuffled.bam -g ${data}/spombe.III.fa -o temp/unsorted_test/unsorted
+cmp temp/unsorted_test/sorted.junctions.tab temp/unsorted_test/unsorted.junctions.tab
+
+$PORTCULLIS junc --unsorted - --memory 4K -g ${data}/spombe.III.fa -o temp/unsorted_test/stdin \
+	< temp/unsorted_test/shuffled.sam > temp/unsorted_test/stdin.log
+grep -q "Spilled alignments to temporary files" temp/unsorted_test/stdin.log
+cmp temp/unsorted_test/sorted.junctions.tab temp/unsorted_test/stdin.junctions.tab
+
+# When full finds junctions while prep sorts, the prepared data should still have the
+# spliced alignment index for later junc runs
+$PORTCULLIS full --keep_temp -o temp/unsorted_test/full ${data}/spombe.III.fa temp/unsorted_test/shuffled.bam
+test -f temp/unsorted_test/full/1-prep/portcullis.sorted.alignments.bam.spi